@@ -29,10 +29,18 @@ SSE_BEGIN_C_DECLS
 #define FILE_OPERATION_DELIVER_RESULT "deliver-file-result"
 #define FILE_OPERATION_FETCH_RESULT   "fetch-file-result"
 
-#define FILE_FILESYS_TYPE_RAMDISK "ramdisk"
-#define FILE_FILESYS_TYPE_NVRAM   "nvram"
-#define FILE_FILESYS_TYPE_RO      "ro"
-#define FILE_FILESYS_TYPE_RW      "rw"
+#define FILE_FILESYS_TYPE_RAMDISK  "ramdisk"
+#define FILE_FILESYS_TYPE_NVRAM    "nvram"
+#define FILE_FILESYS_TYPE_RO       "ro"
+#define FILE_FILESYS_TYPE_RW       "rw"
+#define FILE_FILESYS_TYPE_BLOCKDEV "blockdev" /* Raw block device or MTD partition, see TFILEBlockDevWriter */
+
+#define FILE_PREFETCH_TIMEOUT_DEFAULT      (600) /* sec */
+#define FILE_MANIFEST_CONCURRENCY_DEFAULT  (2)
+#define FILE_KEEP_VERSIONS_DEFAULT         (1)
+#define FILE_UPLOAD_PART_SIZE_MIN          (5 * 1024 * 1024) /* S3 minimum except the last part */
+#define FILE_UPLOAD_CONCURRENCY_DEFAULT    (2)
+#define FILE_UPLOAD_IN_MEMORY_MAX          (16 * 1024 * 1024) /* Uploaded from memory without "uploadpartsize" */
 
 #define FILE_ERROR_OK       "Error.File.Success"
 #define FILE_ERROR_INVAL    "Error.File.IlligalArgument"
@@ -44,11 +52,31 @@ SSE_BEGIN_C_DECLS
 #define FILE_ERROR_DOWNLOAD "Error.File.DownloadFailure"
 #define FILE_ERROR_RENAME   "Error.File.RenameFailure"
 #define FILE_ERROR_UPLOAD   "Error.File.UploadFailure"
+#define FILE_ERROR_VERIFY   "Error.File.VerificationFailure"
 
+#include <file/file_arena.h>
 #include <file/file_filesys_info.h>
-#include <file/file_content_info.h>
+#include <file/file_worker.h>
+#include <file/file_priority.h>
+#include <file/file_uring.h>
+#include <file/file_copy.h>
+#include <file/file_hash.h>
+#include <file/file_blockdev.h>
+#include <file/file_version_store.h>
 #include <file/file_downloader.h>
+#include <file/file_tar.h>
+#include <file/file_sparse.h>
+#include <file/file_mmap.h>
+#include <file/file_source.h>
+#include <file/file_tail.h>
+#include <file/file_slice.h>
+#include <file/file_fingerprint.h>
+#include <file/file_snapshot.h>
+#include <file/file_compress.h>
+#include <file/file_multipart.h>
+#include <file/file_sendfile.h>
 #include <file/file_uploader.h>
+#include <file/file_content_info.h>
 
 SSE_END_C_DECLS
 
@@ -0,0 +1,122 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+
+#ifndef __FILE_ARENA_H__
+#define __FILE_ARENA_H__
+
+SSE_BEGIN_C_DECLS
+
+#define FILE_ARENA_CHUNK_SIZE (1024) /* Default size of a chunk */
+
+/**
+ * @struct TFILEArenaChunk_
+ * @brief A block of the arena allocated from the heap, the memory follows the header.
+ */
+struct TFILEArenaChunk_ {
+  struct TFILEArenaChunk_ *fNext;          /** Chunk allocated before */
+  sse_size fSize;                          /** Size of the memory */
+  sse_size fUsed;                          /** Bytes handed out from the memory */
+};
+typedef struct TFILEArenaChunk_ TFILEArenaChunk;
+
+/**
+ * @struct TFILEArena_
+ * @brief Memory owned by a download or upload job, freed at once when the job is deleted.
+ *
+ * Small strings and structures which live as long as the job are cut out of a few chunks instead
+ * of being allocated one by one, so that a long running process does not fragment the heap with
+ * them. Nothing is freed until TFILEArena_Finalize(). Not thread safe, use it on the event loop.
+ */
+struct TFILEArena_ {
+  TFILEArenaChunk *fChunks;                /** Chunks, the current one first */
+  sse_size fChunkSize;                     /** Size of a chunk, larger requests get a chunk of their own */
+  sse_uint fChunkCount;                    /** Number of heap allocations made for the arena */
+  sse_uint fAllocCount;                    /** Number of allocations served from the arena */
+  sse_size fAllocBytes;                    /** Bytes served from the arena */
+};
+typedef struct TFILEArena_ TFILEArena;
+
+/**
+ * @brief Initialize the arena, no memory is allocated until used.
+ *
+ * @param [in] self          Instance
+ * @param [in] in_chunk_size Size of a chunk, 0 for FILE_ARENA_CHUNK_SIZE
+ */
+void
+TFILEArena_Initialize(TFILEArena *self,
+                      sse_size in_chunk_size);
+
+/**
+ * @brief Free all the memory allocated from the arena.
+ */
+void
+TFILEArena_Finalize(TFILEArena *self);
+
+/**
+ * @brief Allocate zero-filled memory aligned for any type, like sse_zeroalloc().
+ *
+ * @param [in] self    Instance
+ * @param [in] in_size Size
+ *
+ * @return Memory valid until TFILEArena_Finalize()
+ */
+sse_pointer
+TFILEArena_Alloc(TFILEArena *self,
+                 sse_size in_size);
+
+/**
+ * @brief Copy a string into the arena, like sse_strndup().
+ */
+sse_char*
+TFILEArena_StrNDup(TFILEArena *self,
+                   const sse_char *in_str,
+                   sse_size in_len);
+
+/**
+ * @brief Copy a NUL terminated string into the arena, like sse_strdup().
+ */
+sse_char*
+TFILEArena_StrDup(TFILEArena *self,
+                  const sse_char *in_str);
+
+/**
+ * @brief Format a string into the arena like sprintf(3).
+ *
+ * @param [in] self      Instance
+ * @param [out] out_len  Length of the string, may be NULL
+ * @param [in] in_format Format
+ *
+ * @return String valid until TFILEArena_Finalize()
+ */
+sse_char*
+TFILEArena_Printf(TFILEArena *self,
+                  sse_size *out_len,
+                  const sse_char *in_format,
+                  ...);
+
+/**
+ * @brief Number of the chunks alive in the process, 0 when no job is left.
+ */
+sse_uint
+FILEArena_GetLiveChunks(void);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_ARENA_H__*/
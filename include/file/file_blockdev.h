@@ -0,0 +1,223 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+
+#ifndef __FILE_BLOCKDEV_H__
+#define __FILE_BLOCKDEV_H__
+
+SSE_BEGIN_C_DECLS
+
+#define FILE_BLOCKDEV_ERASE_BLOCK_DEFAULT (128 * 1024)  /* Typical NOR/NAND erase block */
+#define FILE_BLOCKDEV_CHUNK_SIZE          (1024 * 1024) /* Bytes requested at once, rounded up to the write buffer */
+#define FILE_BLOCKDEV_RETRIES             (3)
+#define FILE_BLOCKDEV_WRITE_DEPTH         (4)               /* Max writes in flight */
+#define FILE_BLOCKDEV_ASYNC_MEMORY        (2 * 1024 * 1024) /* Bytes of the write buffers in flight, at least 2 of them */
+#define FILE_BLOCKDEV_POLL_MIN_MSEC       (1)   /* Backoff of polling the request which does not proceed */
+#define FILE_BLOCKDEV_POLL_MAX_MSEC       (16)
+#define FILE_BLOCKDEV_TIMEOUT             (60)  /* Seconds without progress before the chunk is requested again */
+
+struct TFILEBlockDevSlot_;
+struct TFILEBlockDevSync_;
+
+/**
+ * @struct TFILEBlockDevWriter_
+ * @brief Streams an image from a URL straight into a block device or an MTD partition.
+ *
+ * The image is requested in chunks with "Range", each chunk is a multiple of the erase block and
+ * written at an aligned offset with a single pwrite(2), so that no block is rewritten. An MTD
+ * partition is erased block by block before it is written. The image is hashed while it is
+ * streamed and verified when the last chunk has been written, nothing is written to a file.
+ *
+ * A regular file can be the target as well. With TFILEBlockDevWriter_SetWriteBufferSize() a chunk
+ * is written in buffers of the given size instead, e.g. into the ".part" file on a flash backed
+ * filesystem, where small writes would rewrite the same erase blocks again and again.
+ *
+ * The buffers are copied into slots and written asynchronously, so that the next chunk is received
+ * while the previous one is written. The slots are registered with io_uring, or written on
+ * TFILEWorkerPool where io_uring is not available. An MTD partition is always written on the
+ * workers, which erase the blocks of a slot before writing it. Without either, every buffer is
+ * written synchronously on the event loop. The image is flushed with fdatasync(2) on the workers
+ * before it is verified.
+ *
+ * MoatHttpClient does not expose its socket, so the request is polled. The polling runs on every
+ * iteration of the event loop (MoatIdle) only while it makes progress, otherwise it backs off on a
+ * timerfd from FILE_BLOCKDEV_POLL_MIN_MSEC up to FILE_BLOCKDEV_POLL_MAX_MSEC. The chunk is
+ * requested again if nothing has been sent nor received for FILE_BLOCKDEV_TIMEOUT seconds.
+ */
+struct TFILEBlockDevWriter_ {
+  sse_char *fUrl;
+  sse_char *fDevicePath;
+  int fFd;
+  sse_bool fMtd;                           /** sse_true if an MTD character device */
+  sse_bool fDirect;                        /** Written with O_DIRECT */
+  sse_size fBlockSize;                     /** Erase block, the alignment of the writes */
+  sse_size fWriteSize;                     /** Bytes written at once, a multiple of fBlockSize, 0 for a chunk */
+  sse_size fChunkSize;                     /** Bytes requested at once, a multiple of fWriteSize */
+  sse_size fPageSize;                      /** Unit of a write to MTD, the tail is padded to it */
+  sse_uint64 fCapacity;                    /** Size of the device */
+  sse_uint64 fOffset;                      /** Bytes written so far */
+  sse_uint64 fTotal;                       /** Size of the image, FILE_SOURCE_TO_END until known */
+  sse_uint64 fWriteCount;                  /** Number of write system calls issued */
+  sse_bool fDropCache;                     /** Drop what has been written back from the page cache */
+  sse_uint64 fDropped;                     /** Bytes dropped from the page cache */
+  sse_byte *fBuffer;                       /** Aligned buffer of fChunkSize bytes */
+  TFILEUring *fUring;                      /** Writes through io_uring, NULL if not available */
+  TFILEWorkerPool *fWorkers;               /** Writes on the workers otherwise, not owned */
+  struct TFILEBlockDevSlot_ *fSlots[FILE_BLOCKDEV_WRITE_DEPTH];
+  sse_uint fDepth;                         /** Number of fSlots, 0 to write synchronously */
+  sse_uint fInFlight;                      /** Writes submitted and not completed */
+  struct TFILEBlockDevSync_ *fSync;        /** Flush of the image before it is verified, NULL if not running */
+  const sse_byte *fBody;                   /** Body of the chunk being queued, NULL if all queued */
+  sse_size fBodyLength;
+  sse_size fBodyDone;                      /** Bytes of fBody queued */
+  sse_int64 fExpectedSize;                 /** -1 if not verified */
+  MoatValue *fExpectedHash;                /** NULL if not verified */
+  TFILEHash fHash;
+  MoatHttpClient *fHttp;
+  sse_bool fSent;
+  sse_uint fRetries;
+  MoatIdle *fIdle;                         /** Polls the request while it proceeds */
+  int fTimerFd;                            /** Polls the request after fBackoff milliseconds otherwise, -1 if not created */
+  MoatIOWatcher *fTimer;
+  sse_uint fBackoff;                       /** Milliseconds, 0 while polling on fIdle */
+  sse_double fProgressed;                  /** Time the request has sent or received anything last */
+  sse_bool fActive;
+  void (*fOnCompleteCallback)(struct TFILEBlockDevWriter_*, const sse_char*, const sse_char*, sse_pointer); /** Callback function */
+  sse_pointer fOnCompleteCallbackUserData;
+};
+typedef struct TFILEBlockDevWriter_ TFILEBlockDevWriter;
+
+/**
+ * @brief Prototype of callback of the completion of TFILEBlockDevWriter.
+ *
+ * @param [in] self         Instance
+ * @param [in] in_err_code  FILE_ERROR_OK or FILE_ERROR_*
+ * @param [in] in_err_msg   Error message
+ * @param [in] in_user_data User data
+ */
+typedef void (*TFILEBlockDevWriter_OnCompleteCallback)(TFILEBlockDevWriter *self,
+                                                       const sse_char *in_err_code,
+                                                       const sse_char *in_err_msg,
+                                                       sse_pointer in_user_data);
+
+/**
+ * @brief Constructor of TFILEBlockDevWriter class
+ *
+ * @param [in] in_url         Source URL
+ * @param [in] in_device_path Block device or MTD character device, e.g. the inactive A/B slot
+ * @param [in] in_block_size  Erase block size, 0 to ask the device
+ * @param [in] in_direct      sse_true to write with O_DIRECT
+ *
+ * @return Instance
+ */
+TFILEBlockDevWriter*
+FILEBlockDevWriter_New(const sse_char *in_url,
+                       const sse_char *in_device_path,
+                       sse_size in_block_size,
+                       sse_bool in_direct);
+
+void
+TFILEBlockDevWriter_Delete(TFILEBlockDevWriter *self);
+
+/**
+ * @brief Verify the image with the size and the hash. Call before TFILEBlockDevWriter_Start().
+ *
+ * @param [in] self     Instance
+ * @param [in] in_size  Expected size, -1 if not verified
+ * @param [in] in_hash  Expected hash, see FILEHash_ParseHash(), NULL if not verified
+ *
+ * @retval SSE_E_OK    Success
+ * @retval SSE_E_INVAL The hash is malformed
+ */
+sse_int
+TFILEBlockDevWriter_SetExpected(TFILEBlockDevWriter *self,
+                                sse_int64 in_size,
+                                MoatValue *in_hash);
+
+/**
+ * @brief Write in buffers of the given size. Call before TFILEBlockDevWriter_Start().
+ *
+ * @param [in] self    Instance
+ * @param [in] in_size Size of the write buffer, rounded up to the erase block. 0 to write a chunk at once.
+ */
+void
+TFILEBlockDevWriter_SetWriteBufferSize(TFILEBlockDevWriter *self,
+                                       sse_size in_size);
+
+/**
+ * @brief Write back the image while it is written and drop it from the page cache, not to push
+ *        the working set of the other processes out. Call before TFILEBlockDevWriter_Start().
+ *
+ * Nothing is done with O_DIRECT or for MTD, they are not cached.
+ *
+ * @param [in] self          Instance
+ * @param [in] in_drop_cache sse_true to drop the written pages
+ */
+void
+TFILEBlockDevWriter_SetDropCache(TFILEBlockDevWriter *self,
+                                 sse_bool in_drop_cache);
+
+/**
+ * @brief Write on the workers where io_uring is not available, and flush the image on them.
+ *        Call before TFILEBlockDevWriter_Start().
+ *
+ * @param [in] self    Instance
+ * @param [in] in_pool Pool, NULL to write and flush synchronously. Must outlive the writes in flight.
+ */
+void
+TFILEBlockDevWriter_SetWorkerPool(TFILEBlockDevWriter *self,
+                                  TFILEWorkerPool *in_pool);
+
+/**
+ * @brief Get the number of write system calls issued so far.
+ *
+ * @param [in] self Instance
+ *
+ * @return Number of pwrite(2) calls, or writes completed through io_uring
+ */
+sse_uint64
+TFILEBlockDevWriter_GetWriteCount(TFILEBlockDevWriter *self);
+
+void
+TFILEBlockDevWriter_SetOnCompleteCallback(TFILEBlockDevWriter *self,
+                                          TFILEBlockDevWriter_OnCompleteCallback in_callback,
+                                          sse_pointer in_user_data);
+
+/**
+ * @brief Open the device and start streaming. The callback is called when completed or failed.
+ *
+ * @param [in] self Instance
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failure, the callback is not called
+ */
+sse_int
+TFILEBlockDevWriter_Start(TFILEBlockDevWriter *self);
+
+/**
+ * @brief Stop streaming without calling the callback. What has been written is left on the device.
+ *
+ * @param [in] self Instance
+ */
+void
+TFILEBlockDevWriter_Cancel(TFILEBlockDevWriter *self);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_BLOCKDEV_H__*/
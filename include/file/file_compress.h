@@ -0,0 +1,185 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+
+#ifndef __FILE_COMPRESS_H__
+#define __FILE_COMPRESS_H__
+
+SSE_BEGIN_C_DECLS
+
+#define FILE_COMPRESS_NONE       (-1)
+#define FILE_COMPRESS_AUTO       (-2)    /* Adjusted while uploading, see TFILECompressTuner */
+#define FILE_COMPRESS_GZIP_LEVEL (6)     /* Level of "gzip" without ":<level>" */
+#define FILE_COMPRESS_LEVEL_MIN  (1)
+#define FILE_COMPRESS_LEVEL_MAX  (9)
+#define FILE_COMPRESS_READ_SIZE  (65536)
+
+/* gzip member being compressed across the calls of FILECompress_GzipRange() */
+typedef struct TFILEGzipMember_ TFILEGzipMember;
+
+/**
+ * @struct TFILECompressTuner_
+ * @brief Choose the gzip level of the next part to upload.
+ *
+ * The cost of a level is the encoding time plus the sending time per byte of the source file,
+ * estimated from the parts compressed and sent so far. The tuner moves to the neighbouring level
+ * on the side of the bottleneck, the CPU or the link, as long as it does not cost more.
+ */
+struct TFILECompressTuner_ {
+  sse_bool fAdaptive;
+  sse_int fLevel;                                        /** Level of the next part */
+  sse_double fEncodeCost[FILE_COMPRESS_LEVEL_MAX + 1];   /** Encoding seconds per source byte, 0 if unknown */
+  sse_double fRatio[FILE_COMPRESS_LEVEL_MAX + 1];        /** Compressed bytes per source byte */
+  sse_double fSendRate;                                  /** Compressed bytes per second, 0 if unknown */
+  sse_uint64 fSourceBytes;
+  sse_uint64 fCompressedBytes;
+  SSEString *fHistory;                                   /** Levels used so far, e.g. "6x2,5x3" */
+  sse_int fRunLevel;                                     /** Level of the last part */
+  sse_uint fRunLength;                                   /** Number of the parts at fRunLevel in a row */
+};
+typedef struct TFILECompressTuner_ TFILECompressTuner;
+
+/**
+ * @brief Parse the compression setting.
+ *
+ * "none", "gzip", "gzip:<level>" (1-9) or "gzip:auto". "zstd" is accepted but compressed with gzip.
+ *
+ * @param [in]  in_spec   Compression setting
+ * @param [in]  in_len    Length of in_spec
+ * @param [out] out_level FILE_COMPRESS_NONE, FILE_COMPRESS_AUTO or gzip level
+ *
+ * @retval SSE_E_OK    Success
+ * @retval SSE_E_INVAL Unknown setting
+ */
+sse_int
+FILECompress_ParseSpec(const sse_char *in_spec,
+                       sse_size in_len,
+                       sse_int *out_level);
+
+/**
+ * @brief Compress a range of the source into a gzip member in memory.
+ *
+ * Read the file from in_offset and stop reading once in_min_out bytes have been compressed or
+ * in_limit has been reached. Concatenated members are a valid gzip stream, so the file can be
+ * compressed a part at a time.
+ *
+ * A command may not have written more yet. Then SSE_E_AGAIN is returned and the member being
+ * compressed is kept in *io_member, call again with the same arguments once the command is
+ * readable, see TFILESource_GetDescriptor(). *io_member must be NULL on the first call, and is
+ * NULL again unless SSE_E_AGAIN is returned. Free it with FILECompress_AbortGzip() not to call again.
+ *
+ * @param [in]     in_source   Source
+ * @param [in]     in_offset   Offset to start reading
+ * @param [in]     in_limit    Offset to stop reading (the file size when the upload started)
+ * @param [in]     in_min_out  Compressed size to stop reading at
+ * @param [in]     in_level    gzip level
+ * @param [in,out] io_member   Member being compressed, NULL on the first call
+ * @param [in,out] io_buf      Output buffer, reallocated if it is too small
+ * @param [in,out] io_buf_size Size of io_buf
+ * @param [out]    out_len     Compressed size
+ * @param [out]    out_end     Offset next to the last byte read
+ *
+ * @retval SSE_E_OK    Success
+ * @retval SSE_E_AGAIN Call again once the source is readable
+ * @retval others      Failure
+ */
+sse_int
+FILECompress_GzipRange(TFILESource *in_source,
+                       sse_uint64 in_offset,
+                       sse_uint64 in_limit,
+                       sse_size in_min_out,
+                       sse_int in_level,
+                       TFILEGzipMember **io_member,
+                       sse_byte **io_buf,
+                       sse_size *io_buf_size,
+                       sse_size *out_len,
+                       sse_uint64 *out_end);
+
+/**
+ * @brief Drop the member kept by FILECompress_GzipRange()
+ *
+ * @param [in] in_member Member, NULL is ignored
+ */
+void
+FILECompress_AbortGzip(TFILEGzipMember *in_member);
+
+/**
+ * @brief Initialize the tuner
+ *
+ * @param [in] self     Instance
+ * @param [in] in_level FILE_COMPRESS_AUTO or the fixed gzip level
+ */
+void
+TFILECompressTuner_Initialize(TFILECompressTuner *self,
+                              sse_int in_level);
+
+void
+TFILECompressTuner_Finalize(TFILECompressTuner *self);
+
+/**
+ * @brief Record a part compressed with the current level, then choose the level of the next part.
+ *
+ * @param [in] self           Instance
+ * @param [in] in_source      Source bytes
+ * @param [in] in_compressed  Compressed bytes
+ * @param [in] in_sec         CPU seconds spent in FILECompress_GzipRange(), see FILECompress_CpuNow()
+ */
+void
+TFILECompressTuner_OnEncoded(TFILECompressTuner *self,
+                             sse_uint64 in_source,
+                             sse_uint64 in_compressed,
+                             sse_double in_sec);
+
+/**
+ * @brief Record the throughput of a part sent.
+ *
+ * @param [in] self           Instance
+ * @param [in] in_compressed  Bytes sent
+ * @param [in] in_sec         Seconds spent to send and receive the response
+ * @param [in] in_concurrency Number of the parts sent in parallel
+ */
+void
+TFILECompressTuner_OnSent(TFILECompressTuner *self,
+                          sse_uint64 in_compressed,
+                          sse_double in_sec,
+                          sse_uint in_concurrency);
+
+/**
+ * @brief Summary of the levels used and the total ratio, e.g. "gzip levels=6x2,5x3 ratio=0.125".
+ *
+ * @return String to be freed with sse_free()
+ */
+sse_char*
+TFILECompressTuner_GetReport(TFILECompressTuner *self);
+
+/**
+ * @brief Monotonic clock in seconds
+ */
+sse_double
+FILECompress_Now(void);
+
+/**
+ * @brief CPU time of the calling thread in seconds, not counting the time waiting for the source
+ */
+sse_double
+FILECompress_CpuNow(void);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_COMPRESS_H__*/
@@ -25,6 +25,13 @@ struct TFILEContentInfo_ {
   Moat fMoat;
   MoatObject *fObject;
   TFILEFilesysInfoTbl fFilesysInfo;
+  TFILEDownloader *fPrefetch;    /** Prefetch which has not been attached to the download command yet */
+  MoatTimer *fPrefetchTimer;     /** Timer to discard the prefetch */
+  sse_int fPrefetchTimerId;      /** Timer id of the prefetch, -1 if not set */
+  sse_char *fPrefetchUrl;        /** deliveryUrl of the last prefetch, kept after it has been attached or discarded */
+  sse_char *fPrefetchPath;       /** destinationPath of the last prefetch */
+  TFILEPriority fPriority;       /** Priority of the process while transfers are running */
+  TFILEWorkerPool *fWorkers;     /** Workers of the transfers */
 };
 typedef struct TFILEContentInfo_ TFILEContentInfo;
 
@@ -94,11 +101,39 @@ FILEContentInfo_UpdateFieldsProc(Moat in_moat,
                                  MoatObject *in_object,
                                  sse_pointer in_model_context);
 
+/**
+ * @brief Get the source URL and the destination file path of the download command.
+ *
+ * @param [in] self           Instance
+ * @param [out] out_url       Source URL, owned by the model object, valid until it is updated
+ * @param [out] out_file_path Destination file path or the list of them, free it with moat_value_free()
+ *
+ * @retval SSE_E_OK  Success
+ * @retval others    Failuer
+ */
 sse_int
 TFILEContentInfo_GetDownloadFilePath(TFILEContentInfo *self,
                                      MoatValue **out_url,
                                      MoatValue **out_file_path);
 
+/**
+ * @brief Get the delivery manifest.
+ *
+ * Parse "deliveryManifest" field, which is a JSON string of a list of {"url", "path", "size", "hash"}
+ * or an object {"files": [...], "concurrency": n}.
+ *
+ * @param [in]  self            ContentInfo instance
+ * @param [out] out_manifest    List of the files. It must be freed by the caller.
+ * @param [out] out_concurrency Number of the files downloaded concurrently
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failuer
+ */
+sse_int
+TFILEContentInfo_GetDeliveryManifest(TFILEContentInfo *self,
+                                     MoatValue **out_manifest,
+                                     sse_uint *out_concurrency);
+
 sse_int
 TFILEContentInfo_GetUploadFilePath(TFILEContentInfo *self,
                                    MoatValue **out_url,
@@ -126,6 +161,48 @@ ContentInfo_download(Moat in_moat,
                      MoatValue *in_data,
                      sse_pointer in_model_context);
 
+/**
+ * @brief Entry point of "downloadManifest" command in "ContentInfo" model.
+ *
+ * Download all files listed in "deliveryManifest" and commit them together.
+ *
+ * @param [in] in_moat          Moat instance
+ * @param [in] in_uid           UUID
+ * @param [in] in_key           Continuation key for notifying asynchronous operation result
+ * @param [in] in_data          Parameter value of the command
+ * @param [in] in_model_context Context information associated with the model
+ *
+ * @retval SSE_E_INPROGRESS Success
+ * @retval others           Failuer
+ */
+sse_int
+ContentInfo_downloadManifest(Moat in_moat,
+                             sse_char *in_uid,
+                             sse_char *in_key,
+                             MoatValue *in_data,
+                             sse_pointer in_model_context);
+
+/**
+ * @brief Entry point of "rollback" command in "ContentInfo" model.
+ *
+ * Switch the version store which includes "destinationPath" back to the previous version.
+ *
+ * @param [in] in_moat          Moat instance
+ * @param [in] in_uid           UUID
+ * @param [in] in_key           Continuation key for notifying asynchronous operation result
+ * @param [in] in_data          Parameter value of the command
+ * @param [in] in_model_context Context information associated with the model
+ *
+ * @retval SSE_E_INPROGRESS Success
+ * @retval others           Failuer
+ */
+sse_int
+ContentInfo_rollback(Moat in_moat,
+                     sse_char *in_uid,
+                     sse_char *in_key,
+                     MoatValue *in_data,
+                     sse_pointer in_model_context);
+
 sse_int
 FILEContent_DownloadFileAsync(Moat in_moat,
                               sse_char *in_uid,
@@ -0,0 +1,64 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+
+#ifndef __FILE_COPY_H__
+#define __FILE_COPY_H__
+
+SSE_BEGIN_C_DECLS
+
+/*
+ * Copying and moving files in plain C, so that they can be called on the worker threads, see
+ * TFILEWorkerPool.
+ */
+
+/**
+ * @brief Copy the file into a new file
+ *
+ * A reflink (FICLONE) or a hard link is used if possible, then copy_file_range(2) which copies
+ * the data in the kernel, then read(2)/write(2). in_dst is replaced if it exists.
+ *
+ * @param [in] in_src Source file path
+ * @param [in] in_dst Destination file path
+ *
+ * @retval SSE_E_OK    Success
+ * @retval SSE_E_NOENT in_src does not exist.
+ * @retval SSE_E_ACCES Permission denied
+ * @retval SSE_E_NOMEM No space left on the device
+ * @retval others      Failure
+ */
+sse_int
+FILECopy_CloneFile(const sse_char *in_src,
+                   const sse_char *in_dst);
+
+/**
+ * @brief Move the file by rename(2), or copy and remove it across filesystems
+ *
+ * @param [in] in_src Source file path
+ * @param [in] in_dst Destination file path
+ *
+ * @return See FILECopy_CloneFile()
+ */
+sse_int
+FILECopy_MoveFile(const sse_char *in_src,
+                  const sse_char *in_dst);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_COPY_H__*/
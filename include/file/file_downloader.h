@@ -21,23 +21,95 @@
 
 SSE_BEGIN_C_DECLS
 
+/**
+ * @brief State of TFILEDownloader
+ */
+enum FILEDownloaderState_ {
+  FILE_DOWNLOADER_STATE_READY,       /** Not started yet */
+  FILE_DOWNLOADER_STATE_PREACTION,   /** Executing the pre-action script */
+  FILE_DOWNLOADER_STATE_DOWNLOADING, /** Downloading into the temporary file */
+  FILE_DOWNLOADER_STATE_FETCHED,     /** Prefetched, waiting for the download command */
+  FILE_DOWNLOADER_STATE_COMMITTING,  /** Moving the temporary file to the destination */
+  FILE_DOWNLOADER_STATE_POSTACTION,  /** Executing the post-action script */
+  FILE_DOWNLOADER_STATE_DISCARDED,   /** Prefetch has been discarded */
+  FILE_DOWNLOADER_STATEs
+};
+
+/**
+ * @brief State of TFILEDownloadItem
+ */
+enum FILEDownloadItemState_ {
+  FILE_DOWNLOAD_ITEM_STATE_WAITING,     /** Not started yet */
+  FILE_DOWNLOAD_ITEM_STATE_DOWNLOADING, /** Downloading into the temporary file */
+  FILE_DOWNLOAD_ITEM_STATE_VERIFYING,   /** Being expanded and verified by a worker */
+  FILE_DOWNLOAD_ITEM_STATE_DOWNLOADED,  /** Downloaded and verified */
+  FILE_DOWNLOAD_ITEM_STATE_FAILED,      /** Failed or canceled */
+  FILE_DOWNLOAD_ITEM_STATEs
+};
+
+/**
+ * @struct TFILEDownloadItem_
+ * @brief A file to be downloaded by TFILEDownloader.
+ */
+struct TFILEDownloadItem_ {
+  struct TFILEDownloader_ *fOwner;         /** Downloader which the item belongs to */
+  sse_uint fIndex;                         /** Index in the downloader */
+  MoatValue *fFilesysInfo;                 /** Filesystem info which the file will be saved to. Owned by the downloader. */
+  MoatValue *fUrl;                         /** Source URL */
+  MoatValue *fFilePath;                    /** Destination file path */
+  MoatValue *fTmpFilePath;                 /** Temporary file path */
+  sse_int64 fSize;                         /** Expected file size, -1 if not specified */
+  MoatValue *fHash;                        /** Expected hash, NULL if not specified */
+  MoatDownloader *fDownloader;             /** MOAT Downloader instance */
+  sse_int fState;                          /** FILEDownloadItemState_ */
+  sse_bool fBackup;                        /** The previous destination file is kept while committing. */
+  struct TFILEDownloadItem_ *fSource;      /** Item whose downloaded file is copied to this one, NULL if the file is downloaded */
+  TFILEVersionStore *fStore;               /** Version store which the file is committed to, NULL if the file is renamed. Owned by the downloader. */
+  sse_bool fDevice;                        /** The destination is a block device, the image is streamed into it. */
+  TFILEBlockDevWriter *fWriter;            /** Writer streaming into the block device or the buffered temporary file, NULL if downloaded by fDownloader */
+  TFILEWorkerJob *fJob;                    /** Verification running on a worker, NULL if not */
+};
+typedef struct TFILEDownloadItem_ TFILEDownloadItem;
+
 /**
  * @struct TFILEDownloader_
- * @brief The downloader class in order to download the file from the web storage.
+ * @brief The downloader class in order to download the files from the web storage.
+ *
+ * All files are downloaded into the temporary files with bounded concurrency, then
+ * committed together only if all of them have been downloaded successfully.
+ * Images under a FILE_FILESYS_TYPE_BLOCKDEV entry are streamed straight into the devices instead,
+ * and the post-action of the entry, e.g. to flip the boot slot, is executed only if all files have
+ * been written and verified.
+ * Files under "symlink" of the filesystem info are committed by swapping the link, see TFILEVersionStore.
  */  
 struct TFILEDownloader_ {
   sse_char *fUid;                          /** uid of download command requeet in ContentInfo model */
   sse_char *fKey;                          /** key of download command requeet in ContentInfo model */
-  MoatValue *fFilesysInfo;                 /** Filesystem info which the file will be saved to. */
-  MoatValue *fUrl;                         /** Source URL */
-  MoatValue *fFilePath;                    /** Destination file path */
-  MoatValue *fTmpFilePath;                 /** Temporary file path */
-  TSseUtilShellCommand *fPreAction;        /** Shell command instance to execute the pre-action script. */
-  MoatDownloader *fDownloader;             /** MOAT Downloader instance */
-  TSseUtilShellCommand *fPostAction;       /** Shell command instance to execute the post-action script. */
+  TFILEDownloadItem **fItems;              /** Files to be downloaded */
+  sse_uint fItemCount;                     /** Number of fItems */
+  sse_uint fConcurrency;                   /** Max number of files downloaded at once */
+  sse_uint fNextItem;                      /** Index of the item to be started next */
+  sse_uint fActiveItems;                   /** Number of items being downloaded */
+  MoatValue **fFilesysInfos;               /** Distinct filesystem info of the items */
+  MoatValue **fFilesysInfoSources;         /** Entries of TFILEFilesysInfoTbl which fFilesysInfos are cloned from */
+  sse_uint fFilesysInfoCount;              /** Number of fFilesysInfos */
+  sse_uint fActionIndex;                   /** Index of fFilesysInfos whose action is being executed */
+  sse_uint fPreActionDone;                 /** Number of fFilesysInfos whose pre-action has been done */
+  TSseUtilShellCommand **fPreActions;      /** Shell command instances to execute the pre-action scripts. */
+  TSseUtilShellCommand **fPostActions;     /** Shell command instances to execute the post-action scripts. */
+  TFILEVersionStore **fStores;             /** Version stores of fFilesysInfos, NULL if "symlink" is not configured. */
+  TFILEVersionStore *fRollbackStore;       /** Version store to be rolled back instead of downloading, one of fStores */
   void (*fOnCompleteCallback)(struct TFILEDownloader_*, MoatValue*, MoatValue*, const sse_char*, const sse_char*, sse_pointer); /** Callback function */
   sse_pointer fOnCompleteCallbackUserData; /** User data passed with callback. */
   MoatObject *fResultCode;                 /** Result code and message. */
+  sse_int fState;                          /** FILEDownloaderState_ */
+  sse_bool fPrefetch;                      /** Started by TFILEDownloader_Prefetch() */
+  sse_bool fSparse;                        /** The files are downloaded as sparse images */
+  sse_uint64 fWriteCount;                  /** Number of write system calls of the items written by TFILEBlockDevWriter */
+  TFILEPriority *fPriority;                /** Priority lowered while downloading, NULL if not lowered. Not owned. */
+  sse_bool fPriorityEntered;               /** TFILEPriority_Enter() has been called */
+  TFILEWorkerPool *fWorkers;               /** Workers to verify and stage the files, required. Not owned. */
+  TFILEArena fArena;                       /** uid, key, the items and the strings built for them */
 };
 typedef struct TFILEDownloader_ TFILEDownloader;
 
@@ -136,6 +208,101 @@ TFILEDownloader_SetResourcePath(TFILEDownloader *self,
                                 MoatValue *in_dst_filepath,
                                 TFILEFilesysInfoTbl * in_filesys_info_tbl);
 
+/**
+ * @brief Set a delivery manifest
+ *
+ * Set the files to be downloaded together. The manifest is a list of objects,
+ * {"url": <source URL>, "path": <destination file path>, "size": <bytes, optional>, "hash": <hash, optional>}.
+ * See FILEHash_ParseHash() for the format of "hash".
+ *
+ * @param [in] self                Instance
+ * @param [in] in_manifest         List of the manifest entries
+ * @param [in] in_filesys_info_tbl Table of the filesystem info
+ *
+ * @retval SSE_E_OK    Success
+ * @retval SSE_E_INVAL Malformed manifest
+ */
+sse_int
+TFILEDownloader_SetManifest(TFILEDownloader *self,
+                            MoatValue *in_manifest,
+                            TFILEFilesysInfoTbl *in_filesys_info_tbl);
+
+/**
+ * @brief Roll back the version store instead of downloading
+ *
+ * The symbolic link of the version store which includes the path is swapped back to the previous
+ * version. The pre-action and the post-action of the filesystem are executed as the download.
+ *
+ * @param [in] self                Instance
+ * @param [in] in_dst_filepath     Destination file path under "symlink" of the filesystem info, or the link itself
+ * @param [in] in_filesys_info_tbl Filesystem info table
+ *
+ * @retval SSE_E_OK    Success
+ * @retval SSE_E_INVAL The path is not under "symlink"
+ */
+sse_int
+TFILEDownloader_SetRollbackPath(TFILEDownloader *self,
+                                MoatValue *in_dst_filepath,
+                                TFILEFilesysInfoTbl *in_filesys_info_tbl);
+
+/**
+ * @brief Set max number of files downloaded at once
+ *
+ * @param [in] self           Instance
+ * @param [in] in_concurrency Max number of files, 1 or more
+ *
+ * @return none
+ */
+void
+TFILEDownloader_SetConcurrency(TFILEDownloader *self,
+                               sse_uint in_concurrency);
+
+/**
+ * @brief Expand the downloaded files as sparse images, see TFILESparseImage
+ *
+ * Each file is expanded with FILESparse_Expand() before it is verified, so the holes are not
+ * written to the storage. The size and the hash to verify are of the expanded file.
+ *
+ * @param [in] self      Instance
+ * @param [in] in_sparse sse_true if the files are sparse images
+ *
+ * @return none
+ */
+void
+TFILEDownloader_SetSparse(TFILEDownloader *self,
+                          sse_bool in_sparse);
+
+/**
+ * @brief Lower the priority of the process while downloading, see TFILEPriority
+ *
+ * The priority is entered with the filesystem info of the items when the download or the prefetch
+ * is started, and left when the downloader is deleted.
+ *
+ * @param [in] self        Instance
+ * @param [in] in_priority Priority shared by the transfers
+ *
+ * @return none
+ */
+void
+TFILEDownloader_SetPriority(TFILEDownloader *self,
+                            TFILEPriority *in_priority);
+
+/**
+ * @brief Verify and stage the files on the worker threads, see TFILEWorkerPool
+ *
+ * Expanding the sparse images, hashing the files and copying them into the destinations run on
+ * the workers, so the event loop keeps handling the other commands. Required, call before
+ * downloading.
+ *
+ * @param [in] self       Instance
+ * @param [in] in_workers Workers shared by the transfers
+ *
+ * @return none
+ */
+void
+TFILEDownloader_SetWorkerPool(TFILEDownloader *self,
+                              TFILEWorkerPool *in_workers);
+
 /**
  * @brief Download the file
  *
@@ -148,6 +315,103 @@ TFILEDownloader_SetResourcePath(TFILEDownloader *self,
 void
 TFILEDownloader_DownloadFile(TFILEDownloader *self);
 
+/**
+ * @brief Prefetch the file
+ *
+ * Execute the pre-action and download the file into the temporary file, but do not
+ * move it to the destination until TFILEDownloader_AttachCommand() and
+ * TFILEDownloader_DownloadFile() are called.
+ *
+ * @param [in] self Instance
+ *
+ * @return none
+ */
+void
+TFILEDownloader_Prefetch(TFILEDownloader *self);
+
+/**
+ * @brief Attach the download command to the prefetch
+ *
+ * Set uid and key of the download command, so that the result is notified for the command.
+ * If the prefetch has been completed already, TFILEDownloader_DownloadFile() commits the file.
+ * If the prefetch is in progress, the file is committed when downloading has been completed.
+ *
+ * @param [in] self   Instance
+ * @param [in] in_uid uid of download command requeet in ContentInfo model
+ * @param [in] in_key key of download command requeet in ContentInfo model
+ *
+ * @retval SSE_E_OK    Success
+ * @retval SSE_E_INVAL The prefetch could not be attached any more.
+ */
+sse_int
+TFILEDownloader_AttachCommand(TFILEDownloader *self,
+                              const sse_char *in_uid,
+                              const sse_char *in_key);
+
+/**
+ * @brief Discard the prefetch
+ *
+ * Cancel downloading, remove the temporary files and execute the post-action.
+ * The on-complete callback will be called at the end.
+ *
+ * @param [in] self Instance
+ *
+ * @return none
+ */
+void
+TFILEDownloader_Discard(TFILEDownloader *self);
+
+/**
+ * @brief Test the resource path
+ *
+ * Only a downloader of a single file can match.
+ *
+ * @param [in] self            Instance
+ * @param [in] in_src_url      Source URL
+ * @param [in] in_dst_filepath Destination file path
+ *
+ * @retval sse_true  Both are same as the ones set by TFILEDownloader_SetResourcePath().
+ * @retval sse_false Otherwise.
+ */
+sse_bool
+TFILEDownloader_MatchResourcePath(TFILEDownloader *self,
+                                  MoatValue *in_src_url,
+                                  MoatValue *in_dst_filepath);
+
+/**
+ * @brief Remove the temporary files
+ *
+ * @param [in] self Instance
+ *
+ * @return none
+ */
+void
+TFILEDownloader_DeleteTmpFiles(TFILEDownloader *self);
+
+/**
+ * @brief Get the number of write system calls issued for the files streamed into block devices or
+ *        written through a write buffer, see TFILEFilesysInfo_GetWriteBufferSize(). Files written by
+ *        MoatDownloader are not counted.
+ *
+ * @param [in] self Instance
+ *
+ * @return Number of write system calls
+ */
+sse_uint64
+TFILEDownloader_GetWriteCount(TFILEDownloader *self);
+
+/**
+ * @brief Attributes of FileResult reporting the download
+ *
+ * "writeCount", see TFILEDownloader_GetWriteCount(), if any file has been written by TFILEBlockDevWriter.
+ *
+ * @param [in] self Instance
+ *
+ * @return Object to be freed with moat_object_free()
+ */
+MoatObject*
+TFILEDownloader_GetResultDetails(TFILEDownloader *self);
+
 
 SSE_END_C_DECLS
 
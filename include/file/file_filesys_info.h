@@ -40,6 +40,19 @@ MoatValue*
 TFILEFilesysInfoTbl_FindFilesysInfo(TFILEFilesysInfoTbl *self,
                                     MoatValue *in_file_path);
 
+/**
+ * @brief Number of the worker threads, see TFILEWorkerPool.
+ *
+ * "workers" at the top level of filesystem.conf, 0 to run the jobs on the event loop, e.g. on
+ * single core devices.
+ *
+ * @param [in] self Instance
+ *
+ * @return 0 to FILE_WORKER_THREADS_MAX, FILE_WORKER_THREADS_AUTO if not configured
+ */
+sse_int
+TFILEFilesysInfoTbl_GetWorkerThreads(TFILEFilesysInfoTbl *self);
+
 typedef MoatValue TFILEFilesysInfo;
 
 MoatValue*
@@ -54,6 +67,174 @@ TFILEFilesysInfo_GetPostAction(TFILEFilesysInfo *self);
 MoatValue*
 TFILEFilesysInfo_GetTmpDir(TFILEFilesysInfo *self);
 
+/**
+ * @brief Whether the file should be prefetched when ContentInfo is updated.
+ *
+ * "prefetch" key, false if not configured.
+ */
+sse_bool
+TFILEFilesysInfo_IsPrefetchEnabled(TFILEFilesysInfo *self);
+
+/**
+ * @brief Seconds to keep a prefetched file waiting for the download command.
+ *
+ * "prefetchtimeout" key, FILE_PREFETCH_TIMEOUT_DEFAULT if not configured.
+ */
+sse_uint
+TFILEFilesysInfo_GetPrefetchTimeout(TFILEFilesysInfo *self);
+
+/**
+ * @brief Symbolic link swapped to commit the files under it at once.
+ *
+ * "symlink" key, NULL if not configured. See TFILEVersionStore.
+ */
+MoatValue*
+TFILEFilesysInfo_GetSymlink(TFILEFilesysInfo *self);
+
+/**
+ * @brief Directory to store the versions pointed by "symlink".
+ *
+ * "versionsdir" key, NULL if not configured.
+ */
+MoatValue*
+TFILEFilesysInfo_GetVersionsDir(TFILEFilesysInfo *self);
+
+/**
+ * @brief Number of the older versions kept under "versionsdir" besides the active one.
+ *
+ * "keepversions" key, FILE_KEEP_VERSIONS_DEFAULT if not configured.
+ */
+sse_uint
+TFILEFilesysInfo_GetKeepVersions(TFILEFilesysInfo *self);
+
+/**
+ * @brief Part size of the multipart upload of the files under the entry.
+ *
+ * "uploadpartsize" key in bytes, 0 (upload with a single PUT) if not configured.
+ */
+sse_size
+TFILEFilesysInfo_GetUploadPartSize(TFILEFilesysInfo *self);
+
+/**
+ * @brief Compression of the files under the entry while uploading.
+ *
+ * "uploadcompression" key, "none", "gzip" or "gzip:<level>". NULL if not configured.
+ */
+MoatValue*
+TFILEFilesysInfo_GetUploadCompression(TFILEFilesysInfo *self);
+
+/**
+ * @brief Max number of the parts uploaded at once.
+ *
+ * "uploadconcurrency" key, FILE_UPLOAD_CONCURRENCY_DEFAULT if not configured.
+ */
+sse_uint
+TFILEFilesysInfo_GetUploadConcurrency(TFILEFilesysInfo *self);
+
+/**
+ * @brief Whether to upload the files under the entry from a snapshot.
+ *
+ * "uploadsnapshot" key, sse_false if not configured.
+ */
+sse_bool
+TFILEFilesysInfo_IsUploadSnapshotEnabled(TFILEFilesysInfo *self);
+
+/**
+ * @brief Whether the files under the entry are block devices or MTD partitions.
+ *
+ * "type" is FILE_FILESYS_TYPE_BLOCKDEV. The image is streamed into the device with
+ * TFILEBlockDevWriter instead of being downloaded into a temporary file.
+ */
+sse_bool
+TFILEFilesysInfo_IsBlockDevice(TFILEFilesysInfo *self);
+
+/**
+ * @brief Erase block size of the block devices or the flash memory under the entry.
+ *
+ * "eraseblocksize" key in bytes, 0 (asked to the device) if not configured.
+ */
+sse_size
+TFILEFilesysInfo_GetEraseBlockSize(TFILEFilesysInfo *self);
+
+/**
+ * @brief Whether to write the block devices under the entry with O_DIRECT.
+ *
+ * "odirect" key, sse_false if not configured.
+ */
+sse_bool
+TFILEFilesysInfo_IsDirectIoEnabled(TFILEFilesysInfo *self);
+
+/**
+ * @brief Size of the buffer which the downloaded data is written to the temporary file in.
+ *
+ * "writebuffersize" key in bytes, e.g. the erase block of FILE_FILESYS_TYPE_NVRAM. 0 if not
+ * configured, written by MoatDownloader without buffering.
+ */
+sse_size
+TFILEFilesysInfo_GetWriteBufferSize(TFILEFilesysInfo *self);
+
+/**
+ * @brief Whether to keep the files transferred under the entry out of the page cache.
+ *
+ * "fadvise" key, sse_false if not configured. An uploaded file is read ahead sequentially and
+ * dropped as it is read, and a downloaded file is written back and dropped as it is written.
+ */
+sse_bool
+TFILEFilesysInfo_IsFadviseEnabled(TFILEFilesysInfo *self);
+
+/**
+ * @brief Whether to send the files under the entry to "http://" URLs with sendfile(2), see TFILESendfileUpload.
+ *
+ * "zerocopy" key, sse_false if not configured. Only a whole file uploaded with a single PUT,
+ * neither compressed nor in parts, is sent this way. The proxy, redirects and TLS of the SDK
+ * are not used, enable it only for the endpoints which do not need them.
+ */
+sse_bool
+TFILEFilesysInfo_IsZeroCopyEnabled(TFILEFilesysInfo *self);
+
+/**
+ * @brief Nice level of the transfers under the entry, see TFILEPriority.
+ *
+ * "nice" key, FILE_PRIORITY_NONE if not configured.
+ */
+sse_int
+TFILEFilesysInfo_GetNice(TFILEFilesysInfo *self);
+
+/**
+ * @brief I/O priority of the transfers under the entry, see TFILEPriority.
+ *
+ * "ioclass" key, one of "realtime", "besteffort" or "idle", and "iolevel" key from 0 (highest)
+ * to 7 (lowest), 4 if not configured. FILE_PRIORITY_NONE if "ioclass" is not configured.
+ *
+ * @return Value for ioprio_set(2)
+ */
+sse_int
+TFILEFilesysInfo_GetIoPriority(TFILEFilesysInfo *self);
+
+/**
+ * @brief cgroup v2 directory which the transfers under the entry are run in, see TFILEPriority.
+ *
+ * "cgroup" key, e.g. "/sys/fs/cgroup/moat-transfer", NULL if not configured.
+ */
+MoatValue*
+TFILEFilesysInfo_GetCgroup(TFILEFilesysInfo *self);
+
+/**
+ * @brief Limits written to "io.max" of the cgroup.
+ *
+ * "cgroupiomax" key, e.g. "179:0 wbps=1048576", NULL if not configured.
+ */
+MoatValue*
+TFILEFilesysInfo_GetCgroupIoMax(TFILEFilesysInfo *self);
+
+/**
+ * @brief Limit written to "cpu.max" of the cgroup.
+ *
+ * "cgroupcpumax" key, e.g. "20000 100000", NULL if not configured.
+ */
+MoatValue*
+TFILEFilesysInfo_GetCgroupCpuMax(TFILEFilesysInfo *self);
+
 SSE_END_C_DECLS
 
 #endif /*__FILE_FILESYS_INFO_H__*/
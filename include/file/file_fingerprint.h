@@ -0,0 +1,107 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#ifndef __FILE_FINGERPRINT_H__
+#define __FILE_FINGERPRINT_H__
+
+SSE_BEGIN_C_DECLS
+
+/**
+ * @struct TFILEFingerprint_
+ * @brief Fingerprint of a file uploaded last time, to skip uploading it again if unchanged.
+ *
+ * The cache is kept in "<dir>/<name>-<hash of the path>.fingerprint" with the inode, size and
+ * mtime of the file, the SHA-256 of the content and the ETag reported by the server. The upload
+ * destination (the URL without the query), the compression and the sparse image are a part of the key.
+ */
+struct TFILEFingerprint_ {
+  sse_char *fFilePath;
+  sse_char *fCachePath;
+  sse_char *fDestination;                  /** Upload URL without the query, e.g. the signature */
+  sse_int fLevel;                          /** Compression of the upload */
+  sse_bool fSparse;                        /** sse_true if uploaded as a sparse image */
+  sse_bool fCached;                        /** sse_true if the cache has been loaded */
+  sse_uint64 fDev;
+  sse_uint64 fIno;
+  sse_uint64 fSize;
+  sse_int64 fMtimeSec;
+  sse_int64 fMtimeNsec;
+  sse_char fHash[FILE_HASH_HEX_MAX + 1];   /** SHA-256 of the content */
+  sse_char *fETag;                         /** ETag of the last upload, NULL if not reported */
+};
+typedef struct TFILEFingerprint_ TFILEFingerprint;
+
+/**
+ * @brief Constructor of TFILEFingerprint class, loads the cache if any.
+ *
+ * @param [in] in_file_path Source file path
+ * @param [in] in_url       Upload URL
+ * @param [in] in_level     Compression, see TFILEMultipartUpload_SetCompression()
+ * @param [in] in_sparse    sse_true if uploaded as a sparse image
+ * @param [in] in_cache_dir Directory to keep the cache
+ *
+ * @return Instance
+ */
+TFILEFingerprint*
+FILEFingerprint_New(const sse_char *in_file_path,
+                    const sse_char *in_url,
+                    sse_int in_level,
+                    sse_bool in_sparse,
+                    const sse_char *in_cache_dir);
+
+void
+TFILEFingerprint_Delete(TFILEFingerprint *self);
+
+/**
+ * @brief Check if the file is the same as uploaded last time.
+ *
+ * The inode, size and mtime are compared first. The content is hashed only if the size is the
+ * same but the others are not, e.g. the file has been rewritten with the same content.
+ *
+ * @param [in] self Instance
+ *
+ * @return sse_true if the file has not been modified
+ */
+sse_bool
+TFILEFingerprint_IsUnchanged(TFILEFingerprint *self);
+
+/**
+ * @brief Save the fingerprint of the file uploaded, unless it has been modified while uploading.
+ *
+ * @param [in] self    Instance
+ * @param [in] in_etag ETag reported by the server, NULL if not reported
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failure
+ */
+sse_int
+TFILEFingerprint_Commit(TFILEFingerprint *self,
+                        const sse_char *in_etag);
+
+/**
+ * @brief SHA-256 of the content, valid if unchanged or committed.
+ *
+ * @return Hex string, NULL if not known
+ */
+const sse_char*
+TFILEFingerprint_GetHash(TFILEFingerprint *self);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_FINGERPRINT_H__*/
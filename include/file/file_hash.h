@@ -0,0 +1,150 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+#ifndef __FILE_HASH_H__
+#define __FILE_HASH_H__
+
+SSE_BEGIN_C_DECLS
+
+/**
+ * @brief Hash algorithms
+ */
+enum FILEHashAlgorithm_ {
+  FILE_HASH_ALGORITHM_MD5,
+  FILE_HASH_ALGORITHM_SHA1,
+  FILE_HASH_ALGORITHM_SHA256,
+  FILE_HASH_ALGORITHMs
+};
+
+#define FILE_HASH_HEX_MAX (SHA256_MD_BYTES * 2) /* without '\0' */
+
+/**
+ * @struct TFILEHash_
+ * @brief Streaming message digest.
+ */
+struct TFILEHash_ {
+  sse_int fAlgorithm;
+  union {
+    SSEMd5Context fMd5;
+    SSESha1Context fSha1;
+    SSESha256Context fSha256;
+  } fContext;
+};
+typedef struct TFILEHash_ TFILEHash;
+
+/**
+ * @brief Initialize the hash context
+ *
+ * @param [in] self    Instance
+ * @param [in] in_algo FILEHashAlgorithm_
+ *
+ * @retval SSE_E_OK    Success
+ * @retval SSE_E_INVAL Unknown algorithm
+ */
+sse_int
+TFILEHash_Initialize(TFILEHash *self,
+                     sse_int in_algo);
+
+/**
+ * @brief Feed data into the hash context
+ */
+void
+TFILEHash_Update(TFILEHash *self,
+                 const sse_byte *in_data,
+                 sse_size in_size);
+
+/**
+ * @brief Finish the hash and get the digest as lower case hex string
+ *
+ * @param [in]  self    Instance
+ * @param [out] out_hex Buffer of FILE_HASH_HEX_MAX + 1 bytes
+ *
+ * @return Length of the hex string
+ */
+sse_uint
+TFILEHash_Finalize(TFILEHash *self,
+                   sse_char *out_hex);
+
+/**
+ * @brief FNV-1a hash of a string, e.g. to name a state file after the path
+ *
+ * @param [in] in_str String
+ *
+ * @return Hash
+ */
+sse_uint32
+FILEHash_Fnv1a(const sse_char *in_str);
+
+/**
+ * @brief Hash the file
+ *
+ * @param [in]  in_path File path
+ * @param [in]  in_algo FILEHashAlgorithm_
+ * @param [out] out_hex Buffer of FILE_HASH_HEX_MAX + 1 bytes
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failure
+ */
+sse_int
+FILEHash_HashFile(const sse_char *in_path,
+                  sse_int in_algo,
+                  sse_char *out_hex);
+
+/**
+ * @brief Parse the expected hash
+ *
+ * "sha256:<hex>", "sha1:<hex>", "md5:<hex>" or <hex> whose algorithm is guessed from its length.
+ *
+ * @param [in]  in_hash  Expected hash
+ * @param [out] out_algo FILEHashAlgorithm_
+ * @param [out] out_hex  Pointer to the hex part in in_hash
+ * @param [out] out_len  Length of the hex part
+ *
+ * @retval SSE_E_OK    Success
+ * @retval SSE_E_INVAL Malformed
+ */
+sse_int
+FILEHash_ParseHash(MoatValue *in_hash,
+                   sse_int *out_algo,
+                   sse_char **out_hex,
+                   sse_uint *out_len);
+
+/**
+ * @brief Verify the file with the expected hash
+ *
+ * Plain C, to be called on the worker threads. Parse the hash with FILEHash_ParseHash() on the
+ * event loop beforehand.
+ *
+ * @param [in] in_path File path
+ * @param [in] in_algo FILEHashAlgorithm_
+ * @param [in] in_hex  Expected hash in hex
+ * @param [in] in_len  Length of in_hex
+ *
+ * @retval SSE_E_OK    The file matches.
+ * @retval SSE_E_INVAL The file does not match.
+ * @retval others      Failure
+ */
+sse_int
+FILEHash_VerifyFile(const sse_char *in_path,
+                    sse_int in_algo,
+                    const sse_char *in_hex,
+                    sse_uint in_len);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_HASH_H__*/
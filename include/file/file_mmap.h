@@ -0,0 +1,86 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+
+#ifndef __FILE_MMAP_H__
+#define __FILE_MMAP_H__
+
+SSE_BEGIN_C_DECLS
+
+#define FILE_MMAP_WINDOWS_MAX (64) /* Windows mapped at once in the process */
+
+/**
+ * @struct TFILEMapWindow_
+ * @brief A read-only window of a file mapped with MADV_SEQUENTIAL, passed to the HTTP client as
+ *        the request body instead of a copy read into a buffer.
+ *
+ * If the file is truncated while it is mapped, touching the pages beyond the end raises SIGBUS.
+ * Every window mapped is registered with a SIGBUS handler installed once, which maps a page of
+ * zeros over the faulting page and marks the window truncated, so that the reader (e.g. the TLS
+ * layer encrypting the body) carries on. The upload of a truncated window must be failed. SIGBUS
+ * outside of the windows is passed to the handler installed before.
+ */
+struct TFILEMapWindow_ {
+  sse_byte *fBase;                         /** Mapped address, page aligned, NULL if not mapped */
+  sse_size fMapLength;                     /** Mapped length */
+  const sse_byte *fData;                   /** Data of the range in the mapping */
+  sse_size fLength;                        /** Length of the range */
+  volatile sse_int fTruncated;             /** Set by the SIGBUS handler */
+};
+typedef struct TFILEMapWindow_ TFILEMapWindow;
+
+void
+TFILEMapWindow_Initialize(TFILEMapWindow *self);
+
+/**
+ * @brief Unmap the window if mapped.
+ */
+void
+TFILEMapWindow_Finalize(TFILEMapWindow *self);
+
+/**
+ * @brief Map a range of the file, the window mapped before is unmapped.
+ *
+ * @param [in] self      Instance
+ * @param [in] in_fd     Regular file
+ * @param [in] in_offset Offset of the range
+ * @param [in] in_length Length of the range, more than 0
+ *
+ * @retval SSE_E_OK Success, fData has fLength bytes
+ * @retval others   Failure, e.g. too many windows, read the file instead
+ */
+sse_int
+TFILEMapWindow_Map(TFILEMapWindow *self,
+                   int in_fd,
+                   sse_uint64 in_offset,
+                   sse_size in_length);
+
+/**
+ * @brief Whether the file has been truncated while the window has been read.
+ *
+ * @param [in] self Instance
+ *
+ * @return sse_true if some of the window has been replaced with zeros
+ */
+sse_bool
+TFILEMapWindow_IsTruncated(TFILEMapWindow *self);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_MMAP_H__*/
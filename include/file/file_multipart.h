@@ -0,0 +1,348 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#ifndef __FILE_MULTIPART_H__
+#define __FILE_MULTIPART_H__
+
+SSE_BEGIN_C_DECLS
+
+#define FILE_MULTIPART_MAX_PARTS     (10000)
+#define FILE_MULTIPART_PART_RETRIES  (3)
+#define FILE_MULTIPART_POLL_MIN_MSEC (1)   /* Backoff of polling the requests which do not proceed */
+#define FILE_MULTIPART_POLL_MAX_MSEC (16)
+
+/**
+ * @brief State of TFILEMultipartUpload
+ */
+enum FILEMultipartState_ {
+  FILE_MULTIPART_STATE_READY,
+  FILE_MULTIPART_STATE_INITIATING,  /** Requesting the upload ID */
+  FILE_MULTIPART_STATE_UPLOADING,   /** Uploading the parts */
+  FILE_MULTIPART_STATE_COMPLETING,  /** Requesting to assemble the parts */
+  FILE_MULTIPART_STATE_PUTTING,     /** Uploading the whole file with a single request */
+  FILE_MULTIPART_STATE_DONE,
+  FILE_MULTIPART_STATEs
+};
+
+/**
+ * @struct TFILEMultipartExchange_
+ * @brief A HTTP request and response driven step by step.
+ */
+struct TFILEMultipartExchange_ {
+  MoatHttpClient *fHttp;
+  sse_bool fActive;
+  sse_bool fSent;
+  sse_uint fRetries;
+  sse_double fStarted;  /** Time the request has been started */
+};
+typedef struct TFILEMultipartExchange_ TFILEMultipartExchange;
+
+/**
+ * @struct TFILEMultipartSlot_
+ * @brief A part read into memory, sent to all the destinations.
+ *
+ * A part of a regular file uploaded as it is is mapped instead, and the request body refers to the
+ * page cache without copying it.
+ */
+struct TFILEMultipartSlot_ {
+  sse_uint fPart;       /** Part number (1 origin), 0 if not a part */
+  sse_byte *fBuffer;    /** Part read into memory */
+  sse_size fCapacity;   /** Allocated size of fBuffer */
+  const sse_byte *fData; /** Request body, fBuffer or the mapped part */
+  sse_size fLength;     /** Length of fData */
+  TFILEMapWindow fWindow; /** Part mapped instead of read, see TFILESource_Map() */
+  sse_bool fPending;    /** Being read from a command or compressed, not to be sent yet */
+};
+typedef struct TFILEMultipartSlot_ TFILEMultipartSlot;
+
+/**
+ * @struct TFILEMultipartTarget_
+ * @brief A destination of the upload.
+ */
+struct TFILEMultipartTarget_ {
+  sse_char *fUrl;                          /** Upload URL */
+  sse_char *fUploadId;
+  sse_char **fETags;                       /** ETags of the parts, NULL if not uploaded yet */
+  sse_char *fETag;                         /** ETag of the object uploaded, NULL if not reported */
+  TFILEMultipartExchange fControl;         /** Initiate, complete or single PUT request */
+  sse_byte *fBody;                         /** Body of the complete request */
+  TFILEMultipartExchange *fExchanges;      /** Part requests of the slots */
+  sse_int fState;                          /** FILEMultipartState_ */
+  const sse_char *fErrCode;                /** FILE_ERROR_OK or FILE_ERROR_* when done, NULL otherwise */
+  const sse_char *fErrMsg;
+};
+typedef struct TFILEMultipartTarget_ TFILEMultipartTarget;
+
+struct FILEMultipartCheckpointJob_;
+
+/**
+ * @struct TFILEMultipartUpload_
+ * @brief Upload a file, a tar archive of a directory or a glob pattern, or the output of a command,
+ * in parts with the S3 compatible multipart upload protocol.
+ *
+ * The parts are uploaded with bounded concurrency. The upload ID and ETags of the completed parts
+ * are appended to the checkpoint file, so that the next upload of the same file to the same URL
+ * continues from the missing parts. The URL is kept without its query, which holds the signature,
+ * and the URL of the next upload is used to resume. The checkpoint is written back on a worker,
+ * the parts completed meanwhile are written back together by the next fdatasync(2).
+ *
+ * When compressed, each part is a gzip member of at least fPartSize bytes compressed from the file
+ * as it is read, so the number of the parts is known at the end of the file. Without a part size,
+ * or if the source fits in a part, the whole source is read into memory and uploaded with a
+ * single PUT.
+ *
+ * The source may be uploaded to several URLs at once. Each part is read once and sent to all the
+ * destinations, a slot is read again when the part has been sent to all of them. A destination
+ * which fails is dropped and the others continue.
+ *
+ * Compressing runs on a worker (TFILEWorkerPool) a part at a time, the part is sent when the job
+ * is done. The instance deleted while a part is being compressed is freed when the job is done.
+ * The output of a command is read as it is written: a part waits on fSourceWatcher until the
+ * command writes more, and goes on from where it has stopped.
+ *
+ * MoatHttpClient does not expose its socket, so the requests are polled. The polling runs on every
+ * iteration of the event loop (MoatIdle) only while it makes progress, otherwise it backs off on a
+ * timerfd from FILE_MULTIPART_POLL_MIN_MSEC up to FILE_MULTIPART_POLL_MAX_MSEC.
+ */
+struct TFILEMultipartUpload_ {
+  sse_char *fFilePath;                     /** Source file path */
+  sse_char *fCheckpointPath;               /** Checkpoint file path, NULL if not resumed */
+  int fCheckpointFd;                       /** Checkpoint being appended to, -1 if not open */
+  struct FILEMultipartCheckpointJob_ *fCheckpointJob; /** fdatasync(2) of the checkpoint on a worker, NULL if not running */
+  sse_bool fCheckpointDirty;               /** Appended while fCheckpointJob runs, written back when it is done */
+  TFILEMultipartTarget *fTargets;          /** Destinations */
+  sse_uint fTargetCount;
+  TFILESource fSource;                     /** Source file or archive */
+  sse_uint64 fFileSize;
+  sse_int64 fMtime;
+  sse_size fPartSize;
+  sse_uint fPartCount;                     /** Number of the parts, read so far if read sequentially */
+  sse_uint fPartCapacity;                  /** Allocated length of fETags and fEnds */
+  sse_uint64 *fEnds;                       /** File offsets next to the compressed parts */
+  sse_uint fNextPart;                      /** Index of the part to be uploaded next */
+  sse_int fCompressLevel;                  /** gzip level, FILE_COMPRESS_AUTO or FILE_COMPRESS_NONE */
+  TFILECompressTuner fTuner;               /** Level of each compressed part */
+  sse_double fCompressSeconds;             /** CPU seconds spent on the part being compressed so far */
+  sse_uint64 fReadOffset;                  /** File offset to compress the next part from */
+  sse_uint64 fRangeStart;                  /** Range of the source to upload */
+  sse_uint64 fRangeLength;
+  sse_bool fSparse;                        /** Upload the sparse image of the source, see TFILESparseImage */
+  sse_bool fFadvise;                       /** Keep the source out of the page cache, see TFILESource_SetFadvise() */
+  sse_uint fConcurrency;
+  TFILEMultipartSlot *fSlots;              /** fConcurrency parts being uploaded */
+  TFILEMultipartSlot fWhole;               /** Whole source uploaded with a single PUT */
+  TFILEWorkerPool *fWorkers;               /** Workers to compress the parts, required if compressed. Not owned. */
+  TFILEWorkerJob *fCompressJob;            /** Part being compressed, NULL if not */
+  sse_bool fDeleted;                       /** Deleted while fCompressJob is running, freed when it is done */
+  TFILEGzipMember *fMember;                /** Part compressed so far while waiting for the command, see FILECompress_GzipRange() */
+  MoatIOWatcher *fSourceWatcher;           /** Waits for the command to write more, NULL if not created */
+  MoatIdle *fIdle;                         /** Polls the requests while they proceed */
+  int fTimerFd;                            /** Polls the requests after fBackoff milliseconds otherwise, -1 if not created */
+  MoatIOWatcher *fTimer;
+  sse_uint fBackoff;                       /** Milliseconds, 0 while polling on fIdle */
+  sse_bool fProgress;                      /** Something has been sent, received or read in this round of polling */
+  sse_int fState;                          /** FILEMultipartState_ */
+  void (*fOnCompleteCallback)(struct TFILEMultipartUpload_*, const sse_char*, const sse_char*, sse_pointer); /** Callback function */
+  sse_pointer fOnCompleteCallbackUserData;
+};
+typedef struct TFILEMultipartUpload_ TFILEMultipartUpload;
+
+/**
+ * @brief Prototype of callback of multipart upload completion.
+ *
+ * @param [in] self         Instance
+ * @param [in] in_err_code  FILE_ERROR_OK or FILE_ERROR_*
+ * @param [in] in_err_msg   Error message
+ * @param [in] in_user_data User data
+ */
+typedef void (*TFILEMultipartUpload_OnCompleteCallback)(TFILEMultipartUpload *self,
+                                                        const sse_char *in_err_code,
+                                                        const sse_char *in_err_msg,
+                                                        sse_pointer in_user_data);
+
+/**
+ * @brief Constructor of TFILEMultipartUpload class
+ *
+ * @param [in] in_file_path       Source file path, directory, glob pattern or command
+ * @param [in] in_url             Upload URL
+ * @param [in] in_part_size       Size of each part except the last one, 0 to upload with a single
+ *                                request
+ * @param [in] in_concurrency     Max number of parts uploaded at once
+ * @param [in] in_checkpoint_path Checkpoint file path, NULL not to resume, e.g. a command
+ *
+ * @return Instance
+ */
+TFILEMultipartUpload*
+FILEMultipartUpload_New(const sse_char *in_file_path,
+                        const sse_char *in_url,
+                        sse_size in_part_size,
+                        sse_uint in_concurrency,
+                        const sse_char *in_checkpoint_path);
+
+void
+TFILEMultipartUpload_Delete(TFILEMultipartUpload *self);
+
+void
+TFILEMultipartUpload_SetOnCompleteCallback(TFILEMultipartUpload *self,
+                                           TFILEMultipartUpload_OnCompleteCallback in_callback,
+                                           sse_pointer in_user_data);
+
+/**
+ * @brief Compress the file with gzip while uploading. Call before TFILEMultipartUpload_Start().
+ *
+ * The uploaded object has "Content-Encoding: gzip". FILE_COMPRESS_AUTO tunes the level of each
+ * part, see TFILECompressTuner. The whole source uploaded with a single PUT is compressed at
+ * FILE_COMPRESS_GZIP_LEVEL, there is no next part to tune.
+ *
+ * @param [in] self     Instance
+ * @param [in] in_level gzip level, FILE_COMPRESS_AUTO or FILE_COMPRESS_NONE
+ */
+void
+TFILEMultipartUpload_SetCompression(TFILEMultipartUpload *self,
+                                    sse_int in_level);
+
+/**
+ * @brief Compress the parts on the worker threads. Required if compressed, call before TFILEMultipartUpload_Start().
+ *
+ * @param [in] self       Instance
+ * @param [in] in_workers Workers shared by the transfers
+ */
+void
+TFILEMultipartUpload_SetWorkerPool(TFILEMultipartUpload *self,
+                                   TFILEWorkerPool *in_workers);
+
+/**
+ * @brief Upload the source as a sparse image without the holes. Call before TFILEMultipartUpload_Start().
+ *
+ * The uploaded object is expanded with FILESparse_Expand().
+ *
+ * @param [in] self      Instance
+ * @param [in] in_sparse sse_true to upload the sparse image
+ */
+void
+TFILEMultipartUpload_SetSparse(TFILEMultipartUpload *self,
+                               sse_bool in_sparse);
+
+/**
+ * @brief Read the source sequentially and drop it from the page cache. Call before TFILEMultipartUpload_Start().
+ *
+ * @param [in] self       Instance
+ * @param [in] in_fadvise sse_true to call TFILESource_SetFadvise()
+ */
+void
+TFILEMultipartUpload_SetFadvise(TFILEMultipartUpload *self,
+                                sse_bool in_fadvise);
+
+/**
+ * @brief Upload a range of the source only. Call before TFILEMultipartUpload_Start().
+ *
+ * @param [in] self      Instance
+ * @param [in] in_start  Offset
+ * @param [in] in_length Length, FILE_SOURCE_TO_END for the rest
+ */
+void
+TFILEMultipartUpload_SetRange(TFILEMultipartUpload *self,
+                              sse_uint64 in_start,
+                              sse_uint64 in_length);
+
+/**
+ * @brief Upload the source to another URL as well. Call before TFILEMultipartUpload_Start().
+ *
+ * The source is read once for all the URLs. The upload is not resumed, the checkpoint is not used.
+ *
+ * @param [in] self   Instance
+ * @param [in] in_url Upload URL
+ */
+void
+TFILEMultipartUpload_AddUrl(TFILEMultipartUpload *self,
+                            const sse_char *in_url);
+
+/**
+ * @brief Number of the upload URLs
+ *
+ * @param [in] self Instance
+ *
+ * @return 1 + the number of the URLs added
+ */
+sse_uint
+TFILEMultipartUpload_GetUrlCount(TFILEMultipartUpload *self);
+
+/**
+ * @brief Result of the upload to a URL
+ *
+ * @param [in]  self     Instance
+ * @param [in]  in_index Index of the URL, 0 for the URL of the constructor
+ * @param [out] out_url  URL
+ *
+ * @return FILE_ERROR_OK, FILE_ERROR_*, or NULL if not completed
+ */
+const sse_char*
+TFILEMultipartUpload_GetUrlResult(TFILEMultipartUpload *self,
+                                  sse_uint in_index,
+                                  const sse_char **out_url);
+
+/**
+ * @brief Range of the source being uploaded, clamped to the size when started.
+ *
+ * @param [in]  self      Instance
+ * @param [out] out_start Offset
+ * @param [out] out_end   Offset next to the last byte
+ */
+void
+TFILEMultipartUpload_GetRange(TFILEMultipartUpload *self,
+                              sse_uint64 *out_start,
+                              sse_uint64 *out_end);
+
+/**
+ * @brief ETag of the object uploaded to the URL of the constructor
+ *
+ * @return ETag, NULL if not completed or not reported by the server
+ */
+const sse_char*
+TFILEMultipartUpload_GetETag(TFILEMultipartUpload *self);
+
+/**
+ * @brief Summary of the compression, see TFILECompressTuner_GetReport().
+ *
+ * @return String to be freed with sse_free(), NULL if not compressed
+ */
+sse_char*
+TFILEMultipartUpload_GetCompressionReport(TFILEMultipartUpload *self);
+
+/**
+ * @brief Start the upload
+ *
+ * The on-complete callback is called when the upload to all the URLs has been completed or
+ * failed. It reports a failure if the upload to any of the URLs has been failed.
+ *
+ * @retval SSE_E_OK Started
+ * @retval others   Failure, the callback will not be called.
+ */
+sse_int
+TFILEMultipartUpload_Start(TFILEMultipartUpload *self);
+
+/**
+ * @brief Stop the upload without calling the callback. The checkpoint is kept.
+ */
+void
+TFILEMultipartUpload_Cancel(TFILEMultipartUpload *self);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_MULTIPART_H__*/
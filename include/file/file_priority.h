@@ -0,0 +1,130 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+
+#ifndef __FILE_PRIORITY_H__
+#define __FILE_PRIORITY_H__
+
+SSE_BEGIN_C_DECLS
+
+#define FILE_PRIORITY_NONE          (-1000) /* Not configured, nor changed */
+#define FILE_PRIORITY_CGROUP_ROOT   "/sys/fs/cgroup"
+#define FILE_PRIORITY_IOCLASS_SHIFT (13)
+#define FILE_PRIORITY_IOCLASS_RT    (1)
+#define FILE_PRIORITY_IOCLASS_BE    (2)
+#define FILE_PRIORITY_IOCLASS_IDLE  (3)
+#define FILE_PRIORITY_IOPRIO(io_class, level) (((io_class) << FILE_PRIORITY_IOCLASS_SHIFT) | (level))
+
+/**
+ * @struct TFILEPriority_
+ * @brief CPU and I/O priority of the transfers while they are running.
+ *
+ * The application shares the process with the agent, so the event loop and the threads of the
+ * agent keep their priority and their cgroup. The first transfer lowers the nice level and the
+ * I/O priority of the worker threads of TFILEWorkerPool, where hashing, compression, commits and
+ * copies run. The children forked between FILEPriority_BeginFork() and FILEPriority_EndFork(),
+ * i.e. the pre-action and the post-action scripts and the commands uploaded, are lowered as well
+ * and moved into the cgroup configured in filesystem.conf. The cgroup is of the children only,
+ * the io controller is not available to the threads of a process. Transfers running together
+ * only lower the priority further. The priority of the workers is restored when the last
+ * transfer has finished, the children keep theirs until they exit.
+ *
+ * An unprivileged process cannot raise the nice level again, then the workers stay lowered.
+ */
+struct TFILEPriority_ {
+  sse_uint fDepth;                         /** Number of transfers running */
+  sse_int fNice;                           /** Nice level set, FILE_PRIORITY_NONE if not changed */
+  sse_int fIoPriority;                     /** I/O priority set, FILE_PRIORITY_NONE if not changed */
+  sse_char *fCgroup;                       /** cgroup of the children, NULL if none */
+  sse_int fSavedNice;                      /** Nice level of the event loop */
+  sse_int fSavedIoPriority;                /** I/O priority of the event loop */
+  TFILEWorkerPool *fWorkers;               /** Workers lowered, NULL if none. Not owned. */
+};
+typedef struct TFILEPriority_ TFILEPriority;
+
+sse_int
+TFILEPriority_Initialize(TFILEPriority *self);
+
+/**
+ * @brief Restore the priority if any transfer is still running.
+ *
+ * @param [in] self Instance
+ */
+void
+TFILEPriority_Finalize(TFILEPriority *self);
+
+/**
+ * @brief Set the worker threads to lower while transfers are running.
+ *
+ * @param [in] self       Instance
+ * @param [in] in_workers Worker pool, NULL for none. Not owned.
+ */
+void
+TFILEPriority_SetWorkerPool(TFILEPriority *self,
+                            TFILEWorkerPool *in_workers);
+
+/**
+ * @brief Lower the priority for a transfer, to the lowest one configured for the filesystems.
+ *        Call TFILEPriority_Leave() when the transfer has finished.
+ *
+ * @param [in] self     Instance
+ * @param [in] in_infos Filesystem info of the files transferred, may contain NULL
+ * @param [in] in_count Number of in_infos
+ */
+void
+TFILEPriority_Enter(TFILEPriority *self,
+                    TFILEFilesysInfo **in_infos,
+                    sse_uint in_count);
+
+/**
+ * @brief Restore the priority when no transfer is running any more.
+ *
+ * @param [in] self Instance
+ */
+void
+TFILEPriority_Leave(TFILEPriority *self);
+
+/**
+ * @brief Set the nice level and the I/O priority of the calling thread.
+ *
+ * Called by the worker threads, see TFILEWorkerPool_SetPriority().
+ *
+ * @param [in] in_nice        Nice level, FILE_PRIORITY_NONE to keep it
+ * @param [in] in_io_priority I/O priority, FILE_PRIORITY_NONE to keep it
+ */
+void
+FILEPriority_SetThread(sse_int in_nice,
+                       sse_int in_io_priority);
+
+/**
+ * @brief Apply the priority of the transfers to the children forked by the calling thread until
+ *        FILEPriority_EndFork() is called.
+ */
+void
+FILEPriority_BeginFork(void);
+
+/**
+ * @brief Stop applying the priority to the children forked by the calling thread.
+ */
+void
+FILEPriority_EndFork(void);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_PRIORITY_H__*/
@@ -0,0 +1,187 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+
+#ifndef __FILE_SENDFILE_H__
+#define __FILE_SENDFILE_H__
+
+SSE_BEGIN_C_DECLS
+
+#define FILE_SENDFILE_TIMEOUT       (60)   /* Seconds without progress before the upload fails */
+#define FILE_SENDFILE_RESPONSE_MAX  (4096) /* Bytes of the response header kept */
+
+/**
+ * @brief Path the body has been sent through
+ */
+enum FILESendfileMethod_ {
+  FILE_SENDFILE_METHOD_NONE,
+  FILE_SENDFILE_METHOD_SENDFILE,  /** sendfile(2) from the file to the socket */
+  FILE_SENDFILE_METHOD_SPLICE,    /** splice(2) from the file into a pipe, then to the socket */
+  FILE_SENDFILE_METHODs
+};
+
+/**
+ * @brief State of TFILESendfileUpload
+ */
+enum FILESendfileState_ {
+  FILE_SENDFILE_STATE_READY,
+  FILE_SENDFILE_STATE_RESOLVING,  /** Resolving the host name on a worker */
+  FILE_SENDFILE_STATE_CONNECTING,
+  FILE_SENDFILE_STATE_HEADER,     /** Sending the request header */
+  FILE_SENDFILE_STATE_BODY,       /** Sending the file */
+  FILE_SENDFILE_STATE_RESPONSE,   /** Receiving the response header */
+  FILE_SENDFILE_STATE_DONE,
+  FILE_SENDFILE_STATEs
+};
+
+/**
+ * @struct TFILESendfileUpload_
+ * @brief Upload a file with a single PUT to a plain "http://" URL without copying it through
+ * userspace.
+ *
+ * MoatHttpClient owns its socket and takes the body in memory, so the request is made on a socket
+ * of its own. The request header is sent with MSG_MORE, then the file is sent with sendfile(2), or
+ * spliced through a pipe where sendfile(2) is not supported for the file. The socket is
+ * non-blocking and watched by MoatIOWatcher, and the host name is resolved on a worker, so the event
+ * loop is never blocked. Only for endpoints without TLS, redirects and proxies, e.g. on-premises
+ * storage.
+ */
+struct TFILESendfileUpload_ {
+  sse_char *fFilePath;                     /** Source file path */
+  sse_char *fUrl;                          /** Upload URL */
+  sse_uint64 fStart;                       /** Range of the file to upload, the whole file */
+  sse_uint64 fEnd;
+  sse_uint64 fOffset;                      /** File offset sent so far */
+  int fFileFd;
+  int fSocket;
+  int fPipe[2];                            /** Pipe for splice(2), -1 until used */
+  sse_size fPiped;                         /** Bytes in the pipe */
+  sse_int fMethod;                         /** FILESendfileMethod_ */
+  sse_int fState;                          /** FILESendfileState_ */
+  sse_char *fHeader;                       /** Request header */
+  sse_size fHeaderLength;
+  sse_size fHeaderSent;
+  sse_char *fResponse;                     /** Response header received so far */
+  sse_size fResponseLength;
+  sse_int fStatus;                         /** Status code of the response, 0 until received */
+  sse_char *fETag;                         /** ETag of the response, NULL if not reported */
+  MoatIOWatcher *fWatcher;
+  MoatTimer *fTimer;
+  sse_int fTimerId;
+  sse_double fProgressed;                  /** Time the last byte has been sent or received */
+  TFILEWorkerPool *fWorkers;               /** Resolves the host name, not owned */
+  struct TFILESendfileResolve_ *fResolve;  /** Host name being resolved, NULL if not running */
+  void (*fOnCompleteCallback)(struct TFILESendfileUpload_*, const sse_char*, const sse_char*, sse_pointer); /** Callback function */
+  sse_pointer fOnCompleteCallbackUserData;
+};
+typedef struct TFILESendfileUpload_ TFILESendfileUpload;
+
+/**
+ * @brief Prototype of callback of the completion of TFILESendfileUpload.
+ *
+ * @param [in] self         Instance
+ * @param [in] in_err_code  FILE_ERROR_OK or FILE_ERROR_*
+ * @param [in] in_err_msg   Error message
+ * @param [in] in_user_data User data
+ */
+typedef void (*TFILESendfileUpload_OnCompleteCallback)(TFILESendfileUpload *self,
+                                                       const sse_char *in_err_code,
+                                                       const sse_char *in_err_msg,
+                                                       sse_pointer in_user_data);
+
+/**
+ * @brief Whether the URL can be uploaded with TFILESendfileUpload
+ *
+ * @param [in] in_url Upload URL
+ *
+ * @return sse_true if "http://"
+ */
+sse_bool
+FILESendfileUpload_IsSupportedUrl(const sse_char *in_url);
+
+/**
+ * @brief Constructor of TFILESendfileUpload class
+ *
+ * @param [in] in_file_path Source file path, a regular file
+ * @param [in] in_url       Upload URL, see FILESendfileUpload_IsSupportedUrl()
+ *
+ * @return Instance
+ */
+TFILESendfileUpload*
+FILESendfileUpload_New(const sse_char *in_file_path,
+                       const sse_char *in_url);
+
+void
+TFILESendfileUpload_Delete(TFILESendfileUpload *self);
+
+void
+TFILESendfileUpload_SetOnCompleteCallback(TFILESendfileUpload *self,
+                                          TFILESendfileUpload_OnCompleteCallback in_callback,
+                                          sse_pointer in_user_data);
+
+/**
+ * @brief Resolve the host name on the workers. Call before TFILESendfileUpload_Start().
+ *
+ * @param [in] self       Instance
+ * @param [in] in_workers Pool, NULL to resolve it synchronously. Must outlive the upload.
+ */
+void
+TFILESendfileUpload_SetWorkerPool(TFILESendfileUpload *self,
+                                  TFILEWorkerPool *in_workers);
+
+/**
+ * @brief Open the file, resolve the host name and start sending.
+ *
+ * With a worker pool, the host is connected once resolved, and failing to resolve or connect to
+ * it is reported to the callback.
+ *
+ * @param [in] self Instance
+ *
+ * @retval SSE_E_OK Started, the callback will be called
+ * @retval others   Failure before anything has been sent, the callback will not be called.
+ *                  The file may be uploaded in another way.
+ */
+sse_int
+TFILESendfileUpload_Start(TFILESendfileUpload *self);
+
+/**
+ * @brief Stop the upload without calling the callback.
+ */
+void
+TFILESendfileUpload_Cancel(TFILESendfileUpload *self);
+
+/**
+ * @brief Path the body has been sent through
+ *
+ * @return "sendfile" or "splice", NULL if nothing has been sent yet
+ */
+const sse_char*
+TFILESendfileUpload_GetMethodName(TFILESendfileUpload *self);
+
+/**
+ * @brief ETag of the object uploaded
+ *
+ * @return ETag, NULL if not completed or not reported by the server
+ */
+const sse_char*
+TFILESendfileUpload_GetETag(TFILESendfileUpload *self);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_SENDFILE_H__*/
@@ -0,0 +1,66 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#ifndef __FILE_SLICE_H__
+#define __FILE_SLICE_H__
+
+SSE_BEGIN_C_DECLS
+
+#define FILE_SLICE_TIME_NONE ((sse_int64)-1)
+#define FILE_SLICE_SCAN_MAX  (64 * 1024) /* Lines without a timestamp skipped at most per probe */
+
+/**
+ * @brief Parse a timestamp as it appears at the beginning of a log line.
+ *
+ * "YYYY-MM-DD[T ]hh:mm:ss[.fff][Z|+hh:mm]" (ISO 8601) or "Mmm dd hh:mm:ss" (syslog, this year).
+ * Leading spaces and '[' are skipped. A timestamp without a time zone is the local time.
+ *
+ * @param [in]  in_str    String
+ * @param [in]  in_len    Length of the string
+ * @param [out] out_time  Seconds since the epoch
+ *
+ * @retval SSE_E_OK    Success
+ * @retval SSE_E_INVAL No timestamp
+ */
+sse_int
+FILESlice_ParseTime(const sse_char *in_str,
+                    sse_size in_len,
+                    sse_int64 *out_time);
+
+/**
+ * @brief Find the first line stamped at or after the time in a log sorted by time.
+ *
+ * The lines are binary searched, so only a few blocks of the source are read. Lines without
+ * a timestamp, e.g. a stack trace, are regarded as a part of the preceding line.
+ *
+ * @param [in]  in_source Source opened
+ * @param [in]  in_time   Seconds since the epoch
+ * @param [out] out_offset Offset of the line, the size of the source if no line is found
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failure
+ */
+sse_int
+FILESlice_FindTime(TFILESource *in_source,
+                   sse_int64 in_time,
+                   sse_uint64 *out_offset);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_SLICE_H__*/
@@ -0,0 +1,58 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#ifndef __FILE_SNAPSHOT_H__
+#define __FILE_SNAPSHOT_H__
+
+SSE_BEGIN_C_DECLS
+
+/**
+ * @brief Take a snapshot of a file being written, to upload it without stalling the writer.
+ *
+ * The snapshot is a reflink (FICLONE) if the filesystem supports it, which shares the blocks
+ * until either is modified. Otherwise the range is copied with copy_file_range(2) to the same
+ * offsets, so that the snapshot is sparse before the range. The mtime is preserved.
+ *
+ * @param [in]  in_path  File path
+ * @param [in]  in_dir   Directory to create the snapshot in
+ * @param [in]  in_start Offset of the range to be uploaded
+ * @param [in]  in_end   Offset next to the range, FILE_SOURCE_TO_END for the whole file
+ * @param [out] out_path Snapshot path to be removed with FILESnapshot_Remove()
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failure, e.g. no space for the copy
+ */
+sse_int
+FILESnapshot_Take(const sse_char *in_path,
+                  const sse_char *in_dir,
+                  sse_uint64 in_start,
+                  sse_uint64 in_end,
+                  sse_char **out_path);
+
+/**
+ * @brief Remove the snapshot and free the path.
+ *
+ * @param [in] in_path Snapshot path
+ */
+void
+FILESnapshot_Remove(sse_char *in_path);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_SNAPSHOT_H__*/
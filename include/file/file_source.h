@@ -0,0 +1,189 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+
+#ifndef __FILE_SOURCE_H__
+#define __FILE_SOURCE_H__
+
+SSE_BEGIN_C_DECLS
+
+#define FILE_SOURCE_TO_END         ((sse_uint64)-1)
+#define FILE_SOURCE_COMMAND_SCHEME "cmd:" /* Output of a shell command, e.g. "cmd:dmesg" */
+#define FILE_SOURCE_READAHEAD_SIZE (1024 * 1024) /* Read ahead with TFILESource_SetFadvise() */
+#define FILE_SOURCE_KILL_TIMEOUT   (5) /* Seconds a command terminated is given to exit before being killed */
+
+/**
+ * @struct TFILESource_
+ * @brief Source of an upload, a regular file, a tar archive of a directory or a glob pattern,
+ *        or the output of a command. A regular file may be read as a sparse image.
+ *
+ * The output of a command is streamed, so it must be read sequentially and its size is
+ * FILE_SOURCE_TO_END until the end is read. The pipe is non-blocking, reading it returns
+ * SSE_E_AGAIN until the command writes more, see TFILESource_GetDescriptor().
+ */
+struct TFILESource_ {
+  int fFd;                     /** Regular file or the pipe from the command, -1 if archived */
+  TFILETarArchive *fArchive;   /** Archive, NULL if a regular file */
+  TFILESparseImage *fSparse;   /** Sparse image of the regular file, NULL if read as is */
+  sse_bool fStreamed;          /** sse_true if the output of a command */
+  sse_int fPid;                /** Command running, 0 if exited */
+  sse_bool fEnded;             /** The output of the command has ended, waiting for it to exit */
+  sse_uint64 fPosition;        /** Bytes read from the command */
+  sse_uint64 fStart;           /** Offset of the range to read */
+  sse_uint64 fSize;            /** Size of the range to read */
+  sse_int64 fMtime;
+  sse_bool fFadvise;           /** Read ahead and drop what has been read from the page cache */
+};
+typedef struct TFILESource_ TFILESource;
+
+/**
+ * @brief Check if the path is a command, see FILE_SOURCE_COMMAND_SCHEME.
+ *
+ * @param [in] in_path Source path
+ *
+ * @return sse_true if a command
+ */
+sse_bool
+FILESource_IsCommandPath(const sse_char *in_path);
+
+/**
+ * @brief Open the source, a command is started with /bin/sh.
+ *
+ * @param [in] self    Instance
+ * @param [in] in_path File path, directory, glob pattern or command
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failure
+ */
+sse_int
+TFILESource_Open(TFILESource *self,
+                 const sse_char *in_path);
+
+/**
+ * @brief Close the source, a command still running is terminated.
+ *
+ * The command is reaped in the background from the event loop, and killed if it has not exited
+ * in FILE_SOURCE_KILL_TIMEOUT seconds.
+ *
+ * @param [in] self Instance
+ */
+void
+TFILESource_Close(TFILESource *self);
+
+/**
+ * @brief Read a regular file as a sparse image, see TFILESparseImage. Call before TFILESource_SetRange().
+ *
+ * The size of the source becomes the size of the image. The source is read as is if it is not a
+ * regular file.
+ *
+ * @param [in] self Instance
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failure
+ */
+sse_int
+TFILESource_SetSparse(TFILESource *self);
+
+/**
+ * @brief Limit the source to a range, clamped to the size.
+ *
+ * @param [in] self      Instance
+ * @param [in] in_start  Offset
+ * @param [in] in_length Length, FILE_SOURCE_TO_END for the rest
+ */
+void
+TFILESource_SetRange(TFILESource *self,
+                     sse_uint64 in_start,
+                     sse_uint64 in_length);
+
+/**
+ * @brief Keep the source out of the page cache, see "fadvise" of filesystem.conf. Call after TFILESource_SetRange().
+ *
+ * The range is read sequentially with FILE_SOURCE_READAHEAD_SIZE bytes read ahead, and the pages
+ * are dropped once they have been read, not to push the working set of the other processes out
+ * of the page cache. Nothing is done unless the source is a regular file read as is.
+ *
+ * @param [in] self Instance
+ */
+void
+TFILESource_SetFadvise(TFILESource *self);
+
+/**
+ * @brief Drop the file from the page cache.
+ *
+ * The dirty pages are not dropped unless they are written back beforehand, which may block until
+ * the file is written to the storage. Write back on a worker only, e.g. a file just downloaded.
+ * A file just read has nothing of its own to write back.
+ *
+ * @param [in] in_path       File path
+ * @param [in] in_write_back sse_true to write back the file with fdatasync(2) beforehand
+ */
+void
+FILESource_DropCache(const sse_char *in_path,
+                     sse_bool in_write_back);
+
+/**
+ * @brief Read the source like pread(2), see TFILETarArchive_Read(). in_offset is relative to the range.
+ *
+ * A command must be read from where the last read ended, and fails at the end if it has exited
+ * with an error. SSE_E_AGAIN is returned if the command has not written more yet, or if its output
+ * has ended but it has not exited yet.
+ */
+sse_int
+TFILESource_Read(TFILESource *self,
+                 sse_byte *out_buf,
+                 sse_size in_len,
+                 sse_uint64 in_offset,
+                 sse_size *out_len);
+
+/**
+ * @brief Descriptor to watch before reading the command again after SSE_E_AGAIN.
+ *
+ * @param [in] self Instance
+ *
+ * @return Pipe from the command to watch for reading, -1 if not a command or its output has ended:
+ *         the command is exiting, read again a little later
+ */
+sse_int
+TFILESource_GetDescriptor(TFILESource *self);
+
+/**
+ * @brief Map a part of the source instead of reading it, see TFILEMapWindow_Map(). in_offset is
+ *        relative to the range and in_length is cut at its end.
+ *
+ * Only a regular file read as it is can be mapped, and not while it is kept out of the page cache.
+ *
+ * @param [in] self Source
+ * @param [in,out] io_window Window to map, the previous part is unmapped
+ * @param [in] in_offset Offset of the part
+ * @param [in] in_length Length of the part
+ *
+ * @retval SSE_E_OK Mapped
+ * @retval SSE_E_INVAL Not a regular file or out of the range, read the part instead
+ * @retval others Failed to map, read the part instead
+ */
+sse_int
+TFILESource_Map(TFILESource *self,
+                TFILEMapWindow *io_window,
+                sse_uint64 in_offset,
+                sse_size in_length);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_SOURCE_H__*/
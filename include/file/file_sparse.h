@@ -0,0 +1,110 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+
+#ifndef __FILE_SPARSE_H__
+#define __FILE_SPARSE_H__
+
+SSE_BEGIN_C_DECLS
+
+#define FILE_SPARSE_MAGIC       "MOATSPRS"
+#define FILE_SPARSE_HEADER_SIZE (24) /* Magic, apparent size and number of extents */
+#define FILE_SPARSE_EXTENT_SIZE (16) /* Offset and length of an extent */
+
+/**
+ * @struct TFILESparseExtent_
+ * @brief A range of a sparse file holding data.
+ */
+struct TFILESparseExtent_ {
+  sse_uint64 fOffset;       /** Offset in the file */
+  sse_uint64 fLength;
+  sse_uint64 fPosition;     /** Offset of the extent header in the image */
+};
+typedef struct TFILESparseExtent_ TFILESparseExtent;
+
+/**
+ * @struct TFILESparseImage_
+ * @brief A sparse file encoded as its data extents, never written to the storage.
+ *
+ * The image is the header, FILE_SPARSE_MAGIC followed by the apparent size of the file and the
+ * number of the extents, then the offset and the length of each extent followed by its data.
+ * The numbers are 64 bit big endian. The holes are not sent, and they are not written when the
+ * image is expanded, see FILESparse_Expand().
+ *
+ * The extents are found with SEEK_DATA and SEEK_HOLE when the image is created, so that any range
+ * of the image can be read at any time like TFILETarArchive. An extent shrunk since then is padded
+ * with zeros, and data written into a hole since then is not uploaded.
+ */
+struct TFILESparseImage_ {
+  TFILESparseExtent *fExtents;
+  sse_uint fCount;
+  sse_uint64 fFileSize;     /** Apparent size of the file */
+  sse_uint64 fSize;         /** Size of the image */
+  int fFd;                  /** Descriptor of the file, owned by the caller */
+};
+typedef struct TFILESparseImage_ TFILESparseImage;
+
+/**
+ * @brief Constructor of TFILESparseImage class
+ *
+ * A filesystem not supporting SEEK_DATA reports the whole file as a single extent.
+ *
+ * @param [in]  in_fd     Descriptor of the file, kept open while the image is read
+ * @param [in]  in_size   Size of the file
+ * @param [out] out_image Instance
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failure
+ */
+sse_int
+FILESparseImage_New(int in_fd,
+                    sse_uint64 in_size,
+                    TFILESparseImage **out_image);
+
+void
+TFILESparseImage_Delete(TFILESparseImage *self);
+
+/**
+ * @brief Read a range of the image, see TFILETarArchive_Read().
+ */
+sse_int
+TFILESparseImage_Read(TFILESparseImage *self,
+                      sse_byte *out_buf,
+                      sse_size in_len,
+                      sse_uint64 in_offset,
+                      sse_size *out_len);
+
+/**
+ * @brief Replace an image downloaded to the file with the sparse file it encodes.
+ *
+ * Only the extents are written to a new file, which is truncated to the apparent size so that
+ * the holes are left unallocated, then renamed to the path. The mode of the file is kept.
+ *
+ * @param [in] in_path Path of the image
+ *
+ * @retval SSE_E_OK    Success
+ * @retval SSE_E_INVAL The file is not a valid image
+ * @retval others      Failure
+ */
+sse_int
+FILESparse_Expand(const sse_char *in_path);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_SPARSE_H__*/
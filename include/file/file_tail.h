@@ -0,0 +1,90 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+#ifndef __FILE_TAIL_H__
+#define __FILE_TAIL_H__
+
+SSE_BEGIN_C_DECLS
+
+#define FILE_TAIL_BLOCK_SIZE (4096) /* Hashed block before the offset */
+
+/**
+ * @struct TFILETailState_
+ * @brief Offset of a growing file uploaded so far, for the incremental upload.
+ *
+ * The state is kept in "<dir>/<name>-<hash of the path>.tail" with the inode, the offset and the
+ * hash of the block before the offset. The next upload starts from the offset unless the file has
+ * been rotated (another inode), truncated (shorter than the offset) or rewritten (the hash differs).
+ */
+struct TFILETailState_ {
+  sse_char *fFilePath;
+  sse_char *fStatePath;
+  sse_uint64 fDev;
+  sse_uint64 fIno;
+  sse_uint64 fOffset;                      /** Offset to start the next upload from */
+  sse_char fHash[FILE_HASH_HEX_MAX + 1];   /** SHA-256 of the block before fOffset */
+};
+typedef struct TFILETailState_ TFILETailState;
+
+/**
+ * @brief Constructor of TFILETailState class, loads the state if any.
+ *
+ * @param [in] in_file_path Source file path
+ * @param [in] in_state_dir Directory to keep the state
+ *
+ * @return Instance
+ */
+TFILETailState*
+FILETailState_New(const sse_char *in_file_path,
+                  const sse_char *in_state_dir);
+
+void
+TFILETailState_Delete(TFILETailState *self);
+
+/**
+ * @brief Range to upload, from the offset uploaded so far (0 if the file has been rotated,
+ *        truncated or rewritten) to the current size.
+ *
+ * @param [in]  self      Instance
+ * @param [out] out_start Offset
+ * @param [out] out_end   Current size
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   The file cannot be read
+ */
+sse_int
+TFILETailState_GetRange(TFILETailState *self,
+                        sse_uint64 *out_start,
+                        sse_uint64 *out_end);
+
+/**
+ * @brief Save the offset uploaded up to, unless the file has been rotated while uploading.
+ *
+ * @param [in] self   Instance
+ * @param [in] in_end Offset next to the last byte uploaded
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failure
+ */
+sse_int
+TFILETailState_Commit(TFILETailState *self,
+                      sse_uint64 in_end);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_TAIL_H__*/
@@ -0,0 +1,107 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+
+#ifndef __FILE_TAR_H__
+#define __FILE_TAR_H__
+
+SSE_BEGIN_C_DECLS
+
+#define FILE_TAR_BLOCK_SIZE (512)
+
+/**
+ * @struct TFILETarEntry_
+ * @brief A member of TFILETarArchive
+ */
+struct TFILETarEntry_ {
+  sse_char *fPath;          /** Path on the filesystem */
+  sse_char *fName;          /** Name in the archive */
+  sse_char fType;           /** '0': regular file, '5': directory */
+  sse_uint fMode;
+  sse_int64 fMtime;
+  sse_uint64 fSize;         /** Size when the archive has been created */
+  sse_uint64 fOffset;       /** Offset of the header in the archive */
+  sse_uint fHeaderSize;     /** Size of the headers including the long name */
+};
+typedef struct TFILETarEntry_ TFILETarEntry;
+
+/**
+ * @struct TFILETarArchive_
+ * @brief A tar archive of a directory or the files matching a glob pattern, never written to the storage.
+ *
+ * The members and their sizes are fixed when the archive is created, so that any range of the
+ * archive can be read at any time. A member grown since then is cut at the size, a member
+ * shrunk is padded with zeros.
+ */
+struct TFILETarArchive_ {
+  TFILETarEntry *fEntries;
+  sse_uint fCount;
+  sse_uint fCapacity;
+  sse_uint64 fSize;         /** Size of the archive */
+  sse_int64 fMtime;         /** The latest mtime of the members */
+  int fFd;                  /** Descriptor of the member being read, -1 if none */
+  sse_uint fFdIndex;        /** Index of the member of fFd */
+};
+typedef struct TFILETarArchive_ TFILETarArchive;
+
+/**
+ * @brief Check if the path should be archived, a directory or a glob pattern.
+ */
+sse_bool
+FILETarArchive_IsArchivePath(const sse_char *in_path);
+
+/**
+ * @brief Constructor of TFILETarArchive class
+ *
+ * @param [in]  in_path     Directory or glob pattern
+ * @param [out] out_archive Instance
+ *
+ * @retval SSE_E_OK    Success
+ * @retval SSE_E_NOENT No file matches
+ * @retval others      Failure
+ */
+sse_int
+FILETarArchive_New(const sse_char *in_path,
+                   TFILETarArchive **out_archive);
+
+void
+TFILETarArchive_Delete(TFILETarArchive *self);
+
+/**
+ * @brief Read a range of the archive.
+ *
+ * @param [in]  self      Instance
+ * @param [out] out_buf   Buffer
+ * @param [in]  in_len    Size of out_buf
+ * @param [in]  in_offset Offset in the archive
+ * @param [out] out_len   Bytes read, 0 at the end of the archive
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failure
+ */
+sse_int
+TFILETarArchive_Read(TFILETarArchive *self,
+                     sse_byte *out_buf,
+                     sse_size in_len,
+                     sse_uint64 in_offset,
+                     sse_size *out_len);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_TAR_H__*/
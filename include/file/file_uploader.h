@@ -28,12 +28,37 @@ SSE_BEGIN_C_DECLS
 struct TFILEUploader_ {
   sse_char *fUid;                          /** uid of upload command requeet in ContentInfo model */
   sse_char *fKey;                          /** key of upload command requeet in ContentInfo model */
-  MoatValue *fUrl;                         /** Upload URL */
+  MoatValue *fUrl;                         /** Upload URL, the first one if uploaded to several */
+  MoatValue *fUrls;                        /** List of the upload URLs if uploaded to several, NULL otherwise */
   MoatValue *fFilePath;                    /** Source file path */
   MoatUploader *fUploader;                 /** MOAT Uploader instance */
+  TFILEFilesysInfo *fFilesysInfo;          /** Filesystem info of the source file, NULL if not configured */
+  TFILEMultipartUpload *fMultipart;        /** Multipart or compressed upload, NULL if uploaded with MoatUploader */
+  TFILESendfileUpload *fSendfile;          /** Upload to a "http://" URL with sendfile(2), NULL if not used */
+  MoatValue *fCompression;                 /** Compression requested with the command, NULL if not requested */
+  sse_bool fIncremental;                   /** Upload the bytes appended since the last upload only */
+  TFILETailState *fTail;                   /** Offset uploaded so far, NULL unless incremental */
+  sse_uint64 fSliceOffset;                 /** Byte range requested with the command */
+  sse_uint64 fSliceLength;
+  sse_int64 fSince;                        /** Time range requested with the command, FILE_SLICE_TIME_NONE if not requested */
+  sse_int64 fUntil;
+  sse_bool fForce;                         /** Upload even if the file has not been modified */
+  sse_bool fSparse;                        /** Upload the file as a sparse image without the holes */
+  TFILEFingerprint *fFingerprint;          /** Fingerprint of the last upload, NULL if a range or an archive */
+  sse_bool fNotModified;                   /** sse_true if skipped as not modified */
+  sse_char *fSnapshotPath;                 /** Snapshot uploaded instead of the file, NULL if not taken */
+  sse_bool fRanged;                        /** sse_true if a range of the file is uploaded */
+  sse_uint64 fRangeStart;                  /** Range of the file uploaded */
+  sse_uint64 fRangeEnd;
   void (*fOnCompleteCallback)(struct TFILEUploader_*, MoatValue*, MoatValue*, const sse_char*, const sse_char*, sse_pointer); /** Callback function */
   sse_pointer fOnCompleteCallbackUserData; /** User data passed with callback. */
   MoatObject *fResultCode;                 /** Result code and message. */
+  TFILEPriority *fPriority;                /** Priority lowered while uploading, NULL if not lowered. Not owned. */
+  sse_bool fPriorityEntered;               /** TFILEPriority_Enter() has been called */
+  TFILEWorkerPool *fWorkers;               /** Workers to hash, snapshot and compress the file, required. Not owned. */
+  TFILEWorkerJob *fPrepareJob;             /** Hashing and snapshot running on a worker, NULL if not */
+  TFILEWorkerJob *fCommitJob;              /** Fingerprint being saved on a worker, NULL if not */
+  TFILEArena fArena;                       /** uid, key and the strings built for the upload */
 };
 typedef struct TFILEUploader_ TFILEUploader;
 
@@ -117,10 +142,17 @@ TFILEUploader_RemoveOnCompleteCallback(TFILEUploader *self);
  * @brief Set a resource path
  *
  * Set a resource path, upload URL and source file path.
+ * The source file is uploaded in parts if "uploadpartsize" is configured for it.
+ * A directory or a glob pattern (e.g. "*.log" under a directory) is uploaded as a tar archive.
+ * "cmd:<command>" uploads the output of the command as it runs, configured with the "cmd:" entry
+ * of the filesystem info.
+ * If a list of URLs is given, the source is read once and uploaded to all of them at once. It is
+ * always uploaded even if not modified, and is not resumed.
  *
  * @param [in] self                Instance
  * @param [in] in_src_filepath     Source file path
- * @param [in] in_dst_url          Upload URL
+ * @param [in] in_dst_url          Upload URL or a list of upload URLs
+ * @param [in] in_filesys_info_tbl Filesystem info table
  *
  * @retval SSE_E_OK Success
  * @retval others   Failure
@@ -128,7 +160,163 @@ TFILEUploader_RemoveOnCompleteCallback(TFILEUploader *self);
 sse_int
 TFILEUploader_SetResourcePath(TFILEUploader *self,
                               MoatValue *in_src_filepath,
-                              MoatValue *in_dst_url);
+                              MoatValue *in_dst_url,
+                              TFILEFilesysInfoTbl *in_filesys_info_tbl);
+
+/**
+ * @brief Set the compression requested with the command
+ *
+ * "none", "gzip" or "gzip:<level>". It overrides "uploadcompression" of the filesystem info.
+ *
+ * @param [in] self           Instance
+ * @param [in] in_compression Compression setting
+ *
+ * @return none
+ */
+void
+TFILEUploader_SetCompression(TFILEUploader *self,
+                             MoatValue *in_compression);
+
+/**
+ * @brief Summary of the compression of the upload
+ *
+ * @param [in] self Instance
+ *
+ * @return String to be freed with sse_free(), NULL if not compressed
+ */
+sse_char*
+TFILEUploader_GetCompressionReport(TFILEUploader *self);
+
+/**
+ * @brief Upload the bytes appended since the last successful upload only
+ *
+ * The whole file is uploaded again if it has been rotated, truncated or rewritten.
+ * A directory or a glob pattern is always uploaded as a whole.
+ *
+ * @param [in] self           Instance
+ * @param [in] in_incremental sse_true to upload incrementally
+ *
+ * @return none
+ */
+void
+TFILEUploader_SetIncremental(TFILEUploader *self,
+                             sse_bool in_incremental);
+
+/**
+ * @brief Upload a byte range of the file only
+ *
+ * @param [in] self      Instance
+ * @param [in] in_offset Offset
+ * @param [in] in_length Length, FILE_SOURCE_TO_END for the rest
+ *
+ * @return none
+ */
+void
+TFILEUploader_SetRange(TFILEUploader *self,
+                       sse_uint64 in_offset,
+                       sse_uint64 in_length);
+
+/**
+ * @brief Upload the lines logged in a time range only
+ *
+ * The log lines must begin with timestamps in order, see FILESlice_ParseTime().
+ * It is applied within the byte range if both are set, and takes precedence over
+ * the incremental upload.
+ *
+ * @param [in] self     Instance
+ * @param [in] in_since Seconds since the epoch, FILE_SLICE_TIME_NONE from the beginning
+ * @param [in] in_until Seconds since the epoch inclusive, FILE_SLICE_TIME_NONE up to the end
+ *
+ * @return none
+ */
+void
+TFILEUploader_SetTimeRange(TFILEUploader *self,
+                           sse_int64 in_since,
+                           sse_int64 in_until);
+
+/**
+ * @brief Range of the file uploaded incrementally or selected by the byte or time range
+ *
+ * @param [in] self Instance
+ *
+ * @return "<start>-<end>" (end exclusive) to be freed with sse_free(), NULL if the whole file
+ */
+sse_char*
+TFILEUploader_GetRangeReport(TFILEUploader *self);
+
+/**
+ * @brief Upload the file even if it has not been modified since the last upload
+ *
+ * A regular file is not uploaded again to the same destination by default if its inode,
+ * size and mtime, or its content, are the same as uploaded last time.
+ *
+ * @param [in] self     Instance
+ * @param [in] in_force sse_true to upload anyway
+ *
+ * @return none
+ */
+void
+TFILEUploader_SetForce(TFILEUploader *self,
+                       sse_bool in_force);
+
+/**
+ * @brief Upload the file as a sparse image, see TFILESparseImage
+ *
+ * Only the data extents of a disk image are sent, the holes are not. The downloader expands the
+ * image with FILESparse_Expand(). A directory, a command or a range of the file is uploaded as is.
+ *
+ * @param [in] self      Instance
+ * @param [in] in_sparse sse_true to upload the sparse image
+ *
+ * @return none
+ */
+void
+TFILEUploader_SetSparse(TFILEUploader *self,
+                        sse_bool in_sparse);
+
+/**
+ * @brief Lower the priority of the process while uploading, see TFILEPriority
+ *
+ * The priority is entered with the filesystem info of the source file when the upload is started,
+ * and left when the uploader is deleted.
+ *
+ * @param [in] self        Instance
+ * @param [in] in_priority Priority shared by the transfers
+ *
+ * @return none
+ */
+void
+TFILEUploader_SetPriority(TFILEUploader *self,
+                          TFILEPriority *in_priority);
+
+/**
+ * @brief Hash the file, take its snapshot and compress it on the worker threads, see TFILEWorkerPool
+ *
+ * Required, call before uploading.
+ *
+ * @param [in] self       Instance
+ * @param [in] in_workers Workers shared by the transfers
+ *
+ * @return none
+ */
+void
+TFILEUploader_SetWorkerPool(TFILEUploader *self,
+                            TFILEWorkerPool *in_workers);
+
+/**
+ * @brief Attributes of FileResult reporting the upload
+ *
+ * "compression", "range", "hash" (SHA-256 of the file if known), "notModified", "destinations"
+ * if uploaded to several URLs, e.g. [{"url":"https://a.example.com/x","success":true},...] as JSON
+ * string without the queries of the URLs, and "transfer", how the file has been sent: "sendfile"
+ * or "splice" without copying it through userspace, or "copy".
+ *
+ * @param [in] self Instance
+ *
+ * @return Object to be freed with moat_object_free()
+ */
+MoatObject*
+TFILEUploader_GetResultDetails(TFILEUploader *self);
 
 /**
  * @brief Upload the file
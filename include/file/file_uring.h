@@ -0,0 +1,114 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+
+#ifndef __FILE_URING_H__
+#define __FILE_URING_H__
+
+SSE_BEGIN_C_DECLS
+
+/**
+ * @struct TFILEUring_
+ * @brief Minimal io_uring to write registered buffers without blocking the event loop.
+ *
+ * Only IORING_OP_WRITE_FIXED is issued. The completions are signaled through an eventfd
+ * registered with the ring and watched by MoatIOWatcher, then the callback is called on the event
+ * loop for each of them. The ring may be deleted in the callback. It waits for the writes in
+ * flight when it is deleted, in the callback as well, so the registered buffers may be freed
+ * once TFILEUring_Delete() returns.
+ *
+ * liburing is not required, the ring is set up with the system calls.
+ */
+typedef struct TFILEUring_ TFILEUring;
+
+/**
+ * @brief Prototype of callback of a completed write.
+ *
+ * @param [in] self         Instance
+ * @param [in] in_tag       Tag given to TFILEUring_WriteFixed()
+ * @param [in] in_result    Bytes written, or -errno
+ * @param [in] in_user_data User data
+ */
+typedef void (*TFILEUring_OnCompleteCallback)(TFILEUring *self,
+                                              sse_uint64 in_tag,
+                                              sse_int in_result,
+                                              sse_pointer in_user_data);
+
+/**
+ * @brief Constructor of TFILEUring class
+ *
+ * @param [in] in_entries Max number of writes in flight
+ *
+ * @return Instance, NULL if io_uring is not available (e.g. kernels older than 5.1, or disabled)
+ */
+TFILEUring*
+FILEUring_New(sse_uint in_entries);
+
+void
+TFILEUring_Delete(TFILEUring *self);
+
+/**
+ * @brief Register the buffers to be written, so that they are not mapped for each write.
+ *
+ * @param [in] self       Instance
+ * @param [in] in_buffers Buffers
+ * @param [in] in_size    Size of each buffer
+ * @param [in] in_count   Number of in_buffers
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failure, e.g. RLIMIT_MEMLOCK
+ */
+sse_int
+TFILEUring_RegisterBuffers(TFILEUring *self,
+                           sse_byte **in_buffers,
+                           sse_size in_size,
+                           sse_uint in_count);
+
+void
+TFILEUring_SetOnCompleteCallback(TFILEUring *self,
+                                 TFILEUring_OnCompleteCallback in_callback,
+                                 sse_pointer in_user_data);
+
+/**
+ * @brief Submit a write of a registered buffer.
+ *
+ * @param [in] self      Instance
+ * @param [in] in_fd     File descriptor
+ * @param [in] in_index  Index of the buffer registered
+ * @param [in] in_data   Data in the buffer
+ * @param [in] in_length Bytes to write
+ * @param [in] in_offset Offset in the file
+ * @param [in] in_tag    Passed to the callback
+ *
+ * @retval SSE_E_OK    Submitted
+ * @retval SSE_E_AGAIN Too many writes in flight
+ * @retval others      Failure
+ */
+sse_int
+TFILEUring_WriteFixed(TFILEUring *self,
+                      sse_int in_fd,
+                      sse_uint in_index,
+                      const sse_byte *in_data,
+                      sse_size in_length,
+                      sse_uint64 in_offset,
+                      sse_uint64 in_tag);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_URING_H__*/
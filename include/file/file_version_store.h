@@ -0,0 +1,175 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#ifndef __FILE_VERSION_STORE_H__
+#define __FILE_VERSION_STORE_H__
+
+SSE_BEGIN_C_DECLS
+
+/**
+ * @struct TFILEVersionStore_
+ * @brief Staged directory published by swapping a symbolic link.
+ *
+ * Files under the link path (e.g. "/opt/app/current") are written into a new version directory
+ * under the versions directory (e.g. "/opt/app/versions/0000000002"), which is populated with
+ * reflinks, or hard links where not supported, of the current version beforehand. Then the link is
+ * replaced with rename(2), so that all files of the set are activated at once.
+ * fKeepVersions older versions are kept besides the active one for TFILEVersionStore_Rollback().
+ * A version rolled back from is marked with "<version>.rolledback" in the versions directory, so
+ * that it is neither rolled back to nor kept in place of the others.
+ * Files in a version directory must not be modified in place since they may be hard links shared
+ * among versions.
+ */
+struct TFILEVersionStore_ {
+  sse_char *fLinkPath;
+  sse_char *fVersionsDir;
+  sse_char *fCurrent;  /* Version directory which the link pointed before the commit */
+  sse_char *fStaged;   /* Version directory being staged */
+  sse_bool fActivated;
+  sse_uint fKeepVersions;
+  sse_bool fNoClone;   /* FICLONE is not supported by the filesystem */
+};
+typedef struct TFILEVersionStore_ TFILEVersionStore;
+
+/**
+ * @brief Create the version store
+ *
+ * @param [in] in_link_path     Path of the symbolic link to be swapped
+ * @param [in] in_versions_dir  Directory to store the versions, "versions" next to the link if NULL.
+ * @param [in] in_keep_versions Number of the older versions to be kept besides the active one
+ *
+ * @return Instance, NULL if the arguments are invalid.
+ */
+TFILEVersionStore*
+FILEVersionStore_New(MoatValue *in_link_path,
+                     MoatValue *in_versions_dir,
+                     sse_uint in_keep_versions);
+
+void
+TFILEVersionStore_Delete(TFILEVersionStore *self);
+
+/**
+ * @brief Get the path relative to the link
+ *
+ * @param [in]  self          Instance
+ * @param [in]  in_path       Destination file path
+ * @param [out] out_rel_path  Pointer to the relative part in in_path
+ *
+ * @retval sse_true  The path is under the link.
+ * @retval sse_false Otherwise
+ */
+sse_bool
+TFILEVersionStore_GetRelativePath(TFILEVersionStore *self,
+                                  const sse_char *in_path,
+                                  const sse_char **out_rel_path);
+
+/**
+ * @brief Create a new version directory which has the same files as the current version
+ *
+ * It does nothing if the version has been staged already.
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failure
+ */
+sse_int
+TFILEVersionStore_Stage(TFILEVersionStore *self);
+
+/**
+ * @brief Move the file into the staged version directory
+ *
+ * The file is discarded if it is the same as the one in the current version, so that they keep
+ * sharing the data. Plain C, it may be called on a worker thread.
+ *
+ * @param [in] self        Instance
+ * @param [in] in_rel_path Path relative to the link
+ * @param [in] in_src_path File to be moved
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failure
+ */
+sse_int
+TFILEVersionStore_Put(TFILEVersionStore *self,
+                      const sse_char *in_rel_path,
+                      const sse_char *in_src_path);
+
+/**
+ * @brief Write back the staged version and its entry in the versions directory
+ *
+ * It may block until the files are written to the storage. Plain C, call it on a worker thread
+ * before TFILEVersionStore_Activate().
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failure
+ */
+sse_int
+TFILEVersionStore_Flush(TFILEVersionStore *self);
+
+/**
+ * @brief Write back the directory of the link, so that the link swapped survives a power loss
+ *
+ * Plain C, call it on a worker thread after TFILEVersionStore_Activate() or
+ * TFILEVersionStore_Rollback().
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failure
+ */
+sse_int
+TFILEVersionStore_FlushLink(TFILEVersionStore *self);
+
+/**
+ * @brief Activate the staged version by swapping the link atomically
+ *
+ * The staged version must have been written back with TFILEVersionStore_Flush().
+ *
+ * @retval SSE_E_OK Success
+ * @retval others   Failure
+ */
+sse_int
+TFILEVersionStore_Activate(TFILEVersionStore *self);
+
+/**
+ * @brief Discard the staged version, and restore the link if it has been swapped
+ */
+void
+TFILEVersionStore_Revert(TFILEVersionStore *self);
+
+/**
+ * @brief Finish the activation, and remove the old versions exceeding fKeepVersions
+ *
+ * The active version and the one to roll back to are always kept. The versions rolled back from
+ * are removed before the others, and then the oldest ones.
+ */
+void
+TFILEVersionStore_Commit(TFILEVersionStore *self);
+
+/**
+ * @brief Swap the link back to the newest version older than the active one
+ *
+ * The versions rolled back from are skipped, and the active one is marked as rolled back from.
+ *
+ * @retval SSE_E_OK    Success
+ * @retval SSE_E_NOENT No version to roll back to
+ * @retval others      Failure
+ */
+sse_int
+TFILEVersionStore_Rollback(TFILEVersionStore *self);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_VERSION_STORE_H__*/
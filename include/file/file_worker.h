@@ -0,0 +1,147 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+
+#ifndef __FILE_WORKER_H__
+#define __FILE_WORKER_H__
+
+SSE_BEGIN_C_DECLS
+
+#define FILE_WORKER_THREADS_AUTO (-1) /* Online CPUs but one, up to FILE_WORKER_THREADS_MAX */
+#define FILE_WORKER_THREADS_MAX  (4)
+#define FILE_WORKER_LOG_SIZE     (256) /* Messages longer than this are formatted on the heap */
+
+/*
+ * MOAT SDK is bound to the event loop, its logger included. The log messages of the files
+ * including this header go through FILEWorker_LogPrint(): on the event loop they are printed as
+ * usual, on a worker thread they are kept in the job running and printed from the event loop
+ * just before its done procedure is called back.
+ */
+#define ssep_app_log_print FILEWorker_LogPrint
+
+/**
+ * @struct TFILEWorkerPool_
+ * @brief Threads which run the CPU- and disk-heavy stages of the transfers off the event loop.
+ *
+ * A job is a pair of procedures. The work procedure runs on a worker thread and must only touch
+ * the data of the job, in plain C: no MoatValue, SSEString, MOAT objects or SseUtil* calls,
+ * only POSIX I/O, hashing and the LOG_* macros which are deferred, see FILEWorker_LogPrint(). The done procedure is called
+ * back on the event loop: the workers push the finished jobs onto a lock-free list and wake the
+ * loop through an eventfd watched by MoatIOWatcher.
+ *
+ * With no threads (e.g. single core devices), the work procedure runs in
+ * TFILEWorkerPool_Submit(), and the done procedure is still called back from the event loop.
+ * The done procedure is never called back before TFILEWorkerPool_Submit() returns, so the
+ * caller may keep the job and touch its own data after submitting it.
+ */
+typedef struct TFILEWorkerPool_ TFILEWorkerPool;
+typedef struct TFILEWorkerJob_ TFILEWorkerJob;
+
+typedef void (*TFILEWorkerPool_WorkProc)(sse_pointer in_user_data);
+typedef void (*TFILEWorkerPool_DoneProc)(sse_pointer in_user_data, sse_bool in_canceled);
+
+/**
+ * @brief Constructor of TFILEWorkerPool class
+ *
+ * @param [in] in_threads Number of worker threads, 0 or FILE_WORKER_THREADS_AUTO
+ *
+ * @return Instance, NULL if the eventfd could not be watched
+ */
+TFILEWorkerPool*
+FILEWorkerPool_New(sse_int in_threads);
+
+/**
+ * @brief Destructor of TFILEWorkerPool class
+ *
+ * Wait for the jobs running, then call back the done procedures of the rest as canceled.
+ *
+ * @param [in] self Instance
+ */
+void
+TFILEWorkerPool_Delete(TFILEWorkerPool *self);
+
+/**
+ * @brief Number of the worker threads
+ *
+ * @param [in] self Instance
+ *
+ * @return Number of threads, 0 if the jobs run on the event loop
+ */
+sse_uint
+TFILEWorkerPool_GetThreadCount(TFILEWorkerPool *self);
+
+/**
+ * @brief Set the priority of the worker threads, applied by each of them before its next job
+ *
+ * Nothing is applied with no threads, the jobs run on the event loop then.
+ *
+ * @param [in] self           Instance
+ * @param [in] in_nice        Nice level, FILE_PRIORITY_NONE to keep it
+ * @param [in] in_io_priority I/O priority, FILE_PRIORITY_NONE to keep it
+ */
+void
+TFILEWorkerPool_SetPriority(TFILEWorkerPool *self,
+                            sse_int in_nice,
+                            sse_int in_io_priority);
+
+/**
+ * @brief Run the job on a worker thread
+ *
+ * @param [in] self         Instance
+ * @param [in] in_work      Procedure to run on a worker thread
+ * @param [in] in_done      Procedure to be called back on the event loop
+ * @param [in] in_user_data Data of the job passed to both of them
+ *
+ * @return Job to cancel, valid until in_done has been called
+ */
+TFILEWorkerJob*
+TFILEWorkerPool_Submit(TFILEWorkerPool *self,
+                       TFILEWorkerPool_WorkProc in_work,
+                       TFILEWorkerPool_DoneProc in_done,
+                       sse_pointer in_user_data);
+
+/**
+ * @brief Cancel the job
+ *
+ * The work procedure is skipped if it has not been started. The done procedure is called back
+ * with in_canceled sse_true anyway, to free the data of the job.
+ *
+ * @param [in] self   Instance
+ * @param [in] in_job Job returned by TFILEWorkerPool_Submit()
+ */
+void
+TFILEWorkerPool_Cancel(TFILEWorkerPool *self,
+                       TFILEWorkerJob *in_job);
+
+/**
+ * @brief Print the log message, or keep it in the job if called on a worker thread
+ *
+ * @param [in] in_level  Log level
+ * @param [in] in_format Format of the message
+ *
+ * @return none
+ */
+void
+FILEWorker_LogPrint(sse_int in_level,
+                    const sse_char *in_format,
+                    ...);
+
+SSE_END_C_DECLS
+
+#endif /*__FILE_WORKER_H__*/
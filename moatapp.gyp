@@ -14,18 +14,43 @@
       'sources': [
         '<@(sseutils_src)',
         'src/file/file_uploader.c',
+        'src/file/file_multipart.c',
+        'src/file/file_sendfile.c',
+        'src/file/file_compress.c',
+        'src/file/file_tar.c',
+        'src/file/file_sparse.c',
+        'src/file/file_source.c',
+        'src/file/file_mmap.c',
+        'src/file/file_tail.c',
+        'src/file/file_slice.c',
+        'src/file/file_fingerprint.c',
+        'src/file/file_snapshot.c',
         'src/file/file_downloader.c',
+        'src/file/file_blockdev.c',
+        'src/file/file_copy.c',
+        'src/file/file_hash.c',
+        'src/file/file_version_store.c',
         'src/file/file_filesys_info.c',
+        'src/file/file_priority.c',
+        'src/file/file_worker.c',
+        'src/file/file_uring.c',
+        'src/file/file_arena.c',
         'src/file/file_content_info.c',
         'src/<(package_name).c',
        ],
       'product_prefix': '',
       'type': 'shared_library',
       'cflags': [ '-fPIC' ],
+      'defines': [
+        # 64-bit off_t on i386 as well, images and logs may be larger than 2 GB
+        '_FILE_OFFSET_BITS=64',
+      ],
       'include_dirs' : [
         '<(sseutils_include)',
       ],
       'libraries': [
+        '-lz',
+        '-lpthread',
       ],
       'dependencies': [
       ],
@@ -0,0 +1,161 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+#define FILE_ARENA_ALIGN (sizeof(sse_uint64) > sizeof(sse_pointer) ? sizeof(sse_uint64) : sizeof(sse_pointer))
+#define FILE_ARENA_ROUND(size) (((size) + FILE_ARENA_ALIGN - 1) & ~(FILE_ARENA_ALIGN - 1))
+#define FILE_ARENA_HEADER_SIZE FILE_ARENA_ROUND(sizeof(TFILEArenaChunk))
+
+/* Chunks of all the arenas, the jobs are created and deleted on the event loop. */
+static sse_uint gFILEArenaLiveChunks = 0;
+
+static TFILEArenaChunk*
+TFILEArena_AddChunk(TFILEArena *self,
+                    sse_size in_size)
+{
+  TFILEArenaChunk *chunk;
+
+  chunk = sse_malloc(FILE_ARENA_HEADER_SIZE + in_size);
+  ASSERT(chunk);
+  chunk->fSize = in_size;
+  chunk->fUsed = 0;
+  if (self->fChunks && in_size > self->fChunkSize) {
+    /* Keep the current chunk in front, its rest is still available. */
+    chunk->fNext = self->fChunks->fNext;
+    self->fChunks->fNext = chunk;
+  } else {
+    chunk->fNext = self->fChunks;
+    self->fChunks = chunk;
+  }
+  self->fChunkCount++;
+  gFILEArenaLiveChunks++;
+  return chunk;
+}
+
+void
+TFILEArena_Initialize(TFILEArena *self,
+                      sse_size in_chunk_size)
+{
+  ASSERT(self);
+  self->fChunks = NULL;
+  self->fChunkSize = FILE_ARENA_ROUND((in_chunk_size > 0) ? in_chunk_size : FILE_ARENA_CHUNK_SIZE);
+  self->fChunkCount = 0;
+  self->fAllocCount = 0;
+  self->fAllocBytes = 0;
+}
+
+void
+TFILEArena_Finalize(TFILEArena *self)
+{
+  TFILEArenaChunk *chunk;
+
+  ASSERT(self);
+  while (self->fChunks) {
+    chunk = self->fChunks;
+    self->fChunks = chunk->fNext;
+    sse_free(chunk);
+    gFILEArenaLiveChunks--;
+  }
+}
+
+sse_pointer
+TFILEArena_Alloc(TFILEArena *self,
+                 sse_size in_size)
+{
+  TFILEArenaChunk *chunk = self->fChunks;
+  sse_byte *p;
+
+  ASSERT(self);
+  in_size = FILE_ARENA_ROUND((in_size > 0) ? in_size : 1);
+  if (chunk == NULL || chunk->fSize - chunk->fUsed < in_size) {
+    chunk = TFILEArena_AddChunk(self, (in_size > self->fChunkSize) ? in_size : self->fChunkSize);
+  }
+  p = (sse_byte *)chunk + FILE_ARENA_HEADER_SIZE + chunk->fUsed;
+  chunk->fUsed += in_size;
+  self->fAllocCount++;
+  self->fAllocBytes += in_size;
+  sse_memset(p, 0, in_size);
+  return p;
+}
+
+sse_char*
+TFILEArena_StrNDup(TFILEArena *self,
+                   const sse_char *in_str,
+                   sse_size in_len)
+{
+  sse_char *str;
+
+  ASSERT(in_str);
+  str = TFILEArena_Alloc(self, in_len + 1);
+  sse_memcpy(str, in_str, in_len);
+  return str;
+}
+
+sse_char*
+TFILEArena_StrDup(TFILEArena *self,
+                  const sse_char *in_str)
+{
+  ASSERT(in_str);
+  return TFILEArena_StrNDup(self, in_str, sse_strlen(in_str));
+}
+
+sse_char*
+TFILEArena_Printf(TFILEArena *self,
+                  sse_size *out_len,
+                  const sse_char *in_format,
+                  ...)
+{
+  va_list ap;
+  sse_char *str;
+  int len;
+
+  va_start(ap, in_format);
+  len = vsnprintf(NULL, 0, in_format, ap);
+  va_end(ap);
+  ASSERT(len >= 0);
+  str = TFILEArena_Alloc(self, len + 1);
+  va_start(ap, in_format);
+  vsnprintf(str, len + 1, in_format, ap);
+  va_end(ap);
+  if (out_len) {
+    *out_len = len;
+  }
+  return str;
+}
+
+sse_uint
+FILEArena_GetLiveChunks(void)
+{
+  return gFILEArenaLiveChunks;
+}
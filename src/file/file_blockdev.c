@@ -0,0 +1,1172 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <linux/fs.h>
+#include <mtd/mtd-user.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+#define FILE_BLOCKDEV_DIRECT_ALIGN (4096) /* Alignment of the buffer and the writes with O_DIRECT */
+#define FILE_BLOCKDEV_RANGE_SIZE   (64)
+
+/* A buffer written asynchronously. A slot on a worker outlives the writer, it is freed when done. */
+struct TFILEBlockDevSlot_ {
+  TFILEBlockDevWriter *fWriter;            /** NULL once the writer has been deleted */
+  sse_uint fIndex;                         /** Index of the buffer registered with io_uring */
+  sse_byte *fBuffer;                       /** Aligned buffer of fWriteSize bytes */
+  sse_size fLength;                        /** Bytes of the image */
+  sse_size fPadded;                        /** Bytes written, fLength padded to the write unit of MTD */
+  sse_size fErase;                         /** Bytes erased before writing, 0 but for MTD */
+  sse_bool fEraseFailed;
+  sse_uint64 fOffset;
+  sse_bool fBusy;
+  int fFd;                                 /** dup() of the device while on a worker, -1 otherwise */
+  sse_int fResult;                         /** Bytes written, or -errno */
+  TFILEWorkerJob *fJob;
+};
+typedef struct TFILEBlockDevSlot_ TFILEBlockDevSlot;
+
+/* Flush of the image written, on a worker. It outlives the writer as well, it is freed when done. */
+struct TFILEBlockDevSync_ {
+  TFILEBlockDevWriter *fWriter;            /** NULL once the writer has been deleted */
+  int fFd;                                 /** dup() of the device */
+  sse_int64 fLength;                       /** Size to truncate the file to, -1 not to truncate */
+  sse_bool fDataSync;                      /** fdatasync(2), sse_false for MTD */
+  sse_bool fDropCache;                     /** Drop the image from the page cache after the flush */
+  int fTruncateErrno;                      /** errno of ftruncate(2), 0 if succeeded */
+  int fSyncErrno;                          /** errno of fdatasync(2), 0 if succeeded */
+  TFILEWorkerJob *fJob;
+};
+typedef struct TFILEBlockDevSync_ TFILEBlockDevSync;
+
+static void FILEBlockDevWriter_OnUringCompleteCallback(TFILEUring *in_uring, sse_uint64 in_tag, sse_int in_result, sse_pointer in_user_data);
+static void FILEBlockDevWriter_OnWriteDone(sse_pointer in_user_data, sse_bool in_canceled);
+static void FILEBlockDevWriter_OnIdle(MoatIdle *in_idle, sse_pointer in_user_data);
+static void FILEBlockDevWriter_OnTimer(MoatIOWatcher *in_watcher, sse_pointer in_user_data, sse_int in_desc, sse_int in_event_flags);
+
+static sse_size
+FILEBlockDev_RoundUp(sse_size in_value,
+                     sse_size in_unit)
+{
+  return (in_value + in_unit - 1) / in_unit * in_unit;
+}
+
+/*
+ * Device
+ */
+
+/* Find the size, the erase block and the write unit of the device. */
+static sse_int
+TFILEBlockDevWriter_Probe(TFILEBlockDevWriter *self,
+                          sse_size in_block_size)
+{
+  struct stat st;
+  struct mtd_info_user mtd;
+  unsigned long long size;
+
+  if (fstat(self->fFd, &st) != 0) {
+    LOG_ERROR("fstat(%s) has been failed with [%s].", self->fDevicePath, strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  self->fPageSize = 1;
+  if (S_ISCHR(st.st_mode) && ioctl(self->fFd, MEMGETINFO, &mtd) == 0) {
+    if (in_block_size != 0 && in_block_size != mtd.erasesize) {
+      LOG_WARN("The erase block of [%s] is %u bytes, not %zu.", self->fDevicePath, mtd.erasesize, in_block_size);
+    }
+    self->fMtd = sse_true;
+    self->fCapacity = mtd.size;
+    self->fBlockSize = mtd.erasesize;
+    self->fPageSize = (mtd.writesize > 0) ? mtd.writesize : 1;
+    if (self->fDirect) {
+      LOG_DEBUG("O_DIRECT is not used for MTD.");
+      self->fDirect = sse_false;
+    }
+  } else if (S_ISBLK(st.st_mode) && ioctl(self->fFd, BLKGETSIZE64, &size) == 0) {
+    self->fCapacity = size;
+    self->fBlockSize = (in_block_size > 0) ? in_block_size : FILE_BLOCKDEV_ERASE_BLOCK_DEFAULT;
+  } else if (S_ISREG(st.st_mode)) {
+    /* A disk image, e.g. on a loop device */
+    self->fCapacity = FILE_SOURCE_TO_END;
+    self->fBlockSize = (in_block_size > 0) ? in_block_size : FILE_BLOCKDEV_ERASE_BLOCK_DEFAULT;
+  } else {
+    LOG_ERROR("[%s] is not a block device nor an MTD partition.", self->fDevicePath);
+    return SSE_E_INVAL;
+  }
+  if (self->fDirect) {
+    self->fBlockSize = FILEBlockDev_RoundUp(self->fBlockSize, FILE_BLOCKDEV_DIRECT_ALIGN);
+  }
+  self->fChunkSize = FILEBlockDev_RoundUp(FILE_BLOCKDEV_CHUNK_SIZE, self->fBlockSize);
+  if (self->fWriteSize > 0) {
+    self->fWriteSize = FILEBlockDev_RoundUp(self->fWriteSize, self->fBlockSize);
+    self->fChunkSize = FILEBlockDev_RoundUp(self->fChunkSize, self->fWriteSize);
+  } else {
+    self->fWriteSize = self->fChunkSize;
+  }
+  LOG_INFO("[%s] is written in buffers of %zu bytes, chunk=[%zu], erase block=[%zu], capacity=[%llu]%s.",
+           self->fDevicePath, self->fWriteSize, self->fChunkSize, self->fBlockSize, (unsigned long long)self->fCapacity,
+           (self->fMtd) ? ", MTD" : (self->fDirect) ? ", O_DIRECT" : "");
+  return SSE_E_OK;
+}
+
+static sse_int
+TFILEBlockDevWriter_Erase(TFILEBlockDevWriter *self,
+                          sse_uint64 in_offset,
+                          sse_size in_length)
+{
+  struct erase_info_user erase;
+
+  erase.start = in_offset;
+  erase.length = FILEBlockDev_RoundUp(in_length, self->fBlockSize);
+  if (erase.start + erase.length > self->fCapacity) {
+    erase.length = self->fCapacity - erase.start;
+  }
+  if (ioctl(self->fFd, MEMERASE, &erase) != 0) {
+    LOG_ERROR("Erasing [%s] at %llu has been failed with [%s].", self->fDevicePath, (unsigned long long)in_offset, strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  return SSE_E_OK;
+}
+
+/* Start writing back the buffer just written, and drop the ones before it, whose write back has been started already. */
+static void
+TFILEBlockDevWriter_DropCache(TFILEBlockDevWriter *self,
+                              sse_uint64 in_offset,
+                              sse_size in_length)
+{
+  sync_file_range(self->fFd, in_offset, in_length, SYNC_FILE_RANGE_WRITE);
+  if (in_offset > self->fDropped) {
+    sync_file_range(self->fFd, self->fDropped, in_offset - self->fDropped,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(self->fFd, self->fDropped, in_offset - self->fDropped, POSIX_FADV_DONTNEED);
+    self->fDropped = in_offset;
+  }
+}
+
+/* Write a chunk at an aligned offset, the tail of the image is padded to the write unit of MTD. */
+static sse_int
+TFILEBlockDevWriter_WriteChunk(TFILEBlockDevWriter *self,
+                               const sse_byte *in_data,
+                               sse_size in_length)
+{
+  sse_size length = in_length;
+  sse_size done = 0;
+  ssize_t n;
+  int flags;
+
+  if (self->fMtd) {
+    if (TFILEBlockDevWriter_Erase(self, self->fOffset, in_length) != SSE_E_OK) {
+      return SSE_E_GENERIC;
+    }
+    length = FILEBlockDev_RoundUp(in_length, self->fPageSize);
+    /* 0xFF is the erased state. */
+    sse_memset(self->fBuffer + in_length, 0xFF, length - in_length);
+  } else if (self->fDirect && (in_length % FILE_BLOCKDEV_DIRECT_ALIGN) != 0) {
+    /* The tail is not aligned, write it through the page cache. */
+    flags = fcntl(self->fFd, F_GETFL);
+    if (flags < 0 || fcntl(self->fFd, F_SETFL, flags & ~O_DIRECT) != 0) {
+      LOG_ERROR("fcntl(%s) has been failed with [%s].", self->fDevicePath, strerror(errno));
+      return SSE_E_GENERIC;
+    }
+    self->fDirect = sse_false;
+  }
+  if (in_data != self->fBuffer) {
+    sse_memcpy(self->fBuffer, in_data, in_length);
+  }
+  while (done < length) {
+    n = pwrite(self->fFd, self->fBuffer + done, length - done, self->fOffset + done);
+    self->fWriteCount++;
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      LOG_ERROR("Writing [%s] at %llu has been failed with [%s].", self->fDevicePath,
+                (unsigned long long)(self->fOffset + done), (n < 0) ? strerror(errno) : "no space");
+      return SSE_E_GENERIC;
+    }
+    done += n;
+  }
+  if (self->fDropCache && !self->fMtd && !self->fDirect) {
+    TFILEBlockDevWriter_DropCache(self, self->fOffset, length);
+  }
+  TFILEHash_Update(&self->fHash, self->fBuffer, in_length);
+  self->fOffset += in_length;
+  return SSE_E_OK;
+}
+
+/*
+ * Slots
+ */
+
+static void
+FILEBlockDevSlot_Free(TFILEBlockDevSlot *self)
+{
+  if (self->fFd >= 0) {
+    close(self->fFd);
+  }
+  free(self->fBuffer);
+  sse_free(self);
+}
+
+/* Runs on a worker thread. */
+static void
+FILEBlockDevWriter_WriteWork(sse_pointer in_user_data)
+{
+  TFILEBlockDevSlot *slot = (TFILEBlockDevSlot *)in_user_data;
+  struct erase_info_user erase;
+  sse_size done = 0;
+  ssize_t n;
+
+  slot->fEraseFailed = sse_false;
+  if (slot->fErase > 0) {
+    erase.start = slot->fOffset;
+    erase.length = slot->fErase;
+    if (ioctl(slot->fFd, MEMERASE, &erase) != 0) {
+      slot->fResult = -errno;
+      slot->fEraseFailed = sse_true;
+      return;
+    }
+  }
+  while (done < slot->fPadded) {
+    n = pwrite(slot->fFd, slot->fBuffer + done, slot->fPadded - done, slot->fOffset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      slot->fResult = -errno;
+      return;
+    }
+    if (n == 0) {
+      break;
+    }
+    done += n;
+  }
+  slot->fResult = done;
+}
+
+/* Make the slots and the backend to write them, fDepth is left 0 if written synchronously. */
+static void
+TFILEBlockDevWriter_SetupSlots(TFILEBlockDevWriter *self)
+{
+  TFILEBlockDevSlot *slot;
+  sse_byte *buffers[FILE_BLOCKDEV_WRITE_DEPTH];
+  sse_uint depth;
+  sse_uint i;
+
+  depth = FILE_BLOCKDEV_ASYNC_MEMORY / self->fWriteSize;
+  depth = (depth < 2) ? 2 : (depth > FILE_BLOCKDEV_WRITE_DEPTH) ? FILE_BLOCKDEV_WRITE_DEPTH : depth;
+  for (i = 0; i < depth; i++) {
+    slot = sse_zeroalloc(sizeof(TFILEBlockDevSlot));
+    ASSERT(slot);
+    slot->fWriter = self;
+    slot->fIndex = i;
+    slot->fFd = -1;
+    if (posix_memalign((void **)&slot->fBuffer, FILE_BLOCKDEV_DIRECT_ALIGN, self->fWriteSize) != 0) {
+      LOG_WARN("posix_memalign() has been failed, write synchronously.");
+      sse_free(slot);
+      break;
+    }
+    self->fSlots[i] = slot;
+    buffers[i] = slot->fBuffer;
+  }
+  if (i == depth && !self->fMtd) {
+    /* MTD is erased with ioctl(2), on the workers. */
+    self->fUring = FILEUring_New(depth);
+  }
+  if (self->fUring && TFILEUring_RegisterBuffers(self->fUring, buffers, self->fWriteSize, depth) != SSE_E_OK) {
+    TFILEUring_Delete(self->fUring);
+    self->fUring = NULL;
+  }
+  if (self->fUring) {
+    TFILEUring_SetOnCompleteCallback(self->fUring, FILEBlockDevWriter_OnUringCompleteCallback, self);
+    LOG_DEBUG("[%s] is written through io_uring, %u buffers in flight.", self->fDevicePath, depth);
+  } else if (i == depth && self->fWorkers && TFILEWorkerPool_GetThreadCount(self->fWorkers) > 0) {
+    LOG_DEBUG("[%s] is written on the workers, %u buffers in flight.", self->fDevicePath, depth);
+  } else {
+    while (i > 0) {
+      i--;
+      FILEBlockDevSlot_Free(self->fSlots[i]);
+      self->fSlots[i] = NULL;
+    }
+    return;
+  }
+  self->fDepth = depth;
+}
+
+static TFILEBlockDevSlot*
+TFILEBlockDevWriter_GetFreeSlot(TFILEBlockDevWriter *self)
+{
+  sse_uint i;
+
+  for (i = 0; i < self->fDepth; i++) {
+    if (!self->fSlots[i]->fBusy) {
+      return self->fSlots[i];
+    }
+  }
+  return NULL;
+}
+
+static sse_int
+TFILEBlockDevWriter_SubmitSlot(TFILEBlockDevWriter *self,
+                               TFILEBlockDevSlot *in_slot)
+{
+  sse_int err;
+
+  if (self->fUring) {
+    err = TFILEUring_WriteFixed(self->fUring, self->fFd, in_slot->fIndex, in_slot->fBuffer,
+                                in_slot->fPadded, in_slot->fOffset, in_slot->fIndex);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+  } else {
+    /* The worker has its own descriptor, the writer may be closed or deleted while it writes. */
+    in_slot->fFd = dup(self->fFd);
+    if (in_slot->fFd < 0) {
+      LOG_ERROR("dup(%s) has been failed with [%s].", self->fDevicePath, strerror(errno));
+      return SSE_E_GENERIC;
+    }
+    in_slot->fJob = TFILEWorkerPool_Submit(self->fWorkers, FILEBlockDevWriter_WriteWork,
+                                           FILEBlockDevWriter_OnWriteDone, in_slot);
+  }
+  in_slot->fBusy = sse_true;
+  self->fInFlight++;
+  return SSE_E_OK;
+}
+
+/*
+ * Stream
+ */
+
+/* Stop polling the request. */
+static void
+TFILEBlockDevWriter_StopPolling(TFILEBlockDevWriter *self)
+{
+  struct itimerspec its;
+
+  if (self->fIdle) {
+    moat_idle_stop(self->fIdle);
+  }
+  if (self->fTimer) {
+    sse_memset(&its, 0, sizeof(its));
+    timerfd_settime(self->fTimerFd, 0, &its, NULL);
+    moat_io_watcher_stop(self->fTimer);
+  }
+  self->fBackoff = 0;
+}
+
+/*
+ * Poll the request on the next iteration of the event loop if it has made progress, otherwise back
+ * off not to spin while waiting for the network.
+ */
+static sse_int
+TFILEBlockDevWriter_SchedulePolling(TFILEBlockDevWriter *self,
+                                    sse_bool in_progress)
+{
+  struct itimerspec its;
+
+  if (in_progress || self->fTimer == NULL) {
+    self->fBackoff = 0;
+    if (!moat_idle_is_active(self->fIdle)) {
+      return moat_idle_start(self->fIdle);
+    }
+    return SSE_E_OK;
+  }
+  moat_idle_stop(self->fIdle);
+  if (self->fBackoff == 0) {
+    self->fBackoff = FILE_BLOCKDEV_POLL_MIN_MSEC;
+  } else if (self->fBackoff * 2 <= FILE_BLOCKDEV_POLL_MAX_MSEC) {
+    self->fBackoff *= 2;
+  } else {
+    self->fBackoff = FILE_BLOCKDEV_POLL_MAX_MSEC;
+  }
+  sse_memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = self->fBackoff / 1000;
+  its.it_value.tv_nsec = (long)(self->fBackoff % 1000) * 1000000L;
+  if (timerfd_settime(self->fTimerFd, 0, &its, NULL) != 0) {
+    LOG_WARN("timerfd_settime() has been failed with [%s].", strerror(errno));
+    return moat_idle_start(self->fIdle);
+  }
+  return moat_io_watcher_start(self->fTimer);
+}
+
+static void
+TFILEBlockDevWriter_Finish(TFILEBlockDevWriter *self,
+                           const sse_char *in_err_code,
+                           const sse_char *in_err_msg)
+{
+  self->fActive = sse_false;
+  self->fBody = NULL;
+  TFILEBlockDevWriter_StopPolling(self);
+  moat_httpc_reset(self->fHttp);
+  if (self->fFd >= 0) {
+    close(self->fFd);
+    self->fFd = -1;
+  }
+  if (self->fOnCompleteCallback) {
+    self->fOnCompleteCallback(self, in_err_code, in_err_msg, self->fOnCompleteCallbackUserData);
+  }
+}
+
+static sse_int
+TFILEBlockDevWriter_Request(TFILEBlockDevWriter *self)
+{
+  MoatHttpRequest *req;
+  sse_char range[FILE_BLOCKDEV_RANGE_SIZE];
+  sse_int err;
+
+  moat_httpc_reset(self->fHttp);
+  req = moat_httpc_create_request(self->fHttp, MOAT_HTTP_METHOD_GET, self->fUrl, sse_strlen(self->fUrl));
+  if (req == NULL) {
+    LOG_ERROR("moat_httpc_create_request() has been failed.");
+    return SSE_E_GENERIC;
+  }
+  snprintf(range, sizeof(range), "bytes=%llu-%llu",
+           (unsigned long long)self->fOffset, (unsigned long long)(self->fOffset + self->fChunkSize - 1));
+  err = moat_httpreq_add_header(req, "Range", 5, range, sse_strlen(range));
+  if (err != SSE_E_OK) {
+    LOG_ERROR("moat_httpreq_add_header() has been failed with [%s].", sse_get_error_string(err));
+    moat_httpreq_free(req);
+    return err;
+  }
+  err = moat_httpc_send_request(self->fHttp, req);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("moat_httpc_send_request() has been failed with [%s].", sse_get_error_string(err));
+    return err;
+  }
+  self->fSent = sse_false;
+  self->fProgressed = FILECompress_Now();
+  TFILEBlockDevWriter_StopPolling(self);
+  return TFILEBlockDevWriter_SchedulePolling(self, sse_true);
+}
+
+/* Request the chunk again, sse_false if retried too many times. */
+static sse_bool
+TFILEBlockDevWriter_Retry(TFILEBlockDevWriter *self)
+{
+  if (self->fRetries >= FILE_BLOCKDEV_RETRIES) {
+    return sse_false;
+  }
+  self->fRetries++;
+  LOG_WARN("Request the chunk at %llu again (%u/%u).", (unsigned long long)self->fOffset, self->fRetries, FILE_BLOCKDEV_RETRIES);
+  return TFILEBlockDevWriter_Request(self) == SSE_E_OK;
+}
+
+/* Verify the image flushed to the device, then finish. */
+static void
+TFILEBlockDevWriter_Verify(TFILEBlockDevWriter *self,
+                           int in_truncate_errno,
+                           int in_sync_errno)
+{
+  sse_char actual[FILE_HASH_HEX_MAX + 1];
+  sse_char *expected;
+  sse_uint expected_len;
+  sse_int algo;
+
+  if (in_truncate_errno != 0) {
+    LOG_WARN("ftruncate(%s) has been failed with [%s].", self->fDevicePath, strerror(in_truncate_errno));
+  }
+  if (in_sync_errno != 0) {
+    LOG_ERROR("fdatasync(%s) has been failed with [%s].", self->fDevicePath, strerror(in_sync_errno));
+    TFILEBlockDevWriter_Finish(self, FILE_ERROR_DOWNLOAD, "Writing the image to the device has been failed.");
+    return;
+  }
+  TFILEHash_Finalize(&self->fHash, actual);
+  if (self->fExpectedSize >= 0 && (sse_uint64)self->fExpectedSize != self->fOffset) {
+    LOG_ERROR("Size mismatch, device=[%s], expected=[%lld], actual=[%llu].", self->fDevicePath,
+              self->fExpectedSize, (unsigned long long)self->fOffset);
+    TFILEBlockDevWriter_Finish(self, FILE_ERROR_VERIFY, "File size mismatch.");
+    return;
+  }
+  if (self->fExpectedHash) {
+    FILEHash_ParseHash(self->fExpectedHash, &algo, &expected, &expected_len);
+    if (sse_strlen(actual) != expected_len || sse_strncasecmp(actual, expected, expected_len) != 0) {
+      LOG_ERROR("Hash mismatch, device=[%s], expected=[%.*s], actual=[%s].", self->fDevicePath, expected_len, expected, actual);
+      TFILEBlockDevWriter_Finish(self, FILE_ERROR_VERIFY, "File hash mismatch.");
+      return;
+    }
+  }
+  LOG_INFO("%llu bytes have been written to [%s] and verified.", (unsigned long long)self->fOffset, self->fDevicePath);
+  TFILEBlockDevWriter_Finish(self, FILE_ERROR_OK, NULL);
+}
+
+/* Runs on a worker thread. */
+static void
+FILEBlockDevWriter_SyncWork(sse_pointer in_user_data)
+{
+  TFILEBlockDevSync *sync = (TFILEBlockDevSync *)in_user_data;
+
+  if (sync->fLength >= 0 && ftruncate(sync->fFd, sync->fLength) != 0) {
+    sync->fTruncateErrno = errno;
+  }
+  if (sync->fDataSync && fdatasync(sync->fFd) != 0) {
+    sync->fSyncErrno = errno;
+    return;
+  }
+  if (sync->fDropCache) {
+    posix_fadvise(sync->fFd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+}
+
+static void
+FILEBlockDevWriter_OnSyncDone(sse_pointer in_user_data,
+                              sse_bool in_canceled)
+{
+  TFILEBlockDevSync *sync = (TFILEBlockDevSync *)in_user_data;
+  TFILEBlockDevWriter *writer = sync->fWriter;
+  int truncate_errno = sync->fTruncateErrno;
+  int sync_errno = (in_canceled) ? ECANCELED : sync->fSyncErrno;
+
+  close(sync->fFd);
+  sse_free(sync);
+  if (writer == NULL) {
+    /* The writer has been deleted. */
+    return;
+  }
+  writer->fSync = NULL;
+  if (!writer->fActive) {
+    return;
+  }
+  TFILEBlockDevWriter_Verify(writer, truncate_errno, sync_errno);
+}
+
+/* Flush the image written on a worker, and verify it when done. */
+static void
+TFILEBlockDevWriter_Sync(TFILEBlockDevWriter *self)
+{
+  TFILEBlockDevSync *sync;
+
+  if (self->fSync) {
+    return;
+  }
+  sync = sse_zeroalloc(sizeof(TFILEBlockDevSync));
+  ASSERT(sync);
+  sync->fWriter = self;
+  sync->fLength = (self->fCapacity == FILE_SOURCE_TO_END) ? (sse_int64)self->fOffset : -1;
+  sync->fDataSync = !self->fMtd;
+  sync->fDropCache = self->fDropCache && !self->fMtd;
+  /* The worker has its own descriptor, the writer may be closed or deleted while it flushes. */
+  sync->fFd = dup(self->fFd);
+  if (sync->fFd < 0) {
+    LOG_ERROR("dup(%s) has been failed with [%s].", self->fDevicePath, strerror(errno));
+    sse_free(sync);
+    TFILEBlockDevWriter_Finish(self, FILE_ERROR_DOWNLOAD, "Writing the image to the device has been failed.");
+    return;
+  }
+  if (self->fWorkers == NULL) {
+    FILEBlockDevWriter_SyncWork(sync);
+    self->fSync = sync;
+    FILEBlockDevWriter_OnSyncDone(sync, sse_false);
+    return;
+  }
+  self->fSync = sync;
+  sync->fJob = TFILEWorkerPool_Submit(self->fWorkers, FILEBlockDevWriter_SyncWork,
+                                      FILEBlockDevWriter_OnSyncDone, sync);
+}
+
+/* Take the size of the image from "Content-Range: bytes <first>-<last>/<total>". */
+static sse_int
+TFILEBlockDevWriter_ParseRange(TFILEBlockDevWriter *self,
+                               MoatHttpResponse *in_res)
+{
+  sse_char *value;
+  sse_size len;
+  sse_char *str;
+  unsigned long long first;
+  unsigned long long last;
+  unsigned long long total;
+  int n;
+
+  if (moat_httpres_get_header_value(in_res, "Content-Range", 13, &value, &len) != SSE_E_OK || value == NULL) {
+    LOG_ERROR("No Content-Range in the partial response.");
+    return SSE_E_INVAL;
+  }
+  str = sse_strndup(value, len);
+  ASSERT(str);
+  n = sscanf(str, "bytes %llu-%llu/%llu", &first, &last, &total);
+  sse_free(str);
+  if (n < 2 || first != self->fOffset) {
+    LOG_ERROR("Unexpected Content-Range at %llu.", (unsigned long long)self->fOffset);
+    return SSE_E_INVAL;
+  }
+  if (n == 3 && self->fTotal == FILE_SOURCE_TO_END) {
+    self->fTotal = total;
+  }
+  return SSE_E_OK;
+}
+
+/* Copy the body into the free slots and write them, then request the next chunk once all are queued. */
+static void
+TFILEBlockDevWriter_QueueWrites(TFILEBlockDevWriter *self)
+{
+  TFILEBlockDevSlot *slot;
+  sse_size chunk;
+
+  if (!self->fActive) {
+    return;
+  }
+  while (self->fBody && self->fBodyDone < self->fBodyLength) {
+    chunk = self->fBodyLength - self->fBodyDone;
+    chunk = (chunk > self->fWriteSize) ? self->fWriteSize : chunk;
+    if (self->fDirect && (chunk % FILE_BLOCKDEV_DIRECT_ALIGN) != 0) {
+      /* The unaligned tail is written through the page cache after the others. */
+      if (self->fInFlight > 0) {
+        return;
+      }
+      if (TFILEBlockDevWriter_WriteChunk(self, self->fBody + self->fBodyDone, chunk) != SSE_E_OK) {
+        TFILEBlockDevWriter_Finish(self, FILE_ERROR_DOWNLOAD, "Writing the image to the device has been failed.");
+        return;
+      }
+      self->fBodyDone += chunk;
+      continue;
+    }
+    slot = TFILEBlockDevWriter_GetFreeSlot(self);
+    if (slot == NULL) {
+      return;
+    }
+    sse_memcpy(slot->fBuffer, self->fBody + self->fBodyDone, chunk);
+    slot->fOffset = self->fOffset;
+    slot->fLength = chunk;
+    slot->fPadded = chunk;
+    slot->fErase = 0;
+    if (self->fMtd) {
+      slot->fErase = FILEBlockDev_RoundUp(chunk, self->fBlockSize);
+      if (slot->fOffset + slot->fErase > self->fCapacity) {
+        slot->fErase = self->fCapacity - slot->fOffset;
+      }
+      /* 0xFF is the erased state. */
+      slot->fPadded = FILEBlockDev_RoundUp(chunk, self->fPageSize);
+      sse_memset(slot->fBuffer + chunk, 0xFF, slot->fPadded - chunk);
+    }
+    if (TFILEBlockDevWriter_SubmitSlot(self, slot) != SSE_E_OK) {
+      TFILEBlockDevWriter_Finish(self, FILE_ERROR_DOWNLOAD, "Writing the image to the device has been failed.");
+      return;
+    }
+    TFILEHash_Update(&self->fHash, slot->fBuffer, chunk);
+    self->fOffset += chunk;
+    self->fBodyDone += chunk;
+  }
+  if (self->fBody) {
+    /* The body is not referred any more, receive the next chunk while the slots are written. */
+    self->fBody = NULL;
+    self->fRetries = 0;
+    if (self->fOffset < self->fTotal) {
+      if (TFILEBlockDevWriter_Request(self) != SSE_E_OK) {
+        TFILEBlockDevWriter_Finish(self, FILE_ERROR_DOWNLOAD, "File download failure.");
+      }
+      return;
+    }
+  }
+  if (self->fOffset >= self->fTotal && self->fInFlight == 0) {
+    TFILEBlockDevWriter_Sync(self);
+  }
+}
+
+static void
+TFILEBlockDevWriter_OnWritten(TFILEBlockDevWriter *self,
+                              TFILEBlockDevSlot *in_slot,
+                              sse_int in_result)
+{
+  in_slot->fBusy = sse_false;
+  self->fInFlight--;
+  self->fWriteCount++;
+  if (!self->fActive) {
+    return;
+  }
+  if (in_result < 0 || (sse_size)in_result != in_slot->fPadded) {
+    LOG_ERROR("%s [%s] at %llu has been failed with [%s].", (in_slot->fEraseFailed) ? "Erasing" : "Writing", self->fDevicePath,
+              (unsigned long long)in_slot->fOffset, (in_result < 0) ? strerror(-in_result) : "no space");
+    TFILEBlockDevWriter_Finish(self, FILE_ERROR_DOWNLOAD, "Writing the image to the device has been failed.");
+    return;
+  }
+  if (self->fDropCache && !self->fDirect && !self->fMtd) {
+    TFILEBlockDevWriter_DropCache(self, in_slot->fOffset, in_slot->fLength);
+  }
+  TFILEBlockDevWriter_QueueWrites(self);
+}
+
+static void
+FILEBlockDevWriter_OnUringCompleteCallback(TFILEUring *in_uring,
+                                           sse_uint64 in_tag,
+                                           sse_int in_result,
+                                           sse_pointer in_user_data)
+{
+  TFILEBlockDevWriter *self = (TFILEBlockDevWriter *)in_user_data;
+
+  ASSERT(self);
+  ASSERT(in_tag < self->fDepth);
+  TFILEBlockDevWriter_OnWritten(self, self->fSlots[in_tag], in_result);
+}
+
+static void
+FILEBlockDevWriter_OnWriteDone(sse_pointer in_user_data,
+                               sse_bool in_canceled)
+{
+  TFILEBlockDevSlot *slot = (TFILEBlockDevSlot *)in_user_data;
+
+  ASSERT(slot);
+  slot->fJob = NULL;
+  close(slot->fFd);
+  slot->fFd = -1;
+  if (slot->fWriter == NULL) {
+    /* The writer has been deleted. */
+    FILEBlockDevSlot_Free(slot);
+    return;
+  }
+  TFILEBlockDevWriter_OnWritten(slot->fWriter, slot, (in_canceled) ? -ECANCELED : slot->fResult);
+}
+
+static void
+TFILEBlockDevWriter_OnResponse(TFILEBlockDevWriter *self)
+{
+  MoatHttpResponse *res;
+  sse_int status = 0;
+  sse_byte *body = NULL;
+  sse_size len = 0;
+  sse_size chunk;
+  sse_size done;
+  sse_char *url;
+  sse_size url_len;
+
+  res = moat_httpc_get_response(self->fHttp);
+  if (res) {
+    moat_httpres_get_status_code(res, &status);
+  }
+  if (res && moat_httpres_need_redirect(res) &&
+      moat_httpres_get_redirect_to(res, &url, &url_len) == SSE_E_OK && url && url_len > 0) {
+    sse_free(self->fUrl);
+    self->fUrl = sse_strndup(url, url_len);
+    ASSERT(self->fUrl);
+    if (!TFILEBlockDevWriter_Retry(self)) {
+      TFILEBlockDevWriter_Finish(self, FILE_ERROR_DOWNLOAD, "File download failure.");
+    }
+    return;
+  }
+  if (status == 416 && self->fTotal == FILE_SOURCE_TO_END) {
+    /* The image has ended at the chunk, or it is empty. */
+    self->fTotal = self->fOffset;
+    if (self->fInFlight == 0) {
+      TFILEBlockDevWriter_Sync(self);
+    }
+    return;
+  }
+  if ((status != 206 && !(status == 200 && self->fOffset == 0)) ||
+      (status == 206 && TFILEBlockDevWriter_ParseRange(self, res) != SSE_E_OK)) {
+    LOG_ERROR("Downloading the chunk at %llu has been failed with status=[%d].", (unsigned long long)self->fOffset, status);
+    if (!TFILEBlockDevWriter_Retry(self)) {
+      TFILEBlockDevWriter_Finish(self, FILE_ERROR_DOWNLOAD, "File download failure.");
+    }
+    return;
+  }
+  moat_httpres_peek_body(res, &body, &len);
+  if (status == 200) {
+    /* The server has ignored "Range", the whole image has been received. */
+    self->fTotal = len;
+  } else if (self->fTotal == FILE_SOURCE_TO_END && len < self->fChunkSize) {
+    self->fTotal = self->fOffset + len;
+  }
+  if (self->fTotal != FILE_SOURCE_TO_END && self->fTotal > self->fCapacity) {
+    LOG_ERROR("The image of %llu bytes is larger than [%s].", (unsigned long long)self->fTotal, self->fDevicePath);
+    TFILEBlockDevWriter_Finish(self, FILE_ERROR_DOWNLOAD, "Image is larger than the device.");
+    return;
+  }
+  if (self->fTotal != FILE_SOURCE_TO_END && self->fExpectedSize >= 0 && self->fTotal != (sse_uint64)self->fExpectedSize) {
+    /* No need to overwrite the slot with an image which would never pass the verification. */
+    LOG_ERROR("Size mismatch, device=[%s], expected=[%lld], actual=[%llu].", self->fDevicePath,
+              (long long)self->fExpectedSize, (unsigned long long)self->fTotal);
+    TFILEBlockDevWriter_Finish(self, FILE_ERROR_VERIFY, "File size mismatch.");
+    return;
+  }
+  if (len == 0 || (status == 206 && len != self->fChunkSize && self->fOffset + len != self->fTotal)) {
+    LOG_ERROR("Unexpected length of the chunk at %llu, %zu bytes.", (unsigned long long)self->fOffset, len);
+    if (!TFILEBlockDevWriter_Retry(self)) {
+      TFILEBlockDevWriter_Finish(self, FILE_ERROR_DOWNLOAD, "File download failure.");
+    }
+    return;
+  }
+  if (self->fDepth > 0) {
+    self->fBody = body;
+    self->fBodyLength = len;
+    self->fBodyDone = 0;
+    TFILEBlockDevWriter_QueueWrites(self);
+    return;
+  }
+  for (done = 0; done < len; done += chunk) {
+    chunk = (len - done > self->fWriteSize) ? self->fWriteSize : len - done;
+    if (TFILEBlockDevWriter_WriteChunk(self, body + done, chunk) != SSE_E_OK) {
+      TFILEBlockDevWriter_Finish(self, FILE_ERROR_DOWNLOAD, "Writing the image to the device has been failed.");
+      return;
+    }
+  }
+  self->fRetries = 0;
+  if (self->fOffset >= self->fTotal) {
+    TFILEBlockDevWriter_Sync(self);
+  } else if (TFILEBlockDevWriter_Request(self) != SSE_E_OK) {
+    TFILEBlockDevWriter_Finish(self, FILE_ERROR_DOWNLOAD, "File download failure.");
+  }
+}
+
+/* Proceed the request a step. */
+static void
+TFILEBlockDevWriter_Poll(TFILEBlockDevWriter *self)
+{
+  sse_bool complete = sse_false;
+  sse_bool progress = sse_false;
+  sse_int err;
+
+  if (!self->fActive) {
+    TFILEBlockDevWriter_StopPolling(self);
+    return;
+  }
+  if (!self->fSent) {
+    err = moat_httpc_do_send(self->fHttp, &complete);
+    if (err == SSE_E_OK || complete) {
+      progress = sse_true;
+    }
+    if (err == SSE_E_OK && complete) {
+      err = moat_httpc_recv_response(self->fHttp);
+      self->fSent = (err == SSE_E_OK);
+      complete = sse_false;
+    }
+  } else {
+    err = moat_httpc_do_recv(self->fHttp, &complete);
+    if (err == SSE_E_OK || complete) {
+      progress = sse_true;
+    }
+  }
+  if (err != SSE_E_OK && err != SSE_E_AGAIN && err != SSE_E_INPROGRESS) {
+    LOG_ERROR("Receiving the chunk at %llu has been failed with [%s].", (unsigned long long)self->fOffset, sse_get_error_string(err));
+    if (!TFILEBlockDevWriter_Retry(self)) {
+      TFILEBlockDevWriter_Finish(self, FILE_ERROR_DOWNLOAD, "File download failure.");
+    }
+    return;
+  }
+  if (complete) {
+    /* Started again by the next request, the response may be kept while its body is queued. */
+    TFILEBlockDevWriter_StopPolling(self);
+    TFILEBlockDevWriter_OnResponse(self);
+    return;
+  }
+  if (progress) {
+    self->fProgressed = FILECompress_Now();
+  } else if (FILECompress_Now() - self->fProgressed >= FILE_BLOCKDEV_TIMEOUT) {
+    LOG_ERROR("Receiving the chunk at %llu has timed out.", (unsigned long long)self->fOffset);
+    if (!TFILEBlockDevWriter_Retry(self)) {
+      TFILEBlockDevWriter_Finish(self, FILE_ERROR_DOWNLOAD, "File download failure.");
+    }
+    return;
+  }
+  if (TFILEBlockDevWriter_SchedulePolling(self, progress) != SSE_E_OK) {
+    LOG_ERROR("Polling the request has been failed.");
+    TFILEBlockDevWriter_Finish(self, FILE_ERROR_DOWNLOAD, "File download failure.");
+  }
+}
+
+static void
+FILEBlockDevWriter_OnIdle(MoatIdle *in_idle,
+                          sse_pointer in_user_data)
+{
+  TFILEBlockDevWriter *self = (TFILEBlockDevWriter *)in_user_data;
+
+  ASSERT(self);
+  TFILEBlockDevWriter_Poll(self);
+}
+
+static void
+FILEBlockDevWriter_OnTimer(MoatIOWatcher *in_watcher,
+                           sse_pointer in_user_data,
+                           sse_int in_desc,
+                           sse_int in_event_flags)
+{
+  TFILEBlockDevWriter *self = (TFILEBlockDevWriter *)in_user_data;
+  sse_uint64 expirations;
+
+  ASSERT(self);
+  if (read(self->fTimerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+    LOG_WARN("read(timerfd) has been failed with [%s].", strerror(errno));
+  }
+  moat_io_watcher_stop(in_watcher);
+  TFILEBlockDevWriter_Poll(self);
+}
+
+/*
+ * Constructor / Destructor
+ */
+
+TFILEBlockDevWriter*
+FILEBlockDevWriter_New(const sse_char *in_url,
+                       const sse_char *in_device_path,
+                       sse_size in_block_size,
+                       sse_bool in_direct)
+{
+  TFILEBlockDevWriter *self;
+
+  ASSERT(in_url);
+  ASSERT(in_device_path);
+
+  self = sse_zeroalloc(sizeof(TFILEBlockDevWriter));
+  ASSERT(self);
+  self->fUrl = sse_strdup(in_url);
+  ASSERT(self->fUrl);
+  self->fDevicePath = sse_strdup(in_device_path);
+  ASSERT(self->fDevicePath);
+  self->fFd = -1;
+  self->fMtd = sse_false;
+  self->fDirect = in_direct;
+  self->fBlockSize = in_block_size;
+  self->fOffset = 0;
+  self->fTotal = FILE_SOURCE_TO_END;
+  self->fWriteSize = 0;
+  self->fWriteCount = 0;
+  self->fDropCache = sse_false;
+  self->fDropped = 0;
+  self->fBuffer = NULL;
+  self->fUring = NULL;
+  self->fWorkers = NULL;
+  self->fDepth = 0;
+  self->fInFlight = 0;
+  self->fSync = NULL;
+  self->fBody = NULL;
+  self->fBodyLength = 0;
+  self->fBodyDone = 0;
+  self->fExpectedSize = -1;
+  self->fExpectedHash = NULL;
+  TFILEHash_Initialize(&self->fHash, FILE_HASH_ALGORITHM_SHA256);
+  self->fHttp = moat_httpc_new();
+  ASSERT(self->fHttp);
+  self->fSent = sse_false;
+  self->fRetries = 0;
+  self->fIdle = NULL;
+  self->fTimerFd = -1;
+  self->fTimer = NULL;
+  self->fBackoff = 0;
+  self->fProgressed = 0;
+  self->fActive = sse_false;
+  self->fOnCompleteCallback = NULL;
+  self->fOnCompleteCallbackUserData = NULL;
+  return self;
+}
+
+void
+TFILEBlockDevWriter_Delete(TFILEBlockDevWriter *self)
+{
+  sse_uint i;
+
+  ASSERT(self);
+  /*
+   * Deleting the ring waits for the writes through io_uring even in its callback, so the buffers
+   * registered with it are freed after the ring has drained. The writes on the workers are left
+   * to free their slots.
+   */
+  if (self->fUring) TFILEUring_Delete(self->fUring);
+  for (i = 0; i < self->fDepth; i++) {
+    if (self->fSlots[i]->fJob) {
+      self->fSlots[i]->fWriter = NULL;
+      TFILEWorkerPool_Cancel(self->fWorkers, self->fSlots[i]->fJob);
+    } else {
+      FILEBlockDevSlot_Free(self->fSlots[i]);
+    }
+  }
+  if (self->fSync) {
+    self->fSync->fWriter = NULL;
+    TFILEWorkerPool_Cancel(self->fWorkers, self->fSync->fJob);
+  }
+  TFILEBlockDevWriter_StopPolling(self);
+  if (self->fIdle)         moat_idle_free(self->fIdle);
+  if (self->fTimer)        moat_io_watcher_free(self->fTimer);
+  if (self->fTimerFd >= 0) close(self->fTimerFd);
+  if (self->fHttp)         moat_httpc_free(self->fHttp);
+  if (self->fFd >= 0)      close(self->fFd);
+  if (self->fBuffer)       free(self->fBuffer);
+  if (self->fExpectedHash) moat_value_free(self->fExpectedHash);
+  sse_free(self->fDevicePath);
+  sse_free(self->fUrl);
+  sse_free(self);
+}
+
+sse_int
+TFILEBlockDevWriter_SetExpected(TFILEBlockDevWriter *self,
+                                sse_int64 in_size,
+                                MoatValue *in_hash)
+{
+  sse_char *hex;
+  sse_uint len;
+  sse_int algo;
+  sse_int err;
+
+  ASSERT(self);
+  ASSERT(!self->fActive);
+  self->fExpectedSize = in_size;
+  if (in_hash == NULL) {
+    return SSE_E_OK;
+  }
+  err = FILEHash_ParseHash(in_hash, &algo, &hex, &len);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  TFILEHash_Initialize(&self->fHash, algo);
+  self->fExpectedHash = moat_value_clone(in_hash);
+  ASSERT(self->fExpectedHash);
+  return SSE_E_OK;
+}
+
+void
+TFILEBlockDevWriter_SetWriteBufferSize(TFILEBlockDevWriter *self,
+                                       sse_size in_size)
+{
+  ASSERT(self);
+  ASSERT(!self->fActive);
+  self->fWriteSize = in_size;
+}
+
+void
+TFILEBlockDevWriter_SetDropCache(TFILEBlockDevWriter *self,
+                                 sse_bool in_drop_cache)
+{
+  ASSERT(self);
+  ASSERT(!self->fActive);
+  self->fDropCache = in_drop_cache;
+}
+
+void
+TFILEBlockDevWriter_SetWorkerPool(TFILEBlockDevWriter *self,
+                                  TFILEWorkerPool *in_pool)
+{
+  ASSERT(self);
+  ASSERT(!self->fActive);
+  self->fWorkers = in_pool;
+}
+
+sse_uint64
+TFILEBlockDevWriter_GetWriteCount(TFILEBlockDevWriter *self)
+{
+  ASSERT(self);
+  return self->fWriteCount;
+}
+
+void
+TFILEBlockDevWriter_SetOnCompleteCallback(TFILEBlockDevWriter *self,
+                                          TFILEBlockDevWriter_OnCompleteCallback in_callback,
+                                          sse_pointer in_user_data)
+{
+  ASSERT(self);
+  self->fOnCompleteCallback = in_callback;
+  self->fOnCompleteCallbackUserData = in_user_data;
+}
+
+sse_int
+TFILEBlockDevWriter_Start(TFILEBlockDevWriter *self)
+{
+  sse_size block_size;
+  sse_int err;
+
+  ASSERT(self);
+  ASSERT(!self->fActive);
+
+  self->fFd = open(self->fDevicePath, O_WRONLY | O_CLOEXEC | ((self->fDirect) ? O_DIRECT : 0));
+  if (self->fFd < 0 && self->fDirect && errno == EINVAL) {
+    LOG_WARN("O_DIRECT is not supported by [%s], write through the page cache.", self->fDevicePath);
+    self->fDirect = sse_false;
+    self->fFd = open(self->fDevicePath, O_WRONLY | O_CLOEXEC);
+  }
+  if (self->fFd < 0) {
+    LOG_ERROR("open(%s) has been failed with [%s].", self->fDevicePath, strerror(errno));
+    return (errno == ENOENT) ? SSE_E_NOENT : (errno == EACCES) ? SSE_E_ACCES : SSE_E_GENERIC;
+  }
+  block_size = self->fBlockSize;
+  err = TFILEBlockDevWriter_Probe(self, block_size);
+  if (err != SSE_E_OK) {
+    close(self->fFd);
+    self->fFd = -1;
+    return err;
+  }
+  if (self->fExpectedSize >= 0 && (sse_uint64)self->fExpectedSize > self->fCapacity) {
+    LOG_ERROR("The image of %lld bytes is larger than [%s].", self->fExpectedSize, self->fDevicePath);
+    close(self->fFd);
+    self->fFd = -1;
+    return SSE_E_NOMEM;
+  }
+  /* Aligned for O_DIRECT, with room to pad the tail to the write unit of MTD. */
+  if (posix_memalign((void **)&self->fBuffer, FILE_BLOCKDEV_DIRECT_ALIGN,
+                     FILEBlockDev_RoundUp(self->fWriteSize, self->fPageSize)) != 0) {
+    LOG_ERROR("posix_memalign() has been failed.");
+    close(self->fFd);
+    self->fFd = -1;
+    return SSE_E_NOMEM;
+  }
+  TFILEBlockDevWriter_SetupSlots(self);
+  if (self->fIdle == NULL) {
+    self->fIdle = moat_idle_new(FILEBlockDevWriter_OnIdle, self);
+    ASSERT(self->fIdle);
+  }
+  if (self->fTimerFd < 0) {
+    self->fTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  }
+  if (self->fTimerFd >= 0 && self->fTimer == NULL) {
+    self->fTimer = moat_io_watcher_new(self->fTimerFd, FILEBlockDevWriter_OnTimer, self, MOAT_IO_FLAG_READ);
+  }
+  if (self->fTimer == NULL) {
+    LOG_WARN("The timer could not be created, poll the request on every iteration.");
+  }
+  err = TFILEBlockDevWriter_Request(self);
+  if (err != SSE_E_OK) {
+    TFILEBlockDevWriter_StopPolling(self);
+    close(self->fFd);
+    self->fFd = -1;
+    return err;
+  }
+  LOG_INFO("Stream [%s] into [%s].", self->fUrl, self->fDevicePath);
+  self->fActive = sse_true;
+  return SSE_E_OK;
+}
+
+void
+TFILEBlockDevWriter_Cancel(TFILEBlockDevWriter *self)
+{
+  ASSERT(self);
+  if (!self->fActive) {
+    return;
+  }
+  LOG_INFO("Streaming into [%s] has been canceled at %llu.", self->fDevicePath, (unsigned long long)self->fOffset);
+  self->fActive = sse_false;
+  self->fBody = NULL;
+  TFILEBlockDevWriter_StopPolling(self);
+  moat_httpc_reset(self->fHttp);
+  if (self->fFd >= 0) {
+    close(self->fFd);
+    self->fFd = -1;
+  }
+}
@@ -0,0 +1,386 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+#define FILE_COMPRESS_GZIP_WINDOW_BITS (15 + 16) /* 16: gzip header and trailer */
+#define FILE_COMPRESS_MEM_LEVEL        (8)
+#define FILE_COMPRESS_EWMA_WEIGHT      (0.3)    /* Weight of the latest sample */
+
+sse_int
+FILECompress_ParseSpec(const sse_char *in_spec,
+                       sse_size in_len,
+                       sse_int *out_level)
+{
+  sse_char *spec;
+  sse_char *algo;
+  sse_char *level;
+  sse_char *p;
+  long num;
+  sse_int err = SSE_E_OK;
+
+  ASSERT(in_spec);
+  ASSERT(out_level);
+
+  spec = sse_strndup(in_spec, in_len);
+  ASSERT(spec);
+  algo = spec;
+  level = sse_strchr(spec, ':');
+  if (level) {
+    *level++ = '\0';
+  }
+
+  if (sse_strcmp(algo, "none") == 0 || algo[0] == '\0') {
+    *out_level = FILE_COMPRESS_NONE;
+  } else if (sse_strcmp(algo, "gzip") == 0 || sse_strcmp(algo, "zstd") == 0) {
+    if (algo[0] == 'z') {
+      /* zstd is not available on the gateway, gzip is the nearest alternative. */
+      LOG_WARN("zstd is not supported, compress with gzip.");
+    }
+    *out_level = FILE_COMPRESS_GZIP_LEVEL;
+    if (level && sse_strcmp(level, "auto") == 0) {
+      *out_level = FILE_COMPRESS_AUTO;
+    } else if (level) {
+      num = strtol(level, &p, 10);
+      if (*p != '\0' || num < 1) {
+        LOG_ERROR("Compression level=[%s] is invalid.", level);
+        err = SSE_E_INVAL;
+      } else {
+        *out_level = (num > FILE_COMPRESS_LEVEL_MAX) ? FILE_COMPRESS_LEVEL_MAX : (sse_int)num;
+      }
+    }
+  } else {
+    LOG_ERROR("Compression=[%s] is not supported.", algo);
+    err = SSE_E_INVAL;
+  }
+  sse_free(spec);
+  return err;
+}
+
+/* Make sure that the buffer has room for the output. */
+static void
+FILECompress_GrowBuffer(z_stream *in_stream,
+                        sse_byte **io_buf,
+                        sse_size *io_buf_size)
+{
+  sse_byte *buf;
+  sse_size size;
+  sse_size len;
+
+  if (in_stream->avail_out > 0) {
+    return;
+  }
+  len = in_stream->total_out;
+  size = (*io_buf_size < FILE_COMPRESS_READ_SIZE) ? FILE_COMPRESS_READ_SIZE : *io_buf_size * 2;
+  buf = sse_malloc(size);
+  ASSERT(buf);
+  if (*io_buf) {
+    sse_memcpy(buf, *io_buf, len);
+    sse_free(*io_buf);
+  }
+  *io_buf = buf;
+  *io_buf_size = size;
+  in_stream->next_out = buf + len;
+  in_stream->avail_out = size - len;
+}
+
+struct TFILEGzipMember_ {
+  z_stream fStream;
+  sse_uint64 fOffset;                      /** Offset to read next */
+  sse_uint64 fLimit;                       /** Lowered to the end of a stream */
+};
+
+void
+FILECompress_AbortGzip(TFILEGzipMember *in_member)
+{
+  if (in_member == NULL) {
+    return;
+  }
+  deflateEnd(&in_member->fStream);
+  sse_free(in_member);
+}
+
+sse_int
+FILECompress_GzipRange(TFILESource *in_source,
+                       sse_uint64 in_offset,
+                       sse_uint64 in_limit,
+                       sse_size in_min_out,
+                       sse_int in_level,
+                       TFILEGzipMember **io_member,
+                       sse_byte **io_buf,
+                       sse_size *io_buf_size,
+                       sse_size *out_len,
+                       sse_uint64 *out_end)
+{
+  TFILEGzipMember *member;
+  z_stream *stream;
+  sse_byte in[FILE_COMPRESS_READ_SIZE];
+  sse_size n;
+  int flush = Z_NO_FLUSH;
+  sse_int err;
+  int ret;
+
+  ASSERT(io_member);
+  ASSERT(io_buf);
+  ASSERT(io_buf_size);
+  ASSERT(out_len);
+  ASSERT(out_end);
+
+  member = *io_member;
+  *io_member = NULL;
+  if (member == NULL) {
+    member = sse_zeroalloc(sizeof(TFILEGzipMember));
+    ASSERT(member);
+    ret = deflateInit2(&member->fStream, in_level, Z_DEFLATED, FILE_COMPRESS_GZIP_WINDOW_BITS,
+                       FILE_COMPRESS_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+      LOG_ERROR("deflateInit2() has been failed with [%d].", ret);
+      sse_free(member);
+      return SSE_E_GENERIC;
+    }
+    member->fStream.next_out = *io_buf;
+    member->fStream.avail_out = *io_buf_size;
+    member->fOffset = in_offset;
+    member->fLimit = in_limit;
+  }
+  stream = &member->fStream;
+
+  do {
+    if (stream->total_out < in_min_out && member->fOffset < member->fLimit) {
+      err = TFILESource_Read(in_source, in, (member->fLimit - member->fOffset < sizeof(in)) ?
+                             (sse_size)(member->fLimit - member->fOffset) : sizeof(in), member->fOffset, &n);
+      if (err == SSE_E_AGAIN) {
+        /* All the input so far has been consumed, nothing refers to in. */
+        *io_member = member;
+        return SSE_E_AGAIN;
+      }
+      if (err != SSE_E_OK) {
+        FILECompress_AbortGzip(member);
+        return SSE_E_GENERIC;
+      }
+      if (n == 0) {
+        /* Truncated since the upload started, or the end of a stream. */
+        member->fLimit = member->fOffset;
+      }
+      member->fOffset += n;
+      stream->next_in = in;
+      stream->avail_in = n;
+    }
+    if (stream->total_out >= in_min_out || member->fOffset >= member->fLimit) {
+      flush = Z_FINISH;
+    }
+    do {
+      FILECompress_GrowBuffer(stream, io_buf, io_buf_size);
+      ret = deflate(stream, flush);
+      if (ret == Z_STREAM_ERROR) {
+        LOG_ERROR("deflate() has been failed with [%d].", ret);
+        FILECompress_AbortGzip(member);
+        return SSE_E_GENERIC;
+      }
+    } while (stream->avail_in > 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+  } while (flush != Z_FINISH);
+
+  *out_len = stream->total_out;
+  *out_end = member->fOffset;
+  FILECompress_AbortGzip(member);
+  return SSE_E_OK;
+}
+
+/*
+ * Tuner
+ */
+
+sse_double
+FILECompress_Now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+sse_double
+FILECompress_CpuNow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static sse_double
+FILECompress_Average(sse_double in_average,
+                     sse_double in_sample)
+{
+  if (in_average <= 0) {
+    return in_sample;
+  }
+  return in_average + (in_sample - in_average) * FILE_COMPRESS_EWMA_WEIGHT;
+}
+
+/* Seconds per source byte to encode and send at the level, 0 if unknown. */
+static sse_double
+TFILECompressTuner_GetCost(TFILECompressTuner *self,
+                           sse_int in_level)
+{
+  if (self->fEncodeCost[in_level] <= 0 || self->fSendRate <= 0) {
+    return 0;
+  }
+  return self->fEncodeCost[in_level] + self->fRatio[in_level] / self->fSendRate;
+}
+
+static void
+TFILECompressTuner_AddHistory(TFILECompressTuner *self)
+{
+  sse_char buf[32];
+
+  if (self->fRunLength == 0) {
+    return;
+  }
+  snprintf(buf, sizeof(buf), "%s%dx%u", (sse_string_get_length(self->fHistory) > 0) ? "," : "",
+           self->fRunLevel, self->fRunLength);
+  sse_string_concat_cstr(self->fHistory, buf);
+}
+
+void
+TFILECompressTuner_Initialize(TFILECompressTuner *self,
+                              sse_int in_level)
+{
+  ASSERT(self);
+  sse_memset(self, 0, sizeof(TFILECompressTuner));
+  self->fAdaptive = (in_level == FILE_COMPRESS_AUTO);
+  self->fLevel = (self->fAdaptive) ? FILE_COMPRESS_GZIP_LEVEL : in_level;
+  self->fHistory = sse_string_new("");
+  ASSERT(self->fHistory);
+  self->fRunLevel = self->fLevel;
+}
+
+void
+TFILECompressTuner_Finalize(TFILECompressTuner *self)
+{
+  ASSERT(self);
+  if (self->fHistory) {
+    sse_string_free(self->fHistory, sse_true);
+    self->fHistory = NULL;
+  }
+}
+
+void
+TFILECompressTuner_OnEncoded(TFILECompressTuner *self,
+                             sse_uint64 in_source,
+                             sse_uint64 in_compressed,
+                             sse_double in_sec)
+{
+  sse_int level = self->fLevel;
+  sse_int next;
+  sse_double cost;
+  sse_double next_cost;
+
+  ASSERT(self);
+  self->fSourceBytes += in_source;
+  self->fCompressedBytes += in_compressed;
+  if (level != self->fRunLevel) {
+    TFILECompressTuner_AddHistory(self);
+    self->fRunLevel = level;
+    self->fRunLength = 0;
+  }
+  self->fRunLength++;
+
+  if (!self->fAdaptive || in_source == 0) {
+    return;
+  }
+  self->fEncodeCost[level] = FILECompress_Average(self->fEncodeCost[level], in_sec / in_source);
+  self->fRatio[level] = FILECompress_Average(self->fRatio[level], (sse_double)in_compressed / in_source);
+  cost = TFILECompressTuner_GetCost(self, level);
+  if (cost <= 0) {
+    return;
+  }
+
+  /* Explore the unknown neighbour on the side of the bottleneck. */
+  next = (self->fEncodeCost[level] > self->fRatio[level] / self->fSendRate) ? level - 1 : level + 1;
+  if (next >= FILE_COMPRESS_LEVEL_MIN && next <= FILE_COMPRESS_LEVEL_MAX &&
+      TFILECompressTuner_GetCost(self, next) <= 0) {
+    LOG_DEBUG("Try the compression level %d instead of %d.", next, level);
+    self->fLevel = next;
+    return;
+  }
+
+  /* Otherwise move to the cheapest of the known neighbours. */
+  for (next = level - 1; next <= level + 1; next += 2) {
+    if (next < FILE_COMPRESS_LEVEL_MIN || next > FILE_COMPRESS_LEVEL_MAX) {
+      continue;
+    }
+    next_cost = TFILECompressTuner_GetCost(self, next);
+    if (next_cost > 0 && next_cost < cost) {
+      cost = next_cost;
+      self->fLevel = next;
+    }
+  }
+  if (self->fLevel != level) {
+    LOG_DEBUG("Change the compression level from %d to %d.", level, self->fLevel);
+  }
+}
+
+void
+TFILECompressTuner_OnSent(TFILECompressTuner *self,
+                          sse_uint64 in_compressed,
+                          sse_double in_sec,
+                          sse_uint in_concurrency)
+{
+  ASSERT(self);
+  if (in_sec <= 0) {
+    return;
+  }
+  self->fSendRate = FILECompress_Average(self->fSendRate, in_compressed / in_sec * in_concurrency);
+}
+
+sse_char*
+TFILECompressTuner_GetReport(TFILECompressTuner *self)
+{
+  sse_char buf[64];
+  SSEString *report;
+
+  ASSERT(self);
+  report = sse_string_new("gzip levels=");
+  ASSERT(report);
+  sse_string_concat_cstr(report, sse_string_get_cstr(self->fHistory));
+  snprintf(buf, sizeof(buf), "%s%dx%u ratio=%.3f", (sse_string_get_length(self->fHistory) > 0) ? "," : "",
+           self->fRunLevel, self->fRunLength,
+           (self->fSourceBytes > 0) ? (sse_double)self->fCompressedBytes / self->fSourceBytes : 1.0);
+  sse_string_concat_cstr(report, buf);
+  return sse_string_free(report, sse_false);
+}
@@ -35,11 +35,14 @@ FILEContentInfo_OnCompleteCallback(MoatValue *in_err_code,
                                    const sse_char *in_uid,
                                    const sse_char *in_key,
                                    const sse_char *operation,
+                                   MoatObject *in_details,
                                    sse_pointer in_user_data)
 {
   TFILEContentInfo *self = (TFILEContentInfo*)in_user_data;
   sse_char *job_service_id = NULL;
   MoatObject *collection = NULL;
+  MoatObjectIterator *it;
+  sse_char *key;
   sse_int err;
   sse_char *str;
   sse_uint len;
@@ -75,6 +78,17 @@ FILEContentInfo_OnCompleteCallback(MoatValue *in_err_code,
     err = moat_object_add_string_value(collection, "uid", (sse_char*)in_uid, 0, sse_true, sse_true);
     ASSERT(err == SSE_E_OK);
   }
+  if (in_details) {
+    it = moat_object_create_iterator(in_details);
+    ASSERT(it);
+    while (moat_object_iterator_has_next(it)) {
+      key = moat_object_iterator_get_next_key(it);
+      ASSERT(key);
+      err = moat_object_add_value(collection, key, moat_object_get_value(in_details, key), sse_true, sse_true);
+      ASSERT(err == SSE_E_OK);
+    }
+    moat_object_iterator_free(it);
+  }
 
   /* Send a notification. */
   request_id = moat_send_notification(self->fMoat,
@@ -96,6 +110,21 @@ FILEContentInfo_OnCompleteCallback(MoatValue *in_err_code,
   return;
 }
 
+static TFILEDownloader*
+TFILEContentInfo_DetachPrefetch(TFILEContentInfo *self)
+{
+  TFILEDownloader *prefetch;
+
+  ASSERT(self);
+  if (self->fPrefetchTimerId >= 0) {
+    moat_timer_cancel(self->fPrefetchTimer, self->fPrefetchTimerId);
+    self->fPrefetchTimerId = -1;
+  }
+  prefetch = self->fPrefetch;
+  self->fPrefetch = NULL;
+  return prefetch;
+}
+
 static void
 FILEContentInfo_OnDownloadCompleteCallback(TFILEDownloader *downloader,
                                            MoatValue *in_err_code,
@@ -104,8 +133,22 @@ FILEContentInfo_OnDownloadCompleteCallback(TFILEDownloader *downloader,
                                            const sse_char *in_key,
                                            sse_pointer in_user_data)
 {
+  TFILEContentInfo *self = (TFILEContentInfo*)in_user_data;
+  MoatObject *details;
+
   ASSERT(downloader);
-  FILEContentInfo_OnCompleteCallback(in_err_code, in_err_msg, in_uid, in_key, FILE_OPERATION_DELIVER_RESULT, in_user_data);
+  ASSERT(self);
+  if (downloader == self->fPrefetch) {
+    LOG_INFO("The prefetch has been finished before the download command.");
+    TFILEContentInfo_DetachPrefetch(self);
+  }
+  if (in_key == NULL) {
+    LOG_INFO("No download command has been attached. Skip notifying the result.");
+  } else {
+    details = TFILEDownloader_GetResultDetails(downloader);
+    FILEContentInfo_OnCompleteCallback(in_err_code, in_err_msg, in_uid, in_key, FILE_OPERATION_DELIVER_RESULT, details, in_user_data);
+    moat_object_free(details);
+  }
   TFILEDownloader_Delete(downloader);
 }
 
@@ -117,11 +160,221 @@ FILEContentInfo_OnUploadCompleteCallback(TFILEUploader *uploader,
                                          const sse_char *in_key,
                                          sse_pointer in_user_data)
 {
+  MoatObject *details;
+
   ASSERT(uploader);
-  FILEContentInfo_OnCompleteCallback(in_err_code, in_err_msg, in_uid, in_key, FILE_OPERATION_FETCH_RESULT, in_user_data);
+  details = TFILEUploader_GetResultDetails(uploader);
+  FILEContentInfo_OnCompleteCallback(in_err_code, in_err_msg, in_uid, in_key, FILE_OPERATION_FETCH_RESULT, details, in_user_data);
+  moat_object_free(details);
   TFILEUploader_Delete(uploader);
 }
 
+/*
+ * Prefetch
+ */
+
+static void
+TFILEContentInfo_DiscardPrefetch(TFILEContentInfo *self)
+{
+  TFILEDownloader *prefetch;
+
+  prefetch = TFILEContentInfo_DetachPrefetch(self);
+  if (prefetch) {
+    TFILEDownloader_Discard(prefetch);
+  }
+}
+
+static sse_bool
+FILEContentInfo_OnPrefetchTimeout(sse_int in_timer_id,
+                                  sse_pointer in_user_data)
+{
+  TFILEContentInfo *self = (TFILEContentInfo*)in_user_data;
+
+  ASSERT(self);
+  LOG_INFO("The download command has not come. Discard the prefetch.");
+  self->fPrefetchTimerId = -1;
+  TFILEContentInfo_DiscardPrefetch(self);
+  return sse_false;
+}
+
+/*
+ * "destinationPath" is a file path, or a list of file paths as JSON string (e.g. ["/etc/ssl/ca.pem","/opt/app/ca.pem"]).
+ * "uploadUrl" is a URL, or a list of URLs as JSON string as well.
+ */
+static sse_bool
+FILEContentInfo_IsList(MoatValue *in_value)
+{
+  sse_char *str;
+  sse_uint len;
+
+  if (moat_value_get_type(in_value) == MOAT_VALUE_TYPE_LIST) {
+    return sse_true;
+  }
+  if (moat_value_get_string(in_value, &str, &len) != SSE_E_OK) {
+    return sse_false;
+  }
+  return (len > 0) && (str[0] == '[');
+}
+
+static MoatValue*
+FILEContentInfo_ParseList(MoatValue *in_value)
+{
+  sse_int err;
+  sse_char *str;
+  sse_uint len;
+  sse_char *err_msg = NULL;
+  MoatValue *list;
+
+  if (!FILEContentInfo_IsList(in_value) || (moat_value_get_type(in_value) == MOAT_VALUE_TYPE_LIST)) {
+    list = moat_value_clone(in_value);
+    ASSERT(list);
+    return list;
+  }
+  err = moat_value_get_string(in_value, &str, &len);
+  ASSERT(err == SSE_E_OK);
+  err = moat_json_string_to_moat_value(str, len, &list, &err_msg);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("moat_json_string_to_moat_value() has been failed with [%s]. message=[%s]",
+              sse_get_error_string(err), err_msg);
+    sse_free(err_msg);
+    return NULL;
+  }
+  return list;
+}
+
+/* "deliverySparse", sse_true if the files are delivered as sparse images. */
+static sse_bool
+TFILEContentInfo_IsDeliverySparse(TFILEContentInfo *self)
+{
+  MoatValue *sparse;
+  sse_bool b;
+
+  sparse = moat_object_get_value(self->fObject, "deliverySparse");
+  return (sparse && moat_value_get_boolean(sparse, &b) == SSE_E_OK && b);
+}
+
+/* Whether the string value is in_str, NULL matches a value which is missing or not a string. */
+static sse_bool
+FILEContentInfo_IsSameString(MoatValue *in_value,
+                             const sse_char *in_str)
+{
+  sse_char *str;
+  sse_uint len;
+
+  if ((in_value == NULL) || (moat_value_get_string(in_value, &str, &len) != SSE_E_OK)) {
+    return (in_str == NULL);
+  }
+  return (in_str != NULL) && (sse_strlen(in_str) == len) && (sse_strncmp(in_str, str, len) == 0);
+}
+
+static sse_char*
+FILEContentInfo_DupString(MoatValue *in_value)
+{
+  sse_char *str;
+  sse_uint len;
+  sse_char *dup;
+
+  if ((in_value == NULL) || (moat_value_get_string(in_value, &str, &len) != SSE_E_OK)) {
+    return NULL;
+  }
+  dup = sse_strndup(str, len);
+  ASSERT(dup);
+  return dup;
+}
+
+/*
+ * Start a prefetch once deliveryUrl or destinationPath has been changed. The same pair is not
+ * fetched again after the prefetch has been attached to the download command, which may be still
+ * writing the temporary file, nor after it has been discarded.
+ */
+static void
+TFILEContentInfo_UpdatePrefetch(TFILEContentInfo *self)
+{
+  sse_int err;
+  MoatValue *url;
+  MoatValue *path;
+  TFILEFilesysInfo *filesys_info;
+  TFILEDownloader *prefetch;
+
+  ASSERT(self);
+  ASSERT(self->fObject);
+
+  url  = moat_object_get_value(self->fObject, "deliveryUrl");
+  path = moat_object_get_value(self->fObject, "destinationPath");
+  if (FILEContentInfo_IsSameString(url, self->fPrefetchUrl) &&
+      FILEContentInfo_IsSameString(path, self->fPrefetchPath)) {
+    LOG_DEBUG("deliveryUrl and destinationPath have not been changed. Keep the prefetch.");
+    return;
+  }
+  if (self->fPrefetch) {
+    LOG_INFO("deliveryUrl or destinationPath has been changed. Discard the prefetch.");
+    TFILEContentInfo_DiscardPrefetch(self);
+  }
+  if (self->fPrefetchUrl)  sse_free(self->fPrefetchUrl);
+  if (self->fPrefetchPath) sse_free(self->fPrefetchPath);
+  self->fPrefetchUrl = FILEContentInfo_DupString(url);
+  self->fPrefetchPath = FILEContentInfo_DupString(path);
+  if ((url == NULL) || (moat_value_get_type(url) != MOAT_VALUE_TYPE_STRING) ||
+      (path == NULL) || (moat_value_get_type(path) != MOAT_VALUE_TYPE_STRING)) {
+    return;
+  }
+  if (FILEContentInfo_IsList(path)) {
+    /* Only a single destination is prefetched. */
+    return;
+  }
+  filesys_info = TFILEFilesysInfoTbl_FindFilesysInfo(&self->fFilesysInfo, path);
+  if (!TFILEFilesysInfo_IsPrefetchEnabled(filesys_info)) {
+    return;
+  }
+
+  prefetch = FILEDownloader_New(NULL, NULL);
+  ASSERT(prefetch);
+  TFILEDownloader_SetOnCompleteCallback(prefetch, FILEContentInfo_OnDownloadCompleteCallback, self);
+  TFILEDownloader_SetSparse(prefetch, TFILEContentInfo_IsDeliverySparse(self));
+  TFILEDownloader_SetPriority(prefetch, &self->fPriority);
+  TFILEDownloader_SetWorkerPool(prefetch, self->fWorkers);
+  err = TFILEDownloader_SetResourcePath(prefetch, url, path, &self->fFilesysInfo);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("TFILEDownloader_SetResourcePath() has been failed with [%s].", sse_get_error_string(err));
+    TFILEDownloader_Delete(prefetch);
+    return;
+  }
+  self->fPrefetch = prefetch;
+  self->fPrefetchTimerId = moat_timer_set(self->fPrefetchTimer,
+                                          TFILEFilesysInfo_GetPrefetchTimeout(filesys_info),
+                                          FILEContentInfo_OnPrefetchTimeout,
+                                          self);
+  if (self->fPrefetchTimerId < 0) {
+    LOG_WARN("moat_timer_set() has been failed with [%s]. The prefetch will be kept until the model is updated.",
+             sse_get_error_string(self->fPrefetchTimerId));
+    self->fPrefetchTimerId = -1;
+  }
+  TFILEDownloader_Prefetch(prefetch);
+}
+
+static TFILEDownloader*
+TFILEContentInfo_TakePrefetch(TFILEContentInfo *self,
+                              const sse_char *in_uid,
+                              const sse_char *in_key,
+                              MoatValue *in_url,
+                              MoatValue *in_file_path)
+{
+  TFILEDownloader *prefetch = self->fPrefetch;
+
+  if (prefetch == NULL) {
+    return NULL;
+  }
+  if (TFILEDownloader_MatchResourcePath(prefetch, in_url, in_file_path) &&
+      prefetch->fSparse == TFILEContentInfo_IsDeliverySparse(self) &&
+      (TFILEDownloader_AttachCommand(prefetch, in_uid, in_key) == SSE_E_OK)) {
+    LOG_INFO("Use the prefetch for the download command.");
+    return TFILEContentInfo_DetachPrefetch(self);
+  }
+  LOG_INFO("The prefetch could not be used for the download command. Discard it.");
+  TFILEContentInfo_DiscardPrefetch(self);
+  return NULL;
+}
+
 sse_int
 TFILEContentInfo_Initialize(TFILEContentInfo *self,
                             Moat in_moat)
@@ -135,6 +388,14 @@ TFILEContentInfo_Initialize(TFILEContentInfo *self,
 
   self->fMoat = in_moat;
   self->fObject = NULL;
+  self->fPrefetch = NULL;
+  self->fPrefetchTimer = moat_timer_new();
+  ASSERT(self->fPrefetchTimer);
+  self->fPrefetchTimerId = -1;
+  self->fPrefetchUrl = NULL;
+  self->fPrefetchPath = NULL;
+  TFILEPriority_Initialize(&self->fPriority);
+  self->fWorkers = NULL;
   err = TFILEFilesysInfoTbl_Initialize(&self->fFilesysInfo);
   if (err != SSE_E_OK) {
     LOG_ERROR("TFILEFilesysInfoTbl_Initialize() has been failed with [%s].", sse_get_error_string(err));
@@ -145,16 +406,47 @@ TFILEContentInfo_Initialize(TFILEContentInfo *self,
   if (err != SSE_E_OK) {
     LOG_WARN("TFILEFilesysInfoTbl_LoadConfig() has been failed with [%s].", sse_get_error_string(err));
   }
+  self->fWorkers = FILEWorkerPool_New(TFILEFilesysInfoTbl_GetWorkerThreads(&self->fFilesysInfo));
+  if (self->fWorkers == NULL) {
+    LOG_ERROR("FILEWorkerPool_New() has been failed.");
+    return SSE_E_GENERIC;
+  }
+  TFILEPriority_SetWorkerPool(&self->fPriority, self->fWorkers);
   return SSE_E_OK;
 }
 
 void
 TFILEContentInfo_Finalize(TFILEContentInfo *self)
 {
+  TFILEDownloader *prefetch;
+
   LOG_DEBUG("Enter: self=[%p]", self);
 
   ASSERT(self);
 
+  if (self->fPrefetchTimer) {
+    prefetch = TFILEContentInfo_DetachPrefetch(self);
+    if (prefetch) {
+      TFILEDownloader_RemoveOnCompleteCallback(prefetch);
+      TFILEDownloader_DeleteTmpFiles(prefetch);
+      TFILEDownloader_Delete(prefetch);
+    }
+    moat_timer_free(self->fPrefetchTimer);
+    self->fPrefetchTimer = NULL;
+  }
+  if (self->fPrefetchUrl) {
+    sse_free(self->fPrefetchUrl);
+    self->fPrefetchUrl = NULL;
+  }
+  if (self->fPrefetchPath) {
+    sse_free(self->fPrefetchPath);
+    self->fPrefetchPath = NULL;
+  }
+  TFILEPriority_Finalize(&self->fPriority);
+  if (self->fWorkers) {
+    TFILEWorkerPool_Delete(self->fWorkers);
+    self->fWorkers = NULL;
+  }
   if (self->fObject) {
     moat_object_free(self->fObject);
     self->fObject = NULL;
@@ -185,6 +477,7 @@ FILEContentInfo_UpdateProc(Moat in_moat,
   self->fObject = moat_object_clone(in_object);
   ASSERT(self->fObject);
   MOAT_OBJECT_DUMP_INFO(TAG, self->fObject);
+  TFILEContentInfo_UpdatePrefetch(self);
 
   return SSE_E_OK;
 }
@@ -211,6 +504,7 @@ FILEContentInfo_UpdateFieldsProc(Moat in_moat,
     ASSERT(self->fObject);
     LOG_INFO("All fields of ContentInfo object have been update.");
     MOAT_OBJECT_DUMP_INFO(TAG, self->fObject);
+    TFILEContentInfo_UpdatePrefetch(self);
     return SSE_E_OK;
   }
 
@@ -233,6 +527,7 @@ FILEContentInfo_UpdateFieldsProc(Moat in_moat,
 
   LOG_INFO("Some fields of ContentInfo object have been update.");
   MOAT_OBJECT_DUMP_INFO(TAG, self->fObject);
+  TFILEContentInfo_UpdatePrefetch(self);
   return SSE_E_OK;
 }
 
@@ -267,10 +562,86 @@ TFILEContentInfo_GetDownloadFilePath(TFILEContentInfo *self,
     return SSE_E_GENERIC;
   }
 
-  *out_url = moat_value_clone(url);
-  ASSERT(*out_url);
-  *out_file_path = moat_value_clone(path);
-  ASSERT(*out_file_path);
+  *out_file_path = FILEContentInfo_ParseList(path);
+  if (*out_file_path == NULL) {
+    LOG_ERROR("Invalid destination file path information.");
+    MOAT_VALUE_DUMP_ERROR(TAG, path);
+    return SSE_E_INVAL;
+  }
+  *out_url = url;
+  return SSE_E_OK;
+}
+
+sse_int
+TFILEContentInfo_GetDeliveryManifest(TFILEContentInfo *self,
+                                     MoatValue **out_manifest,
+                                     sse_uint *out_concurrency)
+{
+  sse_int err;
+  MoatValue *json;
+  MoatValue *value;
+  MoatValue *files;
+  MoatValue *concurrency;
+  MoatObject *object;
+  sse_char *str;
+  sse_uint len;
+  sse_char *err_msg = NULL;
+  sse_int32 num;
+
+  LOG_DEBUG("Enter: self=[%p]", self);
+  ASSERT(self);
+  ASSERT(out_manifest);
+  ASSERT(out_concurrency);
+
+  if (self->fObject == NULL) {
+    LOG_ERROR("self->fObject=[%p]", self->fObject);
+    return SSE_E_INVAL;
+  }
+
+  json = moat_object_get_value(self->fObject, "deliveryManifest");
+  if (json == NULL) {
+    LOG_ERROR("No manifest information.");
+    MOAT_OBJECT_DUMP_ERROR(TAG, self->fObject);
+    return SSE_E_GENERIC;
+  }
+  err = moat_value_get_string(json, &str, &len);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("moat_value_get_string() has been failed with [%s].", sse_get_error_string(err));
+    return err;
+  }
+  err = moat_json_string_to_moat_value(str, len, &value, &err_msg);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("moat_json_string_to_moat_value() has been failed with [%s]. message=[%s]",
+              sse_get_error_string(err), err_msg);
+    sse_free(err_msg);
+    return err;
+  }
+
+  /* The manifest is either a list of the files or {"files":[...], "concurrency":n}. */
+  *out_concurrency = FILE_MANIFEST_CONCURRENCY_DEFAULT;
+  if (moat_value_get_type(value) == MOAT_VALUE_TYPE_LIST) {
+    *out_manifest = value;
+    return SSE_E_OK;
+  }
+  err = moat_value_get_object(value, &object);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("The manifest must be a list or an object.");
+    moat_value_free(value);
+    return SSE_E_INVAL;
+  }
+  files = moat_object_get_value(object, "files");
+  if (files == NULL) {
+    LOG_ERROR("No \"files\" in the manifest.");
+    moat_value_free(value);
+    return SSE_E_INVAL;
+  }
+  concurrency = moat_object_get_value(object, "concurrency");
+  if (concurrency && (moat_value_get_int32(concurrency, &num) == SSE_E_OK) && (num > 0)) {
+    *out_concurrency = num;
+  }
+  *out_manifest = moat_value_clone(files);
+  ASSERT(*out_manifest);
+  moat_value_free(value);
   return SSE_E_OK;
 }
 
@@ -305,8 +676,12 @@ TFILEContentInfo_GetUploadUrl(TFILEContentInfo *self,
     return SSE_E_GENERIC;
   }
 
-  *out_url = moat_value_clone(url);
-  ASSERT(*out_url);
+  *out_url = FILEContentInfo_ParseList(url);
+  if (*out_url == NULL) {
+    LOG_ERROR("Invalid URL information.");
+    MOAT_VALUE_DUMP_ERROR(TAG, url);
+    return SSE_E_INVAL;
+  }
   *out_file_path = moat_value_clone(path);
   ASSERT(*out_file_path);
   return SSE_E_OK;
@@ -329,11 +704,6 @@ ContentInfo_download(Moat in_moat,
   ASSERT(in_moat);
   ASSERT(in_model_context);
 
-
-  downloader = FILEDownloader_New(in_uid, in_key);
-  ASSERT(downloader);
-  TFILEDownloader_SetOnCompleteCallback(downloader, FILEContentInfo_OnDownloadCompleteCallback, self);
-
   /* Get the source URL and distination local file path. */
   err = TFILEContentInfo_GetDownloadFilePath(self, &url, &file_path);
   if (err != SSE_E_OK) {
@@ -345,22 +715,129 @@ ContentInfo_download(Moat in_moat,
   LOG_DEBUG("Destination file path=...");
   MOAT_VALUE_DUMP_DEBUG(TAG, file_path);
 
-  err = TFILEDownloader_SetResourcePath(downloader, url, file_path, &self->fFilesysInfo);
-  moat_value_free(url);
+  downloader = TFILEContentInfo_TakePrefetch(self, in_uid, in_key, url, file_path);
+  if (downloader == NULL) {
+    downloader = FILEDownloader_New(in_uid, in_key);
+    ASSERT(downloader);
+    TFILEDownloader_SetOnCompleteCallback(downloader, FILEContentInfo_OnDownloadCompleteCallback, self);
+    TFILEDownloader_SetSparse(downloader, TFILEContentInfo_IsDeliverySparse(self));
+    TFILEDownloader_SetPriority(downloader, &self->fPriority);
+    TFILEDownloader_SetWorkerPool(downloader, self->fWorkers);
+    err = TFILEDownloader_SetResourcePath(downloader, url, file_path, &self->fFilesysInfo);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("TFILEDownloader_SetResourcePath() has been failed with [%s].", sse_get_error_string(err));
+      moat_value_free(file_path);
+      TFILEDownloader_Delete(downloader);
+      return err;
+    }
+  }
   moat_value_free(file_path);
+
+  err = moat_start_async_command(in_moat, in_uid, in_key, in_data, FILEContent_DownloadFileAsync, downloader);
   if (err != SSE_E_OK) {
-    LOG_ERROR("TFILEDownloader_SetResourcePath() has been failed with [%s].", sse_get_error_string(err));
+    LOG_ERROR("moat_start_async_command() ... failed with [%s].", sse_get_error_string(err));
+    return err;
+  }
+  return SSE_E_INPROGRESS;
+}
+
+sse_int
+ContentInfo_downloadManifest(Moat in_moat,
+                             sse_char *in_uid,
+                             sse_char *in_key,
+                             MoatValue *in_data,
+                             sse_pointer in_model_context)
+{
+  sse_int err;
+  TFILEDownloader *downloader;
+  MoatValue *manifest;
+  sse_uint concurrency;
+  TFILEContentInfo *self = (TFILEContentInfo*)in_model_context;
+
+  LOG_DEBUG("Enter: moat=[%p], uid=[%s], key=[%s], data=[%p], context=[%p]", in_moat, in_uid, in_key, in_data, in_model_context);
+  ASSERT(in_moat);
+  ASSERT(in_model_context);
+
+  /* Get the list of the source URLs and distination local file paths. */
+  err = TFILEContentInfo_GetDeliveryManifest(self, &manifest, &concurrency);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("TFILEContentInfo_GetDeliveryManifest() has been failed with [%s].", sse_get_error_string(err));
+    return err;
+  }
+  LOG_DEBUG("Manifest=...");
+  MOAT_VALUE_DUMP_DEBUG(TAG, manifest);
+
+  downloader = FILEDownloader_New(in_uid, in_key);
+  ASSERT(downloader);
+  TFILEDownloader_SetOnCompleteCallback(downloader, FILEContentInfo_OnDownloadCompleteCallback, self);
+  TFILEDownloader_SetConcurrency(downloader, concurrency);
+  TFILEDownloader_SetSparse(downloader, TFILEContentInfo_IsDeliverySparse(self));
+  TFILEDownloader_SetPriority(downloader, &self->fPriority);
+  TFILEDownloader_SetWorkerPool(downloader, self->fWorkers);
+  err = TFILEDownloader_SetManifest(downloader, manifest, &self->fFilesysInfo);
+  moat_value_free(manifest);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("TFILEDownloader_SetManifest() has been failed with [%s].", sse_get_error_string(err));
+    TFILEDownloader_Delete(downloader);
     return err;
   }
 
   err = moat_start_async_command(in_moat, in_uid, in_key, in_data, FILEContent_DownloadFileAsync, downloader);
   if (err != SSE_E_OK) {
     LOG_ERROR("moat_start_async_command() ... failed with [%s].", sse_get_error_string(err));
+    TFILEDownloader_Delete(downloader);
     return err;
   }
   return SSE_E_INPROGRESS;
 }
 
+sse_int
+ContentInfo_rollback(Moat in_moat,
+                     sse_char *in_uid,
+                     sse_char *in_key,
+                     MoatValue *in_data,
+                     sse_pointer in_model_context)
+{
+  sse_int err;
+  TFILEDownloader *downloader;
+  MoatValue *path;
+  TFILEContentInfo *self = (TFILEContentInfo*)in_model_context;
+
+  LOG_DEBUG("Enter: moat=[%p], uid=[%s], key=[%s], data=[%p], context=[%p]", in_moat, in_uid, in_key, in_data, in_model_context);
+  ASSERT(in_moat);
+  ASSERT(in_model_context);
+
+  if (self->fObject == NULL) {
+    LOG_ERROR("self->fObject=[%p]", self->fObject);
+    return SSE_E_INVAL;
+  }
+  path = moat_object_get_value(self->fObject, "destinationPath");
+  if (path == NULL) {
+    LOG_ERROR("No destination file path information.");
+    MOAT_OBJECT_DUMP_ERROR(TAG, self->fObject);
+    return SSE_E_GENERIC;
+  }
+
+  downloader = FILEDownloader_New(in_uid, in_key);
+  ASSERT(downloader);
+  TFILEDownloader_SetOnCompleteCallback(downloader, FILEContentInfo_OnDownloadCompleteCallback, self);
+  TFILEDownloader_SetPriority(downloader, &self->fPriority);
+  TFILEDownloader_SetWorkerPool(downloader, self->fWorkers);
+  err = TFILEDownloader_SetRollbackPath(downloader, path, &self->fFilesysInfo);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("TFILEDownloader_SetRollbackPath() has been failed with [%s].", sse_get_error_string(err));
+    TFILEDownloader_Delete(downloader);
+    return err;
+  }
+
+  err = moat_start_async_command(in_moat, in_uid, in_key, in_data, FILEContent_DownloadFileAsync, downloader);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("moat_start_async_command() ... failed with [%s].", sse_get_error_string(err));
+    TFILEDownloader_Delete(downloader);
+    return err;
+  }
+  return SSE_E_INPROGRESS;
+}
 
 sse_int
 FILEContent_DownloadFileAsync(Moat in_moat,
@@ -381,6 +858,82 @@ FILEContent_DownloadFileAsync(Moat in_moat,
   return SSE_E_INPROGRESS;
 }
 
+/* Integer attribute, sse_false if not set. */
+static sse_bool
+TFILEContentInfo_GetUploadInt64(TFILEContentInfo *self,
+                                const sse_char *in_name,
+                                sse_int64 *out_num)
+{
+  MoatValue *value;
+  sse_int32 i32;
+
+  value = moat_object_get_value(self->fObject, (sse_char*)in_name);
+  if (value == NULL || moat_value_get_type(value) == MOAT_VALUE_TYPE_NULL) {
+    return sse_false;
+  }
+  if (moat_value_get_int64(value, out_num) != SSE_E_OK) {
+    if (moat_value_get_int32(value, &i32) != SSE_E_OK) {
+      return sse_false;
+    }
+    *out_num = i32;
+  }
+  return sse_true;
+}
+
+/* Timestamp attribute, FILE_SLICE_TIME_NONE if not set. */
+static sse_int
+TFILEContentInfo_GetUploadTime(TFILEContentInfo *self,
+                               const sse_char *in_name,
+                               sse_int64 *out_time)
+{
+  MoatValue *value;
+  sse_char *str;
+  sse_uint len;
+
+  *out_time = FILE_SLICE_TIME_NONE;
+  value = moat_object_get_value(self->fObject, (sse_char*)in_name);
+  if (value == NULL || moat_value_get_type(value) == MOAT_VALUE_TYPE_NULL) {
+    return SSE_E_OK;
+  }
+  if (moat_value_get_string(value, &str, &len) != SSE_E_OK ||
+      FILESlice_ParseTime(str, len, out_time) != SSE_E_OK) {
+    LOG_ERROR("\"%s\" must be a timestamp, e.g. \"2015-07-17T09:00:00Z\".", in_name);
+    return SSE_E_INVAL;
+  }
+  return SSE_E_OK;
+}
+
+/* Byte range and time range to upload. */
+static sse_int
+TFILEContentInfo_SetUploadRange(TFILEContentInfo *self,
+                                TFILEUploader *in_uploader)
+{
+  sse_int64 offset = 0;
+  sse_int64 length = -1;
+  sse_int64 since;
+  sse_int64 until;
+  sse_int err;
+
+  TFILEContentInfo_GetUploadInt64(self, "uploadOffset", &offset);
+  TFILEContentInfo_GetUploadInt64(self, "uploadLength", &length);
+  if (offset < 0) {
+    LOG_ERROR("\"uploadOffset\" must not be negative.");
+    return SSE_E_INVAL;
+  }
+  TFILEUploader_SetRange(in_uploader, offset, (length < 0) ? FILE_SOURCE_TO_END : (sse_uint64)length);
+
+  err = TFILEContentInfo_GetUploadTime(self, "uploadSince", &since);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  err = TFILEContentInfo_GetUploadTime(self, "uploadUntil", &until);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  TFILEUploader_SetTimeRange(in_uploader, since, until);
+  return SSE_E_OK;
+}
+
 sse_int
 ContentInfo_upload(Moat in_moat,
                    sse_char *in_uid,
@@ -392,6 +945,10 @@ ContentInfo_upload(Moat in_moat,
   TFILEUploader *uploader;
   MoatValue *src_file_path;
   MoatValue *dst_url;
+  MoatValue *incremental;
+  MoatValue *force;
+  MoatValue *sparse;
+  sse_bool b;
   TFILEContentInfo *self = (TFILEContentInfo*)in_model_context;
 
   ASSERT(in_moat);
@@ -401,6 +958,8 @@ ContentInfo_upload(Moat in_moat,
   uploader = FILEUploader_New(in_uid, in_key);
   ASSERT(uploader);
   TFILEUploader_SetOnCompleteCallback(uploader, FILEContentInfo_OnUploadCompleteCallback, self);
+  TFILEUploader_SetPriority(uploader, &self->fPriority);
+  TFILEUploader_SetWorkerPool(uploader, self->fWorkers);
 
   /* Get the source file path and distination URL. */
   err = TFILEContentInfo_GetUploadUrl(self, &src_file_path, &dst_url);
@@ -413,13 +972,31 @@ ContentInfo_upload(Moat in_moat,
   LOG_DEBUG("Destination URL=...");
   MOAT_VALUE_DUMP_DEBUG(TAG, dst_url);
 
-  err = TFILEUploader_SetResourcePath(uploader, src_file_path, dst_url);
+  err = TFILEUploader_SetResourcePath(uploader, src_file_path, dst_url, &self->fFilesysInfo);
   moat_value_free(src_file_path);
   moat_value_free(dst_url);
   if (err != SSE_E_OK) {
     LOG_ERROR("TFILEUploader_SetResourcePath() has been failed with [%s].", sse_get_error_string(err));
     return err;
   }
+  TFILEUploader_SetCompression(uploader, moat_object_get_value(self->fObject, "uploadCompression"));
+  incremental = moat_object_get_value(self->fObject, "uploadIncremental");
+  if (incremental && moat_value_get_boolean(incremental, &b) == SSE_E_OK) {
+    TFILEUploader_SetIncremental(uploader, b);
+  }
+  force = moat_object_get_value(self->fObject, "uploadForce");
+  if (force && moat_value_get_boolean(force, &b) == SSE_E_OK) {
+    TFILEUploader_SetForce(uploader, b);
+  }
+  sparse = moat_object_get_value(self->fObject, "uploadSparse");
+  if (sparse && moat_value_get_boolean(sparse, &b) == SSE_E_OK) {
+    TFILEUploader_SetSparse(uploader, b);
+  }
+  err = TFILEContentInfo_SetUploadRange(self, uploader);
+  if (err != SSE_E_OK) {
+    TFILEUploader_Delete(uploader);
+    return err;
+  }
 
   err = moat_start_async_command(in_moat, in_uid, in_key, in_data, FILEContent_UploadFileAsync, uploader);
   if (err != SSE_E_OK) {
@@ -0,0 +1,157 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+#define FILE_COPY_COPY_SIZE       (8192)
+#define FILE_COPY_COPY_RANGE_SIZE (1024 * 1024)
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+sse_int
+FILECopy_CloneFile(const sse_char *in_src,
+                   const sse_char *in_dst)
+{
+  int src_fd;
+  int dst_fd;
+  struct stat st;
+  ssize_t len;
+  sse_byte buf[FILE_COPY_COPY_SIZE];
+  ssize_t written;
+  ssize_t n;
+  sse_int err = SSE_E_OK;
+  sse_bool use_copy_range = sse_true;
+
+  src_fd = open(in_src, O_RDONLY);
+  if (src_fd < 0) {
+    LOG_ERROR("open(%s) has been failed with [%s].", in_src, strerror(errno));
+    return (errno == ENOENT) ? SSE_E_NOENT : (errno == EACCES) ? SSE_E_ACCES : SSE_E_GENERIC;
+  }
+  if (fstat(src_fd, &st) != 0) {
+    LOG_ERROR("fstat(%s) has been failed with [%s].", in_src, strerror(errno));
+    close(src_fd);
+    return SSE_E_GENERIC;
+  }
+  unlink(in_dst);
+  dst_fd = open(in_dst, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777);
+  if (dst_fd < 0) {
+    LOG_ERROR("open(%s) has been failed with [%s].", in_dst, strerror(errno));
+    close(src_fd);
+    return (errno == EACCES) ? SSE_E_ACCES : SSE_E_GENERIC;
+  }
+  if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+    LOG_DEBUG("[%s] has been cloned to [%s].", in_src, in_dst);
+    goto done;
+  }
+  close(dst_fd);
+  unlink(in_dst);
+  if (link(in_src, in_dst) == 0) {
+    LOG_DEBUG("[%s] has been linked to [%s].", in_src, in_dst);
+    close(src_fd);
+    return SSE_E_OK;
+  }
+  dst_fd = open(in_dst, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777);
+  if (dst_fd < 0) {
+    LOG_ERROR("open(%s) has been failed with [%s].", in_dst, strerror(errno));
+    close(src_fd);
+    return (errno == EACCES) ? SSE_E_ACCES : SSE_E_GENERIC;
+  }
+  for (;;) {
+    if (use_copy_range) {
+      len = copy_file_range(src_fd, NULL, dst_fd, NULL, FILE_COPY_COPY_RANGE_SIZE, 0);
+      if (len < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+        use_copy_range = sse_false;
+        continue;
+      }
+    } else {
+      len = read(src_fd, buf, sizeof(buf));
+      for (written = 0; len > 0 && written < len; written += n) {
+        n = write(dst_fd, buf + written, len - written);
+        if (n < 0) {
+          len = -1;
+          break;
+        }
+      }
+    }
+    if (len < 0) {
+      LOG_ERROR("Copying [%s] to [%s] has been failed with [%s].", in_src, in_dst, strerror(errno));
+      err = (errno == ENOSPC) ? SSE_E_NOMEM : SSE_E_GENERIC;
+      break;
+    }
+    if (len == 0) {
+      break;
+    }
+  }
+
+done:
+  close(src_fd);
+  if (close(dst_fd) != 0 && err == SSE_E_OK) {
+    LOG_ERROR("close(%s) has been failed with [%s].", in_dst, strerror(errno));
+    err = SSE_E_GENERIC;
+  }
+  if (err != SSE_E_OK) {
+    unlink(in_dst);
+  }
+  return err;
+}
+
+sse_int
+FILECopy_MoveFile(const sse_char *in_src,
+                  const sse_char *in_dst)
+{
+  sse_int err;
+
+  if (rename(in_src, in_dst) == 0) {
+    return SSE_E_OK;
+  }
+  if (errno != EXDEV) {
+    LOG_ERROR("rename(%s, %s) has been failed with [%s].", in_src, in_dst, strerror(errno));
+    return (errno == ENOENT) ? SSE_E_NOENT : (errno == EACCES) ? SSE_E_ACCES : (errno == ENOSPC) ? SSE_E_NOMEM : SSE_E_GENERIC;
+  }
+  err = FILECopy_CloneFile(in_src, in_dst);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  if (unlink(in_src) != 0) {
+    LOG_WARN("unlink(%s) has been failed with [%s].", in_src, strerror(errno));
+  }
+  return SSE_E_OK;
+}
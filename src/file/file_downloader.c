@@ -16,6 +16,13 @@
  * http://www.yourinventit.com/
  */
 
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <servicesync/moat.h>
 #include <sseutils.h>
 #include <file/file.h>
@@ -30,19 +37,27 @@
 #define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
 
 static void TFILEDownloader_DoPreAction(TFILEDownloader *self);
+static void TFILEDownloader_DoNextPreAction(TFILEDownloader *self);
 static void FILEDownloader_DoPreActionOnCompletedCallback(TSseUtilShellCommand* self, sse_pointer in_user_data, sse_int in_result);
 static void FILEDownloader_DoPreActionOnReadCallback(TSseUtilShellCommand* self, sse_pointer in_user_data);
 static void FILEDownloader_DoPreActionOnErrorCallback(TSseUtilShellCommand* self, sse_pointer in_user_data, sse_int in_error_code, const sse_char* in_message);
 static void TFILEDownloader_DoDownload(TFILEDownloader *self);
+static void TFILEDownloader_StartItems(TFILEDownloader *self);
+static sse_int TFILEDownloader_StartItem(TFILEDownloader *self, TFILEDownloadItem *in_item);
+static void TFILEDownloader_OnItemFinished(TFILEDownloader *self, TFILEDownloadItem *in_item);
 static void FILEDownloader_OnDownloadCompletionCallback(MoatDownloader *in_dl, sse_bool in_canceled, sse_pointer in_user_data);
+static void FILEDownloader_OnWriterCompleteCallback(TFILEBlockDevWriter *in_writer, const sse_char *in_err_code, const sse_char *in_err_msg, sse_pointer in_user_data);
 static void FILEDownlaoder_OnDownloadErrorCallback(MoatDownloader *in_dl, sse_int in_err_code, sse_pointer in_user_data);
 static void TFILEDownloader_DoCopy(TFILEDownloader *self);
+static sse_char* FILEDownloader_GetPathWithSuffix(MoatValue *in_path, const sse_char *in_suffix);
 static void TFILEDownloader_DoPostAction(TFILEDownloader *self);
+static void TFILEDownloader_DoNextPostAction(TFILEDownloader *self);
 static void FILEDownloader_DoPostActionOnCompletedCallback(TSseUtilShellCommand* self, sse_pointer in_user_data, sse_int in_result);
 static void FILEDownloader_DoPostActionOnReadCallback(TSseUtilShellCommand* self, sse_pointer in_user_data);
 static void FILEDownloader_DoPostActionOnErrorCallback(TSseUtilShellCommand* self, sse_pointer in_user_data, sse_int in_error_code, const sse_char* in_message);
 static void TFILEDownloader_CallOnCompleteCallback(TFILEDownloader *self);
 static sse_int TFILEDownloader_StoreResultCode(TFILEDownloader *self, const sse_char *in_err_code, const sse_char *in_err_msg, sse_bool in_overwrite);
+static sse_int TFILEDownloader_StoreItemResultCode(TFILEDownloader *self, TFILEDownloadItem *in_item, const sse_char *in_err_code, const sse_char *in_err_msg);
 
 /*
  * Do pre-action
@@ -50,17 +65,37 @@ static sse_int TFILEDownloader_StoreResultCode(TFILEDownloader *self, const sse_
 
 static void
 TFILEDownloader_DoPreAction(TFILEDownloader *self)
+{
+  LOG_DEBUG("Enter: self=[%p]", self);
+  ASSERT(self);
+
+  self->fState = FILE_DOWNLOADER_STATE_PREACTION;
+  self->fActionIndex = 0;
+  self->fPreActionDone = 0;
+  TFILEDownloader_DoNextPreAction(self);
+}
+
+static void
+TFILEDownloader_DoNextPreAction(TFILEDownloader *self)
 {
   sse_int err;
-  MoatValue *preaction;
+  MoatValue *preaction = NULL;
+  TSseUtilShellCommand *command;
   sse_char *str;
   sse_uint len;
   sse_char *cmd;
 
-  LOG_DEBUG("Enter: self=[%p]", self);
+  LOG_DEBUG("Enter: self=[%p], index=[%d]", self, self->fActionIndex);
   ASSERT(self);
 
-  preaction = TFILEFilesysInfo_GetPreAction(self->fFilesysInfo);
+  while (self->fActionIndex < self->fFilesysInfoCount) {
+    preaction = TFILEFilesysInfo_GetPreAction(self->fFilesysInfos[self->fActionIndex]);
+    if (preaction) {
+      break;
+    }
+    self->fActionIndex++;
+    self->fPreActionDone = self->fActionIndex;
+  }
   if (preaction == NULL) {
       LOG_DEBUG("No pre-action. so download the file.");
       TFILEDownloader_DoDownload(self);
@@ -71,43 +106,47 @@ TFILEDownloader_DoPreAction(TFILEDownloader *self)
   if (err != SSE_E_OK) {
     LOG_ERROR("moat_value_get_string() has been failed with [%s].", sse_get_error_string(err));
     TFILEDownloader_StoreResultCode(self, FILE_ERROR_CONF, "Invalid pre-action script configuration.", sse_false);
+    TFILEDownloader_DoPostAction(self);
     return;
   }
   cmd = sse_strndup(str, len);
   ASSERT(cmd);
 
   LOG_INFO("Execute pre-action=[%s].", cmd);
-  self->fPreAction = SseUtilShellCommand_New();
-  ASSERT(self->fPreAction);
+  command = SseUtilShellCommand_New();
+  ASSERT(command);
   
-  err = TSseUtilShellCommand_SetShellCommand(self->fPreAction, cmd);
+  err = TSseUtilShellCommand_SetShellCommand(command, cmd);
   sse_free(cmd);
   if (err != SSE_E_OK) {
     LOG_ERROR("TSseUtilShellCommand_SetShellCommand() has been failed with [%s].", sse_get_error_string(err));
-    TSseUtilShellCommand_Delete(self->fPreAction);
-    self->fPreAction = NULL;
+    TSseUtilShellCommand_Delete(command);
     TFILEDownloader_StoreResultCode(self, FILE_ERROR_EXEC, "Executing pre-action script has been failed.", sse_false);
+    TFILEDownloader_DoPostAction(self);
     return;
   }
 
-  TSseUtilShellCommand_SetOnComplatedCallback(self->fPreAction,
+  TSseUtilShellCommand_SetOnComplatedCallback(command,
                                               FILEDownloader_DoPreActionOnCompletedCallback,
                                               self);
-  TSseUtilShellCommand_SetOnReadCallback(self->fPreAction,
+  TSseUtilShellCommand_SetOnReadCallback(command,
                                          FILEDownloader_DoPreActionOnReadCallback,
                                          self);
-  TSseUtilShellCommand_SetOnErrorCallback(self->fPreAction,
+  TSseUtilShellCommand_SetOnErrorCallback(command,
                                           FILEDownloader_DoPreActionOnErrorCallback,
                                           self);
 
-  err = TSseUtilShellCommand_Execute(self->fPreAction);
+  FILEPriority_BeginFork();
+  err = TSseUtilShellCommand_Execute(command);
+  FILEPriority_EndFork();
   if (err != SSE_E_OK) {
     LOG_ERROR("TSseUtilShellCommand_Execute() has been failed with [%s].", sse_get_error_string(err));
-    TSseUtilShellCommand_Delete(self->fPreAction);
-    self->fPreAction = NULL;
+    TSseUtilShellCommand_Delete(command);
     TFILEDownloader_StoreResultCode(self, FILE_ERROR_EXEC, "Executing pre-action script has been failed.", sse_true);
+    TFILEDownloader_DoPostAction(self);
     return;
   }
+  self->fPreActions[self->fActionIndex] = command;
 
   return;
 }
@@ -123,11 +162,20 @@ FILEDownloader_DoPreActionOnCompletedCallback(TSseUtilShellCommand* self,
   if (in_result != SSE_E_OK) {
     LOG_ERROR("Pre-action(%s) has been failed with [%s].", self->fShellCommand, sse_get_error_string(in_result));
     TFILEDownloader_StoreResultCode(downloader, FILE_ERROR_EXEC, "Executing pre-action script has been failed.", sse_true);
+    TFILEDownloader_DoPostAction(downloader);
+    return;
+  }
+
+  downloader->fActionIndex++;
+  downloader->fPreActionDone = downloader->fActionIndex;
+  if (downloader->fState == FILE_DOWNLOADER_STATE_DISCARDED) {
+    LOG_INFO("Pre-action(%s) has been completed, but the prefetch has been discarded.", self->fShellCommand);
+    TFILEDownloader_DoPostAction(downloader);
     return;
   }
 
   LOG_INFO("Pre-action(%s) has been completed successfully.", self->fShellCommand);
-  TFILEDownloader_DoDownload(downloader);
+  TFILEDownloader_DoNextPreAction(downloader);
 }
 
 static void
@@ -164,137 +212,413 @@ FILEDownloader_DoPreActionOnErrorCallback(TSseUtilShellCommand* self,
 
   LOG_ERROR("TSseUtilShellCommand_ReadLine() has been failed with [%s], message=[%s].", sse_get_error_string(in_error_code), in_message);
   TFILEDownloader_StoreResultCode(downloader, FILE_ERROR_EXEC, "Executing pre-action script has been failed.", sse_false);
-  TFILEDownloader_CallOnCompleteCallback(downloader);
+  TFILEDownloader_DoPostAction(downloader);
 }
 
 /*
  * Do download
  */
 
-static void
-TFILEDownloader_DoDownload(TFILEDownloader *self)
+static sse_int
+TFILEDownloader_PrepareTmpFilePath(TFILEDownloader *self,
+                                   TFILEDownloadItem *in_item)
 {
   sse_int err;
   sse_char *str;
   sse_uint len;
   MoatValue *dl_dir;
   MoatValue *basename = NULL;
-  SSEString *path = NULL;
-  sse_char src_url[1024];
-  sse_char dst_path[1024];
+  sse_char *dir;
+  sse_uint dir_len;
+  sse_char *path;
+  sse_size path_len;
+  sse_char suffix[32];
+
+  /* Get the directory path for download, then tests an accessability to store temporary file. */
+  dl_dir = TFILEFilesysInfo_GetTmpDir(in_item->fFilesysInfo);
+  if (dl_dir) {
+    dl_dir = moat_value_clone(dl_dir);
+    ASSERT(dl_dir);
+  } else if (in_item->fStore) {
+    /* Never download into the current version directory. */
+    dl_dir = moat_value_new_string(in_item->fStore->fVersionsDir, 0, sse_true);
+    ASSERT(dl_dir);
+  } else {
+    err = SseUtilFile_GetDirectoryPath(in_item->fFilePath, &dl_dir);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("SseUtilFile_GetDirectoryPath() has been failed with [%s].", sse_get_error_string(err));
+      dl_dir = moat_value_new_string("/tmp", 0, sse_true);
+      ASSERT(dl_dir);
+    }
+  }
+
+  /* Create a download dir if any. */
+  if (!SseUtilFile_IsDirectory(dl_dir)) {
+    err = SseUtilFile_MakeDirectory(dl_dir);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("SseUtilFile_MakeDirectory() has been failed with [%s].", sse_get_error_string(err));
+      moat_value_free(dl_dir);
+      dl_dir = moat_value_new_string("/tmp", 0, sse_true);
+      ASSERT(dl_dir);
+    }
+  }
+  err = moat_value_get_string(dl_dir, &dir, &dir_len);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("moat_value_get_string() has been failed with [%s].", sse_get_error_string(err));
+    dir = "/tmp";
+    dir_len = sse_strlen(dir);
+  }
+
+  /* Create a tentative destination file path, ${DOWNLOAD_DIR}/${ORIGIN_FILENAME}[.${INDEX}].part */
+  err = SseUtilFile_GetFileName(in_item->fFilePath, &basename);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("SseUtilFile_GetFileName() has been failed with [%s].", sse_get_error_string(err));
+    MOAT_VALUE_DUMP_ERROR(TAG, in_item->fFilePath);
+    moat_value_free(dl_dir);
+    return SSE_E_INVAL;
+  }
+  if (self->fItemCount > 1) {
+    snprintf(suffix, sizeof(suffix), ".%u.part", in_item->fIndex);
+  } else {
+    snprintf(suffix, sizeof(suffix), ".part");
+  }
+
+  err = moat_value_get_string(basename, &str, &len);   ASSERT(err == SSE_E_OK);
+  path = TFILEArena_Printf(&self->fArena, &path_len, "%.*s/%.*s%s", (int)dir_len, dir, (int)len, str, suffix);
+  moat_value_free(basename);
+  moat_value_free(dl_dir);
+
+  in_item->fTmpFilePath = moat_value_new_string(path, path_len, sse_true);
+  ASSERT(in_item->fTmpFilePath);
+  return SSE_E_OK;
+}
 
+static void
+TFILEDownloader_DoDownload(TFILEDownloader *self)
+{
   LOG_DEBUG("Enter: self=[%p]", self);
   ASSERT(self);
 
-  if ((self->fUrl == NULL) || (self->fFilePath == NULL)) {
-    LOG_ERROR("Source URL or local file path does not specifiled, source=[%p], destination=[%p].", self->fUrl, self->fFilePath);
+  self->fState = FILE_DOWNLOADER_STATE_DOWNLOADING;
+  if (self->fRollbackStore) {
+    LOG_DEBUG("Nothing to download for rollback.");
+    TFILEDownloader_DoCopy(self);
+    return;
+  }
+  if (self->fItemCount == 0) {
+    LOG_ERROR("Source URL or local file path does not specifiled.");
     TFILEDownloader_StoreResultCode(self, FILE_ERROR_INVAL, "Source URL or local file path does not specifiled.", sse_false);
     TFILEDownloader_DoPostAction(self);
-    goto error_exit;
+    return;
   }
 
-  /* Get the source URL */
-  err = moat_value_get_string(self->fUrl, &str, &len);
-  if (err != SSE_E_OK) {
-    LOG_ERROR("moat_value_get_string() has been failed with [%s].", sse_get_error_string(err));
-    TFILEDownloader_StoreResultCode(self, FILE_ERROR_INVAL, "Could not find the source URL.", sse_false);
+  self->fNextItem = 0;
+  self->fActiveItems = 0;
+  TFILEDownloader_StartItems(self);
+  if (self->fActiveItems == 0) {
+    /* Nothing has been started. */
+    TFILEDownloader_DeleteTmpFiles(self);
     TFILEDownloader_DoPostAction(self);
-    goto error_exit;
   }
-  if (len > sizeof(src_url)) {
-    LOG_ERROR("Too long source URL (%d).", len);
-    TFILEDownloader_StoreResultCode(self, FILE_ERROR_INVAL, "Too long source URL.", sse_false);
-    TFILEDownloader_DoPostAction(self);
-    goto error_exit;
-  }
-  sse_strncpy(src_url, str, len);
-  src_url[len] = '\0';
-
+}
 
-  /* Get the directory path for download, then tests an accessability to store temporary file. */
-  dl_dir = TFILEFilesysInfo_GetTmpDir(self->fFilesysInfo);
-  if (dl_dir == NULL) {
-    err = SseUtilFile_GetDirectoryPath(self->fFilePath, &dl_dir);
-    if (err != SSE_E_OK) {
-      LOG_ERROR("SseUtilFile_GetDirectoryPath() has been failed with [%s].", sse_get_error_string(err));
-      dl_dir = moat_value_new_string("/tmp", 0, sse_true);
-      ASSERT(dl_dir);
+static void
+TFILEDownloader_StartItems(TFILEDownloader *self)
+{
+  TFILEDownloadItem *item;
+
+  while ((self->fResultCode == NULL) &&
+         (self->fActiveItems < self->fConcurrency) &&
+         (self->fNextItem < self->fItemCount)) {
+    item = self->fItems[self->fNextItem++];
+    if (item->fSource) {
+      /* Copied from the source item after downloading. */
+      continue;
+    }
+    self->fActiveItems++;
+    if (TFILEDownloader_StartItem(self, item) != SSE_E_OK) {
+      item->fState = FILE_DOWNLOAD_ITEM_STATE_FAILED;
+      self->fActiveItems--;
     }
   }
+}
 
-  /* Create a download dir if any. */
-  if (SseUtilFile_IsDirectory(dl_dir)) {
-    err = moat_value_get_string(dl_dir, &str, &len);
-    if (err == SSE_E_OK) {
-      path = sse_string_new_with_length(str, len);
-      ASSERT(path);
-    } else {
-      LOG_ERROR("moat_value_get_string() has been failed with [%s].", sse_get_error_string(err));
-      path = sse_string_new("/tmp");
-      ASSERT(path);
+/*
+ * Stream the image into the block device, nothing is downloaded into a temporary file.
+ * Or write the temporary file in_tmp_path through the write buffer, it is verified as downloaded by MoatDownloader.
+ */
+static sse_int
+TFILEDownloader_StartWriter(TFILEDownloader *self,
+                            TFILEDownloadItem *in_item,
+                            const sse_char *in_url,
+                            const sse_char *in_tmp_path)
+{
+  sse_int err;
+  sse_char *str;
+  sse_uint len;
+  sse_char *device;
+  int fd;
+
+  if (in_item->fWriter) {
+    TFILEBlockDevWriter_Delete(in_item->fWriter);
+    in_item->fWriter = NULL;
+  }
+  if (in_tmp_path) {
+    /* The writer never creates a file, not to make a regular file for a missing device. */
+    fd = open(in_tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      LOG_ERROR("open(%s) has been failed with [%s].", in_tmp_path, strerror(errno));
+      TFILEDownloader_StoreItemResultCode(self, in_item, FILE_ERROR_DOWNLOAD, "File download failure.");
+      return SSE_E_GENERIC;
     }
+    close(fd);
+    in_item->fWriter = FILEBlockDevWriter_New(in_url, in_tmp_path,
+                                              TFILEFilesysInfo_GetEraseBlockSize(in_item->fFilesysInfo),
+                                              sse_false);
+    ASSERT(in_item->fWriter);
+    TFILEBlockDevWriter_SetWriteBufferSize(in_item->fWriter, TFILEFilesysInfo_GetWriteBufferSize(in_item->fFilesysInfo));
+    TFILEBlockDevWriter_SetOnCompleteCallback(in_item->fWriter, FILEDownloader_OnWriterCompleteCallback, in_item);
   } else {
-    err = SseUtilFile_MakeDirectory(dl_dir);
-    if (err == SSE_E_OK) {
-      err = moat_value_get_string(dl_dir, &str, &len);
-      if (err == SSE_E_OK) {
-        path = sse_string_new_with_length(str, len);
-        ASSERT(path);
-      } else {
-        LOG_ERROR("moat_value_get_string() has been failed with [%s].", sse_get_error_string(err));
-        path = sse_string_new("/tmp");
-        ASSERT(path);
-      }
-    } else {
-      LOG_ERROR("SseUtilFile_MakeDirectory() has been failed with [%s].", sse_get_error_string(err));
-      path = sse_string_new("/tmp");
-      ASSERT(path);
+    if (self->fSparse) {
+      LOG_ERROR("A sparse image cannot be streamed into a block device.");
+      TFILEDownloader_StoreItemResultCode(self, in_item, FILE_ERROR_CONF, "Sparse image cannot be delivered to block device.");
+      return SSE_E_INVAL;
+    }
+    err = moat_value_get_string(in_item->fFilePath, &str, &len);
+    ASSERT(err == SSE_E_OK);
+    device = sse_strndup(str, len);
+    ASSERT(device);
+    in_item->fWriter = FILEBlockDevWriter_New(in_url, device,
+                                              TFILEFilesysInfo_GetEraseBlockSize(in_item->fFilesysInfo),
+                                              TFILEFilesysInfo_IsDirectIoEnabled(in_item->fFilesysInfo));
+    ASSERT(in_item->fWriter);
+    sse_free(device);
+    TFILEBlockDevWriter_SetOnCompleteCallback(in_item->fWriter, FILEDownloader_OnWriterCompleteCallback, in_item);
+    err = TFILEBlockDevWriter_SetExpected(in_item->fWriter, in_item->fSize, in_item->fHash);
+    if (err != SSE_E_OK) {
+      TFILEDownloader_StoreItemResultCode(self, in_item, FILE_ERROR_VERIFY, "File hash mismatch.");
+      return err;
     }
   }
+  TFILEBlockDevWriter_SetDropCache(in_item->fWriter, TFILEFilesysInfo_IsFadviseEnabled(in_item->fFilesysInfo));
+  TFILEBlockDevWriter_SetWorkerPool(in_item->fWriter, self->fWorkers);
+  in_item->fState = FILE_DOWNLOAD_ITEM_STATE_DOWNLOADING;
+  err = TFILEBlockDevWriter_Start(in_item->fWriter);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("TFILEBlockDevWriter_Start() has been failed with [%s].", sse_get_error_string(err));
+    TFILEDownloader_StoreItemResultCode(self, in_item, FILE_ERROR_DOWNLOAD, "File download failure.");
+    return err;
+  }
+  return SSE_E_OK;
+}
 
-  /* Create a tentative destination file path, ${DOWNLOAD_DIR}/${ORIGIN_FILENAME}.part.*/
-  err = SseUtilFile_GetFileName(self->fFilePath, &basename);
+static sse_int
+TFILEDownloader_StartItem(TFILEDownloader *self,
+                          TFILEDownloadItem *in_item)
+{
+  sse_int err;
+  sse_char *str;
+  sse_uint len;
+  sse_char *src_url;
+  sse_char *dst_path;
+
+  /* Get the source URL */
+  err = moat_value_get_string(in_item->fUrl, &str, &len);
   if (err != SSE_E_OK) {
-    LOG_ERROR("SseUtilFile_GetFileName() has been failed with [%s].", sse_get_error_string(err));
-    MOAT_VALUE_DUMP_ERROR(TAG, self->fFilePath);
-    TFILEDownloader_StoreResultCode(self, FILE_ERROR_INVAL, "Could not find a destination file name.", sse_false);
-    TFILEDownloader_DoPostAction(self);
-    goto error_exit;
+    LOG_ERROR("moat_value_get_string() has been failed with [%s].", sse_get_error_string(err));
+    TFILEDownloader_StoreItemResultCode(self, in_item, FILE_ERROR_INVAL, "Could not find the source URL.");
+    return err;
+  }
+  src_url = sse_strndup(str, len);
+  ASSERT(src_url);
+  if (in_item->fDevice) {
+    err = TFILEDownloader_StartWriter(self, in_item, src_url, NULL);
+    sse_free(src_url);
+    return err;
   }
 
-  err = sse_string_concat_cstr(path, "/");             ASSERT(err == SSE_E_OK);
-  err = moat_value_get_string(basename, &str, &len);   ASSERT(err == SSE_E_OK);
-  err = sse_string_concat_with_length(path, str, len); ASSERT(err == SSE_E_OK);
-  err = sse_string_concat_cstr(path, ".part");         ASSERT(err == SSE_E_OK);
-  if (sse_string_get_length(path) > sizeof(dst_path)) {
-    LOG_ERROR("Too long destination file path (len=%d).", sse_string_get_length(path));
-    TFILEDownloader_StoreResultCode(self, FILE_ERROR_INVAL, "Too long destination file name.", sse_false);
-    goto error_exit;
-  }
-  sse_strncpy(dst_path, sse_string_get_cstr(path), sse_string_get_length(path));
-  dst_path[sse_string_get_length(path)] = '\0';
-  self->fTmpFilePath = moat_value_new_string(dst_path, 0, sse_true);
-  ASSERT(self->fTmpFilePath);
+  err = TFILEDownloader_PrepareTmpFilePath(self, in_item);
+  if (err != SSE_E_OK) {
+    TFILEDownloader_StoreItemResultCode(self, in_item, FILE_ERROR_INVAL, "Could not find a destination file name.");
+    sse_free(src_url);
+    return err;
+  }
+  err = moat_value_get_string(in_item->fTmpFilePath, &str, &len);
+  ASSERT(err == SSE_E_OK);
+  dst_path = sse_strndup(str, len);
+  ASSERT(dst_path);
+  if (TFILEFilesysInfo_GetWriteBufferSize(in_item->fFilesysInfo) > 0) {
+    LOG_INFO("Download the file through the write buffer, source=[%s] to local=[%s].", src_url, dst_path);
+    err = TFILEDownloader_StartWriter(self, in_item, src_url, dst_path);
+    sse_free(src_url);
+    sse_free(dst_path);
+    return err;
+  }
+
+  if (in_item->fDownloader == NULL) {
+    in_item->fDownloader = moat_downloader_new();
+    ASSERT(in_item->fDownloader);
+    moat_downloader_set_callbacks(in_item->fDownloader,
+                                  FILEDownloader_OnDownloadCompletionCallback,
+                                  FILEDownlaoder_OnDownloadErrorCallback,
+                                  in_item);
+  }
 
   /* Download the file from web storage. */
   LOG_INFO("Download the file, source=[%s] to local=[%s].", src_url, dst_path);
-  err = moat_downloader_download(self->fDownloader, src_url, sse_strlen(src_url), dst_path);
+  in_item->fState = FILE_DOWNLOAD_ITEM_STATE_DOWNLOADING;
+  err = moat_downloader_download(in_item->fDownloader, src_url, sse_strlen(src_url), dst_path);
+  sse_free(src_url);
+  sse_free(dst_path);
   if (err != SSE_E_OK) {
     LOG_ERROR("moat_downloader_download() has been failed with [%s].", sse_get_error_string(err));
-    TFILEDownloader_StoreResultCode(self, FILE_ERROR_DOWNLOAD, "File download failure.", sse_false);
-    TFILEDownloader_DoPostAction(self);
-    goto error_exit;
+    TFILEDownloader_StoreItemResultCode(self, in_item, FILE_ERROR_DOWNLOAD, "File download failure.");
+    return err;
   }
+  return SSE_E_OK;
+}
 
-  moat_value_free(dl_dir);
-  moat_value_free(basename);
-  sse_string_free(path, sse_true);
-  return;
+/*
+ * Verification of a downloaded file, run on a worker thread. The job holds copies of what it
+ * needs, so it does not touch the item which may be discarded meanwhile.
+ */
+struct FILEDownloadVerifyJob_ {
+  TFILEDownloadItem *fItem;
+  sse_char *fPath;                         /** Temporary file */
+  sse_bool fSparse;                        /** Expand the sparse image before verifying */
+  sse_int64 fSize;                         /** Expected file size, -1 if not specified */
+  sse_int fHashAlgo;                       /** FILEHashAlgorithm_ of fHash */
+  sse_char *fHash;                         /** Expected hash in hex, NULL if not specified */
+  sse_uint fHashLen;
+  sse_bool fDropCache;                     /** Drop the file from the page cache once verified */
+  const sse_char *fErrCode;                /** Result, NULL if verified */
+  const sse_char *fErrMsg;
+};
+typedef struct FILEDownloadVerifyJob_ FILEDownloadVerifyJob;
 
- error_exit:
-  if (dl_dir)   moat_value_free(dl_dir);
-  if (basename) moat_value_free(basename);
-  if (path)     sse_string_free(path, sse_true);
+static void
+FILEDownloader_VerifyWork(sse_pointer in_user_data)
+{
+  FILEDownloadVerifyJob *job = (FILEDownloadVerifyJob *)in_user_data;
+  struct stat st;
+  sse_int err;
+
+  if (job->fErrCode) {
+    return;
+  }
+  /* Replace the downloaded sparse image with the file it encodes. */
+  if (job->fSparse) {
+    err = FILESparse_Expand(job->fPath);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("FILESparse_Expand() has been failed with [%s].", sse_get_error_string(err));
+      job->fErrCode = FILE_ERROR_DOWNLOAD;
+      job->fErrMsg = "Expanding sparse image has been failed.";
+      return;
+    }
+  }
+  if (job->fSize >= 0) {
+    if (stat(job->fPath, &st) != 0) {
+      LOG_ERROR("stat(%s) has been failed with [%s].", job->fPath, strerror(errno));
+      job->fErrCode = FILE_ERROR_DOWNLOAD;
+      job->fErrMsg = "File download failure.";
+      return;
+    }
+    if ((sse_int64)st.st_size != job->fSize) {
+      LOG_ERROR("Size mismatch, path=[%s], expected=[%lld], actual=[%lld].", job->fPath, job->fSize, (sse_int64)st.st_size);
+      job->fErrCode = FILE_ERROR_VERIFY;
+      job->fErrMsg = "File size mismatch.";
+      return;
+    }
+  }
+  if (job->fHash && FILEHash_VerifyFile(job->fPath, job->fHashAlgo, job->fHash, job->fHashLen) != SSE_E_OK) {
+    job->fErrCode = FILE_ERROR_VERIFY;
+    job->fErrMsg = "File hash mismatch.";
+    return;
+  }
+  /* MoatDownloader writes through the page cache, drop the file once it has been written and verified. */
+  if (job->fDropCache) {
+    FILESource_DropCache(job->fPath, sse_true);
+  }
+}
+
+static void
+FILEDownloader_OnVerifyDone(sse_pointer in_user_data,
+                            sse_bool in_canceled)
+{
+  FILEDownloadVerifyJob *job = (FILEDownloadVerifyJob *)in_user_data;
+  TFILEDownloadItem *item = job->fItem;
+
+  if (!in_canceled) {
+    item->fJob = NULL;
+    if (job->fErrCode) {
+      item->fState = FILE_DOWNLOAD_ITEM_STATE_FAILED;
+      TFILEDownloader_StoreItemResultCode(item->fOwner, item, job->fErrCode, job->fErrMsg);
+    } else {
+      LOG_INFO("Download has been completed.");
+      item->fState = FILE_DOWNLOAD_ITEM_STATE_DOWNLOADED;
+    }
+    TFILEDownloader_OnItemFinished(item->fOwner, item);
+  } else {
+    /* Discarded, the file may have been expanded after the temporary files were deleted. */
+    unlink(job->fPath);
+  }
+  if (job->fHash) sse_free(job->fHash);
+  sse_free(job->fPath);
+  sse_free(job);
+}
+
+/* Expand and verify the downloaded file on a worker, then finish the item. */
+static void
+TFILEDownloader_VerifyItem(TFILEDownloader *self,
+                           TFILEDownloadItem *in_item,
+                           sse_bool in_drop_cache)
+{
+  FILEDownloadVerifyJob *job;
+  sse_char *hex;
+
+  job = sse_zeroalloc(sizeof(FILEDownloadVerifyJob));
+  ASSERT(job);
+  job->fItem = in_item;
+  job->fPath = FILEDownloader_GetPathWithSuffix(in_item->fTmpFilePath, "");
+  job->fSparse = self->fSparse;
+  job->fSize = in_item->fSize;
+  if (in_item->fHash) {
+    if (FILEHash_ParseHash(in_item->fHash, &job->fHashAlgo, &hex, &job->fHashLen) == SSE_E_OK) {
+      job->fHash = sse_strndup(hex, job->fHashLen);
+      ASSERT(job->fHash);
+    } else {
+      job->fErrCode = FILE_ERROR_VERIFY;
+      job->fErrMsg = "File hash mismatch.";
+    }
+  }
+  job->fDropCache = in_drop_cache && TFILEFilesysInfo_IsFadviseEnabled(in_item->fFilesysInfo);
+  in_item->fState = FILE_DOWNLOAD_ITEM_STATE_VERIFYING;
+  in_item->fJob = TFILEWorkerPool_Submit(self->fWorkers, FILEDownloader_VerifyWork, FILEDownloader_OnVerifyDone, job);
+}
+
+static void
+TFILEDownloader_OnItemFinished(TFILEDownloader *self,
+                               TFILEDownloadItem *in_item)
+{
+  ASSERT(self->fActiveItems > 0);
+  self->fActiveItems--;
+
+  TFILEDownloader_StartItems(self);
+  if (self->fActiveItems > 0) {
+    return;
+  }
+
+  if (self->fResultCode) {
+    LOG_ERROR("Downloading files has been failed.");
+    TFILEDownloader_DeleteTmpFiles(self);
+    TFILEDownloader_DoPostAction(self);
+  } else if (self->fPrefetch && (self->fKey == NULL)) {
+    LOG_INFO("Prefetch has been completed. Wait for the download command.");
+    self->fState = FILE_DOWNLOADER_STATE_FETCHED;
+  } else {
+    LOG_INFO("All files (%d) have been downloaded, %llu write calls.", self->fItemCount, (unsigned long long)self->fWriteCount);
+    TFILEDownloader_DoCopy(self);
+  }
 }
 
 static void
@@ -302,73 +626,576 @@ FILEDownloader_OnDownloadCompletionCallback(MoatDownloader *in_dl,
                                             sse_bool in_canceled,
                                             sse_pointer in_user_data)
 {
+  TFILEDownloadItem *item;
   TFILEDownloader *downloader;
 
-  downloader = (TFILEDownloader *)in_user_data;
+  item = (TFILEDownloadItem *)in_user_data;
+  ASSERT(item);
+  downloader = item->fOwner;
   ASSERT(downloader);
 
+  if (downloader->fState == FILE_DOWNLOADER_STATE_DISCARDED) {
+    LOG_DEBUG("The prefetch has been discarded.");
+    return;
+  }
   if (in_canceled) {
     LOG_INFO("Download has been canceled.");
-    TFILEDownloader_DoPostAction(downloader);
+    item->fState = FILE_DOWNLOAD_ITEM_STATE_FAILED;
+    TFILEDownloader_StoreItemResultCode(downloader, item, FILE_ERROR_DOWNLOAD, "File download has been canceled.");
+    TFILEDownloader_OnItemFinished(downloader, item);
   } else {
-    LOG_INFO("Download has been completed.");
-    TFILEDownloader_DoCopy(downloader);
+    TFILEDownloader_VerifyItem(downloader, item, sse_true);
   }
 
   return;
 }
 
+static void
+FILEDownloader_OnWriterCompleteCallback(TFILEBlockDevWriter *in_writer,
+                                        const sse_char *in_err_code,
+                                        const sse_char *in_err_msg,
+                                        sse_pointer in_user_data)
+{
+  TFILEDownloadItem *item;
+  TFILEDownloader *downloader;
+
+  item = (TFILEDownloadItem *)in_user_data;
+  ASSERT(item);
+  downloader = item->fOwner;
+  ASSERT(downloader);
+
+  downloader->fWriteCount += TFILEBlockDevWriter_GetWriteCount(in_writer);
+  if (sse_strcmp(in_err_code, FILE_ERROR_OK) != 0) {
+    item->fState = FILE_DOWNLOAD_ITEM_STATE_FAILED;
+    TFILEDownloader_StoreItemResultCode(downloader, item, in_err_code, in_err_msg);
+  } else {
+    LOG_INFO("The file has been written, %llu write calls.", (unsigned long long)TFILEBlockDevWriter_GetWriteCount(in_writer));
+    if (!item->fDevice) {
+      /* The writer has dropped the file from the page cache already. */
+      TFILEDownloader_VerifyItem(downloader, item, sse_false);
+      return;
+    }
+    item->fState = FILE_DOWNLOAD_ITEM_STATE_DOWNLOADED;
+  }
+  TFILEDownloader_OnItemFinished(downloader, item);
+}
+
 static void
 FILEDownlaoder_OnDownloadErrorCallback(MoatDownloader *in_dl,
                                        sse_int in_err_code,
                                        sse_pointer in_user_data)
 {
+  TFILEDownloadItem *item;
   TFILEDownloader *downloader;
 
-  downloader = (TFILEDownloader *)in_user_data;
+  item = (TFILEDownloadItem *)in_user_data;
+  ASSERT(item);
+  downloader = item->fOwner;
   ASSERT(downloader);
 
+  if (downloader->fState == FILE_DOWNLOADER_STATE_DISCARDED) {
+    LOG_DEBUG("The prefetch has been discarded.");
+    return;
+  }
   LOG_ERROR("Download has been failed with [%d].", in_err_code);
-  MOAT_VALUE_DUMP_ERROR(TAG, downloader->fUrl);
-  MOAT_VALUE_DUMP_ERROR(TAG, downloader->fFilePath);
+  MOAT_VALUE_DUMP_ERROR(TAG, item->fUrl);
+  MOAT_VALUE_DUMP_ERROR(TAG, item->fFilePath);
+
+  item->fState = FILE_DOWNLOAD_ITEM_STATE_FAILED;
+  TFILEDownloader_StoreItemResultCode(downloader, item, FILE_ERROR_DOWNLOAD, "File download failure.");
+  TFILEDownloader_OnItemFinished(downloader, item);
+  return;
+}
+
+/*
+ * Do copy
+ */
+
+static sse_char*
+FILEDownloader_GetPathWithSuffix(MoatValue *in_path,
+                                 const sse_char *in_suffix)
+{
+  sse_int err;
+  sse_char *str;
+  sse_uint len;
+  sse_uint suffix_len;
+  sse_char *path;
+
+  err = moat_value_get_string(in_path, &str, &len);
+  ASSERT(err == SSE_E_OK);
+  suffix_len = sse_strlen(in_suffix);
+  path = sse_malloc(len + suffix_len + 1);
+  ASSERT(path);
+  sse_memcpy(path, str, len);
+  sse_memcpy(path + len, in_suffix, suffix_len);
+  path[len + suffix_len] = '\0';
+  return path;
+}
+
+static void
+TFILEDownloader_StoreMoveError(TFILEDownloader *self,
+                               TFILEDownloadItem *in_item,
+                               sse_int in_err)
+{
+  if (in_err == SSE_E_ACCES) {
+    TFILEDownloader_StoreItemResultCode(self, in_item, FILE_ERROR_ACCES, "Renaming file has been failed.");
+  } else if (in_err == SSE_E_NOMEM) {
+    TFILEDownloader_StoreItemResultCode(self, in_item, FILE_ERROR_NOMEM, "Renaming file has been failed.");
+  } else if (in_err == SSE_E_NOENT) {
+    TFILEDownloader_StoreItemResultCode(self, in_item, FILE_ERROR_NOENT, "Renaming file has been failed.");
+  } else {
+    TFILEDownloader_StoreItemResultCode(self, in_item, FILE_ERROR_RENAME, "Renaming file has been failed.");
+  }
+}
+
+/* Decide the temporary files of the items which share the source item. */
+static sse_int
+TFILEDownloader_PrepareFanOut(TFILEDownloader *self)
+{
+  sse_int err;
+  sse_uint i;
+  TFILEDownloadItem *item;
+
+  for (i = 0; i < self->fItemCount; i++) {
+    item = self->fItems[i];
+    if (item->fSource == NULL) {
+      continue;
+    }
+    err = TFILEDownloader_PrepareTmpFilePath(self, item);
+    if (err != SSE_E_OK) {
+      TFILEDownloader_StoreItemResultCode(self, item, FILE_ERROR_INVAL, "Could not find a destination file name.");
+      TFILEDownloader_DeleteTmpFiles(self);
+      return err;
+    }
+  }
+  return SSE_E_OK;
+}
+
+/*
+ * Copying the files in step 1 may take long, run it on a worker. The paths are taken out of the
+ * items on the event loop beforehand, so the worker only calls POSIX I/O and the version stores.
+ * The item states, the result codes and reverting the version stores are left to the event loop.
+ * The downloader is not deleted nor discarded while committing.
+ */
+struct FILEDownloadStageEntry_ {
+  TFILEDownloadItem *fItem;
+  sse_char *fCloneSrc;                     /** Temporary file of the source item to be copied, NULL if downloaded */
+  sse_char *fTmpFile;                      /** Temporary file */
+  sse_bool fDevice;                        /** Written already, not staged */
+  TFILEVersionStore *fStore;               /** Version store to put the file into, NULL to stage it as fNewFile */
+  sse_char *fNewFile;                      /** ${DESTINATION}.new, or the destination path under the link of fStore */
+  const sse_char *fRelPath;                /** Path relative to the link of fStore, points into fNewFile */
+};
+typedef struct FILEDownloadStageEntry_ FILEDownloadStageEntry;
+
+struct FILEDownloadStageJob_ {
+  TFILEDownloader *fOwner;
+  FILEDownloadStageEntry *fEntries;        /** One for each item */
+  sse_uint fCount;
+  sse_uint fFannedOut;                     /** Number of the entries walked by fanning out */
+  sse_bool fStaging;                       /** Fanning out has been done */
+  TFILEDownloadItem *fFailed;              /** Item which could not be copied, NULL if none */
+  sse_int fErr;
+};
+typedef struct FILEDownloadStageJob_ FILEDownloadStageJob;
+
+static FILEDownloadStageJob*
+TFILEDownloader_NewStageJob(TFILEDownloader *self)
+{
+  FILEDownloadStageJob *job;
+  FILEDownloadStageEntry *entry;
+  TFILEDownloadItem *item;
+  sse_uint i;
+
+  job = sse_zeroalloc(sizeof(FILEDownloadStageJob));
+  ASSERT(job);
+  job->fOwner = self;
+  job->fEntries = sse_zeroalloc(sizeof(FILEDownloadStageEntry) * (self->fItemCount + 1));
+  ASSERT(job->fEntries);
+  job->fCount = self->fItemCount;
+  for (i = 0; i < self->fItemCount; i++) {
+    item = self->fItems[i];
+    entry = &job->fEntries[i];
+    entry->fItem = item;
+    if (item->fSource) {
+      entry->fCloneSrc = FILEDownloader_GetPathWithSuffix(item->fSource->fTmpFilePath, "");
+    }
+    entry->fDevice = item->fDevice;
+    if (item->fDevice) {
+      entry->fTmpFile = (item->fSource) ? FILEDownloader_GetPathWithSuffix(item->fTmpFilePath, "") : NULL;
+      continue;
+    }
+    entry->fTmpFile = FILEDownloader_GetPathWithSuffix(item->fTmpFilePath, "");
+    entry->fStore = item->fStore;
+    if (item->fStore) {
+      entry->fNewFile = FILEDownloader_GetPathWithSuffix(item->fFilePath, "");
+      TFILEVersionStore_GetRelativePath(item->fStore, entry->fNewFile, &entry->fRelPath);
+    } else {
+      entry->fNewFile = FILEDownloader_GetPathWithSuffix(item->fFilePath, ".new");
+    }
+  }
+  return job;
+}
+
+static void
+FILEDownloadStageJob_Delete(FILEDownloadStageJob *self)
+{
+  sse_uint i;
+
+  for (i = 0; i < self->fCount; i++) {
+    if (self->fEntries[i].fCloneSrc) sse_free(self->fEntries[i].fCloneSrc);
+    if (self->fEntries[i].fTmpFile)  sse_free(self->fEntries[i].fTmpFile);
+    if (self->fEntries[i].fNewFile)  sse_free(self->fEntries[i].fNewFile);
+  }
+  sse_free(self->fEntries);
+  sse_free(self);
+}
+
+/* Copy the downloaded files for the items which share the source item. */
+static sse_int
+FILEDownloadStageJob_FanOut(FILEDownloadStageJob *self)
+{
+  FILEDownloadStageEntry *entry;
+  sse_int err;
+
+  for (self->fFannedOut = 0; self->fFannedOut < self->fCount; self->fFannedOut++) {
+    entry = &self->fEntries[self->fFannedOut];
+    if (entry->fCloneSrc == NULL) {
+      continue;
+    }
+    err = FILECopy_CloneFile(entry->fCloneSrc, entry->fTmpFile);
+    if (err != SSE_E_OK) {
+      self->fFailed = entry->fItem;
+      return err;
+    }
+  }
+  return SSE_E_OK;
+}
+
+/* Write back the versions staged, once for each store. */
+static sse_int
+FILEDownloadStageJob_Flush(FILEDownloadStageJob *self)
+{
+  FILEDownloadStageEntry *entry;
+  sse_uint i;
+  sse_uint j;
+  sse_int err;
+
+  for (i = 0; i < self->fCount; i++) {
+    entry = &self->fEntries[i];
+    if (entry->fStore == NULL) {
+      continue;
+    }
+    for (j = 0; j < i && self->fEntries[j].fStore != entry->fStore; j++) {
+      ;
+    }
+    if (j < i) {
+      continue;
+    }
+    err = TFILEVersionStore_Flush(entry->fStore);
+    if (err != SSE_E_OK) {
+      self->fFailed = entry->fItem;
+      return err;
+    }
+  }
+  return SSE_E_OK;
+}
+
+/*
+ * Step 1: Move every temporary file next to its destination as ${DESTINATION}.new, or into the
+ * staged version directory. This may copy the file across filesystems, so it may take long and
+ * may fail (e.g. disk full).
+ */
+static sse_int
+FILEDownloadStageJob_Stage(FILEDownloadStageJob *self)
+{
+  FILEDownloadStageEntry *entry;
+  sse_uint i;
+  sse_int err;
+
+  for (i = 0; i < self->fCount; i++) {
+    entry = &self->fEntries[i];
+    if (entry->fDevice) {
+      continue;
+    }
+    if (entry->fStore) {
+      err = TFILEVersionStore_Stage(entry->fStore);
+      if (err == SSE_E_OK) {
+        err = TFILEVersionStore_Put(entry->fStore, entry->fRelPath, entry->fTmpFile);
+      }
+    } else {
+      err = FILECopy_MoveFile(entry->fTmpFile, entry->fNewFile);
+    }
+    if (err != SSE_E_OK) {
+      LOG_ERROR("Staging [%s] as [%s] has been failed with [%s].", entry->fTmpFile, entry->fNewFile, sse_get_error_string(err));
+      self->fFailed = entry->fItem;
+      return err;
+    }
+  }
+  return FILEDownloadStageJob_Flush(self);
+}
+
+/* Discard the files staged by FILEDownloadStageJob_Stage(). */
+static void
+FILEDownloadStageJob_Unstage(FILEDownloadStageJob *self)
+{
+  sse_uint i;
+
+  for (i = 0; i < self->fCount; i++) {
+    if (!self->fEntries[i].fDevice && self->fEntries[i].fStore == NULL) {
+      unlink(self->fEntries[i].fNewFile);
+    }
+  }
+}
+
+static void
+FILEDownloader_StageWork(sse_pointer in_user_data)
+{
+  FILEDownloadStageJob *job = (FILEDownloadStageJob *)in_user_data;
+
+  job->fErr = FILEDownloadStageJob_FanOut(job);
+  if (job->fErr != SSE_E_OK) {
+    return;
+  }
+  job->fStaging = sse_true;
+  job->fErr = FILEDownloadStageJob_Stage(job);
+  if (job->fErr != SSE_E_OK) {
+    FILEDownloadStageJob_Unstage(job);
+  }
+}
+
+/*
+ * Step 2: Replace the destinations by rename(2), then swap the links of the version stores.
+ * The previous destinations are kept as ${DESTINATION}.old (hard link) until all of them have
+ * been replaced, so that they can be restored if any rename fails.
+ */
+static sse_int
+TFILEDownloader_ActivateItems(TFILEDownloader *self)
+{
+  sse_int err = SSE_E_OK;
+  sse_uint i;
+  sse_uint j;
+  TFILEDownloadItem *item;
+  sse_char *new_file;
+  sse_char *old_file;
+  sse_char *dst_file;
+
+  for (i = 0; i < self->fItemCount; i++) {
+    item = self->fItems[i];
+    if (item->fStore || item->fDevice) {
+      continue;
+    }
+    dst_file = FILEDownloader_GetPathWithSuffix(item->fFilePath, "");
+    new_file = FILEDownloader_GetPathWithSuffix(item->fFilePath, ".new");
+    old_file = FILEDownloader_GetPathWithSuffix(item->fFilePath, ".old");
+    item->fBackup = sse_false;
+    if (self->fItemCount > 1) {
+      unlink(old_file);
+      if (link(dst_file, old_file) == 0) {
+        item->fBackup = sse_true;
+      } else if (errno != ENOENT) {
+        LOG_WARN("link(%s, %s) has been failed with [%s]. It could not be restored.", dst_file, old_file, strerror(errno));
+      }
+    }
+    if (rename(new_file, dst_file) != 0) {
+      LOG_ERROR("rename(%s, %s) has been failed with [%s].", new_file, dst_file, strerror(errno));
+      TFILEDownloader_StoreMoveError(self, item, (errno == EACCES) ? SSE_E_ACCES : (errno == ENOENT) ? SSE_E_NOENT : SSE_E_GENERIC);
+      err = SSE_E_GENERIC;
+    }
+    sse_free(dst_file);
+    sse_free(new_file);
+    sse_free(old_file);
+    if (err != SSE_E_OK) {
+      break;
+    }
+  }
+  for (j = 0; (err == SSE_E_OK) && (j < self->fFilesysInfoCount); j++) {
+    if (self->fStores[j] == NULL) {
+      continue;
+    }
+    err = TFILEVersionStore_Activate(self->fStores[j]);
+    if (err != SSE_E_OK) {
+      TFILEDownloader_StoreResultCode(self, FILE_ERROR_RENAME, "Switching the symbolic link has been failed.", sse_false);
+    }
+  }
+
+  if (err != SSE_E_OK) {
+    /* Roll back the replaced destinations, then remove the remaining new files. */
+    for (j = 0; j < self->fItemCount; j++) {
+      item = self->fItems[j];
+      if (item->fStore || item->fDevice) {
+        continue;
+      }
+      dst_file = FILEDownloader_GetPathWithSuffix(item->fFilePath, "");
+      new_file = FILEDownloader_GetPathWithSuffix(item->fFilePath, ".new");
+      old_file = FILEDownloader_GetPathWithSuffix(item->fFilePath, ".old");
+      if (j < i) {
+        if (item->fBackup) {
+          if (rename(old_file, dst_file) != 0) {
+            LOG_ERROR("rename(%s, %s) has been failed with [%s].", old_file, dst_file, strerror(errno));
+          }
+        } else {
+          unlink(dst_file);
+        }
+      } else {
+        unlink(new_file);
+        if (item->fBackup) {
+          unlink(old_file);
+        }
+      }
+      sse_free(dst_file);
+      sse_free(new_file);
+      sse_free(old_file);
+    }
+    for (j = 0; j < self->fFilesysInfoCount; j++) {
+      if (self->fStores[j]) {
+        TFILEVersionStore_Revert(self->fStores[j]);
+      }
+    }
+    return err;
+  }
+
+  for (i = 0; i < self->fItemCount; i++) {
+    item = self->fItems[i];
+    if (item->fBackup) {
+      old_file = FILEDownloader_GetPathWithSuffix(item->fFilePath, ".old");
+      unlink(old_file);
+      sse_free(old_file);
+    }
+  }
+  for (j = 0; j < self->fFilesysInfoCount; j++) {
+    if (self->fStores[j]) {
+      TFILEVersionStore_Commit(self->fStores[j]);
+    }
+  }
+  return SSE_E_OK;
+}
+
+/* Links swapped, whose directories are written back on a worker before the post-action. */
+struct FILEDownloadFlushJob_ {
+  TFILEDownloader *fOwner;
+  TFILEVersionStore **fStores;
+  sse_uint fCount;
+};
+typedef struct FILEDownloadFlushJob_ FILEDownloadFlushJob;
+
+static void
+FILEDownloader_FlushWork(sse_pointer in_user_data)
+{
+  FILEDownloadFlushJob *job = (FILEDownloadFlushJob *)in_user_data;
+  sse_uint i;
+
+  for (i = 0; i < job->fCount; i++) {
+    /* The link has been swapped already, nothing to undo even if it fails. */
+    TFILEVersionStore_FlushLink(job->fStores[i]);
+  }
+}
+
+static void
+FILEDownloader_OnFlushDone(sse_pointer in_user_data,
+                           sse_bool in_canceled)
+{
+  FILEDownloadFlushJob *job = (FILEDownloadFlushJob *)in_user_data;
+  TFILEDownloader *self = job->fOwner;
+
+  sse_free(job->fStores);
+  sse_free(job);
+  if (in_canceled) {
+    return;
+  }
+  TFILEDownloader_DoPostAction(self);
+}
+
+/* Write back the links swapped on a worker, then do the post-action. */
+static void
+TFILEDownloader_FlushLinks(TFILEDownloader *self)
+{
+  FILEDownloadFlushJob *job;
+  sse_uint i;
+
+  job = sse_zeroalloc(sizeof(FILEDownloadFlushJob));
+  ASSERT(job);
+  job->fOwner = self;
+  job->fStores = sse_zeroalloc(sizeof(TFILEVersionStore *) * (self->fFilesysInfoCount + 1));
+  ASSERT(job->fStores);
+  /* The store rolled back is one of them as well. */
+  for (i = 0; i < self->fFilesysInfoCount; i++) {
+    if (self->fStores[i]) {
+      job->fStores[job->fCount++] = self->fStores[i];
+    }
+  }
+  if (job->fCount == 0) {
+    FILEDownloader_OnFlushDone(job, sse_false);
+    return;
+  }
+  TFILEWorkerPool_Submit(self->fWorkers, FILEDownloader_FlushWork, FILEDownloader_OnFlushDone, job);
+}
+
+static void
+FILEDownloader_OnStageDone(sse_pointer in_user_data,
+                           sse_bool in_canceled)
+{
+  FILEDownloadStageJob *job = (FILEDownloadStageJob *)in_user_data;
+  TFILEDownloader *self = job->fOwner;
+  sse_uint i;
 
-  /* Cleanup the temporary file. */
-  if (SseUtilFile_IsFile(downloader->fTmpFilePath)) {
-    LOG_INFO("Delete the temporary file. The file might be incomplete because download has been failed.");
-    SseUtilFile_DeleteFile(downloader->fTmpFilePath);
+  if (in_canceled) {
+    FILEDownloadStageJob_Delete(job);
+    return;
   }
-
-  TFILEDownloader_StoreResultCode(downloader, FILE_ERROR_DOWNLOAD, "File download failure.", sse_false);
-  TFILEDownloader_DoPostAction(downloader);
-  return;
+  for (i = 0; i < job->fFannedOut; i++) {
+    if (job->fEntries[i].fCloneSrc) {
+      job->fEntries[i].fItem->fState = FILE_DOWNLOAD_ITEM_STATE_DOWNLOADED;
+    }
+  }
+  if (job->fErr != SSE_E_OK) {
+    if (job->fStaging) {
+      MOAT_VALUE_DUMP_ERROR(TAG, job->fFailed->fTmpFilePath);
+      MOAT_VALUE_DUMP_ERROR(TAG, job->fFailed->fFilePath);
+      for (i = 0; i < self->fFilesysInfoCount; i++) {
+        if (self->fStores[i]) {
+          TFILEVersionStore_Revert(self->fStores[i]);
+        }
+      }
+    }
+    TFILEDownloader_DeleteTmpFiles(self);
+    TFILEDownloader_StoreMoveError(self, job->fFailed, job->fErr);
+  } else if (TFILEDownloader_ActivateItems(self) == SSE_E_OK) {
+    FILEDownloadStageJob_Delete(job);
+    TFILEDownloader_FlushLinks(self);
+    return;
+  }
+  FILEDownloadStageJob_Delete(job);
+  TFILEDownloader_DoPostAction(self);
 }
 
 /*
- * Do copy
+ * Commit the files in two steps so that either all or none of the destinations are replaced.
  */
-
 static void
 TFILEDownloader_DoCopy(TFILEDownloader *self)
 {
   sse_int err;
+  FILEDownloadStageJob *job;
 
   LOG_DEBUG("Enter: self=[%p]", self);
   ASSERT(self);
 
-  err = SseUtilFile_MoveFile(self->fTmpFilePath, self->fFilePath);
-  if (err != SSE_E_OK) {
-    LOG_ERROR("SseUtilFile_MoveFile() has been failed with [%s].", sse_get_error_string(err));
-    MOAT_VALUE_DUMP_ERROR(TAG, self->fTmpFilePath);
-    MOAT_VALUE_DUMP_ERROR(TAG, self->fFilePath);
-    if (err == SSE_E_ACCES) {
-      TFILEDownloader_StoreResultCode(self, FILE_ERROR_ACCES, "Renaming file has been failed.", sse_false);
-    } else if (err == SSE_E_NOMEM) {
-      TFILEDownloader_StoreResultCode(self, FILE_ERROR_NOMEM, "Renaming file has been failed.", sse_false);
+  self->fState = FILE_DOWNLOADER_STATE_COMMITTING;
+  if (self->fRollbackStore) {
+    err = TFILEVersionStore_Rollback(self->fRollbackStore);
+    if (err == SSE_E_OK) {
+      TFILEDownloader_FlushLinks(self);
+      return;
     } else if (err == SSE_E_NOENT) {
-      TFILEDownloader_StoreResultCode(self, FILE_ERROR_NOENT, "Renaming file has been failed.", sse_false);
-    } else {
-      TFILEDownloader_StoreResultCode(self, FILE_ERROR_RENAME, "Renaming file has been failed.", sse_false);
+      TFILEDownloader_StoreResultCode(self, FILE_ERROR_NOENT, "No version to roll back to.", sse_false);
+    } else if (err != SSE_E_OK) {
+      TFILEDownloader_StoreResultCode(self, FILE_ERROR_RENAME, "Switching the symbolic link has been failed.", sse_false);
     }
+  } else if (TFILEDownloader_PrepareFanOut(self) == SSE_E_OK) {
+    job = TFILEDownloader_NewStageJob(self);
+    TFILEWorkerPool_Submit(self->fWorkers, FILEDownloader_StageWork, FILEDownloader_OnStageDone, job);
+    return;
   }
   TFILEDownloader_DoPostAction(self);
   return;
@@ -380,17 +1207,81 @@ TFILEDownloader_DoCopy(TFILEDownloader *self)
 
 static void
 TFILEDownloader_DoPostAction(TFILEDownloader *self)
+{
+  LOG_DEBUG("Enter: self=[%p]", self);
+  ASSERT(self);
+
+  if (self->fState != FILE_DOWNLOADER_STATE_DISCARDED) {
+    self->fState = FILE_DOWNLOADER_STATE_POSTACTION;
+  }
+  self->fActionIndex = 0;
+  TFILEDownloader_DoNextPostAction(self);
+}
+
+/* Pass the written devices to the post-action as single-quoted arguments so that it can switch the boot slot. */
+static sse_char *
+TFILEDownloader_AppendDevicePaths(TFILEDownloader *self,
+                                  TFILEFilesysInfo *in_info,
+                                  sse_char *in_cmd,
+                                  sse_uint in_len)
+{
+  SSEString *cmd;
+  sse_char *result;
+  sse_char *str;
+  sse_uint len;
+  sse_uint i;
+  sse_uint j;
+
+  cmd = sse_string_new_with_length(in_cmd, in_len);
+  ASSERT(cmd);
+  for (i = 0; i < self->fItemCount; i++) {
+    if (self->fItems[i]->fFilesysInfo != in_info || !self->fItems[i]->fDevice) {
+      continue;
+    }
+    if (moat_value_get_string(self->fItems[i]->fFilePath, &str, &len) != SSE_E_OK) {
+      continue;
+    }
+    sse_string_concat_cstr(cmd, " '");
+    for (j = 0; j < len; j++) {
+      if (str[j] == '\'') {
+        sse_string_concat_cstr(cmd, "'\\''");
+      } else {
+        sse_string_concat_char(cmd, str[j]);
+      }
+    }
+    sse_string_concat_cstr(cmd, "'");
+  }
+  result = sse_strdup(sse_string_get_cstr(cmd));
+  sse_string_free(cmd, sse_true);
+  return result;
+}
+
+static void
+TFILEDownloader_DoNextPostAction(TFILEDownloader *self)
 {
   sse_int err;
-  MoatValue *postaction;
+  MoatValue *postaction = NULL;
+  TSseUtilShellCommand *command;
   sse_char *str;
   sse_uint len;
   sse_char *cmd;
 
-  LOG_DEBUG("Enter: self=[%p]", self);
+  LOG_DEBUG("Enter: self=[%p], index=[%d]", self, self->fActionIndex);
   ASSERT(self);
 
-  postaction = TFILEFilesysInfo_GetPostAction(self->fFilesysInfo);
+  /* Post-actions are executed for the filesystems whose pre-action has been done. */
+  while (self->fActionIndex < self->fPreActionDone) {
+    postaction = TFILEFilesysInfo_GetPostAction(self->fFilesysInfos[self->fActionIndex]);
+    if (postaction && self->fResultCode && TFILEFilesysInfo_IsBlockDevice(self->fFilesysInfos[self->fActionIndex])) {
+      /* Never switch to a slot that has not been written and verified completely. */
+      LOG_WARN("The post-action of the block device is skipped because the download has been failed.");
+      postaction = NULL;
+    }
+    if (postaction) {
+      break;
+    }
+    self->fActionIndex++;
+  }
   if (postaction == NULL) {
       LOG_DEBUG("No post-action. so downloading file has been completed.");
       TFILEDownloader_CallOnCompleteCallback(self);
@@ -401,46 +1292,54 @@ TFILEDownloader_DoPostAction(TFILEDownloader *self)
   if (err != SSE_E_OK) {
     LOG_ERROR("moat_value_get_string() has been failed with [%s].", sse_get_error_string(err));
     TFILEDownloader_StoreResultCode(self, FILE_ERROR_CONF, "Invalid post-action script configuration.", sse_false);
-    TFILEDownloader_CallOnCompleteCallback(self);
+    self->fActionIndex++;
+    TFILEDownloader_DoNextPostAction(self);
     return;
   }
-  cmd = sse_strndup(str, len);
+  if (TFILEFilesysInfo_IsBlockDevice(self->fFilesysInfos[self->fActionIndex])) {
+    cmd = TFILEDownloader_AppendDevicePaths(self, self->fFilesysInfos[self->fActionIndex], str, len);
+  } else {
+    cmd = sse_strndup(str, len);
+  }
   ASSERT(cmd);
 
   LOG_INFO("Execute post-action=[%s].", cmd);
-  self->fPostAction = SseUtilShellCommand_New();
-  ASSERT(self->fPostAction);
+  command = SseUtilShellCommand_New();
+  ASSERT(command);
   
-  err = TSseUtilShellCommand_SetShellCommand(self->fPostAction, cmd);
+  err = TSseUtilShellCommand_SetShellCommand(command, cmd);
   sse_free(cmd);
   if (err != SSE_E_OK) {
     LOG_ERROR("TSseUtilShellCommand_SetShellCommand() has been failed with [%s].", sse_get_error_string(err));
-    TSseUtilShellCommand_Delete(self->fPostAction);
-    self->fPostAction = NULL;
+    TSseUtilShellCommand_Delete(command);
     TFILEDownloader_StoreResultCode(self, FILE_ERROR_EXEC, "Executing post-action script has been failed.", sse_false);
-    TFILEDownloader_CallOnCompleteCallback(self);
+    self->fActionIndex++;
+    TFILEDownloader_DoNextPostAction(self);
     return;
   }
 
-  TSseUtilShellCommand_SetOnComplatedCallback(self->fPostAction,
+  TSseUtilShellCommand_SetOnComplatedCallback(command,
                                               FILEDownloader_DoPostActionOnCompletedCallback,
                                               self);
-  TSseUtilShellCommand_SetOnReadCallback(self->fPostAction,
+  TSseUtilShellCommand_SetOnReadCallback(command,
                                          FILEDownloader_DoPostActionOnReadCallback,
                                          self);
-  TSseUtilShellCommand_SetOnErrorCallback(self->fPostAction,
+  TSseUtilShellCommand_SetOnErrorCallback(command,
                                           FILEDownloader_DoPostActionOnErrorCallback,
                                           self);
 
-  err = TSseUtilShellCommand_Execute(self->fPostAction);
+  FILEPriority_BeginFork();
+  err = TSseUtilShellCommand_Execute(command);
+  FILEPriority_EndFork();
   if (err != SSE_E_OK) {
     LOG_ERROR("TSseUtilShellCommand_Execute() has been failed with [%s].", sse_get_error_string(err));
-    TSseUtilShellCommand_Delete(self->fPostAction);
-    self->fPostAction = NULL;
+    TSseUtilShellCommand_Delete(command);
     TFILEDownloader_StoreResultCode(self, FILE_ERROR_EXEC, "Executing post-action script has been failed.", sse_true);
-    TFILEDownloader_CallOnCompleteCallback(self);
+    self->fActionIndex++;
+    TFILEDownloader_DoNextPostAction(self);
     return;
   }
+  self->fPostActions[self->fActionIndex] = command;
 
   return;
 }
@@ -455,13 +1354,13 @@ FILEDownloader_DoPostActionOnCompletedCallback(TSseUtilShellCommand* self,
   ASSERT(downloader);
 
   if (in_result != SSE_E_OK) {
-    LOG_ERROR("Pre-action(%s) has been failed with [%s].", self->fShellCommand, sse_get_error_string(in_result));
+    LOG_ERROR("Post-action(%s) has been failed with [%s].", self->fShellCommand, sse_get_error_string(in_result));
     TFILEDownloader_StoreResultCode(downloader, FILE_ERROR_EXEC, "Executing post-action script has been failed.", sse_true);
-    return;
+  } else {
+    LOG_INFO("Post-action(%s) has been completed successfully.", self->fShellCommand);
   }
-
-  LOG_INFO("Post-action(%s) has been completed successfully.", self->fShellCommand);
-  TFILEDownloader_CallOnCompleteCallback(downloader);
+  downloader->fActionIndex++;
+  TFILEDownloader_DoNextPostAction(downloader);
 }
 
 static void
@@ -498,7 +1397,8 @@ FILEDownloader_DoPostActionOnErrorCallback(TSseUtilShellCommand* self,
 
   LOG_ERROR("TSseUtilShellCommand_ReadLine() has been failed with [%s], message=[%s].", sse_get_error_string(in_error_code), in_message);
   TFILEDownloader_StoreResultCode(downloader, FILE_ERROR_EXEC, "Executing post-action script has been failed.", sse_false);
-  TFILEDownloader_CallOnCompleteCallback(downloader);
+  downloader->fActionIndex++;
+  TFILEDownloader_DoNextPostAction(downloader);
   return;
 }
 
@@ -518,8 +1418,9 @@ FILEDownloader_New(const sse_char *in_uid,
   self = sse_zeroalloc(sizeof(TFILEDownloader));
   ASSERT(self);
 
+  TFILEArena_Initialize(&self->fArena, 0);
   if (in_uid) {
-    self->fUid = sse_strdup(in_uid);
+    self->fUid = TFILEArena_StrDup(&self->fArena, in_uid);
     LOG_DEBUG("uid=[%s]", in_uid);
   } else {
     self->fUid = NULL;
@@ -527,49 +1428,83 @@ FILEDownloader_New(const sse_char *in_uid,
   }
 
   if (in_key) {
-    self->fKey = sse_strdup(in_key);
+    self->fKey = TFILEArena_StrDup(&self->fArena, in_key);
     LOG_DEBUG("key=[%s]", in_key);
   } else {
     self->fKey = NULL;
     LOG_DEBUG("key=NULL");
   }
 
-  self->fPreAction = NULL;
-  self->fDownloader = moat_downloader_new();
-  ASSERT(self->fDownloader);
-  moat_downloader_set_callbacks(self->fDownloader,
-                                FILEDownloader_OnDownloadCompletionCallback,
-                                FILEDownlaoder_OnDownloadErrorCallback,
-                                self);
-  self->fPostAction = NULL;
-  self->fUrl = NULL;
-  self->fFilePath = NULL;
-  self->fTmpFilePath = NULL;
-  self->fFilesysInfo = NULL;
+  self->fItems = NULL;
+  self->fItemCount = 0;
+  self->fConcurrency = 1;
+  self->fNextItem = 0;
+  self->fActiveItems = 0;
+  self->fFilesysInfos = NULL;
+  self->fFilesysInfoSources = NULL;
+  self->fFilesysInfoCount = 0;
+  self->fActionIndex = 0;
+  self->fPreActionDone = 0;
+  self->fPreActions = NULL;
+  self->fPostActions = NULL;
+  self->fStores = NULL;
+  self->fRollbackStore = NULL;
   self->fOnCompleteCallback = NULL;
   self->fOnCompleteCallbackUserData = NULL;
   self->fResultCode = NULL;
+  self->fState = FILE_DOWNLOADER_STATE_READY;
+  self->fPrefetch = sse_false;
+  self->fSparse = sse_false;
+  self->fWriteCount = 0;
+  self->fPriority = NULL;
+  self->fPriorityEntered = sse_false;
+  self->fWorkers = NULL;
 
   LOG_DEBUG("Leave: self=[%p]", self);
   return self;
 }
 
+static void
+FILEDownloadItem_Delete(TFILEDownloadItem *self)
+{
+  if (self->fJob)         TFILEWorkerPool_Cancel(self->fOwner->fWorkers, self->fJob);
+  if (self->fDownloader)  moat_downloader_free(self->fDownloader);
+  if (self->fWriter)      TFILEBlockDevWriter_Delete(self->fWriter);
+  if (self->fUrl)         moat_value_free(self->fUrl);
+  if (self->fFilePath)    moat_value_free(self->fFilePath);
+  if (self->fTmpFilePath) moat_value_free(self->fTmpFilePath);
+  if (self->fHash)        moat_value_free(self->fHash);
+}
+
 void
 TFILEDownloader_Delete(TFILEDownloader *self)
 {
+  sse_uint i;
+
   LOG_DEBUG("Enter: self=[%p]", self);
   ASSERT(self);
 
-  if (self->fUid)         sse_free(self->fUid);
-  if (self->fKey)         sse_free(self->fKey);
-  if (self->fDownloader)  moat_downloader_free(self->fDownloader);
-  if (self->fUrl)         moat_value_free(self->fUrl);
-  if (self->fFilePath)    moat_value_free(self->fFilePath);
-  if (self->fTmpFilePath) moat_value_free(self->fTmpFilePath);
-  if (self->fFilesysInfo) moat_value_free(self->fFilesysInfo);
+  for (i = 0; i < self->fItemCount; i++) {
+    FILEDownloadItem_Delete(self->fItems[i]);
+  }
+  if (self->fItems)       sse_free(self->fItems);
+  for (i = 0; i < self->fFilesysInfoCount; i++) {
+    if (self->fFilesysInfos[i]) moat_value_free(self->fFilesysInfos[i]);
+    if (self->fPreActions[i])   TSseUtilShellCommand_Delete(self->fPreActions[i]);
+    if (self->fPostActions[i])  TSseUtilShellCommand_Delete(self->fPostActions[i]);
+    if (self->fStores[i])       TFILEVersionStore_Delete(self->fStores[i]);
+  }
+  if (self->fFilesysInfos)       sse_free(self->fFilesysInfos);
+  if (self->fFilesysInfoSources) sse_free(self->fFilesysInfoSources);
+  if (self->fPreActions)         sse_free(self->fPreActions);
+  if (self->fPostActions)        sse_free(self->fPostActions);
+  if (self->fStores)             sse_free(self->fStores);
   if (self->fResultCode)  moat_object_free(self->fResultCode);
-  if (self->fPreAction)   TSseUtilShellCommand_Delete(self->fPreAction);
-  if (self->fPostAction)  TSseUtilShellCommand_Delete(self->fPostAction);
+  if (self->fPriorityEntered) TFILEPriority_Leave(self->fPriority);
+  LOG_DEBUG("%u allocations (%zu bytes) have been made from %u chunks for the job.",
+            self->fArena.fAllocCount, self->fArena.fAllocBytes, self->fArena.fChunkCount);
+  TFILEArena_Finalize(&self->fArena);
+  LOG_DEBUG("%u arena chunks are left in the process.", FILEArena_GetLiveChunks());
   sse_free(self);
 }
 
@@ -591,33 +1526,519 @@ TFILEDownloader_RemoveOnCompleteCallback(TFILEDownloader *self)
   self->fOnCompleteCallbackUserData = NULL;
 }
 
+static sse_pointer
+FILEDownloader_GrowArray(sse_pointer in_array,
+                         sse_uint in_count)
+{
+  sse_pointer *array;
+
+  array = sse_zeroalloc(sizeof(sse_pointer) * (in_count + 1));
+  ASSERT(array);
+  if (in_array) {
+    sse_memcpy(array, in_array, sizeof(sse_pointer) * in_count);
+    sse_free(in_array);
+  }
+  return array;
+}
+
+static sse_int
+TFILEDownloader_AddFilesysInfo(TFILEDownloader *self,
+                               MoatValue *in_filesys_info)
+{
+  sse_uint i;
+  sse_uint count = self->fFilesysInfoCount;
+  MoatValue *symlink;
+
+  if (in_filesys_info == NULL) {
+    return -1;
+  }
+  for (i = 0; i < count; i++) {
+    if (self->fFilesysInfoSources[i] == in_filesys_info) {
+      return i;
+    }
+  }
+  self->fFilesysInfos       = FILEDownloader_GrowArray(self->fFilesysInfos, count);
+  self->fFilesysInfoSources = FILEDownloader_GrowArray(self->fFilesysInfoSources, count);
+  self->fPreActions         = FILEDownloader_GrowArray(self->fPreActions, count);
+  self->fPostActions        = FILEDownloader_GrowArray(self->fPostActions, count);
+  self->fStores             = FILEDownloader_GrowArray(self->fStores, count);
+  self->fFilesysInfos[count] = moat_value_clone(in_filesys_info);
+  ASSERT(self->fFilesysInfos[count]);
+  self->fFilesysInfoSources[count] = in_filesys_info;
+  symlink = TFILEFilesysInfo_GetSymlink(self->fFilesysInfos[count]);
+  if (symlink) {
+    self->fStores[count] = FILEVersionStore_New(symlink,
+                                                TFILEFilesysInfo_GetVersionsDir(self->fFilesysInfos[count]),
+                                                TFILEFilesysInfo_GetKeepVersions(self->fFilesysInfos[count]));
+    if (self->fStores[count] == NULL) {
+      LOG_WARN("Invalid \"symlink\" configuration, the files will be renamed.");
+    }
+  }
+  self->fFilesysInfoCount++;
+  return count;
+}
+
+static sse_int
+TFILEDownloader_AddItem(TFILEDownloader *self,
+                        MoatValue *in_src_url,
+                        MoatValue *in_dst_filepath,
+                        sse_int64 in_size,
+                        MoatValue *in_hash,
+                        TFILEDownloadItem *in_source,
+                        TFILEFilesysInfoTbl *in_filesys_info_tbl)
+{
+  TFILEDownloadItem *item;
+  TFILEVersionStore *store;
+  sse_int index;
+  sse_char *path;
+  const sse_char *rel_path;
+
+  ASSERT(self);
+  ASSERT(in_src_url);
+  ASSERT(in_dst_filepath);
+
+  if (self->fState != FILE_DOWNLOADER_STATE_READY) {
+    LOG_ERROR("The downloader has been started already.");
+    return SSE_E_INVAL;
+  }
+  if ((moat_value_get_type(in_src_url) != MOAT_VALUE_TYPE_STRING) ||
+      (moat_value_get_type(in_dst_filepath) != MOAT_VALUE_TYPE_STRING)) {
+    LOG_ERROR("Source URL and destination file path must be string.");
+    return SSE_E_INVAL;
+  }
+
+  item = TFILEArena_Alloc(&self->fArena, sizeof(TFILEDownloadItem));
+  item->fOwner = self;
+  item->fIndex = self->fItemCount;
+  item->fUrl = moat_value_clone(in_src_url);
+  ASSERT(item->fUrl);
+  item->fFilePath = moat_value_clone(in_dst_filepath);
+  ASSERT(item->fFilePath);
+  item->fTmpFilePath = NULL;
+  item->fSize = in_size;
+  item->fHash = NULL;
+  if (in_hash) {
+    item->fHash = moat_value_clone(in_hash);
+    ASSERT(item->fHash);
+  }
+  item->fDownloader = NULL;
+  item->fState = FILE_DOWNLOAD_ITEM_STATE_WAITING;
+  item->fBackup = sse_false;
+  item->fFilesysInfo = NULL;
+  item->fStore = NULL;
+  item->fDevice = sse_false;
+  item->fWriter = NULL;
+  item->fJob = NULL;
+  item->fSource = in_source;
+  index = TFILEDownloader_AddFilesysInfo(self, TFILEFilesysInfoTbl_FindFilesysInfo(in_filesys_info_tbl, item->fFilePath));
+  if (index >= 0) {
+    item->fFilesysInfo = self->fFilesysInfos[index];
+    store = self->fStores[index];
+    path = FILEDownloader_GetPathWithSuffix(item->fFilePath, "");
+    if (store && TFILEVersionStore_GetRelativePath(store, path, &rel_path)) {
+      item->fStore = store;
+    }
+    sse_free(path);
+    item->fDevice = TFILEFilesysInfo_IsBlockDevice(item->fFilesysInfo);
+  }
+  /* item->fFilesysInfo == NULL is acceptable. */
+
+  self->fItems = FILEDownloader_GrowArray(self->fItems, self->fItemCount);
+  self->fItems[self->fItemCount++] = item;
+  return SSE_E_OK;
+}
+
+/*
+ * Add the items for the destination file path, or the list of them. The file is downloaded only
+ * for the first path, and copied to the others.
+ */
+static sse_int
+TFILEDownloader_AddItems(TFILEDownloader *self,
+                         MoatValue *in_src_url,
+                         MoatValue *in_dst_filepath,
+                         sse_int64 in_size,
+                         MoatValue *in_hash,
+                         TFILEFilesysInfoTbl *in_filesys_info_tbl)
+{
+  sse_int err;
+  SSESList *list;
+  SSESList *it;
+  TFILEDownloadItem *source = NULL;
+
+  if (moat_value_get_type(in_dst_filepath) != MOAT_VALUE_TYPE_LIST) {
+    return TFILEDownloader_AddItem(self, in_src_url, in_dst_filepath, in_size, in_hash, NULL, in_filesys_info_tbl);
+  }
+  err = moat_value_get_list(in_dst_filepath, &list);
+  ASSERT(err == SSE_E_OK);
+  if (list == NULL) {
+    LOG_ERROR("The list of destination file paths is empty.");
+    return SSE_E_INVAL;
+  }
+  for (it = list; it != NULL; it = sse_slist_next(it)) {
+    err = TFILEDownloader_AddItem(self, in_src_url, (MoatValue*)sse_slist_data(it), in_size, in_hash, source, in_filesys_info_tbl);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+    if (source == NULL) {
+      source = self->fItems[self->fItemCount - 1];
+    } else if (source->fDevice || self->fItems[self->fItemCount - 1]->fDevice) {
+      LOG_ERROR("An image streamed into a block device cannot be copied.");
+      return SSE_E_INVAL;
+    }
+  }
+  return SSE_E_OK;
+}
+
 sse_int
 TFILEDownloader_SetResourcePath(TFILEDownloader *self,
                                 MoatValue *in_src_url,
                                 MoatValue *in_dst_filepath,
                                 TFILEFilesysInfoTbl *in_filesys_info_tbl)
 {
-  ASSERT(in_src_url);
-  ASSERT(in_dst_filepath);
+  ASSERT(self);
+  ASSERT(self->fItemCount == 0);
+
+  return TFILEDownloader_AddItems(self, in_src_url, in_dst_filepath, -1, NULL, in_filesys_info_tbl);
+}
+
+sse_int
+TFILEDownloader_SetManifest(TFILEDownloader *self,
+                            MoatValue *in_manifest,
+                            TFILEFilesysInfoTbl *in_filesys_info_tbl)
+{
+  sse_int err;
+  SSESList *list;
+  SSESList *it;
+  MoatValue *entry;
+  MoatObject *object;
+  MoatValue *url;
+  MoatValue *path;
+  MoatValue *size;
+  MoatValue *hash;
+  sse_int64 size_val;
+  sse_int32 i32;
+
+  ASSERT(self);
+  ASSERT(in_manifest);
+  ASSERT(self->fItemCount == 0);
+
+  err = moat_value_get_list(in_manifest, &list);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("The manifest must be a list.");
+    MOAT_VALUE_DUMP_ERROR(TAG, in_manifest);
+    return SSE_E_INVAL;
+  }
+  for (it = list; it != NULL; it = sse_slist_next(it)) {
+    entry = (MoatValue*)sse_slist_data(it);
+    if ((entry == NULL) || (moat_value_get_object(entry, &object) != SSE_E_OK)) {
+      LOG_ERROR("An entry of the manifest must be an object.");
+      return SSE_E_INVAL;
+    }
+    url  = moat_object_get_value(object, "url");
+    path = moat_object_get_value(object, "path");
+    if ((url == NULL) || (path == NULL)) {
+      LOG_ERROR("An entry of the manifest must have \"url\" and \"path\".");
+      MOAT_OBJECT_DUMP_ERROR(TAG, object);
+      return SSE_E_INVAL;
+    }
+    size_val = -1;
+    size = moat_object_get_value(object, "size");
+    if (size && (moat_value_get_type(size) != MOAT_VALUE_TYPE_NULL)) {
+      if (moat_value_get_int64(size, &size_val) != SSE_E_OK) {
+        if (moat_value_get_int32(size, &i32) != SSE_E_OK) {
+          LOG_ERROR("\"size\" of the manifest entry must be integer.");
+          MOAT_OBJECT_DUMP_ERROR(TAG, object);
+          return SSE_E_INVAL;
+        }
+        size_val = i32;
+      }
+    }
+    hash = moat_object_get_value(object, "hash");
+    if (hash && (moat_value_get_type(hash) == MOAT_VALUE_TYPE_NULL)) {
+      hash = NULL;
+    }
+    err = TFILEDownloader_AddItems(self, url, path, size_val, hash, in_filesys_info_tbl);
+    if (err != SSE_E_OK) {
+      MOAT_OBJECT_DUMP_ERROR(TAG, object);
+      return err;
+    }
+  }
+  if (self->fItemCount == 0) {
+    LOG_ERROR("The manifest is empty.");
+    return SSE_E_INVAL;
+  }
+  LOG_INFO("%d files in the manifest.", self->fItemCount);
+  return SSE_E_OK;
+}
+
+sse_int
+TFILEDownloader_SetRollbackPath(TFILEDownloader *self,
+                                MoatValue *in_dst_filepath,
+                                TFILEFilesysInfoTbl *in_filesys_info_tbl)
+{
+  sse_int index;
+  sse_char *path;
+  const sse_char *rel_path;
+  TFILEVersionStore *store = NULL;
 
-  self->fUrl = moat_value_clone(in_src_url);
-  ASSERT(self->fUrl);
-  self->fFilePath = moat_value_clone(in_dst_filepath);
-  ASSERT(self->fFilePath);
-  self->fFilesysInfo = moat_value_clone(TFILEFilesysInfoTbl_FindFilesysInfo(in_filesys_info_tbl, self->fFilePath));
-  /* self->fFilesysInfo == NULL is acceptable. */
+  ASSERT(self);
+  ASSERT(in_dst_filepath);
+  ASSERT(self->fItemCount == 0);
 
+  if (moat_value_get_type(in_dst_filepath) != MOAT_VALUE_TYPE_STRING) {
+    LOG_ERROR("Destination file path must be string.");
+    return SSE_E_INVAL;
+  }
+  index = TFILEDownloader_AddFilesysInfo(self, TFILEFilesysInfoTbl_FindFilesysInfo(in_filesys_info_tbl, in_dst_filepath));
+  if (index >= 0) {
+    store = self->fStores[index];
+  }
+  if (store == NULL) {
+    LOG_ERROR("\"symlink\" is not configured for the destination file path.");
+    MOAT_VALUE_DUMP_ERROR(TAG, in_dst_filepath);
+    return SSE_E_INVAL;
+  }
+  path = FILEDownloader_GetPathWithSuffix(in_dst_filepath, "");
+  if (!TFILEVersionStore_GetRelativePath(store, path, &rel_path) && (sse_strcmp(path, store->fLinkPath) != 0)) {
+    LOG_ERROR("[%s] is not under [%s].", path, store->fLinkPath);
+    sse_free(path);
+    return SSE_E_INVAL;
+  }
+  sse_free(path);
+  self->fRollbackStore = store;
   return SSE_E_OK;
 }
 
+void
+TFILEDownloader_SetConcurrency(TFILEDownloader *self,
+                               sse_uint in_concurrency)
+{
+  ASSERT(self);
+  self->fConcurrency = (in_concurrency > 0) ? in_concurrency : 1;
+}
+
+void
+TFILEDownloader_SetSparse(TFILEDownloader *self,
+                          sse_bool in_sparse)
+{
+  ASSERT(self);
+  self->fSparse = in_sparse;
+}
+
+void
+TFILEDownloader_SetPriority(TFILEDownloader *self,
+                            TFILEPriority *in_priority)
+{
+  ASSERT(self);
+  ASSERT(!self->fPriorityEntered);
+  self->fPriority = in_priority;
+}
+
+void
+TFILEDownloader_SetWorkerPool(TFILEDownloader *self,
+                              TFILEWorkerPool *in_workers)
+{
+  ASSERT(self);
+  self->fWorkers = in_workers;
+}
+
+static void
+TFILEDownloader_EnterPriority(TFILEDownloader *self)
+{
+  if (self->fPriority == NULL || self->fPriorityEntered) {
+    return;
+  }
+  TFILEPriority_Enter(self->fPriority, (TFILEFilesysInfo **)self->fFilesysInfos, self->fFilesysInfoCount);
+  self->fPriorityEntered = sse_true;
+}
+
 void
 TFILEDownloader_DownloadFile(TFILEDownloader *self)
 {
   ASSERT(self);
+  TFILEDownloader_EnterPriority(self);
+
+  switch (self->fState) {
+  case FILE_DOWNLOADER_STATE_READY:
+    TFILEDownloader_DoPreAction(self);
+    break;
+  case FILE_DOWNLOADER_STATE_FETCHED:
+    LOG_INFO("Commit the prefetched file.");
+    TFILEDownloader_DoCopy(self);
+    break;
+  default:
+    LOG_DEBUG("The prefetch is in progress, state=[%d].", self->fState);
+    break;
+  }
+  return;
+}
+
+void
+TFILEDownloader_Prefetch(TFILEDownloader *self)
+{
+  ASSERT(self);
+  ASSERT(self->fState == FILE_DOWNLOADER_STATE_READY);
+
+  LOG_INFO("Prefetch the file.");
+  self->fPrefetch = sse_true;
+  TFILEDownloader_EnterPriority(self);
   TFILEDownloader_DoPreAction(self);
   return;
 }
 
+sse_int
+TFILEDownloader_AttachCommand(TFILEDownloader *self,
+                              const sse_char *in_uid,
+                              const sse_char *in_key)
+{
+  ASSERT(self);
+
+  if (!self->fPrefetch || self->fKey != NULL) {
+    LOG_ERROR("The downloader is not an unattached prefetch.");
+    return SSE_E_INVAL;
+  }
+  switch (self->fState) {
+  case FILE_DOWNLOADER_STATE_PREACTION:
+  case FILE_DOWNLOADER_STATE_DOWNLOADING:
+  case FILE_DOWNLOADER_STATE_FETCHED:
+    break;
+  default:
+    LOG_INFO("The prefetch could not be attached, state=[%d].", self->fState);
+    return SSE_E_INVAL;
+  }
+
+  if (in_uid) {
+    self->fUid = TFILEArena_StrDup(&self->fArena, in_uid);
+  }
+  if (in_key) {
+    self->fKey = TFILEArena_StrDup(&self->fArena, in_key);
+  }
+  LOG_INFO("Download command (uid=[%s], key=[%s]) has been attached to the prefetch, state=[%d].", in_uid, in_key, self->fState);
+  return SSE_E_OK;
+}
+
+void
+TFILEDownloader_DeleteTmpFiles(TFILEDownloader *self)
+{
+  sse_uint i;
+  TFILEDownloadItem *item;
+
+  ASSERT(self);
+  for (i = 0; i < self->fItemCount; i++) {
+    item = self->fItems[i];
+    if (item->fTmpFilePath && SseUtilFile_IsFile(item->fTmpFilePath)) {
+      LOG_INFO("Delete the temporary file.");
+      MOAT_VALUE_DUMP_INFO(TAG, item->fTmpFilePath);
+      SseUtilFile_DeleteFile(item->fTmpFilePath);
+    }
+  }
+}
+
+sse_uint64
+TFILEDownloader_GetWriteCount(TFILEDownloader *self)
+{
+  ASSERT(self);
+  return self->fWriteCount;
+}
+
+MoatObject*
+TFILEDownloader_GetResultDetails(TFILEDownloader *self)
+{
+  MoatObject *details;
+  sse_int err;
+
+  ASSERT(self);
+  details = moat_object_new();
+  ASSERT(details);
+  if (self->fWriteCount > 0) {
+    err = moat_object_add_int64_value(details, "writeCount", (sse_int64)self->fWriteCount, sse_true);
+    ASSERT(err == SSE_E_OK);
+  }
+  return details;
+}
+
+void
+TFILEDownloader_Discard(TFILEDownloader *self)
+{
+  sse_int state;
+  sse_uint i;
+
+  ASSERT(self);
+
+  state = self->fState;
+  LOG_INFO("Discard the prefetch, state=[%d].", state);
+  switch (state) {
+  case FILE_DOWNLOADER_STATE_READY:
+    self->fState = FILE_DOWNLOADER_STATE_DISCARDED;
+    TFILEDownloader_StoreResultCode(self, FILE_ERROR_DOWNLOAD, "Prefetch has been discarded.", sse_false);
+    TFILEDownloader_CallOnCompleteCallback(self);
+    break;
+  case FILE_DOWNLOADER_STATE_PREACTION:
+    /* The post-action will be executed when the pre-action has been completed. */
+    self->fState = FILE_DOWNLOADER_STATE_DISCARDED;
+    TFILEDownloader_StoreResultCode(self, FILE_ERROR_DOWNLOAD, "Prefetch has been discarded.", sse_false);
+    break;
+  case FILE_DOWNLOADER_STATE_DOWNLOADING:
+  case FILE_DOWNLOADER_STATE_FETCHED:
+    self->fState = FILE_DOWNLOADER_STATE_DISCARDED;
+    for (i = 0; i < self->fItemCount; i++) {
+      if (self->fItems[i]->fState == FILE_DOWNLOAD_ITEM_STATE_DOWNLOADING) {
+        if (self->fItems[i]->fWriter) {
+          TFILEBlockDevWriter_Cancel(self->fItems[i]->fWriter);
+        } else {
+          moat_downloader_cancel_download(self->fItems[i]->fDownloader);
+        }
+        self->fItems[i]->fState = FILE_DOWNLOAD_ITEM_STATE_FAILED;
+      } else if (self->fItems[i]->fState == FILE_DOWNLOAD_ITEM_STATE_VERIFYING) {
+        TFILEWorkerPool_Cancel(self->fWorkers, self->fItems[i]->fJob);
+        self->fItems[i]->fJob = NULL;
+        self->fItems[i]->fState = FILE_DOWNLOAD_ITEM_STATE_FAILED;
+      }
+    }
+    self->fActiveItems = 0;
+    TFILEDownloader_DeleteTmpFiles(self);
+    TFILEDownloader_StoreResultCode(self, FILE_ERROR_DOWNLOAD, "Prefetch has been discarded.", sse_false);
+    TFILEDownloader_DoPostAction(self);
+    break;
+  default:
+    /* Already finishing, the on-complete callback will be called. */
+    break;
+  }
+  return;
+}
+
+static sse_bool
+FILEDownloader_EqualsString(MoatValue *in_v1,
+                            MoatValue *in_v2)
+{
+  sse_char *s1;
+  sse_char *s2;
+  sse_uint len1;
+  sse_uint len2;
+
+  if (in_v1 == NULL || in_v2 == NULL) {
+    return sse_false;
+  }
+  if (moat_value_get_string(in_v1, &s1, &len1) != SSE_E_OK ||
+      moat_value_get_string(in_v2, &s2, &len2) != SSE_E_OK) {
+    return sse_false;
+  }
+  return (len1 == len2) && (sse_strncmp(s1, s2, len1) == 0);
+}
+
+sse_bool
+TFILEDownloader_MatchResourcePath(TFILEDownloader *self,
+                                  MoatValue *in_src_url,
+                                  MoatValue *in_dst_filepath)
+{
+  ASSERT(self);
+  if (self->fItemCount != 1) {
+    return sse_false;
+  }
+  return FILEDownloader_EqualsString(self->fItems[0]->fUrl, in_src_url) &&
+         FILEDownloader_EqualsString(self->fItems[0]->fFilePath, in_dst_filepath);
+}
+
 static void
 TFILEDownloader_CallOnCompleteCallback(TFILEDownloader *self)
 {
@@ -649,21 +2070,21 @@ TFILEDownloader_StoreResultCode(TFILEDownloader *self,
 
   ASSERT(self);
   if (self->fResultCode) {
-    if (in_overwrite) {
-      moat_object_free(self->fResultCode);
-    } else {
+    if (!in_overwrite) {
       return SSE_E_OK;
     }
+  } else {
+    self->fResultCode = moat_object_new();
+    ASSERT(self->fResultCode);
   }
-  self->fResultCode = moat_object_new();
-  ASSERT(self->fResultCode);
-  err = moat_object_add_string_value(self->fResultCode, "err_code", (sse_char*)in_err_code, 0, sse_true, sse_false);
+  /* The values are replaced in the object, which is kept until the downloader is deleted. */
+  err = moat_object_add_string_value(self->fResultCode, "err_code", (sse_char*)in_err_code, 0, sse_true, sse_true);
   if (err != SSE_E_OK) {
     moat_object_free(self->fResultCode);
     self->fResultCode = NULL;
     return err;
   }
-  err = moat_object_add_string_value(self->fResultCode, "err_msg", (sse_char*)in_err_msg, 0, sse_true, sse_false);
+  err = moat_object_add_string_value(self->fResultCode, "err_msg", (sse_char*)in_err_msg, 0, sse_true, sse_true);
   if (err != SSE_E_OK) {
     moat_object_free(self->fResultCode);
     self->fResultCode = NULL;
@@ -671,3 +2092,25 @@ TFILEDownloader_StoreResultCode(TFILEDownloader *self,
   }
   return SSE_E_OK;
 }
+
+/*
+ * Store the result code of the item. The destination file path is added to the message if
+ * the downloader has several files.
+ */
+static sse_int
+TFILEDownloader_StoreItemResultCode(TFILEDownloader *self,
+                                    TFILEDownloadItem *in_item,
+                                    const sse_char *in_err_code,
+                                    const sse_char *in_err_msg)
+{
+  sse_char *str;
+  sse_uint len;
+
+  if (self->fItemCount <= 1 || self->fResultCode) {
+    return TFILEDownloader_StoreResultCode(self, in_err_code, in_err_msg, sse_false);
+  }
+  if (moat_value_get_string(in_item->fFilePath, &str, &len) == SSE_E_OK) {
+    in_err_msg = TFILEArena_Printf(&self->fArena, NULL, "%s path=%.*s", in_err_msg, (int)len, str);
+  }
+  return TFILEDownloader_StoreResultCode(self, in_err_code, in_err_msg, sse_false);
+}
@@ -191,3 +191,342 @@ TFILEFilesysInfo_GetTmpDir(TFILEFilesysInfo *self)
   return FILEFilesysInfo_GetValue((MoatValue *)self, "tmpdir");
 }
 
+/*
+ * Optional keys. A missing key or null is not an error, the default is used.
+ */
+
+static MoatValue*
+FILEFilesysInfo_GetOptionalValue(MoatValue *in_value,
+                                 const sse_char *in_key)
+{
+  MoatObject *object;
+  MoatValue *value;
+  sse_int err;
+
+  ASSERT(in_key);
+
+  if (in_value == NULL) {
+    return NULL;
+  }
+  if (moat_value_get_type(in_value) != MOAT_VALUE_TYPE_OBJECT) {
+    LOG_ERROR("MoatValue type of TFILEFilesysInfo must be MoatObject.");
+    MOAT_VALUE_DUMP_ERROR(TAG, in_value);
+    return NULL;
+  }
+  err = moat_value_get_object(in_value, &object);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("moat_value_get_object() has been failed with [%s].", sse_get_error_string(err));
+    return NULL;
+  }
+  value = moat_object_get_value(object, (sse_char*)in_key);
+  if ((value == NULL) || (moat_value_get_type(value) == MOAT_VALUE_TYPE_NULL)) {
+    return NULL;
+  }
+  return value;
+}
+
+static sse_bool
+FILEFilesysInfo_GetBoolean(MoatValue *in_value,
+                           const sse_char *in_key,
+                           sse_bool in_default)
+{
+  MoatValue *value;
+  sse_bool b;
+
+  value = FILEFilesysInfo_GetOptionalValue(in_value, in_key);
+  if (value == NULL) {
+    return in_default;
+  }
+  if (moat_value_get_boolean(value, &b) != SSE_E_OK) {
+    LOG_ERROR("key=[%s] must be boolean.", in_key);
+    MOAT_VALUE_DUMP_ERROR(TAG, value);
+    return in_default;
+  }
+  return b;
+}
+
+static sse_int64
+FILEFilesysInfo_ToInteger(MoatValue *value,
+                          const sse_char *in_key,
+                          sse_int64 in_default)
+{
+  sse_int16 i16;
+  sse_int32 i32;
+  sse_int64 i64;
+  sse_double d;
+
+  if ((value == NULL) || (moat_value_get_type(value) == MOAT_VALUE_TYPE_NULL)) {
+    return in_default;
+  }
+  switch (moat_value_get_type(value)) {
+  case MOAT_VALUE_TYPE_INT16:
+    moat_value_get_int16(value, &i16);
+    return i16;
+  case MOAT_VALUE_TYPE_INT32:
+    moat_value_get_int32(value, &i32);
+    return i32;
+  case MOAT_VALUE_TYPE_INT64:
+    moat_value_get_int64(value, &i64);
+    return i64;
+  case MOAT_VALUE_TYPE_DOUBLE:
+    moat_value_get_double(value, &d);
+    return (sse_int64)d;
+  default:
+    LOG_ERROR("key=[%s] must be integer.", in_key);
+    MOAT_VALUE_DUMP_ERROR(TAG, value);
+    return in_default;
+  }
+}
+
+static sse_int64
+FILEFilesysInfo_GetInteger(MoatValue *in_value,
+                           const sse_char *in_key,
+                           sse_int64 in_default)
+{
+  return FILEFilesysInfo_ToInteger(FILEFilesysInfo_GetOptionalValue(in_value, in_key), in_key, in_default);
+}
+
+sse_bool
+TFILEFilesysInfo_IsPrefetchEnabled(TFILEFilesysInfo *self)
+{
+  return FILEFilesysInfo_GetBoolean((MoatValue *)self, "prefetch", sse_false);
+}
+
+sse_uint
+TFILEFilesysInfo_GetPrefetchTimeout(TFILEFilesysInfo *self)
+{
+  sse_int64 sec;
+
+  sec = FILEFilesysInfo_GetInteger((MoatValue *)self, "prefetchtimeout", FILE_PREFETCH_TIMEOUT_DEFAULT);
+  if (sec <= 0) {
+    return FILE_PREFETCH_TIMEOUT_DEFAULT;
+  }
+  return (sse_uint)sec;
+}
+
+static MoatValue*
+FILEFilesysInfo_GetOptionalString(MoatValue *in_value,
+                                  const sse_char *in_key)
+{
+  MoatValue *value;
+
+  value = FILEFilesysInfo_GetOptionalValue(in_value, in_key);
+  if (value && (moat_value_get_type(value) != MOAT_VALUE_TYPE_STRING)) {
+    LOG_ERROR("key=[%s] must be string.", in_key);
+    MOAT_VALUE_DUMP_ERROR(TAG, value);
+    return NULL;
+  }
+  return value;
+}
+
+MoatValue*
+TFILEFilesysInfo_GetSymlink(TFILEFilesysInfo *self)
+{
+  return FILEFilesysInfo_GetOptionalString((MoatValue *)self, "symlink");
+}
+
+MoatValue*
+TFILEFilesysInfo_GetVersionsDir(TFILEFilesysInfo *self)
+{
+  return FILEFilesysInfo_GetOptionalString((MoatValue *)self, "versionsdir");
+}
+
+sse_uint
+TFILEFilesysInfo_GetKeepVersions(TFILEFilesysInfo *self)
+{
+  sse_int64 num;
+
+  num = FILEFilesysInfo_GetInteger((MoatValue *)self, "keepversions", FILE_KEEP_VERSIONS_DEFAULT);
+  if (num <= 0) {
+    return FILE_KEEP_VERSIONS_DEFAULT;
+  }
+  return (sse_uint)num;
+}
+
+sse_size
+TFILEFilesysInfo_GetUploadPartSize(TFILEFilesysInfo *self)
+{
+  sse_int64 size;
+
+  size = FILEFilesysInfo_GetInteger((MoatValue *)self, "uploadpartsize", 0);
+  if (size <= 0) {
+    return 0;
+  }
+  if (size < FILE_UPLOAD_PART_SIZE_MIN) {
+    LOG_WARN("uploadpartsize=[%lld] is too small, use %d instead.", (long long)size, FILE_UPLOAD_PART_SIZE_MIN);
+    return FILE_UPLOAD_PART_SIZE_MIN;
+  }
+  return (sse_size)size;
+}
+
+MoatValue*
+TFILEFilesysInfo_GetUploadCompression(TFILEFilesysInfo *self)
+{
+  return FILEFilesysInfo_GetOptionalString((MoatValue *)self, "uploadcompression");
+}
+
+sse_uint
+TFILEFilesysInfo_GetUploadConcurrency(TFILEFilesysInfo *self)
+{
+  sse_int64 num;
+
+  num = FILEFilesysInfo_GetInteger((MoatValue *)self, "uploadconcurrency", FILE_UPLOAD_CONCURRENCY_DEFAULT);
+  if (num <= 0) {
+    return FILE_UPLOAD_CONCURRENCY_DEFAULT;
+  }
+  return (sse_uint)num;
+}
+
+sse_bool
+TFILEFilesysInfo_IsUploadSnapshotEnabled(TFILEFilesysInfo *self)
+{
+  return FILEFilesysInfo_GetBoolean((MoatValue *)self, "uploadsnapshot", sse_false);
+}
+
+static sse_bool
+FILEFilesysInfo_IsType(MoatValue *in_info,
+                       const sse_char *in_type)
+{
+  MoatValue *type;
+  sse_char *str;
+  sse_uint len;
+
+  type = FILEFilesysInfo_GetOptionalString(in_info, "type");
+  if (type == NULL || moat_value_get_string(type, &str, &len) != SSE_E_OK) {
+    return sse_false;
+  }
+  return (len == sse_strlen(in_type)) && (sse_strncmp(str, in_type, len) == 0);
+}
+
+sse_bool
+TFILEFilesysInfo_IsBlockDevice(TFILEFilesysInfo *self)
+{
+  return FILEFilesysInfo_IsType((MoatValue *)self, FILE_FILESYS_TYPE_BLOCKDEV);
+}
+
+sse_size
+TFILEFilesysInfo_GetEraseBlockSize(TFILEFilesysInfo *self)
+{
+  sse_int64 size;
+
+  size = FILEFilesysInfo_GetInteger((MoatValue *)self, "eraseblocksize", 0);
+  if (size <= 0) {
+    return 0;
+  }
+  return (sse_size)size;
+}
+
+sse_bool
+TFILEFilesysInfo_IsDirectIoEnabled(TFILEFilesysInfo *self)
+{
+  return FILEFilesysInfo_GetBoolean((MoatValue *)self, "odirect", sse_false);
+}
+
+sse_size
+TFILEFilesysInfo_GetWriteBufferSize(TFILEFilesysInfo *self)
+{
+  sse_int64 size;
+
+  size = FILEFilesysInfo_GetInteger((MoatValue *)self, "writebuffersize", 0);
+  if (size <= 0) {
+    return 0;
+  }
+  return (sse_size)size;
+}
+
+sse_bool
+TFILEFilesysInfo_IsFadviseEnabled(TFILEFilesysInfo *self)
+{
+  return FILEFilesysInfo_GetBoolean((MoatValue *)self, "fadvise", sse_false);
+}
+
+sse_bool
+TFILEFilesysInfo_IsZeroCopyEnabled(TFILEFilesysInfo *self)
+{
+  return FILEFilesysInfo_GetBoolean((MoatValue *)self, "zerocopy", sse_false);
+}
+
+sse_int
+TFILEFilesysInfo_GetNice(TFILEFilesysInfo *self)
+{
+  sse_int64 nice;
+
+  nice = FILEFilesysInfo_GetInteger((MoatValue *)self, "nice", FILE_PRIORITY_NONE);
+  if (nice == FILE_PRIORITY_NONE) {
+    return FILE_PRIORITY_NONE;
+  }
+  if (nice < -20 || nice > 19) {
+    LOG_WARN("nice=[%lld] is out of range, ignored.", (long long)nice);
+    return FILE_PRIORITY_NONE;
+  }
+  return (sse_int)nice;
+}
+
+sse_int
+TFILEFilesysInfo_GetIoPriority(TFILEFilesysInfo *self)
+{
+  MoatValue *value;
+  sse_char *str;
+  sse_uint len;
+  sse_int io_class;
+  sse_int64 level;
+
+  value = FILEFilesysInfo_GetOptionalString((MoatValue *)self, "ioclass");
+  if (value == NULL || moat_value_get_string(value, &str, &len) != SSE_E_OK) {
+    return FILE_PRIORITY_NONE;
+  }
+  if (len == 8 && sse_strncmp(str, "realtime", len) == 0) {
+    io_class = FILE_PRIORITY_IOCLASS_RT;
+  } else if (len == 10 && sse_strncmp(str, "besteffort", len) == 0) {
+    io_class = FILE_PRIORITY_IOCLASS_BE;
+  } else if (len == 4 && sse_strncmp(str, "idle", len) == 0) {
+    io_class = FILE_PRIORITY_IOCLASS_IDLE;
+  } else {
+    LOG_WARN("ioclass=[%.*s] is unknown, ignored.", len, str);
+    return FILE_PRIORITY_NONE;
+  }
+  level = FILEFilesysInfo_GetInteger((MoatValue *)self, "iolevel", 4);
+  if (level < 0 || level > 7) {
+    LOG_WARN("iolevel=[%lld] is out of range, use 4 instead.", (long long)level);
+    level = 4;
+  }
+  return FILE_PRIORITY_IOPRIO(io_class, (sse_int)level);
+}
+
+MoatValue*
+TFILEFilesysInfo_GetCgroup(TFILEFilesysInfo *self)
+{
+  return FILEFilesysInfo_GetOptionalString((MoatValue *)self, "cgroup");
+}
+
+MoatValue*
+TFILEFilesysInfo_GetCgroupIoMax(TFILEFilesysInfo *self)
+{
+  return FILEFilesysInfo_GetOptionalString((MoatValue *)self, "cgroupiomax");
+}
+
+MoatValue*
+TFILEFilesysInfo_GetCgroupCpuMax(TFILEFilesysInfo *self)
+{
+  return FILEFilesysInfo_GetOptionalString((MoatValue *)self, "cgroupcpumax");
+}
+
+/* "workers" at the top level of filesystem.conf, which is not a path. */
+sse_int
+TFILEFilesysInfoTbl_GetWorkerThreads(TFILEFilesysInfoTbl *self)
+{
+  sse_int64 threads;
+
+  ASSERT(self);
+  if (self->fObject == NULL) {
+    return FILE_WORKER_THREADS_AUTO;
+  }
+  threads = FILEFilesysInfo_ToInteger(moat_object_get_value(self->fObject, "workers"), "workers", FILE_WORKER_THREADS_AUTO);
+  if (threads < 0 || threads > FILE_WORKER_THREADS_MAX) {
+    if (threads != FILE_WORKER_THREADS_AUTO) {
+      LOG_WARN("workers=[%lld] is out of range, ignored.", (long long)threads);
+    }
+    return FILE_WORKER_THREADS_AUTO;
+  }
+  return (sse_int)threads;
+}
@@ -0,0 +1,306 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+#define FILE_FINGERPRINT_MAGIC     "fingerprint 1"
+#define FILE_FINGERPRINT_LINE_SIZE (8192)
+
+static sse_bool
+TFILEFingerprint_IsSameStat(TFILEFingerprint *self,
+                            struct stat *in_st)
+{
+  return (sse_uint64)in_st->st_dev == self->fDev && (sse_uint64)in_st->st_ino == self->fIno &&
+         (sse_uint64)in_st->st_size == self->fSize &&
+         (sse_int64)in_st->st_mtim.tv_sec == self->fMtimeSec && (sse_int64)in_st->st_mtim.tv_nsec == self->fMtimeNsec;
+}
+
+static void
+TFILEFingerprint_SetStat(TFILEFingerprint *self,
+                         struct stat *in_st)
+{
+  self->fDev = in_st->st_dev;
+  self->fIno = in_st->st_ino;
+  self->fSize = in_st->st_size;
+  self->fMtimeSec = in_st->st_mtim.tv_sec;
+  self->fMtimeNsec = in_st->st_mtim.tv_nsec;
+}
+
+/* Compare a "<name> <value>" line, returns the value or NULL. */
+static sse_char*
+FILEFingerprint_GetLineValue(sse_char *in_line,
+                             const sse_char *in_name)
+{
+  sse_size len = sse_strlen(in_name);
+
+  in_line[strcspn(in_line, "\n")] = '\0';
+  if (sse_strncmp(in_line, in_name, len) != 0 || in_line[len] != ' ') {
+    return NULL;
+  }
+  return in_line + len + 1;
+}
+
+static void
+TFILEFingerprint_Load(TFILEFingerprint *self)
+{
+  FILE *fp;
+  sse_char *line;
+  sse_char *value;
+  unsigned long long dev;
+  unsigned long long ino;
+  unsigned long long size;
+  long long sec;
+  long long nsec;
+  int level;
+  int sparse;
+
+  fp = fopen(self->fCachePath, "r");
+  if (fp == NULL) {
+    LOG_DEBUG("No fingerprint of [%s].", self->fFilePath);
+    return;
+  }
+  line = sse_malloc(FILE_FINGERPRINT_LINE_SIZE);
+  ASSERT(line);
+  /* Header, the key (path, destination, compression and sparse image), the stat, the hash and the ETag. */
+  if (!fgets(line, FILE_FINGERPRINT_LINE_SIZE, fp) ||
+      sse_strncmp(line, FILE_FINGERPRINT_MAGIC "\n", sizeof(FILE_FINGERPRINT_MAGIC)) != 0) {
+    LOG_WARN("The fingerprint [%s] is broken, ignore it.", self->fCachePath);
+  } else if (!fgets(line, FILE_FINGERPRINT_LINE_SIZE, fp) ||
+             (value = FILEFingerprint_GetLineValue(line, "path")) == NULL || sse_strcmp(value, self->fFilePath) != 0 ||
+             !fgets(line, FILE_FINGERPRINT_LINE_SIZE, fp) ||
+             (value = FILEFingerprint_GetLineValue(line, "url")) == NULL || sse_strcmp(value, self->fDestination) != 0 ||
+             !fgets(line, FILE_FINGERPRINT_LINE_SIZE, fp) ||
+             sscanf(line, "level %d %d", &level, &sparse) != 2 || level != self->fLevel || (sparse != 0) != self->fSparse) {
+    LOG_DEBUG("The fingerprint [%s] is of another upload.", self->fCachePath);
+  } else if (!fgets(line, FILE_FINGERPRINT_LINE_SIZE, fp) ||
+             sscanf(line, "stat %llu %llu %llu %lld %lld", &dev, &ino, &size, &sec, &nsec) != 5 ||
+             !fgets(line, FILE_FINGERPRINT_LINE_SIZE, fp) ||
+             (value = FILEFingerprint_GetLineValue(line, "sha256")) == NULL || sse_strlen(value) > FILE_HASH_HEX_MAX) {
+    LOG_WARN("The fingerprint [%s] is broken, ignore it.", self->fCachePath);
+  } else {
+    sse_strcpy(self->fHash, value);
+    self->fDev = dev;
+    self->fIno = ino;
+    self->fSize = size;
+    self->fMtimeSec = sec;
+    self->fMtimeNsec = nsec;
+    if (fgets(line, FILE_FINGERPRINT_LINE_SIZE, fp) && (value = FILEFingerprint_GetLineValue(line, "etag")) != NULL) {
+      self->fETag = sse_strdup(value);
+      ASSERT(self->fETag);
+    }
+    self->fCached = sse_true;
+  }
+  sse_free(line);
+  fclose(fp);
+}
+
+/* Replace the cache atomically. */
+static sse_int
+TFILEFingerprint_Save(TFILEFingerprint *self)
+{
+  sse_char *tmp_path;
+  sse_size len;
+  FILE *fp;
+  int ret;
+
+  len = sse_strlen(self->fCachePath) + sizeof(".new");
+  tmp_path = sse_malloc(len);
+  ASSERT(tmp_path);
+  snprintf(tmp_path, len, "%s.new", self->fCachePath);
+  fp = fopen(tmp_path, "w");
+  if (fp == NULL) {
+    LOG_ERROR("fopen(%s) has been failed with [%s].", tmp_path, strerror(errno));
+    sse_free(tmp_path);
+    return SSE_E_GENERIC;
+  }
+  ret = fprintf(fp, FILE_FINGERPRINT_MAGIC "\npath %s\nurl %s\nlevel %d %d\nstat %llu %llu %llu %lld %lld\nsha256 %s\n",
+                self->fFilePath, self->fDestination, self->fLevel, (self->fSparse) ? 1 : 0,
+                (unsigned long long)self->fDev, (unsigned long long)self->fIno, (unsigned long long)self->fSize,
+                (long long)self->fMtimeSec, (long long)self->fMtimeNsec, self->fHash);
+  if (ret >= 0 && self->fETag) {
+    ret = fprintf(fp, "etag %s\n", self->fETag);
+  }
+  if (ret < 0 || fflush(fp) != 0 || fdatasync(fileno(fp)) != 0) {
+    LOG_ERROR("Writing [%s] has been failed with [%s].", tmp_path, strerror(errno));
+    fclose(fp);
+    unlink(tmp_path);
+    sse_free(tmp_path);
+    return SSE_E_GENERIC;
+  }
+  fclose(fp);
+  if (rename(tmp_path, self->fCachePath) != 0) {
+    LOG_ERROR("rename(%s) has been failed with [%s].", tmp_path, strerror(errno));
+    unlink(tmp_path);
+    sse_free(tmp_path);
+    return SSE_E_GENERIC;
+  }
+  sse_free(tmp_path);
+  return SSE_E_OK;
+}
+
+/*
+ * Constructor / Destructor
+ */
+
+TFILEFingerprint*
+FILEFingerprint_New(const sse_char *in_file_path,
+                    const sse_char *in_url,
+                    sse_int in_level,
+                    sse_bool in_sparse,
+                    const sse_char *in_cache_dir)
+{
+  TFILEFingerprint *self;
+  const sse_char *name;
+  sse_size len;
+
+  ASSERT(in_file_path);
+  ASSERT(in_url);
+  ASSERT(in_cache_dir);
+
+  self = sse_zeroalloc(sizeof(TFILEFingerprint));
+  ASSERT(self);
+  self->fFilePath = sse_strdup(in_file_path);
+  ASSERT(self->fFilePath);
+  self->fDestination = sse_strndup(in_url, strcspn(in_url, "?#"));
+  ASSERT(self->fDestination);
+  self->fLevel = in_level;
+  self->fSparse = in_sparse;
+  name = sse_strrchr(in_file_path, '/');
+  name = (name) ? name + 1 : in_file_path;
+  len = sse_strlen(in_cache_dir) + 1 + sse_strlen(name) + 1 + 8 + sizeof(".fingerprint");
+  self->fCachePath = sse_malloc(len);
+  ASSERT(self->fCachePath);
+  snprintf(self->fCachePath, len, "%s/%s-%08x.fingerprint", in_cache_dir, name, FILEHash_Fnv1a(in_file_path));
+  self->fCached = sse_false;
+  self->fHash[0] = '\0';
+  self->fETag = NULL;
+  TFILEFingerprint_Load(self);
+  return self;
+}
+
+void
+TFILEFingerprint_Delete(TFILEFingerprint *self)
+{
+  ASSERT(self);
+  if (self->fFilePath)    sse_free(self->fFilePath);
+  if (self->fCachePath)   sse_free(self->fCachePath);
+  if (self->fDestination) sse_free(self->fDestination);
+  if (self->fETag)        sse_free(self->fETag);
+  sse_free(self);
+}
+
+sse_bool
+TFILEFingerprint_IsUnchanged(TFILEFingerprint *self)
+{
+  struct stat st;
+  sse_char hash[FILE_HASH_HEX_MAX + 1];
+  sse_bool unchanged = sse_false;
+
+  ASSERT(self);
+
+  if (stat(self->fFilePath, &st) != 0 || !S_ISREG(st.st_mode)) {
+    self->fCached = sse_false;
+    return sse_false;
+  }
+  if (!self->fCached) {
+    LOG_DEBUG("[%s] has not been uploaded to the destination yet.", self->fFilePath);
+  } else if (TFILEFingerprint_IsSameStat(self, &st)) {
+    unchanged = sse_true;
+  } else if ((sse_uint64)st.st_size == self->fSize &&
+             FILEHash_HashFile(self->fFilePath, FILE_HASH_ALGORITHM_SHA256, hash) == SSE_E_OK &&
+             sse_strcmp(hash, self->fHash) == 0) {
+    /* Touched or rewritten with the same content, refresh the stat not to hash it again. */
+    TFILEFingerprint_SetStat(self, &st);
+    TFILEFingerprint_Save(self);
+    unchanged = sse_true;
+  }
+  if (unchanged) {
+    LOG_INFO("[%s] has not been modified since the last upload, sha256=[%s].", self->fFilePath, self->fHash);
+    return sse_true;
+  }
+  /* The file to be committed */
+  TFILEFingerprint_SetStat(self, &st);
+  self->fHash[0] = '\0';
+  self->fCached = sse_false;
+  return sse_false;
+}
+
+sse_int
+TFILEFingerprint_Commit(TFILEFingerprint *self,
+                        const sse_char *in_etag)
+{
+  struct stat st;
+  sse_int err;
+
+  ASSERT(self);
+
+  if (stat(self->fFilePath, &st) != 0 || !TFILEFingerprint_IsSameStat(self, &st)) {
+    LOG_WARN("[%s] has been modified while uploading, upload it again next time.", self->fFilePath);
+    return SSE_E_OK;
+  }
+  err = FILEHash_HashFile(self->fFilePath, FILE_HASH_ALGORITHM_SHA256, self->fHash);
+  if (err != SSE_E_OK) {
+    self->fHash[0] = '\0';
+    return err;
+  }
+  if (stat(self->fFilePath, &st) != 0 || !TFILEFingerprint_IsSameStat(self, &st)) {
+    LOG_WARN("[%s] has been modified while hashing, upload it again next time.", self->fFilePath);
+    self->fHash[0] = '\0';
+    return SSE_E_OK;
+  }
+  if (self->fETag) {
+    sse_free(self->fETag);
+    self->fETag = NULL;
+  }
+  if (in_etag) {
+    self->fETag = sse_strdup(in_etag);
+    ASSERT(self->fETag);
+  }
+  err = TFILEFingerprint_Save(self);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  self->fCached = sse_true;
+  LOG_DEBUG("The fingerprint of [%s] has been saved, sha256=[%s].", self->fFilePath, self->fHash);
+  return SSE_E_OK;
+}
+
+const sse_char*
+TFILEFingerprint_GetHash(TFILEFingerprint *self)
+{
+  ASSERT(self);
+  return (self->fHash[0]) ? self->fHash : NULL;
+}
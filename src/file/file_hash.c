@@ -0,0 +1,243 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+#define FILE_HASH_READ_SIZE (8192)
+
+sse_int
+TFILEHash_Initialize(TFILEHash *self,
+                     sse_int in_algo)
+{
+  ASSERT(self);
+
+  self->fAlgorithm = in_algo;
+  switch (in_algo) {
+  case FILE_HASH_ALGORITHM_MD5:
+    sse_hashlib_md5_init(&self->fContext.fMd5);
+    break;
+  case FILE_HASH_ALGORITHM_SHA1:
+    sse_hashlib_sha1_init(&self->fContext.fSha1);
+    break;
+  case FILE_HASH_ALGORITHM_SHA256:
+    sse_hashlib_sha256_init(&self->fContext.fSha256);
+    break;
+  default:
+    LOG_ERROR("Unknown hash algorithm=[%d].", in_algo);
+    return SSE_E_INVAL;
+  }
+  return SSE_E_OK;
+}
+
+void
+TFILEHash_Update(TFILEHash *self,
+                 const sse_byte *in_data,
+                 sse_size in_size)
+{
+  ASSERT(self);
+
+  switch (self->fAlgorithm) {
+  case FILE_HASH_ALGORITHM_MD5:
+    sse_hashlib_md5_update(&self->fContext.fMd5, (sse_byte*)in_data, in_size);
+    break;
+  case FILE_HASH_ALGORITHM_SHA1:
+    sse_hashlib_sha1_update(&self->fContext.fSha1, (sse_byte*)in_data, in_size);
+    break;
+  case FILE_HASH_ALGORITHM_SHA256:
+    sse_hashlib_sha256_update(&self->fContext.fSha256, (sse_byte*)in_data, in_size);
+    break;
+  default:
+    break;
+  }
+}
+
+sse_uint
+TFILEHash_Finalize(TFILEHash *self,
+                   sse_char *out_hex)
+{
+  static const sse_char hex[] = "0123456789abcdef";
+  sse_byte md[SHA256_MD_BYTES];
+  sse_uint md_len;
+  sse_uint i;
+
+  ASSERT(self);
+  ASSERT(out_hex);
+
+  switch (self->fAlgorithm) {
+  case FILE_HASH_ALGORITHM_MD5:
+    sse_hashlib_md5_fini(&self->fContext.fMd5, md);
+    md_len = MD5_MD_BYTES;
+    break;
+  case FILE_HASH_ALGORITHM_SHA1:
+    sse_hashlib_sha1_fini(&self->fContext.fSha1, md);
+    md_len = SHA1_MD_BYTES;
+    break;
+  case FILE_HASH_ALGORITHM_SHA256:
+    sse_hashlib_sha256_fini(&self->fContext.fSha256, md);
+    md_len = SHA256_MD_BYTES;
+    break;
+  default:
+    md_len = 0;
+    break;
+  }
+  for (i = 0; i < md_len; i++) {
+    out_hex[i * 2]     = hex[md[i] >> 4];
+    out_hex[i * 2 + 1] = hex[md[i] & 0x0f];
+  }
+  out_hex[md_len * 2] = '\0';
+  return md_len * 2;
+}
+
+sse_uint32
+FILEHash_Fnv1a(const sse_char *in_str)
+{
+  sse_uint32 hash = 2166136261U;
+
+  ASSERT(in_str);
+  while (*in_str) {
+    hash ^= (sse_byte)*in_str++;
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+sse_int
+FILEHash_HashFile(const sse_char *in_path,
+                  sse_int in_algo,
+                  sse_char *out_hex)
+{
+  TFILEHash hash;
+  sse_byte buf[FILE_HASH_READ_SIZE];
+  ssize_t n;
+  sse_int fd;
+  sse_int err;
+
+  ASSERT(in_path);
+  ASSERT(out_hex);
+
+  err = TFILEHash_Initialize(&hash, in_algo);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  fd = open(in_path, O_RDONLY);
+  if (fd < 0) {
+    LOG_ERROR("open(%s) has been failed with [%s].", in_path, strerror(errno));
+    return (errno == ENOENT) ? SSE_E_NOENT : (errno == EACCES) ? SSE_E_ACCES : SSE_E_GENERIC;
+  }
+  while ((n = read(fd, buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_ERROR("read(%s) has been failed with [%s].", in_path, strerror(errno));
+      close(fd);
+      return SSE_E_GENERIC;
+    }
+    TFILEHash_Update(&hash, buf, n);
+  }
+  close(fd);
+  TFILEHash_Finalize(&hash, out_hex);
+  return SSE_E_OK;
+}
+
+sse_int
+FILEHash_ParseHash(MoatValue *in_hash,
+                   sse_int *out_algo,
+                   sse_char **out_hex,
+                   sse_uint *out_len)
+{
+  sse_char *str;
+  sse_uint len;
+  sse_char *p;
+  sse_int err;
+
+  ASSERT(in_hash);
+  ASSERT(out_algo);
+  ASSERT(out_hex);
+  ASSERT(out_len);
+
+  err = moat_value_get_string(in_hash, &str, &len);
+  if (err != SSE_E_OK) {
+    return SSE_E_INVAL;
+  }
+  p = sse_strnchr(str, len, ':');
+  if (p) {
+    if ((p - str == 6) && (sse_strncasecmp(str, "sha256", 6) == 0)) {
+      *out_algo = FILE_HASH_ALGORITHM_SHA256;
+    } else if ((p - str == 4) && (sse_strncasecmp(str, "sha1", 4) == 0)) {
+      *out_algo = FILE_HASH_ALGORITHM_SHA1;
+    } else if ((p - str == 3) && (sse_strncasecmp(str, "md5", 3) == 0)) {
+      *out_algo = FILE_HASH_ALGORITHM_MD5;
+    } else {
+      LOG_ERROR("Unknown hash algorithm=[%.*s].", (sse_int)(p - str), str);
+      return SSE_E_INVAL;
+    }
+    len -= (p + 1 - str);
+    str = p + 1;
+  } else if (len == SHA256_MD_BYTES * 2) {
+    *out_algo = FILE_HASH_ALGORITHM_SHA256;
+  } else if (len == SHA1_MD_BYTES * 2) {
+    *out_algo = FILE_HASH_ALGORITHM_SHA1;
+  } else if (len == MD5_MD_BYTES * 2) {
+    *out_algo = FILE_HASH_ALGORITHM_MD5;
+  } else {
+    LOG_ERROR("Could not guess the hash algorithm from length=[%d].", len);
+    return SSE_E_INVAL;
+  }
+  *out_hex = str;
+  *out_len = len;
+  return SSE_E_OK;
+}
+
+sse_int
+FILEHash_VerifyFile(const sse_char *in_path,
+                    sse_int in_algo,
+                    const sse_char *in_hex,
+                    sse_uint in_len)
+{
+  sse_char actual[FILE_HASH_HEX_MAX + 1];
+  sse_uint actual_len;
+  sse_int err;
+
+  err = FILEHash_HashFile(in_path, in_algo, actual);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  actual_len = sse_strlen(actual);
+  if ((actual_len != in_len) || (sse_strncasecmp(actual, in_hex, in_len) != 0)) {
+    LOG_ERROR("Hash mismatch, path=[%s], expected=[%.*s], actual=[%s].", in_path, in_len, in_hex, actual);
+    return SSE_E_INVAL;
+  }
+  LOG_DEBUG("Hash matches, path=[%s], hash=[%s].", in_path, actual);
+  return SSE_E_OK;
+}
@@ -0,0 +1,198 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+/* Windows mapped in the process, read by the SIGBUS handler. */
+static TFILEMapWindow *gFILEMapWindows[FILE_MMAP_WINDOWS_MAX];
+static struct sigaction gFILEMapPreviousAction;
+static pthread_once_t gFILEMapOnce = PTHREAD_ONCE_INIT;
+static sse_bool gFILEMapInstalled = sse_false;
+static uintptr_t gFILEMapPageSize;
+
+/* Replace the page beyond the end of the file with zeros, only async-signal-safe calls here. */
+static void
+FILEMapWindow_OnSigbus(int in_signo,
+                       siginfo_t *in_info,
+                       void *in_context)
+{
+  TFILEMapWindow *window;
+  uintptr_t addr = (uintptr_t)in_info->si_addr;
+  uintptr_t page;
+  sse_uint i;
+
+  for (i = 0; i < FILE_MMAP_WINDOWS_MAX; i++) {
+    window = __atomic_load_n(&gFILEMapWindows[i], __ATOMIC_ACQUIRE);
+    if (window == NULL || addr < (uintptr_t)window->fBase || addr >= (uintptr_t)window->fBase + window->fMapLength) {
+      continue;
+    }
+    page = addr & ~(gFILEMapPageSize - 1);
+    if (mmap((void *)page, gFILEMapPageSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+      window->fTruncated = 1;
+      return;
+    }
+    break;
+  }
+  /* Not in the windows */
+  if ((gFILEMapPreviousAction.sa_flags & SA_SIGINFO) && gFILEMapPreviousAction.sa_sigaction) {
+    gFILEMapPreviousAction.sa_sigaction(in_signo, in_info, in_context);
+  } else if (!(gFILEMapPreviousAction.sa_flags & SA_SIGINFO) &&
+             gFILEMapPreviousAction.sa_handler != SIG_DFL && gFILEMapPreviousAction.sa_handler != SIG_IGN) {
+    gFILEMapPreviousAction.sa_handler(in_signo);
+  } else {
+    /* The fault happens again with the default action, or raise it if sent by kill(2). */
+    signal(SIGBUS, SIG_DFL);
+    if (in_info->si_code <= 0) {
+      raise(SIGBUS);
+    }
+  }
+}
+
+static void
+FILEMapWindow_Install(void)
+{
+  struct sigaction action;
+
+  gFILEMapPageSize = sysconf(_SC_PAGESIZE);
+  sse_memset(&action, 0, sizeof(action));
+  action.sa_sigaction = FILEMapWindow_OnSigbus;
+  action.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGBUS, &action, &gFILEMapPreviousAction) != 0) {
+    LOG_ERROR("sigaction(SIGBUS) has been failed with [%s], files are not mapped.", strerror(errno));
+    return;
+  }
+  gFILEMapInstalled = sse_true;
+}
+
+static sse_bool
+TFILEMapWindow_Register(TFILEMapWindow *self)
+{
+  TFILEMapWindow *expected;
+  sse_uint i;
+
+  for (i = 0; i < FILE_MMAP_WINDOWS_MAX; i++) {
+    expected = NULL;
+    if (__atomic_compare_exchange_n(&gFILEMapWindows[i], &expected, self, sse_false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      return sse_true;
+    }
+  }
+  return sse_false;
+}
+
+static void
+TFILEMapWindow_Unregister(TFILEMapWindow *self)
+{
+  sse_uint i;
+
+  for (i = 0; i < FILE_MMAP_WINDOWS_MAX; i++) {
+    if (__atomic_load_n(&gFILEMapWindows[i], __ATOMIC_RELAXED) == self) {
+      __atomic_store_n(&gFILEMapWindows[i], NULL, __ATOMIC_RELEASE);
+      return;
+    }
+  }
+}
+
+void
+TFILEMapWindow_Initialize(TFILEMapWindow *self)
+{
+  ASSERT(self);
+  self->fBase = NULL;
+  self->fMapLength = 0;
+  self->fData = NULL;
+  self->fLength = 0;
+  self->fTruncated = 0;
+}
+
+void
+TFILEMapWindow_Finalize(TFILEMapWindow *self)
+{
+  ASSERT(self);
+  if (self->fBase == NULL) {
+    return;
+  }
+  TFILEMapWindow_Unregister(self);
+  munmap(self->fBase, self->fMapLength);
+  TFILEMapWindow_Initialize(self);
+}
+
+sse_int
+TFILEMapWindow_Map(TFILEMapWindow *self,
+                   int in_fd,
+                   sse_uint64 in_offset,
+                   sse_size in_length)
+{
+  sse_uint64 aligned;
+  void *base;
+
+  ASSERT(self);
+  ASSERT(in_length > 0);
+  TFILEMapWindow_Finalize(self);
+  pthread_once(&gFILEMapOnce, FILEMapWindow_Install);
+  if (!gFILEMapInstalled) {
+    return SSE_E_GENERIC;
+  }
+  aligned = in_offset & ~(sse_uint64)(gFILEMapPageSize - 1);
+  base = mmap(NULL, in_length + (in_offset - aligned), PROT_READ, MAP_SHARED, in_fd, aligned);
+  if (base == MAP_FAILED) {
+    LOG_WARN("mmap() has been failed with [%s].", strerror(errno));
+    return (errno == ENOMEM) ? SSE_E_NOMEM : SSE_E_GENERIC;
+  }
+  self->fBase = base;
+  self->fMapLength = in_length + (in_offset - aligned);
+  self->fData = self->fBase + (in_offset - aligned);
+  self->fLength = in_length;
+  self->fTruncated = 0;
+  if (!TFILEMapWindow_Register(self)) {
+    LOG_WARN("Too many windows are mapped.");
+    munmap(self->fBase, self->fMapLength);
+    TFILEMapWindow_Initialize(self);
+    return SSE_E_NOMEM;
+  }
+  /* Read the window ahead as a whole, and drop the pages behind as they are read. */
+  madvise(self->fBase, self->fMapLength, MADV_SEQUENTIAL);
+  madvise(self->fBase, self->fMapLength, MADV_WILLNEED);
+  return SSE_E_OK;
+}
+
+sse_bool
+TFILEMapWindow_IsTruncated(TFILEMapWindow *self)
+{
+  ASSERT(self);
+  return (self->fTruncated != 0);
+}
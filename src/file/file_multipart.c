@@ -0,0 +1,2098 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+#define FILE_MULTIPART_CHECKPOINT_MAGIC "multipart-checkpoint 1"
+#define FILE_MULTIPART_LINE_SIZE        (2048)
+#define FILE_MULTIPART_CONTENT_TYPE     "application/octet-stream"
+#define FILE_MULTIPART_XML_TYPE         "application/xml"
+
+static void FILEMultipartUpload_OnIdle(MoatIdle *in_idle, sse_pointer in_user_data);
+static void FILEMultipartUpload_OnTimer(MoatIOWatcher *in_watcher, sse_pointer in_user_data, sse_int in_desc, sse_int in_event_flags);
+static void TFILEMultipartUpload_StartCompress(TFILEMultipartUpload *self, TFILEMultipartSlot *in_slot, sse_size in_min_out);
+static void TFILEMultipartUpload_Free(TFILEMultipartUpload *self);
+static void FILEMultipartUpload_OnSourceReadable(MoatIOWatcher *in_watcher, sse_pointer in_user_data, sse_int in_desc, sse_int in_event_flags);
+
+/*
+ * Helpers
+ */
+
+/* Append the query to the URL, the URL may have a query already (e.g. pre-signed URL). */
+static sse_char*
+FILEMultipart_AppendQuery(const sse_char *in_url,
+                          const sse_char *in_query)
+{
+  sse_char *url;
+  sse_size len;
+
+  len = sse_strlen(in_url) + 1 + sse_strlen(in_query) + 1;
+  url = sse_malloc(len);
+  ASSERT(url);
+  snprintf(url, len, "%s%c%s", in_url, (sse_strchr(in_url, '?') == NULL) ? '?' : '&', in_query);
+  return url;
+}
+
+/* Find the text of the XML element, e.g. <UploadId>...</UploadId>. */
+static sse_char*
+FILEMultipart_FindXmlElement(const sse_byte *in_body,
+                             sse_size in_len,
+                             const sse_char *in_name)
+{
+  sse_char *body;
+  sse_char *start;
+  sse_char *end;
+  sse_char tag[64];
+  sse_char *value = NULL;
+
+  body = sse_strndup((const sse_char *)in_body, in_len);
+  ASSERT(body);
+  snprintf(tag, sizeof(tag), "<%s>", in_name);
+  start = strstr(body, tag);
+  if (start) {
+    start += sse_strlen(tag);
+    snprintf(tag, sizeof(tag), "</%s>", in_name);
+    end = strstr(start, tag);
+    if (end) {
+      value = sse_strndup(start, end - start);
+      ASSERT(value);
+    }
+  }
+  sse_free(body);
+  return value;
+}
+
+/*
+ * HTTP exchange
+ */
+
+static void
+TFILEMultipartExchange_Initialize(TFILEMultipartExchange *self)
+{
+  self->fHttp = moat_httpc_new();
+  ASSERT(self->fHttp);
+  self->fActive = sse_false;
+  self->fSent = sse_false;
+  self->fRetries = 0;
+  self->fStarted = 0;
+}
+
+static void
+TFILEMultipartExchange_Finalize(TFILEMultipartExchange *self)
+{
+  if (self->fHttp) moat_httpc_free(self->fHttp);
+  self->fHttp = NULL;
+}
+
+/* The body must be kept until the response has been received. */
+static sse_int
+TFILEMultipartExchange_Start(TFILEMultipartExchange *self,
+                             sse_int in_method,
+                             sse_char *in_url,
+                             sse_char *in_content_type,
+                             sse_char *in_content_encoding,
+                             const sse_byte *in_body,
+                             sse_size in_length)
+{
+  MoatHttpRequest *req;
+  sse_int err;
+
+  moat_httpc_reset(self->fHttp);
+  req = moat_httpc_create_request(self->fHttp, in_method, in_url, sse_strlen(in_url));
+  if (req == NULL) {
+    LOG_ERROR("moat_httpc_create_request() has been failed.");
+    return SSE_E_GENERIC;
+  }
+  if (in_content_encoding) {
+    err = moat_httpreq_add_header(req, "Content-Encoding", 16, in_content_encoding, sse_strlen(in_content_encoding));
+    if (err != SSE_E_OK) {
+      LOG_ERROR("moat_httpreq_add_header() has been failed with [%s].", sse_get_error_string(err));
+      moat_httpreq_free(req);
+      return err;
+    }
+  }
+  if (in_content_type) {
+    err = moat_httpreq_set_data(req, (sse_byte *)in_body, in_length, in_content_type, sse_strlen(in_content_type));
+    if (err != SSE_E_OK) {
+      LOG_ERROR("moat_httpreq_set_data() has been failed with [%s].", sse_get_error_string(err));
+      moat_httpreq_free(req);
+      return err;
+    }
+  }
+  err = moat_httpc_send_request(self->fHttp, req);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("moat_httpc_send_request() has been failed with [%s].", sse_get_error_string(err));
+    return err;
+  }
+  self->fActive = sse_true;
+  self->fSent = sse_false;
+  self->fStarted = FILECompress_Now();
+  return SSE_E_OK;
+}
+
+/*
+ * Proceed the exchange a step. *out_done is set when the response has been received, *io_progress
+ * when anything has been sent or received.
+ */
+static sse_int
+TFILEMultipartExchange_Poll(TFILEMultipartExchange *self,
+                            sse_bool *out_done,
+                            sse_bool *io_progress)
+{
+  sse_int err;
+  sse_bool complete = sse_false;
+
+  *out_done = sse_false;
+  if (!self->fSent) {
+    err = moat_httpc_do_send(self->fHttp, &complete);
+    if (err != SSE_E_OK && err != SSE_E_AGAIN && err != SSE_E_INPROGRESS) {
+      LOG_ERROR("moat_httpc_do_send() has been failed with [%s].", sse_get_error_string(err));
+      return err;
+    }
+    if (err == SSE_E_OK || complete) {
+      *io_progress = sse_true;
+    }
+    if (complete) {
+      err = moat_httpc_recv_response(self->fHttp);
+      if (err != SSE_E_OK) {
+        LOG_ERROR("moat_httpc_recv_response() has been failed with [%s].", sse_get_error_string(err));
+        return err;
+      }
+      self->fSent = sse_true;
+    }
+    return SSE_E_OK;
+  }
+  err = moat_httpc_do_recv(self->fHttp, &complete);
+  if (err != SSE_E_OK && err != SSE_E_AGAIN && err != SSE_E_INPROGRESS) {
+    LOG_ERROR("moat_httpc_do_recv() has been failed with [%s].", sse_get_error_string(err));
+    return err;
+  }
+  if (err == SSE_E_OK || complete) {
+    *io_progress = sse_true;
+  }
+  if (complete) {
+    self->fActive = sse_false;
+    *out_done = sse_true;
+  }
+  return SSE_E_OK;
+}
+
+static sse_int
+TFILEMultipartExchange_GetStatus(TFILEMultipartExchange *self)
+{
+  MoatHttpResponse *res;
+  sse_int status = 0;
+
+  res = moat_httpc_get_response(self->fHttp);
+  if (res == NULL || moat_httpres_get_status_code(res, &status) != SSE_E_OK) {
+    return 0;
+  }
+  return status;
+}
+
+/* Drop the request in progress. */
+static void
+TFILEMultipartExchange_Abort(TFILEMultipartExchange *self)
+{
+  if (self->fActive) {
+    moat_httpc_reset(self->fHttp);
+    self->fActive = sse_false;
+  }
+}
+
+/*
+ * Destination
+ */
+
+static void
+TFILEMultipartTarget_Initialize(TFILEMultipartTarget *self,
+                                const sse_char *in_url,
+                                sse_uint in_concurrency)
+{
+  sse_uint i;
+
+  self->fUrl = sse_strdup(in_url);
+  ASSERT(self->fUrl);
+  self->fUploadId = NULL;
+  self->fETags = NULL;
+  self->fETag = NULL;
+  TFILEMultipartExchange_Initialize(&self->fControl);
+  self->fBody = NULL;
+  self->fExchanges = sse_zeroalloc(sizeof(TFILEMultipartExchange) * in_concurrency);
+  ASSERT(self->fExchanges);
+  for (i = 0; i < in_concurrency; i++) {
+    TFILEMultipartExchange_Initialize(&self->fExchanges[i]);
+  }
+  self->fState = FILE_MULTIPART_STATE_READY;
+  self->fErrCode = NULL;
+  self->fErrMsg = NULL;
+}
+
+/* The ETags of the parts are freed with TFILEMultipartUpload_ClearParts(). */
+static void
+TFILEMultipartTarget_Finalize(TFILEMultipartTarget *self,
+                              sse_uint in_concurrency)
+{
+  sse_uint i;
+
+  TFILEMultipartExchange_Finalize(&self->fControl);
+  for (i = 0; i < in_concurrency; i++) {
+    TFILEMultipartExchange_Finalize(&self->fExchanges[i]);
+  }
+  sse_free(self->fExchanges);
+  if (self->fETags)    sse_free(self->fETags);
+  if (self->fUploadId) sse_free(self->fUploadId);
+  if (self->fETag)     sse_free(self->fETag);
+  if (self->fBody)     sse_free(self->fBody);
+  if (self->fUrl)      sse_free(self->fUrl);
+}
+
+/* sse_true unless the upload to the destination has been completed or failed. */
+static sse_bool
+TFILEMultipartTarget_IsAlive(TFILEMultipartTarget *self)
+{
+  return self->fState != FILE_MULTIPART_STATE_DONE;
+}
+
+/*
+ * Checkpoint
+ */
+
+/* Compare the URL without the query, which may be re-signed for each request. */
+static sse_bool
+FILEMultipart_EqualsUrl(const sse_char *in_url1,
+                        const sse_char *in_url2)
+{
+  sse_size len1 = strcspn(in_url1, "?");
+  sse_size len2 = strcspn(in_url2, "?");
+
+  return (len1 == len2) && (sse_strncmp(in_url1, in_url2, len1) == 0);
+}
+
+/* Make sure that fETags of the destinations and fEnds have room for the part. */
+static void
+TFILEMultipartUpload_ReservePart(TFILEMultipartUpload *self,
+                                 sse_uint in_part)
+{
+  TFILEMultipartTarget *target;
+  sse_char **etags;
+  sse_uint64 *ends;
+  sse_uint capacity;
+  sse_uint i;
+
+  if (in_part <= self->fPartCapacity) {
+    return;
+  }
+  capacity = (self->fPartCapacity * 2 < in_part) ? in_part : self->fPartCapacity * 2;
+  for (i = 0; i < self->fTargetCount; i++) {
+    target = &self->fTargets[i];
+    etags = sse_zeroalloc(sizeof(sse_char*) * capacity);
+    ASSERT(etags);
+    if (target->fETags) {
+      sse_memcpy(etags, target->fETags, sizeof(sse_char*) * self->fPartCapacity);
+      sse_free(target->fETags);
+    }
+    target->fETags = etags;
+  }
+  ends = sse_zeroalloc(sizeof(sse_uint64) * capacity);
+  ASSERT(ends);
+  if (self->fEnds) {
+    sse_memcpy(ends, self->fEnds, sizeof(sse_uint64) * self->fPartCapacity);
+    sse_free(self->fEnds);
+  }
+  self->fEnds = ends;
+  self->fPartCapacity = capacity;
+}
+
+static void
+TFILEMultipartUpload_ClearParts(TFILEMultipartUpload *self,
+                                sse_uint in_from)
+{
+  TFILEMultipartTarget *target;
+  sse_uint part;
+  sse_uint i;
+
+  for (part = in_from; part < self->fPartCapacity; part++) {
+    for (i = 0; i < self->fTargetCount; i++) {
+      target = &self->fTargets[i];
+      if (target->fETags[part]) {
+        sse_free(target->fETags[part]);
+        target->fETags[part] = NULL;
+      }
+    }
+    self->fEnds[part] = 0;
+  }
+}
+
+/* The checkpoint is used with a single destination only. */
+static sse_bool
+TFILEMultipartUpload_LoadCheckpoint(TFILEMultipartUpload *self)
+{
+  TFILEMultipartTarget *target = &self->fTargets[0];
+  FILE *fp;
+  sse_char line[FILE_MULTIPART_LINE_SIZE];
+  unsigned long long size;
+  long long mtime;
+  unsigned long long part_size;
+  unsigned long long end;
+  unsigned long long start;
+  int level;
+  int sparse;
+  sse_uint part;
+  sse_char *etag;
+  sse_char *p;
+  sse_bool valid = sse_false;
+  sse_uint count = 0;
+
+  if (self->fCheckpointPath == NULL) {
+    return sse_false;
+  }
+  fp = fopen(self->fCheckpointPath, "r");
+  if (fp == NULL) {
+    return sse_false;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (!valid) {
+      /* Header: magic, source range, mtime, part size, compression and sparse image */
+      if (sse_strcmp(line, FILE_MULTIPART_CHECKPOINT_MAGIC) != 0 ||
+          !fgets(line, sizeof(line), fp)) {
+        break;
+      }
+      line[strcspn(line, "\r\n")] = '\0';
+      if (sscanf(line, "source %llu %llu %lld %llu %d %d", &start, &size, &mtime, &part_size, &level, &sparse) != 6 ||
+          start != self->fSource.fStart || size != self->fFileSize || mtime != self->fMtime || part_size != self->fPartSize ||
+          (level == FILE_COMPRESS_NONE) != (self->fCompressLevel == FILE_COMPRESS_NONE) || (sparse != 0) != self->fSparse) {
+        LOG_INFO("The source file or the settings have been changed since the checkpoint.");
+        break;
+      }
+      valid = sse_true;
+    } else if (sse_strncmp(line, "url ", 4) == 0) {
+      if (!FILEMultipart_EqualsUrl(line + 4, target->fUrl)) {
+        LOG_INFO("The upload URL has been changed since the checkpoint.");
+        valid = sse_false;
+        break;
+      }
+    } else if (sse_strncmp(line, "uploadid ", 9) == 0) {
+      if (target->fUploadId) sse_free(target->fUploadId);
+      target->fUploadId = sse_strdup(line + 9);
+      ASSERT(target->fUploadId);
+    } else if (sse_strncmp(line, "part ", 5) == 0) {
+      /* part <number> <etag> [<end offset if compressed>] */
+      part = (sse_uint)strtoul(line + 5, &p, 10);
+      if (part == 0 || part > FILE_MULTIPART_MAX_PARTS || *p != ' ') {
+        continue;
+      }
+      etag = p + 1;
+      end = 0;
+      p = sse_strchr(etag, ' ');
+      if (p) {
+        *p++ = '\0';
+        end = strtoull(p, NULL, 10);
+      }
+      if (self->fCompressLevel == FILE_COMPRESS_NONE) {
+        if (part > self->fPartCount) {
+          continue;
+        }
+      } else if (end == 0 || end > self->fFileSize) {
+        continue;
+      } else {
+        TFILEMultipartUpload_ReservePart(self, part);
+      }
+      if (target->fETags[part - 1]) {
+        sse_free(target->fETags[part - 1]);
+      }
+      target->fETags[part - 1] = sse_strdup(etag);
+      ASSERT(target->fETags[part - 1]);
+      self->fEnds[part - 1] = end;
+    }
+  }
+  fclose(fp);
+
+  if (!valid || target->fUploadId == NULL) {
+    TFILEMultipartUpload_ClearParts(self, 0);
+    if (target->fUploadId) {
+      sse_free(target->fUploadId);
+      target->fUploadId = NULL;
+    }
+    unlink(self->fCheckpointPath);
+    return sse_false;
+  }
+
+  if (self->fCompressLevel == FILE_COMPRESS_NONE) {
+    for (part = 0; part < self->fPartCount; part++) {
+      if (target->fETags[part]) count++;
+    }
+    LOG_INFO("Resume the upload, %u of %u parts have been uploaded.", count, self->fPartCount);
+  } else {
+    /* The boundaries of the compressed parts are known up to the first missing part only. */
+    while (count < self->fPartCapacity && target->fETags[count]) {
+      count++;
+    }
+    TFILEMultipartUpload_ClearParts(self, count);
+    self->fPartCount = count;
+    self->fNextPart = count;
+    self->fReadOffset = (count > 0) ? self->fEnds[count - 1] : 0;
+    LOG_INFO("Resume the upload from offset %llu, %u parts have been uploaded.",
+             (unsigned long long)self->fReadOffset, count);
+  }
+  return sse_true;
+}
+
+/*
+ * fdatasync(2) of the checkpoint on a worker. It outlives the upload, which leaves it to write
+ * back the checkpoint and to free itself when done.
+ */
+struct FILEMultipartCheckpointJob_ {
+  TFILEMultipartUpload *fOwner;            /** NULL once the upload has been freed */
+  int fFd;                                 /** dup() of the checkpoint */
+  int fErrno;                              /** errno of fdatasync(2), 0 if succeeded */
+  TFILEWorkerJob *fJob;
+};
+typedef struct FILEMultipartCheckpointJob_ FILEMultipartCheckpointJob;
+
+static void TFILEMultipartUpload_SyncCheckpoint(TFILEMultipartUpload *self);
+
+/* Runs on a worker thread. */
+static void
+FILEMultipartUpload_CheckpointWork(sse_pointer in_user_data)
+{
+  FILEMultipartCheckpointJob *job = (FILEMultipartCheckpointJob *)in_user_data;
+
+  if (fdatasync(job->fFd) != 0) {
+    job->fErrno = errno;
+  }
+}
+
+static void
+FILEMultipartUpload_OnCheckpointDone(sse_pointer in_user_data,
+                                     sse_bool in_canceled)
+{
+  FILEMultipartCheckpointJob *job = (FILEMultipartCheckpointJob *)in_user_data;
+  TFILEMultipartUpload *self = job->fOwner;
+  int err = job->fErrno;
+
+  close(job->fFd);
+  sse_free(job);
+  if (self == NULL) {
+    return;
+  }
+  self->fCheckpointJob = NULL;
+  if (in_canceled) {
+    return;
+  }
+  if (err != 0) {
+    LOG_WARN("Writing the checkpoint [%s] has been failed with [%s].", self->fCheckpointPath, strerror(err));
+  }
+  if (self->fCheckpointDirty) {
+    TFILEMultipartUpload_SyncCheckpoint(self);
+  }
+}
+
+/* Write back the checkpoint, once the job running has been done if any. */
+static void
+TFILEMultipartUpload_SyncCheckpoint(TFILEMultipartUpload *self)
+{
+  FILEMultipartCheckpointJob *job;
+
+  if (self->fCheckpointJob) {
+    self->fCheckpointDirty = sse_true;
+    return;
+  }
+  self->fCheckpointDirty = sse_false;
+  if (self->fCheckpointFd < 0) {
+    return;
+  }
+  if (self->fWorkers == NULL) {
+    if (fdatasync(self->fCheckpointFd) != 0) {
+      LOG_WARN("Writing the checkpoint [%s] has been failed with [%s].", self->fCheckpointPath, strerror(errno));
+    }
+    return;
+  }
+  job = sse_zeroalloc(sizeof(FILEMultipartCheckpointJob));
+  ASSERT(job);
+  job->fOwner = self;
+  /* The worker has its own descriptor, the checkpoint may be closed while it is written back. */
+  job->fFd = dup(self->fCheckpointFd);
+  if (job->fFd < 0) {
+    LOG_WARN("dup(%s) has been failed with [%s].", self->fCheckpointPath, strerror(errno));
+    sse_free(job);
+    return;
+  }
+  self->fCheckpointJob = job;
+  job->fJob = TFILEWorkerPool_Submit(self->fWorkers, FILEMultipartUpload_CheckpointWork,
+                                     FILEMultipartUpload_OnCheckpointDone, job);
+}
+
+/* Close the checkpoint, and remove it if in_remove. */
+static void
+TFILEMultipartUpload_CloseCheckpoint(TFILEMultipartUpload *self,
+                                     sse_bool in_remove)
+{
+  if (self->fCheckpointFd >= 0) {
+    close(self->fCheckpointFd);
+    self->fCheckpointFd = -1;
+  }
+  self->fCheckpointDirty = sse_false;
+  if (in_remove && self->fCheckpointPath) {
+    unlink(self->fCheckpointPath);
+  }
+}
+
+/* Append a record to the checkpoint, or start it over with in_mode "w". */
+static sse_int
+TFILEMultipartUpload_WriteCheckpoint(TFILEMultipartUpload *self,
+                                     const sse_char *in_mode,
+                                     const sse_char *in_format,
+                                     ...)
+{
+  va_list args;
+  int ret;
+
+  if (self->fCheckpointPath == NULL) {
+    return SSE_E_OK;
+  }
+  if (in_mode[0] == 'w' || self->fCheckpointFd < 0) {
+    TFILEMultipartUpload_CloseCheckpoint(self, sse_false);
+    self->fCheckpointFd = open(self->fCheckpointPath,
+                               O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | ((in_mode[0] == 'w') ? O_TRUNC : 0), 0600);
+    if (self->fCheckpointFd < 0) {
+      LOG_WARN("open(%s) has been failed with [%s].", self->fCheckpointPath, strerror(errno));
+      return SSE_E_GENERIC;
+    }
+  }
+  va_start(args, in_format);
+  ret = vdprintf(self->fCheckpointFd, in_format, args);
+  va_end(args);
+  if (ret < 0) {
+    LOG_WARN("Writing the checkpoint [%s] has been failed with [%s].", self->fCheckpointPath, strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  TFILEMultipartUpload_SyncCheckpoint(self);
+  return SSE_E_OK;
+}
+
+/*
+ * Upload
+ */
+
+/* Stop polling the requests. The backoff is kept, see TFILEMultipartUpload_Wake(). */
+static void
+TFILEMultipartUpload_StopPolling(TFILEMultipartUpload *self)
+{
+  struct itimerspec its;
+
+  if (self->fIdle) {
+    moat_idle_stop(self->fIdle);
+  }
+  if (self->fTimer) {
+    sse_memset(&its, 0, sizeof(its));
+    timerfd_settime(self->fTimerFd, 0, &its, NULL);
+    moat_io_watcher_stop(self->fTimer);
+  }
+}
+
+/*
+ * Poll the requests on the next iteration of the event loop if this round has made progress,
+ * otherwise back off not to spin while waiting for the network.
+ */
+static void
+TFILEMultipartUpload_SchedulePolling(TFILEMultipartUpload *self)
+{
+  struct itimerspec its;
+
+  if (self->fProgress || self->fTimer == NULL) {
+    self->fBackoff = 0;
+    if (!moat_idle_is_active(self->fIdle)) {
+      moat_idle_start(self->fIdle);
+    }
+    return;
+  }
+  moat_idle_stop(self->fIdle);
+  if (self->fBackoff == 0) {
+    self->fBackoff = FILE_MULTIPART_POLL_MIN_MSEC;
+  } else if (self->fBackoff * 2 <= FILE_MULTIPART_POLL_MAX_MSEC) {
+    self->fBackoff *= 2;
+  } else {
+    self->fBackoff = FILE_MULTIPART_POLL_MAX_MSEC;
+  }
+  sse_memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = self->fBackoff / 1000;
+  its.it_value.tv_nsec = (long)(self->fBackoff % 1000) * 1000000L;
+  if (timerfd_settime(self->fTimerFd, 0, &its, NULL) != 0) {
+    LOG_WARN("timerfd_settime() has been failed with [%s].", strerror(errno));
+    moat_idle_start(self->fIdle);
+    return;
+  }
+  moat_io_watcher_start(self->fTimer);
+}
+
+/* Poll on the next iteration of the event loop, e.g. a part has been compressed. */
+static void
+TFILEMultipartUpload_Wake(TFILEMultipartUpload *self)
+{
+  TFILEMultipartUpload_StopPolling(self);
+  self->fBackoff = 0;
+  moat_idle_start(self->fIdle);
+}
+
+/* sse_true while waiting for the command to write more, see TFILEMultipartUpload_WaitSource(). */
+static sse_bool
+TFILEMultipartUpload_IsWaitingSource(TFILEMultipartUpload *self)
+{
+  return self->fSourceWatcher && moat_io_watcher_is_active(self->fSourceWatcher);
+}
+
+/* Wait for the command to write more. It is read again on the next polling if it is exiting. */
+static void
+TFILEMultipartUpload_WaitSource(TFILEMultipartUpload *self)
+{
+  sse_int fd = TFILESource_GetDescriptor(&self->fSource);
+
+  if (fd < 0) {
+    return;
+  }
+  if (self->fSourceWatcher == NULL) {
+    self->fSourceWatcher = moat_io_watcher_new(fd, FILEMultipartUpload_OnSourceReadable, self, MOAT_IO_FLAG_READ);
+    if (self->fSourceWatcher == NULL) {
+      LOG_WARN("The command cannot be watched, poll it instead.");
+      return;
+    }
+  }
+  moat_io_watcher_start(self->fSourceWatcher);
+}
+
+/*
+ * sse_true if no request is in progress, and a part is being compressed or waits for the command.
+ * Nothing has to be polled until the job is done or the command writes more.
+ */
+static sse_bool
+TFILEMultipartUpload_IsWaiting(TFILEMultipartUpload *self)
+{
+  TFILEMultipartTarget *target;
+  sse_uint i;
+  sse_uint j;
+
+  if (self->fCompressJob == NULL && !TFILEMultipartUpload_IsWaitingSource(self)) {
+    return sse_false;
+  }
+  for (i = 0; i < self->fTargetCount; i++) {
+    target = &self->fTargets[i];
+    if (target->fControl.fActive) {
+      return sse_false;
+    }
+    for (j = 0; j < self->fConcurrency; j++) {
+      if (target->fExchanges[j].fActive) {
+        return sse_false;
+      }
+    }
+  }
+  return sse_true;
+}
+
+/* Report the result of the destinations, the destinations still alive fail with the error if any. */
+static void
+TFILEMultipartUpload_Finish(TFILEMultipartUpload *self,
+                            const sse_char *in_err_code,
+                            const sse_char *in_err_msg)
+{
+  TFILEMultipartTarget *target;
+  sse_uint failed = 0;
+  sse_uint i;
+
+  TFILEMultipartUpload_StopPolling(self);
+  if (self->fSourceWatcher) {
+    moat_io_watcher_stop(self->fSourceWatcher);
+  }
+  self->fState = FILE_MULTIPART_STATE_DONE;
+  for (i = 0; i < self->fTargetCount; i++) {
+    target = &self->fTargets[i];
+    if (TFILEMultipartTarget_IsAlive(target)) {
+      target->fState = FILE_MULTIPART_STATE_DONE;
+      target->fErrCode = in_err_code;
+      target->fErrMsg = in_err_msg;
+    }
+    if (sse_strcmp(target->fErrCode, FILE_ERROR_OK) != 0) {
+      if (failed++ == 0) {
+        in_err_code = target->fErrCode;
+        in_err_msg = target->fErrMsg;
+      }
+    }
+  }
+  if (failed == 0) {
+    LOG_INFO("Upload of [%s] has been completed.", self->fFilePath);
+    TFILEMultipartUpload_CloseCheckpoint(self, sse_true);
+    in_err_code = FILE_ERROR_OK;
+    in_err_msg = "Uploading file has been complated successfuly.";
+  } else if (self->fTargetCount == 1) {
+    LOG_ERROR("Upload of [%s] has been failed, %s", self->fFilePath, in_err_msg);
+  } else {
+    LOG_ERROR("Upload of [%s] to %u of %u URLs has been failed.", self->fFilePath, failed, self->fTargetCount);
+    in_err_code = FILE_ERROR_UPLOAD;
+    in_err_msg = "Uploading file to some of the URLs has been failed.";
+  }
+  /* The callback may delete the instance. */
+  if (self->fOnCompleteCallback) {
+    self->fOnCompleteCallback(self, in_err_code, in_err_msg, self->fOnCompleteCallbackUserData);
+  }
+}
+
+static void
+TFILEMultipartUpload_SucceedTarget(TFILEMultipartUpload *self,
+                                   TFILEMultipartTarget *in_target)
+{
+  if (self->fTargetCount > 1) {
+    LOG_INFO("Upload of [%s] to the URL #%u has been completed.", self->fFilePath, (sse_uint)(in_target - self->fTargets));
+  }
+  in_target->fState = FILE_MULTIPART_STATE_DONE;
+  in_target->fErrCode = FILE_ERROR_OK;
+  in_target->fErrMsg = NULL;
+}
+
+/* Drop the destination, the upload to the others continues. */
+static void
+TFILEMultipartUpload_FailTarget(TFILEMultipartUpload *self,
+                                TFILEMultipartTarget *in_target,
+                                const sse_char *in_err_msg)
+{
+  sse_uint i;
+
+  if (self->fTargetCount > 1) {
+    LOG_ERROR("Upload of [%s] to the URL #%u has been failed, %s", self->fFilePath, (sse_uint)(in_target - self->fTargets), in_err_msg);
+  }
+  TFILEMultipartExchange_Abort(&in_target->fControl);
+  for (i = 0; i < self->fConcurrency; i++) {
+    TFILEMultipartExchange_Abort(&in_target->fExchanges[i]);
+  }
+  in_target->fState = FILE_MULTIPART_STATE_DONE;
+  in_target->fErrCode = FILE_ERROR_UPLOAD;
+  in_target->fErrMsg = in_err_msg;
+}
+
+/* The upload ID is no longer valid, the next upload starts over. */
+static void
+TFILEMultipartUpload_Abandon(TFILEMultipartUpload *self,
+                             TFILEMultipartTarget *in_target)
+{
+  LOG_WARN("The upload ID=[%s] has been rejected.", in_target->fUploadId);
+  TFILEMultipartUpload_CloseCheckpoint(self, sse_true);
+}
+
+static sse_char*
+TFILEMultipartUpload_GetContentEncoding(TFILEMultipartUpload *self)
+{
+  return (self->fCompressLevel == FILE_COMPRESS_NONE) ? NULL : "gzip";
+}
+
+static sse_int
+TFILEMultipartUpload_StartInitiate(TFILEMultipartUpload *self,
+                                   TFILEMultipartTarget *in_target)
+{
+  sse_char *url;
+  sse_int err;
+
+  url = FILEMultipart_AppendQuery(in_target->fUrl, "uploads");
+  err = TFILEMultipartExchange_Start(&in_target->fControl, MOAT_HTTP_METHOD_POST, url, FILE_MULTIPART_CONTENT_TYPE,
+                                     TFILEMultipartUpload_GetContentEncoding(self), NULL, 0);
+  sse_free(url);
+  if (err == SSE_E_OK) {
+    in_target->fState = FILE_MULTIPART_STATE_INITIATING;
+  }
+  return err;
+}
+
+static void
+TFILEMultipartUpload_OnInitiated(TFILEMultipartUpload *self,
+                                 TFILEMultipartTarget *in_target)
+{
+  MoatHttpResponse *res;
+  sse_byte *body = NULL;
+  sse_size len = 0;
+  sse_int status;
+
+  status = TFILEMultipartExchange_GetStatus(&in_target->fControl);
+  res = moat_httpc_get_response(in_target->fControl.fHttp);
+  if (res) {
+    moat_httpres_peek_body(res, &body, &len);
+  }
+  if (status != 200 || body == NULL ||
+      (in_target->fUploadId = FILEMultipart_FindXmlElement(body, len, "UploadId")) == NULL) {
+    LOG_ERROR("Initiating multipart upload has been failed with status=[%d].", status);
+    TFILEMultipartUpload_FailTarget(self, in_target, "Initiating multipart upload has been failed.");
+    return;
+  }
+  LOG_INFO("Multipart upload has been initiated, upload ID=[%s].", in_target->fUploadId);
+  /* The query is not kept, it may hold the signature of the pre-signed URL. */
+  TFILEMultipartUpload_WriteCheckpoint(self, "w", FILE_MULTIPART_CHECKPOINT_MAGIC "\nsource %llu %llu %lld %llu %d %d\nurl %.*s\nuploadid %s\n",
+                                       (unsigned long long)self->fSource.fStart, (unsigned long long)self->fFileSize, (long long)self->fMtime,
+                                       (unsigned long long)self->fPartSize, self->fCompressLevel, (self->fSparse) ? 1 : 0,
+                                       (int)strcspn(in_target->fUrl, "?"), in_target->fUrl, in_target->fUploadId);
+  in_target->fState = FILE_MULTIPART_STATE_UPLOADING;
+}
+
+/* Parts are read in order if compressed or streamed, their number is known at the end. */
+static sse_bool
+TFILEMultipartUpload_IsSequential(TFILEMultipartUpload *self)
+{
+  return self->fCompressLevel != FILE_COMPRESS_NONE || self->fSource.fStreamed;
+}
+
+/*
+ * Read or map the part into the slot, or start compressing it. Compressed or streamed parts must be
+ * read in order. The slot is left pending while it is compressed or waits for the command.
+ */
+static sse_int
+TFILEMultipartUpload_ReadPart(TFILEMultipartUpload *self,
+                              TFILEMultipartSlot *in_slot,
+                              sse_uint in_part)
+{
+  sse_uint64 offset;
+  sse_size length;
+  sse_size n;
+  sse_size done = 0;
+  sse_int err;
+
+  if (self->fCompressLevel != FILE_COMPRESS_NONE) {
+    in_slot->fPart = in_part;
+    TFILEMultipartUpload_StartCompress(self, in_slot, self->fPartSize);
+    return SSE_E_OK;
+  }
+
+  if (!self->fSource.fStreamed) {
+    offset = (sse_uint64)(in_part - 1) * self->fPartSize;
+    length = self->fPartSize;
+    if (offset + length > self->fFileSize) {
+      length = self->fFileSize - offset;
+    }
+    if (TFILESource_Map(&self->fSource, &in_slot->fWindow, offset, length) == SSE_E_OK && in_slot->fWindow.fLength == length) {
+      in_slot->fData = in_slot->fWindow.fData;
+      in_slot->fLength = length;
+      in_slot->fPart = in_part;
+      return SSE_E_OK;
+    }
+    TFILEMapWindow_Finalize(&in_slot->fWindow);
+  }
+  if (in_slot->fBuffer == NULL) {
+    in_slot->fBuffer = sse_malloc(self->fPartSize);
+    ASSERT(in_slot->fBuffer);
+    in_slot->fCapacity = self->fPartSize;
+  }
+  in_slot->fData = in_slot->fBuffer;
+  if (self->fSource.fStreamed) {
+    /* Go on from where the part has stopped to wait for the command. */
+    if (!in_slot->fPending) {
+      in_slot->fLength = 0;
+    }
+    in_slot->fPart = in_part;
+    /* A part shorter than the others is the last one. */
+    while (in_slot->fLength < self->fPartSize) {
+      err = TFILESource_Read(&self->fSource, in_slot->fBuffer + in_slot->fLength, self->fPartSize - in_slot->fLength,
+                             self->fReadOffset + in_slot->fLength, &n);
+      if (err == SSE_E_AGAIN) {
+        in_slot->fPending = sse_true;
+        TFILEMultipartUpload_WaitSource(self);
+        return SSE_E_OK;
+      }
+      if (err != SSE_E_OK) {
+        LOG_ERROR("Reading [%s] has been failed.", self->fFilePath);
+        return SSE_E_GENERIC;
+      }
+      if (n == 0) {
+        self->fFileSize = self->fReadOffset + in_slot->fLength;
+        break;
+      }
+      in_slot->fLength += n;
+    }
+    in_slot->fPending = sse_false;
+    self->fReadOffset += in_slot->fLength;
+    self->fEnds[in_part - 1] = self->fReadOffset;
+    return SSE_E_OK;
+  }
+  while (done < length) {
+    if (TFILESource_Read(&self->fSource, in_slot->fBuffer + done, length - done, offset + done, &n) != SSE_E_OK ||
+        n == 0) {
+      LOG_ERROR("Reading [%s] has been failed.", self->fFilePath);
+      return SSE_E_GENERIC;
+    }
+    done += n;
+  }
+  in_slot->fLength = length;
+  in_slot->fPart = in_part;
+  return SSE_E_OK;
+}
+
+/* Send the part in the slot to the destination. */
+static sse_int
+TFILEMultipartUpload_SendPart(TFILEMultipartUpload *self,
+                              TFILEMultipartTarget *in_target,
+                              sse_uint in_slot)
+{
+  TFILEMultipartSlot *slot = &self->fSlots[in_slot];
+  sse_char query[256];
+  sse_char *url;
+  sse_int err;
+
+  snprintf(query, sizeof(query), "partNumber=%u&uploadId=%s", slot->fPart, in_target->fUploadId);
+  url = FILEMultipart_AppendQuery(in_target->fUrl, query);
+  err = TFILEMultipartExchange_Start(&in_target->fExchanges[in_slot], MOAT_HTTP_METHOD_PUT, url, FILE_MULTIPART_CONTENT_TYPE, NULL,
+                                     slot->fData, slot->fLength);
+  sse_free(url);
+  LOG_DEBUG("Part %u (%zu bytes) has been started.", slot->fPart, slot->fLength);
+  return err;
+}
+
+/* sse_true if the part has not been uploaded to a destination being uploaded. */
+static sse_bool
+TFILEMultipartUpload_IsPartMissing(TFILEMultipartUpload *self,
+                                   sse_uint in_index)
+{
+  TFILEMultipartTarget *target;
+  sse_uint i;
+
+  for (i = 0; i < self->fTargetCount; i++) {
+    target = &self->fTargets[i];
+    if (target->fState == FILE_MULTIPART_STATE_UPLOADING && target->fETags[in_index] == NULL) {
+      return sse_true;
+    }
+  }
+  return sse_false;
+}
+
+/* Find the part which has not been uploaded and is not being uploaded. */
+static sse_uint
+TFILEMultipartUpload_NextPart(TFILEMultipartUpload *self)
+{
+  if (TFILEMultipartUpload_IsSequential(self)) {
+    /* An empty file is uploaded as a part of an empty gzip member or an empty part. */
+    if ((self->fNextPart > 0 && self->fReadOffset >= self->fFileSize) || self->fNextPart >= FILE_MULTIPART_MAX_PARTS) {
+      return 0;
+    }
+    TFILEMultipartUpload_ReservePart(self, self->fNextPart + 1);
+    self->fPartCount = ++self->fNextPart;
+    return self->fNextPart;
+  }
+  while (self->fNextPart < self->fPartCount) {
+    if (TFILEMultipartUpload_IsPartMissing(self, self->fNextPart)) {
+      return ++self->fNextPart;
+    }
+    self->fNextPart++;
+  }
+  return 0;
+}
+
+/* Retry the part, returns sse_false if it has been retried too many times. */
+static sse_bool
+TFILEMultipartUpload_RetryPart(TFILEMultipartUpload *self,
+                               TFILEMultipartTarget *in_target,
+                               sse_uint in_slot)
+{
+  TFILEMultipartExchange *exchange = &in_target->fExchanges[in_slot];
+
+  exchange->fActive = sse_false;
+  if (exchange->fRetries >= FILE_MULTIPART_PART_RETRIES) {
+    return sse_false;
+  }
+  exchange->fRetries++;
+  LOG_WARN("Retry the part %u (%u).", self->fSlots[in_slot].fPart, exchange->fRetries);
+  return TFILEMultipartUpload_SendPart(self, in_target, in_slot) == SSE_E_OK;
+}
+
+static void
+TFILEMultipartUpload_OnPartDone(TFILEMultipartUpload *self,
+                                TFILEMultipartTarget *in_target,
+                                sse_uint in_slot)
+{
+  TFILEMultipartExchange *exchange = &in_target->fExchanges[in_slot];
+  TFILEMultipartSlot *slot = &self->fSlots[in_slot];
+  MoatHttpResponse *res;
+  sse_char *etag = NULL;
+  sse_size len = 0;
+  sse_int status;
+
+  status = TFILEMultipartExchange_GetStatus(exchange);
+  res = moat_httpc_get_response(exchange->fHttp);
+  if (status == 200 && res) {
+    moat_httpres_get_header_value(res, "ETag", 4, &etag, &len);
+  }
+  if (TFILEMapWindow_IsTruncated(&slot->fWindow)) {
+    LOG_ERROR("[%s] has been truncated while uploading the part %u.", self->fFilePath, slot->fPart);
+    TFILEMultipartUpload_FailTarget(self, in_target, "File has been truncated while uploading.");
+    return;
+  }
+  if (etag == NULL || len == 0) {
+    LOG_ERROR("Uploading the part %u has been failed with status=[%d].", slot->fPart, status);
+    if (status == 404) {
+      TFILEMultipartUpload_Abandon(self, in_target);
+      TFILEMultipartUpload_FailTarget(self, in_target, "Uploading a part has been failed.");
+    } else if (!TFILEMultipartUpload_RetryPart(self, in_target, in_slot)) {
+      TFILEMultipartUpload_FailTarget(self, in_target, "Uploading a part has been failed.");
+    }
+    return;
+  }
+  in_target->fETags[slot->fPart - 1] = sse_strndup(etag, len);
+  ASSERT(in_target->fETags[slot->fPart - 1]);
+  if (self->fCompressLevel == FILE_COMPRESS_NONE) {
+    TFILEMultipartUpload_WriteCheckpoint(self, "a", "part %u %s\n", slot->fPart, in_target->fETags[slot->fPart - 1]);
+  } else {
+    TFILEMultipartUpload_WriteCheckpoint(self, "a", "part %u %s %llu\n", slot->fPart, in_target->fETags[slot->fPart - 1],
+                                         (unsigned long long)self->fEnds[slot->fPart - 1]);
+  }
+  LOG_DEBUG("Part %u has been uploaded.", slot->fPart);
+  TFILECompressTuner_OnSent(&self->fTuner, slot->fLength, FILECompress_Now() - exchange->fStarted, self->fConcurrency);
+  exchange->fRetries = 0;
+}
+
+static sse_int
+TFILEMultipartUpload_StartComplete(TFILEMultipartUpload *self,
+                                   TFILEMultipartTarget *in_target)
+{
+  SSEString *xml;
+  SSEString *query;
+  sse_char buf[64];
+  sse_char *url;
+  sse_size len;
+  sse_uint i;
+  sse_int err;
+
+  xml = sse_string_new("<CompleteMultipartUpload>");
+  ASSERT(xml);
+  for (i = 0; i < self->fPartCount; i++) {
+    snprintf(buf, sizeof(buf), "<Part><PartNumber>%u</PartNumber><ETag>", i + 1);
+    sse_string_concat_cstr(xml, buf);
+    sse_string_concat_cstr(xml, in_target->fETags[i]);
+    sse_string_concat_cstr(xml, "</ETag></Part>");
+  }
+  sse_string_concat_cstr(xml, "</CompleteMultipartUpload>");
+
+  if (in_target->fBody) sse_free(in_target->fBody);
+  len = sse_string_get_length(xml);
+  in_target->fBody = (sse_byte *)sse_string_free(xml, sse_false);
+
+  query = sse_string_new("uploadId=");
+  ASSERT(query);
+  sse_string_concat_cstr(query, in_target->fUploadId);
+  url = FILEMultipart_AppendQuery(in_target->fUrl, sse_string_get_cstr(query));
+  sse_string_free(query, sse_true);
+  err = TFILEMultipartExchange_Start(&in_target->fControl, MOAT_HTTP_METHOD_POST, url, FILE_MULTIPART_XML_TYPE, NULL,
+                                     in_target->fBody, len);
+  sse_free(url);
+  if (err == SSE_E_OK) {
+    in_target->fState = FILE_MULTIPART_STATE_COMPLETING;
+  }
+  return err;
+}
+
+static void
+TFILEMultipartUpload_OnCompleted(TFILEMultipartUpload *self,
+                                 TFILEMultipartTarget *in_target)
+{
+  MoatHttpResponse *res;
+  sse_byte *body = NULL;
+  sse_size len = 0;
+  sse_char *error;
+  sse_int status;
+
+  status = TFILEMultipartExchange_GetStatus(&in_target->fControl);
+  res = moat_httpc_get_response(in_target->fControl.fHttp);
+  if (res) {
+    moat_httpres_peek_body(res, &body, &len);
+  }
+  /* S3 may report an error with 200 OK. */
+  error = (body) ? FILEMultipart_FindXmlElement(body, len, "Code") : NULL;
+  if (status != 200 || error) {
+    LOG_ERROR("Completing multipart upload has been failed with status=[%d], code=[%s].", status, (error) ? error : "");
+    if (status == 404 || (error && sse_strcmp(error, "NoSuchUpload") == 0)) {
+      TFILEMultipartUpload_Abandon(self, in_target);
+    }
+    if (error) sse_free(error);
+    TFILEMultipartUpload_FailTarget(self, in_target, "Completing multipart upload has been failed.");
+    return;
+  }
+  in_target->fETag = (body) ? FILEMultipart_FindXmlElement(body, len, "ETag") : NULL;
+  TFILEMultipartUpload_SucceedTarget(self, in_target);
+}
+
+/* Double the whole source buffer up to FILE_UPLOAD_IN_MEMORY_MAX. */
+static sse_int
+TFILEMultipartUpload_GrowWhole(TFILEMultipartUpload *self)
+{
+  sse_byte *buffer;
+  sse_size capacity;
+
+  if (self->fWhole.fCapacity >= FILE_UPLOAD_IN_MEMORY_MAX) {
+    return SSE_E_NOMEM;
+  }
+  capacity = self->fWhole.fCapacity * 2;
+  if (capacity > FILE_UPLOAD_IN_MEMORY_MAX) {
+    capacity = FILE_UPLOAD_IN_MEMORY_MAX;
+  }
+  buffer = sse_malloc(capacity);
+  ASSERT(buffer);
+  sse_memcpy(buffer, self->fWhole.fBuffer, self->fWhole.fLength);
+  sse_free(self->fWhole.fBuffer);
+  self->fWhole.fBuffer = buffer;
+  self->fWhole.fCapacity = capacity;
+  return SSE_E_OK;
+}
+
+/* Read or map the whole source into memory, or start compressing it. Pending like a part, see TFILEMultipartUpload_ReadPart(). */
+static sse_int
+TFILEMultipartUpload_ReadWhole(TFILEMultipartUpload *self)
+{
+  TFILEMultipartSlot *whole = &self->fWhole;
+  sse_size n;
+  sse_int err;
+
+  if (self->fFileSize > FILE_UPLOAD_IN_MEMORY_MAX && !self->fSource.fStreamed) {
+    LOG_ERROR("[%s] is too large to upload with a single request, configure \"uploadpartsize\".", self->fFilePath);
+    return SSE_E_INVAL;
+  }
+  if (self->fCompressLevel == FILE_COMPRESS_NONE && !self->fSource.fStreamed && self->fFileSize > 0 &&
+      TFILESource_Map(&self->fSource, &whole->fWindow, 0, self->fFileSize) == SSE_E_OK) {
+    if (whole->fWindow.fLength == self->fFileSize) {
+      whole->fData = whole->fWindow.fData;
+      whole->fLength = self->fFileSize;
+      return SSE_E_OK;
+    }
+    TFILEMapWindow_Finalize(&whole->fWindow);
+  }
+  if (self->fCompressLevel == FILE_COMPRESS_NONE) {
+    /* Go on from where it has stopped to wait for the command. */
+    if (!whole->fPending) {
+      if (whole->fBuffer) sse_free(whole->fBuffer);
+      whole->fCapacity = (self->fSource.fStreamed) ? FILE_COMPRESS_READ_SIZE : (self->fFileSize > 0) ? self->fFileSize : 1;
+      whole->fBuffer = sse_malloc(whole->fCapacity);
+      ASSERT(whole->fBuffer);
+      whole->fLength = 0;
+    }
+    whole->fPending = sse_false;
+    for (; whole->fLength < self->fFileSize; whole->fLength += n) {
+      if (whole->fLength == whole->fCapacity) {
+        /* Streamed, the size is not known until the end. */
+        if (TFILEMultipartUpload_GrowWhole(self) != SSE_E_OK) {
+          LOG_ERROR("[%s] is too large to upload with a single request, configure \"uploadpartsize\".", self->fFilePath);
+          return SSE_E_INVAL;
+        }
+      }
+      err = TFILESource_Read(&self->fSource, whole->fBuffer + whole->fLength,
+                             whole->fCapacity - whole->fLength, whole->fLength, &n);
+      if (err == SSE_E_AGAIN) {
+        whole->fPending = sse_true;
+        TFILEMultipartUpload_WaitSource(self);
+        return SSE_E_OK;
+      }
+      if (err == SSE_E_OK && n == 0 && self->fSource.fStreamed) {
+        self->fFileSize = whole->fLength;
+        break;
+      }
+      if (err != SSE_E_OK || n == 0) {
+        LOG_ERROR("Reading [%s] has been failed.", self->fFilePath);
+        return SSE_E_GENERIC;
+      }
+    }
+  } else {
+    TFILEMultipartUpload_StartCompress(self, whole, (sse_size)-1);
+    return SSE_E_OK;
+  }
+  whole->fData = whole->fBuffer;
+  return SSE_E_OK;
+}
+
+/* Send the whole source with a single PUT to each destination. */
+static sse_int
+TFILEMultipartUpload_PutWhole(TFILEMultipartUpload *self)
+{
+  TFILEMultipartTarget *target;
+  sse_uint i;
+  sse_int err;
+
+  for (i = 0; i < self->fTargetCount; i++) {
+    target = &self->fTargets[i];
+    err = TFILEMultipartExchange_Start(&target->fControl, MOAT_HTTP_METHOD_PUT, target->fUrl, FILE_MULTIPART_CONTENT_TYPE,
+                                       TFILEMultipartUpload_GetContentEncoding(self), self->fWhole.fData, self->fWhole.fLength);
+    if (err != SSE_E_OK) {
+      if (self->fTargetCount == 1) {
+        return err;
+      }
+      TFILEMultipartUpload_FailTarget(self, target, "File upload failure.");
+      continue;
+    }
+    target->fState = FILE_MULTIPART_STATE_PUTTING;
+  }
+  return SSE_E_OK;
+}
+
+/* Upload the whole source with a single PUT to each destination, once it has been compressed if compressed. */
+static sse_int
+TFILEMultipartUpload_StartPut(TFILEMultipartUpload *self)
+{
+  sse_int err;
+
+  err = TFILEMultipartUpload_ReadWhole(self);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  self->fState = FILE_MULTIPART_STATE_PUTTING;
+  if (self->fWhole.fPending) {
+    return SSE_E_OK;
+  }
+  return TFILEMultipartUpload_PutWhole(self);
+}
+
+/* Go on reading the command which has not written more, and send it once read. sse_false if finished. */
+static sse_bool
+TFILEMultipartUpload_ProceedWhole(TFILEMultipartUpload *self)
+{
+  if (!self->fWhole.fPending || self->fCompressJob || TFILEMultipartUpload_IsWaitingSource(self)) {
+    return sse_true;
+  }
+  if (TFILEMultipartUpload_ReadWhole(self) != SSE_E_OK) {
+    TFILEMultipartUpload_Finish(self, FILE_ERROR_UPLOAD, "File upload failure.");
+    return sse_false;
+  }
+  if (self->fWhole.fPending) {
+    return sse_true;
+  }
+  self->fProgress = sse_true;
+  if (TFILEMultipartUpload_PutWhole(self) != SSE_E_OK) {
+    TFILEMultipartUpload_Finish(self, FILE_ERROR_UPLOAD, "File upload failure.");
+    return sse_false;
+  }
+  return sse_true;
+}
+
+static void
+TFILEMultipartUpload_OnPut(TFILEMultipartUpload *self,
+                           TFILEMultipartTarget *in_target)
+{
+  MoatHttpResponse *res;
+  sse_char *etag = NULL;
+  sse_size len = 0;
+  sse_int status;
+
+  status = TFILEMultipartExchange_GetStatus(&in_target->fControl);
+  if (TFILEMapWindow_IsTruncated(&self->fWhole.fWindow)) {
+    LOG_ERROR("[%s] has been truncated while uploading.", self->fFilePath);
+    TFILEMultipartUpload_FailTarget(self, in_target, "File has been truncated while uploading.");
+    return;
+  }
+  if (status < 200 || status >= 300) {
+    LOG_ERROR("Uploading the file has been failed with status=[%d].", status);
+    TFILEMultipartUpload_FailTarget(self, in_target, "File upload failure.");
+    return;
+  }
+  res = moat_httpc_get_response(in_target->fControl.fHttp);
+  if (res && moat_httpres_get_header_value(res, "ETag", 4, &etag, &len) == SSE_E_OK && etag && len > 0) {
+    in_target->fETag = sse_strndup(etag, len);
+    ASSERT(in_target->fETag);
+  }
+  TFILEMultipartUpload_SucceedTarget(self, in_target);
+}
+
+/* Proceed the requests to the destination a step. */
+static void
+TFILEMultipartUpload_PollTarget(TFILEMultipartUpload *self,
+                                TFILEMultipartTarget *in_target)
+{
+  TFILEMultipartExchange *exchange;
+  sse_bool done;
+  sse_uint i;
+
+  switch (in_target->fState) {
+  case FILE_MULTIPART_STATE_INITIATING:
+    if (TFILEMultipartExchange_Poll(&in_target->fControl, &done, &self->fProgress) != SSE_E_OK) {
+      TFILEMultipartUpload_FailTarget(self, in_target, "Initiating multipart upload has been failed.");
+    } else if (done) {
+      TFILEMultipartUpload_OnInitiated(self, in_target);
+    }
+    return;
+
+  case FILE_MULTIPART_STATE_UPLOADING:
+    for (i = 0; i < self->fConcurrency && in_target->fState == FILE_MULTIPART_STATE_UPLOADING; i++) {
+      exchange = &in_target->fExchanges[i];
+      if (!exchange->fActive) {
+        continue;
+      }
+      if (TFILEMultipartExchange_Poll(exchange, &done, &self->fProgress) != SSE_E_OK) {
+        if (!TFILEMultipartUpload_RetryPart(self, in_target, i)) {
+          TFILEMultipartUpload_FailTarget(self, in_target, "Uploading a part has been failed.");
+        }
+      } else if (done) {
+        TFILEMultipartUpload_OnPartDone(self, in_target, i);
+      }
+    }
+    return;
+
+  case FILE_MULTIPART_STATE_COMPLETING:
+    if (TFILEMultipartExchange_Poll(&in_target->fControl, &done, &self->fProgress) != SSE_E_OK) {
+      TFILEMultipartUpload_FailTarget(self, in_target, "Completing multipart upload has been failed.");
+    } else if (done) {
+      TFILEMultipartUpload_OnCompleted(self, in_target);
+    }
+    return;
+
+  case FILE_MULTIPART_STATE_PUTTING:
+    if (TFILEMultipartExchange_Poll(&in_target->fControl, &done, &self->fProgress) != SSE_E_OK) {
+      TFILEMultipartUpload_FailTarget(self, in_target, "File upload failure.");
+    } else if (done) {
+      TFILEMultipartUpload_OnPut(self, in_target);
+    }
+    return;
+
+  default:
+    return;
+  }
+}
+
+/* sse_true if the part in the slot is being sent to any destination. */
+static sse_bool
+TFILEMultipartUpload_IsSlotBusy(TFILEMultipartUpload *self,
+                                sse_uint in_slot)
+{
+  TFILEMultipartTarget *target;
+  sse_uint i;
+
+  for (i = 0; i < self->fTargetCount; i++) {
+    target = &self->fTargets[i];
+    if (target->fState == FILE_MULTIPART_STATE_UPLOADING && target->fExchanges[in_slot].fActive) {
+      return sse_true;
+    }
+  }
+  return sse_false;
+}
+
+/* sse_true if all the destinations alive have been initiated and any of them is uploading the parts. */
+static sse_bool
+TFILEMultipartUpload_IsInitiated(TFILEMultipartUpload *self)
+{
+  sse_bool uploading = sse_false;
+  sse_uint i;
+
+  for (i = 0; i < self->fTargetCount; i++) {
+    if (self->fTargets[i].fState == FILE_MULTIPART_STATE_INITIATING) {
+      return sse_false;
+    }
+    uploading |= (self->fTargets[i].fState == FILE_MULTIPART_STATE_UPLOADING);
+  }
+  return uploading;
+}
+
+/* Send the part in the slot to the destinations which have not uploaded it. */
+static void
+TFILEMultipartUpload_SendPartToTargets(TFILEMultipartUpload *self,
+                                       sse_uint in_slot)
+{
+  TFILEMultipartTarget *target;
+  sse_uint part = self->fSlots[in_slot].fPart;
+  sse_uint i;
+
+  for (i = 0; i < self->fTargetCount; i++) {
+    target = &self->fTargets[i];
+    if (target->fState != FILE_MULTIPART_STATE_UPLOADING || target->fETags[part - 1] != NULL) {
+      continue;
+    }
+    target->fExchanges[in_slot].fRetries = 0;
+    if (TFILEMultipartUpload_SendPart(self, target, in_slot) != SSE_E_OK) {
+      TFILEMultipartUpload_FailTarget(self, target, "Uploading a part has been failed.");
+    }
+  }
+}
+
+/* sse_true if a part is being read or compressed. */
+static sse_bool
+TFILEMultipartUpload_IsReading(TFILEMultipartUpload *self)
+{
+  sse_uint i;
+
+  for (i = 0; i < self->fConcurrency; i++) {
+    if (self->fSlots[i].fPending) {
+      return sse_true;
+    }
+  }
+  return sse_false;
+}
+
+/* Send the part read into the slot, or drop it if the stream has ended just at the end of the last part. */
+static void
+TFILEMultipartUpload_OnPartRead(TFILEMultipartUpload *self,
+                                sse_uint in_slot)
+{
+  TFILEMultipartSlot *slot = &self->fSlots[in_slot];
+
+  if (slot->fPart > 1 && slot->fLength == 0) {
+    self->fPartCount = self->fNextPart = slot->fPart - 1;
+  } else {
+    TFILEMultipartUpload_SendPartToTargets(self, in_slot);
+  }
+}
+
+/*
+ * Compressing a part takes long, run it on a worker. The parts are compressed one at a time in
+ * order, so the source is only read by the job while it runs. The buffer of the slot is handed
+ * over to the job, and back to the slot when it is done.
+ */
+struct FILEMultipartCompressJob_ {
+  TFILEMultipartUpload *fOwner;            /** Not touched by the worker */
+  TFILEMultipartSlot *fSlot;               /** Slot of the part or fWhole, not touched by the worker */
+  TFILESource *fSource;
+  sse_uint64 fOffset;                      /** See FILECompress_GzipRange() */
+  sse_uint64 fLimit;
+  sse_size fMinOut;
+  sse_int fLevel;
+  TFILEGzipMember *fMember;                /** Kept while waiting for the command */
+  sse_byte *fBuffer;
+  sse_size fCapacity;
+  sse_size fLength;                        /** Results */
+  sse_uint64 fEnd;
+  sse_double fSeconds;
+  sse_int fErr;
+};
+typedef struct FILEMultipartCompressJob_ FILEMultipartCompressJob;
+
+static void
+FILEMultipartUpload_CompressWork(sse_pointer in_user_data)
+{
+  FILEMultipartCompressJob *job = (FILEMultipartCompressJob *)in_user_data;
+  sse_double started;
+
+  /* The CPU time of this thread only, not the time waiting for the source nor the other threads. */
+  started = FILECompress_CpuNow();
+  job->fErr = FILECompress_GzipRange(job->fSource, job->fOffset, job->fLimit, job->fMinOut, job->fLevel, &job->fMember,
+                                     &job->fBuffer, &job->fCapacity, &job->fLength, &job->fEnd);
+  job->fSeconds = FILECompress_CpuNow() - started;
+}
+
+/* Hand the compressed part over to the slot and send it, or the whole source to the destinations. */
+static void
+FILEMultipartUpload_OnCompressDone(sse_pointer in_user_data,
+                                   sse_bool in_canceled)
+{
+  FILEMultipartCompressJob *job = (FILEMultipartCompressJob *)in_user_data;
+  TFILEMultipartUpload *self = job->fOwner;
+  TFILEMultipartSlot *slot = job->fSlot;
+  sse_int err = (in_canceled) ? SSE_E_GENERIC : job->fErr;
+  sse_uint64 start = job->fOffset;
+  sse_uint64 end = job->fEnd;
+
+  self->fCompressJob = NULL;
+  slot->fBuffer = job->fBuffer;
+  slot->fCapacity = job->fCapacity;
+  slot->fData = slot->fBuffer;
+  slot->fLength = job->fLength;
+  slot->fPending = (err == SSE_E_AGAIN);
+  self->fMember = job->fMember;
+  self->fCompressSeconds += job->fSeconds;
+  sse_free(job);
+  if (self->fDeleted) {
+    TFILEMultipartUpload_Free(self);
+    return;
+  }
+  if (self->fState == FILE_MULTIPART_STATE_DONE || self->fState == FILE_MULTIPART_STATE_READY) {
+    return;
+  }
+  if (err == SSE_E_AGAIN) {
+    /* Compressed again from where it has stopped, see TFILEMultipartUpload_ProceedParts(). */
+    TFILEMultipartUpload_WaitSource(self);
+    if (!TFILEMultipartUpload_IsWaitingSource(self)) {
+      self->fProgress = sse_false;
+      TFILEMultipartUpload_SchedulePolling(self);
+    }
+    return;
+  }
+  if (err != SSE_E_OK) {
+    LOG_ERROR("Compressing [%s] has been failed.", self->fFilePath);
+    TFILEMultipartUpload_Finish(self, FILE_ERROR_UPLOAD, (slot == &self->fWhole) ? "File upload failure." :
+                                "Uploading a part has been failed.");
+    return;
+  }
+  TFILECompressTuner_OnEncoded(&self->fTuner, end - start, slot->fLength, self->fCompressSeconds);
+  self->fCompressSeconds = 0;
+  if (slot == &self->fWhole) {
+    if (self->fSource.fStreamed) {
+      self->fFileSize = end;
+    }
+    LOG_INFO("[%s] has been compressed from %llu bytes into %zu bytes.",
+             self->fFilePath, (unsigned long long)end, slot->fLength);
+    if (TFILEMultipartUpload_PutWhole(self) != SSE_E_OK) {
+      TFILEMultipartUpload_Finish(self, FILE_ERROR_UPLOAD, "File upload failure.");
+      return;
+    }
+  } else {
+    LOG_DEBUG("Part %u: %llu bytes have been compressed into %zu bytes.",
+              slot->fPart, (unsigned long long)(end - start), slot->fLength);
+    if (slot->fLength < self->fPartSize && end < self->fFileSize) {
+      if (!self->fSource.fStreamed) {
+        LOG_WARN("[%s] has been truncated to %llu bytes while uploading.", self->fFilePath, (unsigned long long)end);
+      }
+      self->fFileSize = end;
+    }
+    self->fEnds[slot->fPart - 1] = end;
+    self->fReadOffset = end;
+    TFILEMultipartUpload_OnPartRead(self, slot - self->fSlots);
+  }
+  /* Send it on the next iteration of the event loop. */
+  TFILEMultipartUpload_Wake(self);
+}
+
+/* Compress the source from fReadOffset into the slot on a worker, or go on with fMember. See FILEMultipartUpload_OnCompressDone(). */
+static void
+TFILEMultipartUpload_StartCompress(TFILEMultipartUpload *self,
+                                   TFILEMultipartSlot *in_slot,
+                                   sse_size in_min_out)
+{
+  FILEMultipartCompressJob *job;
+
+  ASSERT(self->fWorkers);
+  ASSERT(self->fCompressJob == NULL);
+  job = sse_zeroalloc(sizeof(FILEMultipartCompressJob));
+  ASSERT(job);
+  job->fOwner = self;
+  job->fSlot = in_slot;
+  job->fSource = &self->fSource;
+  job->fOffset = self->fReadOffset;
+  job->fLimit = self->fFileSize;
+  job->fMinOut = in_min_out;
+  job->fLevel = self->fTuner.fLevel;
+  job->fMember = self->fMember;
+  self->fMember = NULL;
+  job->fBuffer = in_slot->fBuffer;
+  job->fCapacity = in_slot->fCapacity;
+  in_slot->fBuffer = NULL;
+  in_slot->fCapacity = 0;
+  in_slot->fData = NULL;
+  in_slot->fLength = 0;
+  in_slot->fPending = sse_true;
+  self->fCompressJob = TFILEWorkerPool_Submit(self->fWorkers, FILEMultipartUpload_CompressWork,
+                                              FILEMultipartUpload_OnCompressDone, job);
+}
+
+/* Read the next parts into the free slots, and complete the upload after the last part. sse_false if finished. */
+static sse_bool
+TFILEMultipartUpload_ProceedParts(TFILEMultipartUpload *self)
+{
+  TFILEMultipartSlot *slot;
+  TFILEMultipartTarget *target;
+  sse_bool busy = sse_false;
+  sse_uint part;
+  sse_uint i;
+
+  if (!TFILEMultipartUpload_IsInitiated(self)) {
+    return sse_true;
+  }
+  for (i = 0; i < self->fConcurrency; i++) {
+    slot = &self->fSlots[i];
+    /* Go on with the part which has stopped to wait for the command. */
+    if (slot->fPending && self->fCompressJob == NULL && !TFILEMultipartUpload_IsWaitingSource(self)) {
+      if (TFILEMultipartUpload_ReadPart(self, slot, slot->fPart) != SSE_E_OK) {
+        TFILEMultipartUpload_Finish(self, FILE_ERROR_UPLOAD, "Uploading a part has been failed.");
+        return sse_false;
+      }
+      if (!slot->fPending) {
+        self->fProgress = sse_true;
+        TFILEMultipartUpload_OnPartRead(self, i);
+      }
+    }
+  }
+  for (i = 0; i < self->fConcurrency; i++) {
+    slot = &self->fSlots[i];
+    /* The next part is not known until the part being read or compressed is done. */
+    if (!TFILEMultipartUpload_IsReading(self) && !TFILEMultipartUpload_IsSlotBusy(self, i)) {
+      part = TFILEMultipartUpload_NextPart(self);
+      if (part > 0 && TFILEMultipartUpload_ReadPart(self, slot, part) != SSE_E_OK) {
+        TFILEMultipartUpload_Finish(self, FILE_ERROR_UPLOAD, "Uploading a part has been failed.");
+        return sse_false;
+      }
+      if (part > 0 && !slot->fPending) {
+        self->fProgress = sse_true;
+        TFILEMultipartUpload_OnPartRead(self, i);
+      }
+    }
+    busy |= slot->fPending || TFILEMultipartUpload_IsSlotBusy(self, i);
+  }
+  if (!busy) {
+    if (self->fReadOffset < self->fFileSize && TFILEMultipartUpload_IsSequential(self)) {
+      TFILEMultipartUpload_Finish(self, FILE_ERROR_UPLOAD, "Too many parts.");
+      return sse_false;
+    }
+    for (i = 0; i < self->fTargetCount; i++) {
+      target = &self->fTargets[i];
+      if (target->fState == FILE_MULTIPART_STATE_UPLOADING &&
+          TFILEMultipartUpload_StartComplete(self, target) != SSE_E_OK) {
+        TFILEMultipartUpload_FailTarget(self, target, "Completing multipart upload has been failed.");
+      }
+    }
+    self->fState = FILE_MULTIPART_STATE_COMPLETING;
+    self->fProgress = sse_true;
+  }
+  return sse_true;
+}
+
+/* A round of polling the requests and reading the parts. */
+static void
+TFILEMultipartUpload_Poll(TFILEMultipartUpload *self)
+{
+  sse_uint i;
+
+  if (self->fState == FILE_MULTIPART_STATE_READY || self->fState == FILE_MULTIPART_STATE_DONE) {
+    TFILEMultipartUpload_StopPolling(self);
+    return;
+  }
+  self->fProgress = sse_false;
+  for (i = 0; i < self->fTargetCount; i++) {
+    TFILEMultipartUpload_PollTarget(self, &self->fTargets[i]);
+  }
+  if (self->fState == FILE_MULTIPART_STATE_UPLOADING && !TFILEMultipartUpload_ProceedParts(self)) {
+    return;
+  }
+  if (self->fState == FILE_MULTIPART_STATE_PUTTING && !TFILEMultipartUpload_ProceedWhole(self)) {
+    return;
+  }
+  for (i = 0; i < self->fTargetCount; i++) {
+    if (TFILEMultipartTarget_IsAlive(&self->fTargets[i])) {
+      if (TFILEMultipartUpload_IsWaiting(self)) {
+        /* Woken up by the job or the command, see TFILEMultipartUpload_Wake(). */
+        TFILEMultipartUpload_StopPolling(self);
+      } else {
+        TFILEMultipartUpload_SchedulePolling(self);
+      }
+      return;
+    }
+  }
+  TFILEMultipartUpload_Finish(self, NULL, NULL);
+}
+
+static void
+FILEMultipartUpload_OnIdle(MoatIdle *in_idle,
+                           sse_pointer in_user_data)
+{
+  TFILEMultipartUpload *self = (TFILEMultipartUpload *)in_user_data;
+
+  ASSERT(self);
+  TFILEMultipartUpload_Poll(self);
+}
+
+/* The command has written more or closed its output. */
+static void
+FILEMultipartUpload_OnSourceReadable(MoatIOWatcher *in_watcher,
+                                     sse_pointer in_user_data,
+                                     sse_int in_desc,
+                                     sse_int in_event_flags)
+{
+  TFILEMultipartUpload *self = (TFILEMultipartUpload *)in_user_data;
+
+  ASSERT(self);
+  moat_io_watcher_stop(in_watcher);
+  TFILEMultipartUpload_Wake(self);
+}
+
+static void
+FILEMultipartUpload_OnTimer(MoatIOWatcher *in_watcher,
+                            sse_pointer in_user_data,
+                            sse_int in_desc,
+                            sse_int in_event_flags)
+{
+  TFILEMultipartUpload *self = (TFILEMultipartUpload *)in_user_data;
+  sse_uint64 expirations;
+
+  ASSERT(self);
+  if (read(self->fTimerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+    LOG_WARN("read(timerfd) has been failed with [%s].", strerror(errno));
+  }
+  moat_io_watcher_stop(in_watcher);
+  TFILEMultipartUpload_Poll(self);
+}
+
+/*
+ * Constructor / Destructor
+ */
+
+TFILEMultipartUpload*
+FILEMultipartUpload_New(const sse_char *in_file_path,
+                        const sse_char *in_url,
+                        sse_size in_part_size,
+                        sse_uint in_concurrency,
+                        const sse_char *in_checkpoint_path)
+{
+  TFILEMultipartUpload *self;
+  sse_uint i;
+
+  ASSERT(in_file_path);
+  ASSERT(in_url);
+
+  self = sse_zeroalloc(sizeof(TFILEMultipartUpload));
+  ASSERT(self);
+  self->fFilePath = sse_strdup(in_file_path);
+  ASSERT(self->fFilePath);
+  if (in_checkpoint_path) {
+    self->fCheckpointPath = sse_strdup(in_checkpoint_path);
+    ASSERT(self->fCheckpointPath);
+  }
+  self->fCheckpointFd = -1;
+  self->fCheckpointJob = NULL;
+  self->fCheckpointDirty = sse_false;
+  self->fConcurrency = (in_concurrency > 0) ? in_concurrency : 1;
+  self->fTargets = sse_zeroalloc(sizeof(TFILEMultipartTarget));
+  ASSERT(self->fTargets);
+  TFILEMultipartTarget_Initialize(&self->fTargets[0], in_url, self->fConcurrency);
+  self->fTargetCount = 1;
+  self->fSource.fFd = -1;
+  self->fSource.fArchive = NULL;
+  self->fSource.fSparse = NULL;
+  self->fSource.fStart = 0;
+  self->fSource.fSize = 0;
+  self->fPartSize = in_part_size;
+  self->fPartCapacity = 0;
+  self->fEnds = NULL;
+  self->fNextPart = 0;
+  self->fCompressLevel = FILE_COMPRESS_NONE;
+  TFILECompressTuner_Initialize(&self->fTuner, FILE_COMPRESS_GZIP_LEVEL);
+  self->fCompressSeconds = 0;
+  self->fReadOffset = 0;
+  self->fRangeStart = 0;
+  self->fRangeLength = FILE_SOURCE_TO_END;
+  self->fSparse = sse_false;
+  self->fFadvise = sse_false;
+  self->fSlots = sse_zeroalloc(sizeof(TFILEMultipartSlot) * self->fConcurrency);
+  ASSERT(self->fSlots);
+  for (i = 0; i < self->fConcurrency; i++) {
+    TFILEMapWindow_Initialize(&self->fSlots[i].fWindow);
+  }
+  TFILEMapWindow_Initialize(&self->fWhole.fWindow);
+  self->fWorkers = NULL;
+  self->fCompressJob = NULL;
+  self->fDeleted = sse_false;
+  self->fMember = NULL;
+  self->fSourceWatcher = NULL;
+  self->fIdle = NULL;
+  self->fTimerFd = -1;
+  self->fTimer = NULL;
+  self->fBackoff = 0;
+  self->fProgress = sse_false;
+  self->fState = FILE_MULTIPART_STATE_READY;
+  self->fOnCompleteCallback = NULL;
+  self->fOnCompleteCallbackUserData = NULL;
+  return self;
+}
+
+static void
+TFILEMultipartUpload_Free(TFILEMultipartUpload *self)
+{
+  sse_uint i;
+
+  if (self->fIdle) moat_idle_free(self->fIdle);
+  if (self->fTimer) moat_io_watcher_free(self->fTimer);
+  if (self->fTimerFd >= 0) close(self->fTimerFd);
+  if (self->fSourceWatcher) {
+    moat_io_watcher_stop(self->fSourceWatcher);
+    moat_io_watcher_free(self->fSourceWatcher);
+  }
+  FILECompress_AbortGzip(self->fMember);
+  TFILEMultipartUpload_CloseCheckpoint(self, sse_false);
+  if (self->fCheckpointJob) {
+    /* Left to write back the checkpoint. */
+    self->fCheckpointJob->fOwner = NULL;
+  }
+  if (self->fEnds) {
+    TFILEMultipartUpload_ClearParts(self, 0);
+    sse_free(self->fEnds);
+  }
+  for (i = 0; i < self->fTargetCount; i++) {
+    TFILEMultipartTarget_Finalize(&self->fTargets[i], self->fConcurrency);
+  }
+  sse_free(self->fTargets);
+  for (i = 0; i < self->fConcurrency; i++) {
+    if (self->fSlots[i].fBuffer) sse_free(self->fSlots[i].fBuffer);
+    TFILEMapWindow_Finalize(&self->fSlots[i].fWindow);
+  }
+  sse_free(self->fSlots);
+  if (self->fWhole.fBuffer) sse_free(self->fWhole.fBuffer);
+  TFILEMapWindow_Finalize(&self->fWhole.fWindow);
+  TFILECompressTuner_Finalize(&self->fTuner);
+  TFILESource_Close(&self->fSource);
+  if (self->fFilePath)       sse_free(self->fFilePath);
+  if (self->fCheckpointPath) sse_free(self->fCheckpointPath);
+  sse_free(self);
+}
+
+void
+TFILEMultipartUpload_Delete(TFILEMultipartUpload *self)
+{
+  ASSERT(self);
+  TFILEMultipartUpload_StopPolling(self);
+  if (self->fCompressJob) {
+    /* The worker may be reading the source, freed when the job is done. */
+    TFILEWorkerPool_Cancel(self->fWorkers, self->fCompressJob);
+    if (self->fSourceWatcher) {
+      moat_io_watcher_stop(self->fSourceWatcher);
+    }
+    self->fState = FILE_MULTIPART_STATE_DONE;
+    self->fDeleted = sse_true;
+    return;
+  }
+  TFILEMultipartUpload_Free(self);
+}
+
+void
+TFILEMultipartUpload_SetOnCompleteCallback(TFILEMultipartUpload *self,
+                                           TFILEMultipartUpload_OnCompleteCallback in_callback,
+                                           sse_pointer in_user_data)
+{
+  ASSERT(self);
+  self->fOnCompleteCallback = in_callback;
+  self->fOnCompleteCallbackUserData = in_user_data;
+}
+
+void
+TFILEMultipartUpload_SetCompression(TFILEMultipartUpload *self,
+                                    sse_int in_level)
+{
+  ASSERT(self);
+  ASSERT(self->fState == FILE_MULTIPART_STATE_READY);
+  self->fCompressLevel = in_level;
+  if (in_level != FILE_COMPRESS_NONE) {
+    TFILECompressTuner_Finalize(&self->fTuner);
+    TFILECompressTuner_Initialize(&self->fTuner, in_level);
+  }
+}
+
+void
+TFILEMultipartUpload_SetWorkerPool(TFILEMultipartUpload *self,
+                                   TFILEWorkerPool *in_workers)
+{
+  ASSERT(self);
+  ASSERT(self->fState == FILE_MULTIPART_STATE_READY);
+  self->fWorkers = in_workers;
+}
+
+void
+TFILEMultipartUpload_SetSparse(TFILEMultipartUpload *self,
+                               sse_bool in_sparse)
+{
+  ASSERT(self);
+  ASSERT(self->fState == FILE_MULTIPART_STATE_READY);
+  self->fSparse = in_sparse;
+}
+
+void
+TFILEMultipartUpload_SetFadvise(TFILEMultipartUpload *self,
+                                sse_bool in_fadvise)
+{
+  ASSERT(self);
+  ASSERT(self->fState == FILE_MULTIPART_STATE_READY);
+  self->fFadvise = in_fadvise;
+}
+
+void
+TFILEMultipartUpload_SetRange(TFILEMultipartUpload *self,
+                              sse_uint64 in_start,
+                              sse_uint64 in_length)
+{
+  ASSERT(self);
+  ASSERT(self->fState == FILE_MULTIPART_STATE_READY);
+  self->fRangeStart = in_start;
+  self->fRangeLength = in_length;
+}
+
+void
+TFILEMultipartUpload_AddUrl(TFILEMultipartUpload *self,
+                            const sse_char *in_url)
+{
+  TFILEMultipartTarget *targets;
+
+  ASSERT(self);
+  ASSERT(in_url);
+  ASSERT(self->fState == FILE_MULTIPART_STATE_READY);
+  if (self->fCheckpointPath) {
+    LOG_INFO("The upload to several URLs is not resumed.");
+    sse_free(self->fCheckpointPath);
+    self->fCheckpointPath = NULL;
+  }
+  targets = sse_zeroalloc(sizeof(TFILEMultipartTarget) * (self->fTargetCount + 1));
+  ASSERT(targets);
+  sse_memcpy(targets, self->fTargets, sizeof(TFILEMultipartTarget) * self->fTargetCount);
+  TFILEMultipartTarget_Initialize(&targets[self->fTargetCount], in_url, self->fConcurrency);
+  sse_free(self->fTargets);
+  self->fTargets = targets;
+  self->fTargetCount++;
+}
+
+sse_uint
+TFILEMultipartUpload_GetUrlCount(TFILEMultipartUpload *self)
+{
+  ASSERT(self);
+  return self->fTargetCount;
+}
+
+const sse_char*
+TFILEMultipartUpload_GetUrlResult(TFILEMultipartUpload *self,
+                                  sse_uint in_index,
+                                  const sse_char **out_url)
+{
+  ASSERT(self);
+  ASSERT(in_index < self->fTargetCount);
+  if (out_url) {
+    *out_url = self->fTargets[in_index].fUrl;
+  }
+  return self->fTargets[in_index].fErrCode;
+}
+
+void
+TFILEMultipartUpload_GetRange(TFILEMultipartUpload *self,
+                              sse_uint64 *out_start,
+                              sse_uint64 *out_end)
+{
+  ASSERT(self);
+  ASSERT(out_start);
+  ASSERT(out_end);
+  *out_start = self->fSource.fStart;
+  *out_end = self->fSource.fStart + self->fFileSize;
+}
+
+const sse_char*
+TFILEMultipartUpload_GetETag(TFILEMultipartUpload *self)
+{
+  ASSERT(self);
+  return self->fTargets[0].fETag;
+}
+
+sse_char*
+TFILEMultipartUpload_GetCompressionReport(TFILEMultipartUpload *self)
+{
+  ASSERT(self);
+  if (self->fCompressLevel == FILE_COMPRESS_NONE) {
+    return NULL;
+  }
+  return TFILECompressTuner_GetReport(&self->fTuner);
+}
+
+sse_int
+TFILEMultipartUpload_Start(TFILEMultipartUpload *self)
+{
+  TFILEMultipartTarget *target;
+  sse_uint i;
+  sse_int err;
+
+  ASSERT(self);
+  ASSERT(self->fState == FILE_MULTIPART_STATE_READY);
+
+  err = TFILESource_Open(&self->fSource, self->fFilePath);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  if (self->fSparse) {
+    err = TFILESource_SetSparse(&self->fSource);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+  }
+  TFILESource_SetRange(&self->fSource, self->fRangeStart, self->fRangeLength);
+  if (self->fFadvise) {
+    TFILESource_SetFadvise(&self->fSource);
+  }
+  self->fFileSize = self->fSource.fSize;
+  self->fMtime = self->fSource.fMtime;
+  self->fIdle = moat_idle_new(FILEMultipartUpload_OnIdle, self);
+  ASSERT(self->fIdle);
+  self->fTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (self->fTimerFd >= 0) {
+    self->fTimer = moat_io_watcher_new(self->fTimerFd, FILEMultipartUpload_OnTimer, self, MOAT_IO_FLAG_READ);
+  }
+  if (self->fTimer == NULL) {
+    LOG_WARN("The timer could not be created, poll the requests on every iteration.");
+  }
+
+  if (self->fPartSize == 0 || self->fFileSize <= self->fPartSize) {
+    err = TFILEMultipartUpload_StartPut(self);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+    return moat_idle_start(self->fIdle);
+  }
+
+  if (self->fSource.fStreamed) {
+    /* The size is not known, the parts are reserved as the stream is read. */
+  } else {
+    if (self->fPartSize == 0 || (self->fFileSize + self->fPartSize - 1) / self->fPartSize > FILE_MULTIPART_MAX_PARTS) {
+      self->fPartSize = (self->fFileSize + FILE_MULTIPART_MAX_PARTS - 1) / FILE_MULTIPART_MAX_PARTS;
+    }
+    if (self->fCompressLevel == FILE_COMPRESS_NONE) {
+      self->fPartCount = (self->fFileSize == 0) ? 1 : (self->fFileSize + self->fPartSize - 1) / self->fPartSize;
+      TFILEMultipartUpload_ReservePart(self, self->fPartCount);
+    } else {
+      /* Compressed parts are not smaller than the parts of the source file. */
+      TFILEMultipartUpload_ReservePart(self, (self->fFileSize + self->fPartSize - 1) / self->fPartSize + 1);
+    }
+  }
+
+  if (TFILEMultipartUpload_LoadCheckpoint(self)) {
+    self->fTargets[0].fState = FILE_MULTIPART_STATE_UPLOADING;
+  } else {
+    for (i = 0; i < self->fTargetCount; i++) {
+      target = &self->fTargets[i];
+      err = TFILEMultipartUpload_StartInitiate(self, target);
+      if (err != SSE_E_OK) {
+        if (self->fTargetCount == 1) {
+          return err;
+        }
+        TFILEMultipartUpload_FailTarget(self, target, "Initiating multipart upload has been failed.");
+      }
+    }
+  }
+  self->fState = FILE_MULTIPART_STATE_UPLOADING;
+  if (self->fTargetCount > 1) {
+    LOG_INFO("Upload [%s] in parts of %zu bytes to %u URLs.", self->fFilePath, self->fPartSize, self->fTargetCount);
+  } else {
+    LOG_INFO("Upload [%s] in parts of %zu bytes.", self->fFilePath, self->fPartSize);
+  }
+  return moat_idle_start(self->fIdle);
+}
+
+void
+TFILEMultipartUpload_Cancel(TFILEMultipartUpload *self)
+{
+  ASSERT(self);
+  TFILEMultipartUpload_StopPolling(self);
+  if (self->fCompressJob) {
+    TFILEWorkerPool_Cancel(self->fWorkers, self->fCompressJob);
+  }
+  if (self->fSourceWatcher) {
+    moat_io_watcher_stop(self->fSourceWatcher);
+  }
+  self->fState = FILE_MULTIPART_STATE_DONE;
+}
@@ -0,0 +1,368 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+#define FILE_PRIORITY_IOPRIO_WHO_PROCESS (1)
+#define FILE_PRIORITY_LINE_SIZE          (1024)
+
+/*
+ * Priority of the children, applied by the fork handler in the child. Guarded by
+ * gFILEPriorityLock, which the fork handlers hold across fork() not to copy it half updated.
+ */
+static pthread_once_t gFILEPriorityOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t gFILEPriorityLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread sse_uint gFILEPriorityForking = 0;
+static sse_int gFILEPriorityChildNice = FILE_PRIORITY_NONE;
+static sse_int gFILEPriorityChildIoPriority = FILE_PRIORITY_NONE;
+static sse_char gFILEPriorityChildProcs[FILE_PRIORITY_LINE_SIZE] = ""; /* cgroup.procs, empty if none */
+
+/*
+ * I/O priority
+ */
+
+static sse_int
+FILEPriority_GetIoPriority(void)
+{
+  return (sse_int)syscall(SYS_ioprio_get, FILE_PRIORITY_IOPRIO_WHO_PROCESS, 0);
+}
+
+/* The nice level and the I/O priority are of a thread on Linux, 0 is the calling thread. */
+void
+FILEPriority_SetThread(sse_int in_nice,
+                       sse_int in_io_priority)
+{
+  if (in_nice != FILE_PRIORITY_NONE && setpriority(PRIO_PROCESS, 0, in_nice) != 0) {
+    LOG_WARN("setpriority(%d) has been failed with [%s].", in_nice, strerror(errno));
+  }
+  if (in_io_priority != FILE_PRIORITY_NONE &&
+      syscall(SYS_ioprio_set, FILE_PRIORITY_IOPRIO_WHO_PROCESS, 0, in_io_priority) != 0) {
+    LOG_WARN("ioprio_set(0x%x) has been failed with [%s].", in_io_priority, strerror(errno));
+  }
+}
+
+/* Order of the I/O priorities, larger is lower. The class "none" follows the nice level, regard it as best effort. */
+static sse_int
+FILEPriority_GetIoRank(sse_int in_io_priority)
+{
+  sse_int io_class = in_io_priority >> FILE_PRIORITY_IOCLASS_SHIFT;
+  sse_int level = in_io_priority & ((1 << FILE_PRIORITY_IOCLASS_SHIFT) - 1);
+
+  switch (io_class) {
+  case FILE_PRIORITY_IOCLASS_RT:
+    return level;
+  case FILE_PRIORITY_IOCLASS_IDLE:
+    return 16;
+  case FILE_PRIORITY_IOCLASS_BE:
+    return 8 + level;
+  default:
+    return 8 + 4;
+  }
+}
+
+/*
+ * Children
+ */
+
+static void
+FILEPriority_OnPrepareFork(void)
+{
+  if (gFILEPriorityForking > 0) {
+    pthread_mutex_lock(&gFILEPriorityLock);
+  }
+}
+
+static void
+FILEPriority_OnForkParent(void)
+{
+  if (gFILEPriorityForking > 0) {
+    pthread_mutex_unlock(&gFILEPriorityLock);
+  }
+}
+
+/* Only async-signal-safe calls, errors are ignored as nothing can be logged. Writing "0" moves the writer. */
+static void
+FILEPriority_OnForkChild(void)
+{
+  int fd;
+
+  if (gFILEPriorityForking == 0) {
+    return;
+  }
+  if (gFILEPriorityChildNice != FILE_PRIORITY_NONE) {
+    setpriority(PRIO_PROCESS, 0, gFILEPriorityChildNice);
+  }
+  if (gFILEPriorityChildIoPriority != FILE_PRIORITY_NONE) {
+    syscall(SYS_ioprio_set, FILE_PRIORITY_IOPRIO_WHO_PROCESS, 0, gFILEPriorityChildIoPriority);
+  }
+  if (gFILEPriorityChildProcs[0] != '\0') {
+    fd = open(gFILEPriorityChildProcs, O_WRONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      if (write(fd, "0", 1) < 0) {
+        /* Stays in the cgroup of the agent. */
+      }
+      close(fd);
+    }
+  }
+  pthread_mutex_unlock(&gFILEPriorityLock);
+}
+
+static void
+FILEPriority_Install(void)
+{
+  if (pthread_atfork(FILEPriority_OnPrepareFork, FILEPriority_OnForkParent, FILEPriority_OnForkChild) != 0) {
+    LOG_WARN("pthread_atfork() has been failed, children are not lowered.");
+  }
+}
+
+void
+FILEPriority_BeginFork(void)
+{
+  pthread_once(&gFILEPriorityOnce, FILEPriority_Install);
+  gFILEPriorityForking++;
+}
+
+void
+FILEPriority_EndFork(void)
+{
+  ASSERT(gFILEPriorityForking > 0);
+  gFILEPriorityForking--;
+}
+
+static void
+FILEPriority_SetChildren(sse_int in_nice,
+                         sse_int in_io_priority,
+                         const sse_char *in_cgroup)
+{
+  pthread_mutex_lock(&gFILEPriorityLock);
+  gFILEPriorityChildNice = in_nice;
+  gFILEPriorityChildIoPriority = in_io_priority;
+  if (in_cgroup) {
+    snprintf(gFILEPriorityChildProcs, sizeof(gFILEPriorityChildProcs), "%s/cgroup.procs", in_cgroup);
+  } else {
+    gFILEPriorityChildProcs[0] = '\0';
+  }
+  pthread_mutex_unlock(&gFILEPriorityLock);
+}
+
+/*
+ * cgroup
+ */
+
+static sse_int
+FILEPriority_WriteFile(const sse_char *in_dir,
+                       const sse_char *in_name,
+                       const sse_char *in_value,
+                       sse_uint in_len)
+{
+  sse_char path[FILE_PRIORITY_LINE_SIZE];
+  ssize_t n;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%s", in_dir, in_name);
+  fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOG_WARN("open(%s) has been failed with [%s].", path, strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  n = write(fd, in_value, in_len);
+  close(fd);
+  if (n != (ssize_t)in_len) {
+    LOG_WARN("Writing [%.*s] to [%s] has been failed with [%s].", in_len, in_value, path, (n < 0) ? strerror(errno) : "short write");
+    return SSE_E_GENERIC;
+  }
+  return SSE_E_OK;
+}
+
+/* Create the cgroup with the limits for the children, the process itself stays where it is. */
+static void
+TFILEPriority_EnterCgroup(TFILEPriority *self,
+                          TFILEFilesysInfo *in_info)
+{
+  MoatValue *value;
+  sse_char *str;
+  sse_uint len;
+  sse_char *dir;
+
+  value = TFILEFilesysInfo_GetCgroup(in_info);
+  if (value == NULL || moat_value_get_string(value, &str, &len) != SSE_E_OK) {
+    return;
+  }
+  dir = sse_strndup(str, len);
+  ASSERT(dir);
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    LOG_WARN("mkdir(%s) has been failed with [%s].", dir, strerror(errno));
+    sse_free(dir);
+    return;
+  }
+  value = TFILEFilesysInfo_GetCgroupIoMax(in_info);
+  if (value && moat_value_get_string(value, &str, &len) == SSE_E_OK) {
+    FILEPriority_WriteFile(dir, "io.max", str, len);
+  }
+  value = TFILEFilesysInfo_GetCgroupCpuMax(in_info);
+  if (value && moat_value_get_string(value, &str, &len) == SSE_E_OK) {
+    FILEPriority_WriteFile(dir, "cpu.max", str, len);
+  }
+  LOG_INFO("Children are going to be moved into cgroup [%s].", dir);
+  self->fCgroup = dir;
+}
+
+/* Publish the priority to the workers and to the children. */
+static void
+TFILEPriority_Apply(TFILEPriority *self)
+{
+  if (self->fWorkers) {
+    TFILEWorkerPool_SetPriority(self->fWorkers,
+                                (self->fNice != FILE_PRIORITY_NONE) ? self->fNice : self->fSavedNice,
+                                (self->fIoPriority != FILE_PRIORITY_NONE) ? self->fIoPriority : self->fSavedIoPriority);
+  }
+  FILEPriority_SetChildren(self->fNice, self->fIoPriority, self->fCgroup);
+}
+
+static void
+TFILEPriority_Restore(TFILEPriority *self)
+{
+  self->fNice = FILE_PRIORITY_NONE;
+  self->fIoPriority = FILE_PRIORITY_NONE;
+  if (self->fCgroup) {
+    sse_free(self->fCgroup);
+    self->fCgroup = NULL;
+  }
+  TFILEPriority_Apply(self);
+  LOG_DEBUG("The priority has been restored.");
+}
+
+/*
+ * Constructor / Destructor
+ */
+
+sse_int
+TFILEPriority_Initialize(TFILEPriority *self)
+{
+  ASSERT(self);
+  self->fDepth = 0;
+  self->fNice = FILE_PRIORITY_NONE;
+  self->fIoPriority = FILE_PRIORITY_NONE;
+  self->fCgroup = NULL;
+  self->fSavedNice = 0;
+  self->fSavedIoPriority = 0;
+  self->fWorkers = NULL;
+  return SSE_E_OK;
+}
+
+void
+TFILEPriority_Finalize(TFILEPriority *self)
+{
+  ASSERT(self);
+  if (self->fDepth > 0) {
+    TFILEPriority_Restore(self);
+    self->fDepth = 0;
+  }
+}
+
+void
+TFILEPriority_SetWorkerPool(TFILEPriority *self,
+                            TFILEWorkerPool *in_workers)
+{
+  ASSERT(self);
+  ASSERT(self->fDepth == 0);
+  self->fWorkers = in_workers;
+}
+
+void
+TFILEPriority_Enter(TFILEPriority *self,
+                    TFILEFilesysInfo **in_infos,
+                    sse_uint in_count)
+{
+  sse_uint i;
+  sse_int nice;
+  sse_int io_priority;
+  sse_int current;
+
+  ASSERT(self);
+  if (self->fDepth == 0) {
+    errno = 0;
+    self->fSavedNice = getpriority(PRIO_PROCESS, 0);
+    if (errno != 0) {
+      self->fSavedNice = 0;
+    }
+    self->fSavedIoPriority = FILEPriority_GetIoPriority();
+    if (self->fSavedIoPriority < 0) {
+      self->fSavedIoPriority = 0;
+    }
+  }
+  self->fDepth++;
+  for (i = 0; i < in_count; i++) {
+    if (in_infos[i] == NULL) {
+      continue;
+    }
+    nice = TFILEFilesysInfo_GetNice(in_infos[i]);
+    current = (self->fNice != FILE_PRIORITY_NONE) ? self->fNice : self->fSavedNice;
+    if (nice != FILE_PRIORITY_NONE && nice > current) {
+      LOG_INFO("Nice level of the transfers has been changed to %d.", nice);
+      self->fNice = nice;
+    }
+    io_priority = TFILEFilesysInfo_GetIoPriority(in_infos[i]);
+    current = (self->fIoPriority != FILE_PRIORITY_NONE) ? self->fIoPriority : self->fSavedIoPriority;
+    if (io_priority != FILE_PRIORITY_NONE && FILEPriority_GetIoRank(io_priority) > FILEPriority_GetIoRank(current)) {
+      LOG_INFO("I/O priority of the transfers has been changed to class=[%d], level=[%d].",
+               io_priority >> FILE_PRIORITY_IOCLASS_SHIFT, io_priority & ((1 << FILE_PRIORITY_IOCLASS_SHIFT) - 1));
+      self->fIoPriority = io_priority;
+    }
+    if (self->fCgroup == NULL) {
+      TFILEPriority_EnterCgroup(self, in_infos[i]);
+    }
+  }
+  TFILEPriority_Apply(self);
+}
+
+void
+TFILEPriority_Leave(TFILEPriority *self)
+{
+  ASSERT(self);
+  if (self->fDepth == 0) {
+    /* Already restored by TFILEPriority_Finalize() */
+    return;
+  }
+  self->fDepth--;
+  if (self->fDepth == 0) {
+    TFILEPriority_Restore(self);
+  }
+}
@@ -0,0 +1,735 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+#define FILE_SENDFILE_CONTENT_TYPE "application/octet-stream"
+#define FILE_SENDFILE_SEND_MAX     (0x40000000) /* Bytes passed to sendfile(2) at once */
+#define FILE_SENDFILE_PIPE_SIZE    (64 * 1024)  /* Default capacity of a pipe */
+
+static void FILESendfileUpload_OnEvent(MoatIOWatcher *in_watcher, sse_pointer in_user_data, sse_int in_desc, sse_int in_event_flags);
+static sse_bool FILESendfileUpload_OnTimeout(sse_int in_timer_id, sse_pointer in_user_data);
+static void TFILESendfileUpload_Finish(TFILESendfileUpload *self, const sse_char *in_err_code, const sse_char *in_err_msg);
+
+/*
+ * URL
+ */
+
+sse_bool
+FILESendfileUpload_IsSupportedUrl(const sse_char *in_url)
+{
+  ASSERT(in_url);
+  return (sse_strncasecmp(in_url, "http://", 7) == 0);
+}
+
+/*
+ * Split "http://<host>[:<port>]<path>" into the host, the port, the value of "Host" and the path
+ * with the query. User info is not supported.
+ */
+static sse_int
+FILESendfileUpload_ParseUrl(const sse_char *in_url,
+                            sse_char **out_host,
+                            sse_char **out_port,
+                            sse_char **out_authority,
+                            sse_char **out_path)
+{
+  const sse_char *authority;
+  const sse_char *end;
+  const sse_char *port;
+  const sse_char *path_end;
+
+  if (!FILESendfileUpload_IsSupportedUrl(in_url)) {
+    return SSE_E_INVAL;
+  }
+  authority = in_url + 7;
+  end = authority + strcspn(authority, "/?#");
+  if (end == authority || memchr(authority, '@', end - authority) != NULL) {
+    return SSE_E_INVAL;
+  }
+  if (*authority == '[') {
+    /* IPv6 literal */
+    port = memchr(authority, ']', end - authority);
+    if (port == NULL) {
+      return SSE_E_INVAL;
+    }
+    *out_host = sse_strndup(authority + 1, port - authority - 1);
+    port = (port + 1 < end && port[1] == ':') ? port + 1 : NULL;
+  } else {
+    port = memchr(authority, ':', end - authority);
+    *out_host = sse_strndup(authority, ((port) ? port : end) - authority);
+  }
+  ASSERT(*out_host);
+  *out_port = (port && port + 1 < end) ? sse_strndup(port + 1, end - port - 1) : sse_strdup("80");
+  ASSERT(*out_port);
+  *out_authority = sse_strndup(authority, end - authority);
+  ASSERT(*out_authority);
+  path_end = end + strcspn(end, "#");
+  if (path_end == end || *end != '/') {
+    /* "http://host?query" */
+    *out_path = sse_malloc(path_end - end + 2);
+    ASSERT(*out_path);
+    (*out_path)[0] = '/';
+    sse_memcpy(*out_path + 1, end, path_end - end);
+    (*out_path)[path_end - end + 1] = '\0';
+  } else {
+    *out_path = sse_strndup(end, path_end - end);
+    ASSERT(*out_path);
+  }
+  return SSE_E_OK;
+}
+
+/* Resolve "<host>:<port>", 0 or the error of getaddrinfo(3). */
+static int
+FILESendfileUpload_Resolve(const sse_char *in_host,
+                           const sse_char *in_port,
+                           struct addrinfo **out_result)
+{
+  struct addrinfo hints;
+
+  sse_memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+  *out_result = NULL;
+  return getaddrinfo(in_host, in_port, &hints, out_result);
+}
+
+/* Connect a non-blocking socket to the first address which accepts it, and watch it. */
+static sse_int
+TFILESendfileUpload_Connect(TFILESendfileUpload *self,
+                            const sse_char *in_host,
+                            const sse_char *in_port,
+                            struct addrinfo *in_result)
+{
+  struct addrinfo *ai;
+  int sock = -1;
+
+  for (ai = in_result; ai; ai = ai->ai_next) {
+    sock = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+    if (sock < 0) {
+      continue;
+    }
+    if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS) {
+      break;
+    }
+    close(sock);
+    sock = -1;
+  }
+  if (sock < 0) {
+    LOG_ERROR("Connecting to [%s:%s] has been failed with [%s].", in_host, in_port, strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  self->fSocket = sock;
+  self->fWatcher = moat_io_watcher_new(self->fSocket, FILESendfileUpload_OnEvent, self, MOAT_IO_FLAG_WRITE);
+  if (self->fWatcher == NULL || moat_io_watcher_start(self->fWatcher) != SSE_E_OK) {
+    LOG_ERROR("Watching the socket has been failed.");
+    return SSE_E_GENERIC;
+  }
+  self->fState = FILE_SENDFILE_STATE_CONNECTING;
+  return SSE_E_OK;
+}
+
+/*
+ * Host name resolved on a worker. The upload may be closed meanwhile, then fOwner is NULL and the
+ * done procedure only frees the job.
+ */
+struct TFILESendfileResolve_ {
+  TFILESendfileUpload *fOwner;
+  sse_char *fHost;
+  sse_char *fPort;
+  struct addrinfo *fResult;
+  int fErr;                                /* Error of getaddrinfo(3) */
+  TFILEWorkerJob *fJob;
+};
+typedef struct TFILESendfileResolve_ TFILESendfileResolve;
+
+static void
+FILESendfileUpload_ResolveWork(sse_pointer in_user_data)
+{
+  TFILESendfileResolve *resolve = (TFILESendfileResolve *)in_user_data;
+
+  resolve->fErr = FILESendfileUpload_Resolve(resolve->fHost, resolve->fPort, &resolve->fResult);
+}
+
+static void
+FILESendfileUpload_OnResolveDone(sse_pointer in_user_data,
+                                 sse_bool in_canceled)
+{
+  TFILESendfileResolve *resolve = (TFILESendfileResolve *)in_user_data;
+  TFILESendfileUpload *self = resolve->fOwner;
+
+  if (self) {
+    self->fResolve = NULL;
+    if (in_canceled || resolve->fErr != 0) {
+      LOG_ERROR("getaddrinfo(%s) has been failed with [%s].", resolve->fHost,
+                (in_canceled) ? "canceled" : gai_strerror(resolve->fErr));
+      TFILESendfileUpload_Finish(self, FILE_ERROR_UPLOAD, "File upload failure.");
+    } else if (TFILESendfileUpload_Connect(self, resolve->fHost, resolve->fPort, resolve->fResult) != SSE_E_OK) {
+      TFILESendfileUpload_Finish(self, FILE_ERROR_UPLOAD, "File upload failure.");
+    }
+  }
+  if (resolve->fResult) {
+    freeaddrinfo(resolve->fResult);
+  }
+  sse_free(resolve->fHost);
+  sse_free(resolve->fPort);
+  sse_free(resolve);
+}
+
+/*
+ * Stream
+ */
+
+static void
+TFILESendfileUpload_Close(TFILESendfileUpload *self)
+{
+  if (self->fResolve) {
+    self->fResolve->fOwner = NULL;
+    TFILEWorkerPool_Cancel(self->fWorkers, self->fResolve->fJob);
+    self->fResolve = NULL;
+  }
+  if (self->fTimerId >= 0) {
+    moat_timer_cancel(self->fTimer, self->fTimerId);
+    self->fTimerId = -1;
+  }
+  if (self->fWatcher) {
+    moat_io_watcher_stop(self->fWatcher);
+    moat_io_watcher_free(self->fWatcher);
+    self->fWatcher = NULL;
+  }
+  if (self->fSocket >= 0) {
+    close(self->fSocket);
+    self->fSocket = -1;
+  }
+  if (self->fFileFd >= 0) {
+    close(self->fFileFd);
+    self->fFileFd = -1;
+  }
+  if (self->fPipe[0] >= 0) {
+    close(self->fPipe[0]);
+    close(self->fPipe[1]);
+    self->fPipe[0] = self->fPipe[1] = -1;
+  }
+}
+
+static void
+TFILESendfileUpload_Finish(TFILESendfileUpload *self,
+                           const sse_char *in_err_code,
+                           const sse_char *in_err_msg)
+{
+  self->fState = FILE_SENDFILE_STATE_DONE;
+  TFILESendfileUpload_Close(self);
+  if (self->fOnCompleteCallback) {
+    self->fOnCompleteCallback(self, in_err_code, in_err_msg, self->fOnCompleteCallbackUserData);
+  }
+}
+
+/* Splice the file into the pipe, and the pipe into the socket. */
+static sse_int
+TFILESendfileUpload_Splice(TFILESendfileUpload *self)
+{
+  loff_t offset;
+  sse_uint64 remaining;
+  ssize_t n;
+
+  if (self->fPipe[0] < 0 && pipe2(self->fPipe, O_CLOEXEC) != 0) {
+    self->fPipe[0] = self->fPipe[1] = -1;
+    LOG_ERROR("pipe2() has been failed with [%s].", strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  while (self->fOffset < self->fEnd || self->fPiped > 0) {
+    if (self->fPiped == 0) {
+      offset = self->fOffset;
+      remaining = self->fEnd - self->fOffset;
+      n = splice(self->fFileFd, &offset, self->fPipe[1], NULL,
+                 (remaining > FILE_SENDFILE_PIPE_SIZE) ? FILE_SENDFILE_PIPE_SIZE : remaining, SPLICE_F_MOVE);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        LOG_ERROR("splice(%s) has been failed with [%s].", self->fFilePath, (n < 0) ? strerror(errno) : "truncated");
+        return SSE_E_GENERIC;
+      }
+      self->fOffset += n;
+      self->fPiped = n;
+    }
+    n = splice(self->fPipe[0], NULL, self->fSocket, NULL, self->fPiped,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK | ((self->fOffset < self->fEnd) ? SPLICE_F_MORE : 0));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EAGAIN) {
+      return SSE_E_AGAIN;
+    }
+    if (n < 0) {
+      LOG_ERROR("splice() to [%s] has been failed with [%s].", self->fUrl, strerror(errno));
+      return SSE_E_GENERIC;
+    }
+    self->fPiped -= n;
+    self->fProgressed = FILECompress_Now();
+  }
+  return SSE_E_OK;
+}
+
+/* Send the file with sendfile(2), and splice it if not supported for the file. */
+static sse_int
+TFILESendfileUpload_SendFile(TFILESendfileUpload *self)
+{
+  off_t offset;
+  sse_uint64 remaining;
+  ssize_t n;
+
+  if (self->fMethod == FILE_SENDFILE_METHOD_SPLICE) {
+    return TFILESendfileUpload_Splice(self);
+  }
+  while (self->fOffset < self->fEnd) {
+    offset = self->fOffset;
+    remaining = self->fEnd - self->fOffset;
+    n = sendfile(self->fSocket, self->fFileFd, &offset,
+                 (remaining > FILE_SENDFILE_SEND_MAX) ? FILE_SENDFILE_SEND_MAX : remaining);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EAGAIN) {
+      return SSE_E_AGAIN;
+    }
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS) && self->fMethod == FILE_SENDFILE_METHOD_NONE) {
+      LOG_INFO("sendfile() is not supported for [%s], splice it.", self->fFilePath);
+      self->fMethod = FILE_SENDFILE_METHOD_SPLICE;
+      return TFILESendfileUpload_Splice(self);
+    }
+    if (n <= 0) {
+      LOG_ERROR("sendfile(%s) has been failed with [%s].", self->fFilePath, (n < 0) ? strerror(errno) : "truncated");
+      return SSE_E_GENERIC;
+    }
+    self->fMethod = FILE_SENDFILE_METHOD_SENDFILE;
+    self->fOffset += n;
+    self->fProgressed = FILECompress_Now();
+  }
+  return SSE_E_OK;
+}
+
+/*
+ * Unlike send(2), neither sendfile(2) nor splice(2) takes MSG_NOSIGNAL. Block SIGPIPE while sending,
+ * and take it if the server has closed the connection, e.g. rejecting the request early.
+ */
+static sse_int
+TFILESendfileUpload_SendBody(TFILESendfileUpload *self)
+{
+  sigset_t sigpipe;
+  sigset_t saved;
+  struct timespec zero = { 0, 0 };
+  sse_int err;
+
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, &saved);
+  err = TFILESendfileUpload_SendFile(self);
+  if (err == SSE_E_GENERIC && errno == EPIPE) {
+    sigtimedwait(&sigpipe, NULL, &zero);
+  }
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  return err;
+}
+
+/* Take the status code and the ETag once the whole response header has been received. */
+static sse_int
+TFILESendfileUpload_ParseResponse(TFILESendfileUpload *self)
+{
+  sse_char *line;
+  sse_char *next;
+  sse_char *value;
+  sse_size len;
+  int status;
+
+  if (sscanf(self->fResponse, "HTTP/%*d.%*d %d", &status) != 1) {
+    LOG_ERROR("Malformed response from [%s].", self->fUrl);
+    return SSE_E_INVAL;
+  }
+  self->fStatus = status;
+  for (line = sse_strchr(self->fResponse, '\n'); line; line = next) {
+    line++;
+    next = sse_strchr(line, '\n');
+    if (sse_strncasecmp(line, "ETag:", 5) != 0 || next == NULL) {
+      continue;
+    }
+    value = line + 5;
+    while (*value == ' ' || *value == '\t') value++;
+    len = next - value;
+    while (len > 0 && (value[len - 1] == '\r' || value[len - 1] == ' ')) len--;
+    if (len > 0 && self->fETag == NULL) {
+      self->fETag = sse_strndup(value, len);
+      ASSERT(self->fETag);
+    }
+  }
+  return SSE_E_OK;
+}
+
+/* Receive the response header, SSE_E_AGAIN until completed. */
+static sse_int
+TFILESendfileUpload_Receive(TFILESendfileUpload *self)
+{
+  ssize_t n;
+
+  while (self->fResponseLength < FILE_SENDFILE_RESPONSE_MAX - 1) {
+    n = recv(self->fSocket, self->fResponse + self->fResponseLength,
+             FILE_SENDFILE_RESPONSE_MAX - 1 - self->fResponseLength, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EAGAIN) {
+      return SSE_E_AGAIN;
+    }
+    if (n <= 0) {
+      LOG_ERROR("Receiving the response from [%s] has been failed with [%s].", self->fUrl,
+                (n < 0) ? strerror(errno) : "closed");
+      return SSE_E_GENERIC;
+    }
+    self->fResponseLength += n;
+    self->fResponse[self->fResponseLength] = '\0';
+    self->fProgressed = FILECompress_Now();
+    if (strstr(self->fResponse, "\r\n\r\n") != NULL) {
+      return TFILESendfileUpload_ParseResponse(self);
+    }
+  }
+  LOG_ERROR("The response header from [%s] is too long.", self->fUrl);
+  return SSE_E_INVAL;
+}
+
+static void
+FILESendfileUpload_OnEvent(MoatIOWatcher *in_watcher,
+                           sse_pointer in_user_data,
+                           sse_int in_desc,
+                           sse_int in_event_flags)
+{
+  TFILESendfileUpload *self = (TFILESendfileUpload *)in_user_data;
+  socklen_t len = sizeof(int);
+  int so_error = 0;
+  ssize_t n;
+  sse_int err;
+
+  ASSERT(self);
+  switch (self->fState) {
+  case FILE_SENDFILE_STATE_CONNECTING:
+    if (getsockopt(self->fSocket, SOL_SOCKET, SO_ERROR, &so_error, &len) != 0 || so_error != 0) {
+      LOG_ERROR("Connecting to [%s] has been failed with [%s].", self->fUrl, strerror((so_error) ? so_error : errno));
+      TFILESendfileUpload_Finish(self, FILE_ERROR_UPLOAD, "File upload failure.");
+      return;
+    }
+    self->fState = FILE_SENDFILE_STATE_HEADER;
+    /* fall through */
+  case FILE_SENDFILE_STATE_HEADER:
+    while (self->fHeaderSent < self->fHeaderLength) {
+      n = send(self->fSocket, self->fHeader + self->fHeaderSent, self->fHeaderLength - self->fHeaderSent,
+               MSG_NOSIGNAL | ((self->fEnd > self->fStart) ? MSG_MORE : 0));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && errno == EAGAIN) {
+        return;
+      }
+      if (n < 0) {
+        LOG_ERROR("Sending the request to [%s] has been failed with [%s].", self->fUrl, strerror(errno));
+        TFILESendfileUpload_Finish(self, FILE_ERROR_UPLOAD, "File upload failure.");
+        return;
+      }
+      self->fHeaderSent += n;
+    }
+    self->fState = FILE_SENDFILE_STATE_BODY;
+    /* fall through */
+  case FILE_SENDFILE_STATE_BODY:
+    err = TFILESendfileUpload_SendBody(self);
+    if (err == SSE_E_AGAIN) {
+      return;
+    }
+    if (err != SSE_E_OK) {
+      TFILESendfileUpload_Finish(self, FILE_ERROR_UPLOAD, "File upload failure.");
+      return;
+    }
+    LOG_DEBUG("%llu bytes have been sent to [%s] with %s.", (unsigned long long)(self->fEnd - self->fStart),
+              self->fUrl, (TFILESendfileUpload_GetMethodName(self)) ? TFILESendfileUpload_GetMethodName(self) : "no body");
+    self->fState = FILE_SENDFILE_STATE_RESPONSE;
+    moat_io_watcher_set_descriptor(self->fWatcher, self->fSocket, MOAT_IO_FLAG_READ);
+    return;
+  case FILE_SENDFILE_STATE_RESPONSE:
+    err = TFILESendfileUpload_Receive(self);
+    if (err == SSE_E_AGAIN) {
+      return;
+    }
+    if (err != SSE_E_OK) {
+      TFILESendfileUpload_Finish(self, FILE_ERROR_UPLOAD, "File upload failure.");
+    } else if (self->fStatus < 200 || self->fStatus >= 300) {
+      LOG_ERROR("Uploading to [%s] has been failed with status=[%d].", self->fUrl, self->fStatus);
+      TFILESendfileUpload_Finish(self, FILE_ERROR_UPLOAD, "File upload failure.");
+    } else {
+      TFILESendfileUpload_Finish(self, FILE_ERROR_OK, NULL);
+    }
+    return;
+  default:
+    moat_io_watcher_stop(in_watcher);
+    return;
+  }
+}
+
+/* Fail if nothing has been sent nor received for FILE_SENDFILE_TIMEOUT seconds. */
+static sse_bool
+FILESendfileUpload_OnTimeout(sse_int in_timer_id,
+                             sse_pointer in_user_data)
+{
+  TFILESendfileUpload *self = (TFILESendfileUpload *)in_user_data;
+  sse_double idle;
+
+  ASSERT(self);
+  self->fTimerId = -1;
+  idle = FILECompress_Now() - self->fProgressed;
+  if (idle >= FILE_SENDFILE_TIMEOUT) {
+    LOG_ERROR("Uploading to [%s] has timed out at %llu.", self->fUrl, (unsigned long long)self->fOffset);
+    TFILESendfileUpload_Finish(self, FILE_ERROR_UPLOAD, "File upload failure.");
+    return sse_false;
+  }
+  self->fTimerId = moat_timer_set(self->fTimer, (sse_uint)(FILE_SENDFILE_TIMEOUT - idle) + 1,
+                                  FILESendfileUpload_OnTimeout, self);
+  return sse_false;
+}
+
+/*
+ * Constructor / Destructor
+ */
+
+TFILESendfileUpload*
+FILESendfileUpload_New(const sse_char *in_file_path,
+                       const sse_char *in_url)
+{
+  TFILESendfileUpload *self;
+
+  ASSERT(in_file_path);
+  ASSERT(in_url);
+
+  self = sse_zeroalloc(sizeof(TFILESendfileUpload));
+  ASSERT(self);
+  self->fFilePath = sse_strdup(in_file_path);
+  ASSERT(self->fFilePath);
+  self->fUrl = sse_strdup(in_url);
+  ASSERT(self->fUrl);
+  self->fStart = 0;
+  self->fEnd = FILE_SOURCE_TO_END;
+  self->fOffset = 0;
+  self->fFileFd = -1;
+  self->fSocket = -1;
+  self->fPipe[0] = self->fPipe[1] = -1;
+  self->fPiped = 0;
+  self->fMethod = FILE_SENDFILE_METHOD_NONE;
+  self->fState = FILE_SENDFILE_STATE_READY;
+  self->fHeader = NULL;
+  self->fResponse = NULL;
+  self->fStatus = 0;
+  self->fETag = NULL;
+  self->fWatcher = NULL;
+  self->fTimer = NULL;
+  self->fTimerId = -1;
+  self->fWorkers = NULL;
+  self->fResolve = NULL;
+  self->fOnCompleteCallback = NULL;
+  self->fOnCompleteCallbackUserData = NULL;
+  return self;
+}
+
+void
+TFILESendfileUpload_Delete(TFILESendfileUpload *self)
+{
+  ASSERT(self);
+  TFILESendfileUpload_Close(self);
+  if (self->fTimer)    moat_timer_free(self->fTimer);
+  if (self->fHeader)   sse_free(self->fHeader);
+  if (self->fResponse) sse_free(self->fResponse);
+  if (self->fETag)     sse_free(self->fETag);
+  sse_free(self->fUrl);
+  sse_free(self->fFilePath);
+  sse_free(self);
+}
+
+void
+TFILESendfileUpload_SetOnCompleteCallback(TFILESendfileUpload *self,
+                                          TFILESendfileUpload_OnCompleteCallback in_callback,
+                                          sse_pointer in_user_data)
+{
+  ASSERT(self);
+  self->fOnCompleteCallback = in_callback;
+  self->fOnCompleteCallbackUserData = in_user_data;
+}
+
+void
+TFILESendfileUpload_SetWorkerPool(TFILESendfileUpload *self,
+                                  TFILEWorkerPool *in_workers)
+{
+  ASSERT(self);
+  self->fWorkers = in_workers;
+}
+
+sse_int
+TFILESendfileUpload_Start(TFILESendfileUpload *self)
+{
+  struct stat st;
+  struct addrinfo *result;
+  TFILESendfileResolve *resolve;
+  sse_char *host = NULL;
+  sse_char *port = NULL;
+  sse_char *authority = NULL;
+  sse_char *path = NULL;
+  sse_size len;
+  sse_int err;
+
+  ASSERT(self);
+  ASSERT(self->fState == FILE_SENDFILE_STATE_READY);
+
+  err = FILESendfileUpload_ParseUrl(self->fUrl, &host, &port, &authority, &path);
+  if (err != SSE_E_OK) {
+    LOG_DEBUG("[%s] is not supported.", self->fUrl);
+    return err;
+  }
+  self->fFileFd = open(self->fFilePath, O_RDONLY | O_CLOEXEC);
+  if (self->fFileFd < 0 || fstat(self->fFileFd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    LOG_ERROR("[%s] is not a regular file to send.", self->fFilePath);
+    err = SSE_E_INVAL;
+    goto error;
+  }
+  if (self->fEnd > (sse_uint64)st.st_size) {
+    self->fEnd = st.st_size;
+  }
+  self->fOffset = self->fStart;
+  len = sse_strlen(path) + sse_strlen(authority) + 160;
+  self->fHeader = sse_malloc(len);
+  ASSERT(self->fHeader);
+  self->fHeaderLength = snprintf(self->fHeader, len,
+                                 "PUT %s HTTP/1.1\r\n"
+                                 "Host: %s\r\n"
+                                 "Content-Type: " FILE_SENDFILE_CONTENT_TYPE "\r\n"
+                                 "Content-Length: %llu\r\n"
+                                 "Connection: close\r\n"
+                                 "\r\n",
+                                 path, authority, (unsigned long long)(self->fEnd - self->fStart));
+  self->fHeaderSent = 0;
+  self->fResponse = sse_malloc(FILE_SENDFILE_RESPONSE_MAX);
+  ASSERT(self->fResponse);
+  self->fResponseLength = 0;
+  if (self->fWorkers == NULL) {
+    err = FILESendfileUpload_Resolve(host, port, &result);
+    if (err != 0) {
+      LOG_ERROR("getaddrinfo(%s) has been failed with [%s].", host, gai_strerror(err));
+      err = SSE_E_GENERIC;
+      goto error;
+    }
+    err = TFILESendfileUpload_Connect(self, host, port, result);
+    freeaddrinfo(result);
+    if (err != SSE_E_OK) {
+      goto error;
+    }
+  }
+  if (self->fTimer == NULL) {
+    self->fTimer = moat_timer_new();
+    ASSERT(self->fTimer);
+  }
+  self->fProgressed = FILECompress_Now();
+  self->fTimerId = moat_timer_set(self->fTimer, FILE_SENDFILE_TIMEOUT, FILESendfileUpload_OnTimeout, self);
+  if (self->fTimerId < 0) {
+    LOG_WARN("moat_timer_set() has been failed with [%s]. The upload will not time out.", sse_get_error_string(self->fTimerId));
+    self->fTimerId = -1;
+  }
+  LOG_INFO("Send [%s] to [%s] without copying it.", self->fFilePath, self->fUrl);
+  if (self->fWorkers) {
+    /* The job takes the host and the port. */
+    resolve = sse_zeroalloc(sizeof(TFILESendfileResolve));
+    ASSERT(resolve);
+    resolve->fOwner = self;
+    resolve->fHost = host;
+    resolve->fPort = port;
+    host = port = NULL;
+    self->fState = FILE_SENDFILE_STATE_RESOLVING;
+    self->fResolve = resolve;
+    resolve->fJob = TFILEWorkerPool_Submit(self->fWorkers, FILESendfileUpload_ResolveWork,
+                                           FILESendfileUpload_OnResolveDone, resolve);
+  }
+  if (host) sse_free(host);
+  if (port) sse_free(port);
+  sse_free(authority);
+  sse_free(path);
+  return SSE_E_OK;
+
+error:
+  TFILESendfileUpload_Close(self);
+  sse_free(host);
+  sse_free(port);
+  sse_free(authority);
+  sse_free(path);
+  return err;
+}
+
+void
+TFILESendfileUpload_Cancel(TFILESendfileUpload *self)
+{
+  ASSERT(self);
+  if (self->fState == FILE_SENDFILE_STATE_READY || self->fState == FILE_SENDFILE_STATE_DONE) {
+    return;
+  }
+  LOG_INFO("Sending [%s] has been canceled at %llu.", self->fFilePath, (unsigned long long)self->fOffset);
+  self->fState = FILE_SENDFILE_STATE_DONE;
+  TFILESendfileUpload_Close(self);
+}
+
+const sse_char*
+TFILESendfileUpload_GetMethodName(TFILESendfileUpload *self)
+{
+  ASSERT(self);
+  switch (self->fMethod) {
+  case FILE_SENDFILE_METHOD_SENDFILE: return "sendfile";
+  case FILE_SENDFILE_METHOD_SPLICE:   return "splice";
+  default:                            return NULL;
+  }
+}
+
+const sse_char*
+TFILESendfileUpload_GetETag(TFILESendfileUpload *self)
+{
+  ASSERT(self);
+  return (self->fState == FILE_SENDFILE_STATE_DONE && self->fStatus >= 200 && self->fStatus < 300) ? self->fETag : NULL;
+}
@@ -0,0 +1,306 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <time.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+#define FILE_SLICE_BLOCK_SIZE (4096)
+#define FILE_SLICE_STAMP_SIZE (64)  /* Bytes read to parse the timestamp of a line */
+
+static const sse_char *FILESlice_Months[] = {
+  "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+/* Parse in_digits digits, returns the position next to them or NULL. */
+static const sse_char*
+FILESlice_ParseNumber(const sse_char *in_p,
+                      const sse_char *in_end,
+                      sse_int in_digits,
+                      sse_int *out_num)
+{
+  sse_int num = 0;
+
+  if (in_end - in_p < in_digits) {
+    return NULL;
+  }
+  while (in_digits-- > 0) {
+    if (*in_p < '0' || *in_p > '9') {
+      return NULL;
+    }
+    num = num * 10 + (*in_p++ - '0');
+  }
+  *out_num = num;
+  return in_p;
+}
+
+/* "hh:mm:ss" */
+static const sse_char*
+FILESlice_ParseClock(const sse_char *in_p,
+                     const sse_char *in_end,
+                     struct tm *out_tm)
+{
+  in_p = FILESlice_ParseNumber(in_p, in_end, 2, &out_tm->tm_hour);
+  if (in_p == NULL || in_p >= in_end || *in_p++ != ':') return NULL;
+  in_p = FILESlice_ParseNumber(in_p, in_end, 2, &out_tm->tm_min);
+  if (in_p == NULL || in_p >= in_end || *in_p++ != ':') return NULL;
+  return FILESlice_ParseNumber(in_p, in_end, 2, &out_tm->tm_sec);
+}
+
+/* "YYYY-MM-DD[T ]hh:mm:ss[.fff][Z|+hh:mm|+hhmm]" */
+static sse_int
+FILESlice_ParseIso8601(const sse_char *in_p,
+                       const sse_char *in_end,
+                       sse_int64 *out_time)
+{
+  struct tm tm;
+  sse_int hour;
+  sse_int min;
+  sse_int sign;
+
+  sse_memset(&tm, 0, sizeof(tm));
+  in_p = FILESlice_ParseNumber(in_p, in_end, 4, &tm.tm_year);
+  if (in_p == NULL || in_p >= in_end || *in_p++ != '-') return SSE_E_INVAL;
+  in_p = FILESlice_ParseNumber(in_p, in_end, 2, &tm.tm_mon);
+  if (in_p == NULL || in_p >= in_end || *in_p++ != '-') return SSE_E_INVAL;
+  in_p = FILESlice_ParseNumber(in_p, in_end, 2, &tm.tm_mday);
+  if (in_p == NULL || in_p >= in_end || (*in_p != 'T' && *in_p != ' ')) return SSE_E_INVAL;
+  in_p = FILESlice_ParseClock(in_p + 1, in_end, &tm);
+  if (in_p == NULL) return SSE_E_INVAL;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  if (in_p < in_end && (*in_p == '.' || *in_p == ',')) {
+    for (in_p++; in_p < in_end && *in_p >= '0' && *in_p <= '9'; in_p++)
+      ;
+  }
+  if (in_p < in_end && *in_p == 'Z') {
+    *out_time = timegm(&tm);
+  } else if (in_p < in_end && (*in_p == '+' || *in_p == '-')) {
+    sign = (*in_p++ == '+') ? 1 : -1;
+    in_p = FILESlice_ParseNumber(in_p, in_end, 2, &hour);
+    if (in_p == NULL) return SSE_E_INVAL;
+    if (in_p < in_end && *in_p == ':') in_p++;
+    if (FILESlice_ParseNumber(in_p, in_end, 2, &min) == NULL) min = 0;
+    *out_time = timegm(&tm) - sign * (hour * 3600 + min * 60);
+  } else {
+    tm.tm_isdst = -1;
+    *out_time = mktime(&tm);
+  }
+  return SSE_E_OK;
+}
+
+/* "Mmm dd hh:mm:ss", the year is not logged. */
+static sse_int
+FILESlice_ParseSyslog(const sse_char *in_p,
+                      const sse_char *in_end,
+                      sse_int64 *out_time)
+{
+  struct tm tm;
+  struct tm now_tm;
+  time_t now;
+  sse_int i;
+
+  if (in_end - in_p < 15) {
+    return SSE_E_INVAL;
+  }
+  sse_memset(&tm, 0, sizeof(tm));
+  for (i = 0; i < 12; i++) {
+    if (sse_strncmp(in_p, FILESlice_Months[i], 3) == 0) {
+      break;
+    }
+  }
+  if (i == 12 || in_p[3] != ' ') {
+    return SSE_E_INVAL;
+  }
+  tm.tm_mon = i;
+  in_p += 4;
+  if (*in_p == ' ') {
+    in_p++;
+    in_p = FILESlice_ParseNumber(in_p, in_end, 1, &tm.tm_mday);
+  } else {
+    in_p = FILESlice_ParseNumber(in_p, in_end, 2, &tm.tm_mday);
+  }
+  if (in_p == NULL || in_p >= in_end || *in_p++ != ' ') return SSE_E_INVAL;
+  if (FILESlice_ParseClock(in_p, in_end, &tm) == NULL) return SSE_E_INVAL;
+
+  /* This year, or the last year if it would be in the future, e.g. "Dec 31" logged before the new year. */
+  now = time(NULL);
+  localtime_r(&now, &now_tm);
+  tm.tm_year = now_tm.tm_year;
+  tm.tm_isdst = -1;
+  *out_time = mktime(&tm);
+  if (*out_time > (sse_int64)now + 24 * 3600) {
+    tm.tm_year--;
+    tm.tm_isdst = -1;
+    *out_time = mktime(&tm);
+  }
+  return SSE_E_OK;
+}
+
+sse_int
+FILESlice_ParseTime(const sse_char *in_str,
+                    sse_size in_len,
+                    sse_int64 *out_time)
+{
+  const sse_char *p = in_str;
+  const sse_char *end = in_str + in_len;
+
+  ASSERT(in_str);
+  ASSERT(out_time);
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '[')) {
+    p++;
+  }
+  if (p < end && *p >= '0' && *p <= '9') {
+    return FILESlice_ParseIso8601(p, end, out_time);
+  }
+  return FILESlice_ParseSyslog(p, end, out_time);
+}
+
+/* Offset of the first line starting at or after in_pos, in_limit if none before it. */
+static sse_int
+FILESlice_FindLineStart(TFILESource *in_source,
+                        sse_uint64 in_pos,
+                        sse_uint64 in_limit,
+                        sse_uint64 *out_line)
+{
+  sse_byte buf[FILE_SLICE_BLOCK_SIZE];
+  sse_uint64 offset;
+  sse_byte *nl;
+  sse_size n;
+  sse_int err;
+
+  if (in_pos == 0) {
+    *out_line = 0;
+    return SSE_E_OK;
+  }
+  /* A line starts next to '\n' */
+  for (offset = in_pos - 1; offset < in_limit; offset += n) {
+    err = TFILESource_Read(in_source, buf, sizeof(buf), offset, &n);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+    if (n == 0) {
+      break;
+    }
+    nl = memchr(buf, '\n', n);
+    if (nl) {
+      offset += nl - buf + 1;
+      *out_line = (offset < in_limit) ? offset : in_limit;
+      return SSE_E_OK;
+    }
+  }
+  *out_line = in_limit;
+  return SSE_E_OK;
+}
+
+/* The first line with a timestamp starting in [in_pos, in_limit), out_found is sse_false if none. */
+static sse_int
+FILESlice_FindStampedLine(TFILESource *in_source,
+                          sse_uint64 in_pos,
+                          sse_uint64 in_limit,
+                          sse_uint64 *out_line,
+                          sse_int64 *out_time,
+                          sse_bool *out_found)
+{
+  sse_char stamp[FILE_SLICE_STAMP_SIZE];
+  sse_uint64 line;
+  sse_uint64 scan_end;
+  sse_size n;
+  sse_char *nl;
+  sse_int err;
+
+  *out_found = sse_false;
+  scan_end = (in_limit - in_pos > FILE_SLICE_SCAN_MAX) ? in_pos + FILE_SLICE_SCAN_MAX : in_limit;
+  while (in_pos < scan_end) {
+    err = FILESlice_FindLineStart(in_source, in_pos, in_limit, &line);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+    if (line >= in_limit) {
+      break;
+    }
+    err = TFILESource_Read(in_source, (sse_byte*)stamp, sizeof(stamp), line, &n);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+    nl = memchr(stamp, '\n', n);
+    if (FILESlice_ParseTime(stamp, (nl) ? (sse_size)(nl - stamp) : n, out_time) == SSE_E_OK) {
+      *out_line = line;
+      *out_found = sse_true;
+      break;
+    }
+    in_pos = line + 1;
+  }
+  return SSE_E_OK;
+}
+
+sse_int
+FILESlice_FindTime(TFILESource *in_source,
+                   sse_int64 in_time,
+                   sse_uint64 *out_offset)
+{
+  sse_uint64 lo = 0;
+  sse_uint64 hi;
+  sse_uint64 mid;
+  sse_uint64 line;
+  sse_int64 time;
+  sse_bool found;
+  sse_uint probes = 0;
+  sse_int err;
+
+  ASSERT(in_source);
+  ASSERT(out_offset);
+
+  /*
+   * The answer is in [lo, hi] and *out_offset holds the best known one. A probe at mid looks
+   * at the first stamped line at or after it, which narrows the range to either side.
+   */
+  hi = in_source->fSize;
+  *out_offset = hi;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    err = FILESlice_FindStampedLine(in_source, mid, hi, &line, &time, &found);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+    probes++;
+    if (!found) {
+      hi = mid;
+    } else if (time < in_time) {
+      lo = line + 1;
+    } else {
+      *out_offset = line;
+      hi = line;
+    }
+  }
+  LOG_DEBUG("Offset %llu has been found with %u probes.", (unsigned long long)*out_offset, probes);
+  return SSE_E_OK;
+}
@@ -0,0 +1,218 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+#define FILE_SNAPSHOT_COPY_SIZE (1024 * 1024)
+
+/* Share the blocks of the file, sse_false if not supported. */
+static sse_bool
+FILESnapshot_Clone(int in_src_fd,
+                   int in_dst_fd)
+{
+#ifdef FICLONE
+  if (ioctl(in_dst_fd, FICLONE, in_src_fd) == 0) {
+    return sse_true;
+  }
+  LOG_DEBUG("FICLONE has been failed with [%s].", strerror(errno));
+#endif
+  return sse_false;
+}
+
+/* Copy the range in the kernel, or with read and write if not supported. */
+static sse_int
+FILESnapshot_Copy(int in_src_fd,
+                  int in_dst_fd,
+                  sse_uint64 in_start,
+                  sse_uint64 in_end,
+                  sse_uint64 *out_end)
+{
+  sse_byte *buf = NULL;
+  loff_t off_in = in_start;
+  loff_t off_out = in_start;
+  sse_bool in_kernel = sse_true;
+  ssize_t n = 0;
+  sse_size len;
+
+  while ((sse_uint64)off_in < in_end) {
+    len = (in_end - off_in > FILE_SNAPSHOT_COPY_SIZE) ? FILE_SNAPSHOT_COPY_SIZE : (sse_size)(in_end - off_in);
+#ifdef SYS_copy_file_range
+    if (in_kernel) {
+      n = syscall(SYS_copy_file_range, in_src_fd, &off_in, in_dst_fd, &off_out, len, 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && (sse_uint64)off_in == in_start &&
+          (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+        LOG_DEBUG("copy_file_range() has been failed with [%s], copy with read and write.", strerror(errno));
+        in_kernel = sse_false;
+        continue;
+      }
+    }
+#else
+    in_kernel = sse_false;
+#endif
+    if (!in_kernel) {
+      if (buf == NULL) {
+        buf = sse_malloc(FILE_SNAPSHOT_COPY_SIZE);
+        ASSERT(buf);
+      }
+      n = pread(in_src_fd, buf, len, off_in);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n > 0 && pwrite(in_dst_fd, buf, n, off_out) != n) {
+        n = -1;
+      }
+      if (n > 0) {
+        off_in += n;
+        off_out += n;
+      }
+    }
+    if (n < 0) {
+      LOG_ERROR("Copying the file has been failed with [%s].", strerror(errno));
+      if (buf) sse_free(buf);
+      return SSE_E_GENERIC;
+    }
+    if (n == 0) {
+      /* Truncated while copying */
+      break;
+    }
+  }
+  if (buf) sse_free(buf);
+  *out_end = off_in;
+  return SSE_E_OK;
+}
+
+sse_int
+FILESnapshot_Take(const sse_char *in_path,
+                  const sse_char *in_dir,
+                  sse_uint64 in_start,
+                  sse_uint64 in_end,
+                  sse_char **out_path)
+{
+  struct stat st;
+  struct statvfs vfs;
+  struct timespec times[2];
+  struct timespec started;
+  struct timespec now;
+  const sse_char *name;
+  sse_char *path;
+  sse_uint64 end;
+  sse_bool cloned;
+  sse_size len;
+  int src_fd;
+  int dst_fd;
+  sse_int err = SSE_E_OK;
+
+  ASSERT(in_path);
+  ASSERT(in_dir);
+  ASSERT(out_path);
+
+  src_fd = open(in_path, O_RDONLY);
+  if (src_fd < 0 || fstat(src_fd, &st) != 0) {
+    LOG_ERROR("open(%s) has been failed with [%s].", in_path, strerror(errno));
+    if (src_fd >= 0) close(src_fd);
+    return SSE_E_NOENT;
+  }
+  if (in_end > (sse_uint64)st.st_size) {
+    in_end = st.st_size;
+  }
+  if (in_start > in_end) {
+    in_start = in_end;
+  }
+  name = sse_strrchr(in_path, '/');
+  name = (name) ? name + 1 : in_path;
+  len = sse_strlen(in_dir) + 1 + sse_strlen(name) + sizeof(".snapshot.XXXXXX");
+  path = sse_malloc(len);
+  ASSERT(path);
+  snprintf(path, len, "%s/%s.snapshot.XXXXXX", in_dir, name);
+  dst_fd = mkstemp(path);
+  if (dst_fd < 0) {
+    LOG_ERROR("mkstemp(%s) has been failed with [%s].", path, strerror(errno));
+    sse_free(path);
+    close(src_fd);
+    return SSE_E_GENERIC;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  cloned = FILESnapshot_Clone(src_fd, dst_fd);
+  if (!cloned) {
+    if (statvfs(in_dir, &vfs) == 0 && (sse_uint64)vfs.f_bavail * vfs.f_frsize < in_end - in_start) {
+      LOG_WARN("No space in [%s] to copy %llu bytes.", in_dir, (unsigned long long)(in_end - in_start));
+      err = SSE_E_GENERIC;
+    } else {
+      err = FILESnapshot_Copy(src_fd, dst_fd, in_start, in_end, &end);
+      if (err == SSE_E_OK && ftruncate(dst_fd, end) != 0) {
+        LOG_ERROR("ftruncate(%s) has been failed with [%s].", path, strerror(errno));
+        err = SSE_E_GENERIC;
+      }
+    }
+  }
+  if (err == SSE_E_OK) {
+    /* The multipart checkpoint compares the mtime. */
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    futimens(dst_fd, times);
+  }
+  close(dst_fd);
+  close(src_fd);
+  if (err != SSE_E_OK) {
+    unlink(path);
+    sse_free(path);
+    return err;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  LOG_INFO("[%s] has been %s into [%s] in %ld ms.", in_path, (cloned) ? "cloned" : "copied", path,
+           (long)((now.tv_sec - started.tv_sec) * 1000 + (now.tv_nsec - started.tv_nsec) / 1000000));
+  *out_path = path;
+  return SSE_E_OK;
+}
+
+void
+FILESnapshot_Remove(sse_char *in_path)
+{
+  if (in_path) {
+    unlink(in_path);
+    sse_free(in_path);
+  }
+}
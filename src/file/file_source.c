@@ -0,0 +1,447 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+sse_bool
+FILESource_IsCommandPath(const sse_char *in_path)
+{
+  ASSERT(in_path);
+  return sse_strncmp(in_path, FILE_SOURCE_COMMAND_SCHEME, sizeof(FILE_SOURCE_COMMAND_SCHEME) - 1) == 0;
+}
+
+/* Start the command with its stdout connected to a pipe. */
+static sse_int
+TFILESource_StartCommand(TFILESource *self,
+                         const sse_char *in_command)
+{
+  int fds[2];
+  int null_fd;
+  pid_t pid;
+
+  if (pipe(fds) != 0) {
+    LOG_ERROR("pipe() has been failed with [%s].", strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  /* The child is lowered by the fork handler, see TFILEPriority. */
+  FILEPriority_BeginFork();
+  pid = fork();
+  if (pid != 0) {
+    FILEPriority_EndFork();
+  }
+  if (pid < 0) {
+    LOG_ERROR("fork() has been failed with [%s].", strerror(errno));
+    close(fds[0]);
+    close(fds[1]);
+    return SSE_E_GENERIC;
+  }
+  if (pid == 0) {
+    /* A process group to terminate the pipeline as a whole. */
+    setpgid(0, 0);
+    close(fds[0]);
+    null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+      dup2(null_fd, STDIN_FILENO);
+      close(null_fd);
+    }
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[1]);
+    execl("/bin/sh", "sh", "-c", in_command, (char *)NULL);
+    _exit(127);
+  }
+  close(fds[1]);
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  /* Read from the event loop, see TFILESource_GetDescriptor(). */
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  LOG_INFO("Command [%s] has been started, pid=[%d].", in_command, (int)pid);
+  self->fFd = fds[0];
+  self->fPid = pid;
+  self->fStreamed = sse_true;
+  self->fSize = FILE_SOURCE_TO_END;
+  self->fMtime = time(NULL);
+  return SSE_E_OK;
+}
+
+/* Reap the command without waiting, SSE_E_AGAIN if it is still running, SSE_E_OK if it has exited successfully. */
+static sse_int
+TFILESource_WaitCommand(TFILESource *self)
+{
+  int status;
+  pid_t pid;
+
+  if (self->fPid <= 0) {
+    return SSE_E_GENERIC;
+  }
+  do {
+    pid = waitpid(self->fPid, &status, WNOHANG);
+  } while (pid < 0 && errno == EINTR);
+  if (pid == 0) {
+    return SSE_E_AGAIN;
+  }
+  if (pid < 0) {
+    LOG_ERROR("waitpid() has been failed with [%s].", strerror(errno));
+    self->fPid = 0;
+    return SSE_E_GENERIC;
+  }
+  self->fPid = 0;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    LOG_ERROR("The command has been failed with status=[%d].", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return SSE_E_GENERIC;
+  }
+  return SSE_E_OK;
+}
+
+/*
+ * Commands terminated by TFILESource_Close() are reaped from the event loop every second, not to
+ * wait for them to exit. The process group is killed after FILE_SOURCE_KILL_TIMEOUT seconds.
+ */
+struct TFILESourceZombie_ {
+  struct TFILESourceZombie_ *fNext;
+  pid_t fPid;
+  sse_uint fSeconds;                       /** Since terminated */
+};
+typedef struct TFILESourceZombie_ TFILESourceZombie;
+
+static TFILESourceZombie *gFILESourceZombies = NULL;
+static MoatTimer *gFILESourceReaper = NULL;
+static sse_int gFILESourceReaperId = -1;
+
+static sse_bool
+FILESource_OnReap(sse_int in_timer_id,
+                  sse_pointer in_user_data)
+{
+  TFILESourceZombie **link = &gFILESourceZombies;
+  TFILESourceZombie *zombie;
+  pid_t pid;
+
+  while ((zombie = *link) != NULL) {
+    pid = waitpid(zombie->fPid, NULL, WNOHANG);
+    if (pid != 0 && !(pid < 0 && errno == EINTR)) {
+      *link = zombie->fNext;
+      sse_free(zombie);
+      continue;
+    }
+    if (++zombie->fSeconds == FILE_SOURCE_KILL_TIMEOUT) {
+      LOG_WARN("The command has not exited, kill it, pid=[%d].", (int)zombie->fPid);
+      kill(-zombie->fPid, SIGKILL);
+    }
+    link = &zombie->fNext;
+  }
+  gFILESourceReaperId = -1;
+  if (gFILESourceZombies) {
+    gFILESourceReaperId = moat_timer_set(gFILESourceReaper, 1, FILESource_OnReap, NULL);
+  }
+  return sse_false;
+}
+
+/* Terminate the command and reap it in the background. */
+static void
+FILESource_Terminate(pid_t in_pid)
+{
+  TFILESourceZombie *zombie;
+
+  if (waitpid(in_pid, NULL, WNOHANG) != 0) {
+    return;
+  }
+  LOG_WARN("Terminate the command, pid=[%d].", (int)in_pid);
+  kill(-in_pid, SIGTERM);
+  zombie = sse_zeroalloc(sizeof(TFILESourceZombie));
+  ASSERT(zombie);
+  zombie->fPid = in_pid;
+  zombie->fSeconds = 0;
+  zombie->fNext = gFILESourceZombies;
+  gFILESourceZombies = zombie;
+  if (gFILESourceReaperId >= 0) {
+    return;
+  }
+  if (gFILESourceReaper == NULL) {
+    gFILESourceReaper = moat_timer_new();
+    ASSERT(gFILESourceReaper);
+  }
+  gFILESourceReaperId = moat_timer_set(gFILESourceReaper, 1, FILESource_OnReap, NULL);
+  if (gFILESourceReaperId < 0) {
+    LOG_WARN("moat_timer_set() has been failed with [%s]. The command will not be reaped.",
+             sse_get_error_string(gFILESourceReaperId));
+  }
+}
+
+sse_int
+TFILESource_Open(TFILESource *self,
+                 const sse_char *in_path)
+{
+  struct stat st;
+  sse_int err;
+
+  ASSERT(self);
+  ASSERT(in_path);
+
+  self->fFd = -1;
+  self->fArchive = NULL;
+  self->fSparse = NULL;
+  self->fStreamed = sse_false;
+  self->fPid = 0;
+  self->fEnded = sse_false;
+  self->fPosition = 0;
+  self->fStart = 0;
+  self->fFadvise = sse_false;
+  if (FILESource_IsCommandPath(in_path)) {
+    return TFILESource_StartCommand(self, in_path + sizeof(FILE_SOURCE_COMMAND_SCHEME) - 1);
+  }
+  if (FILETarArchive_IsArchivePath(in_path)) {
+    err = FILETarArchive_New(in_path, &self->fArchive);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+    self->fSize = self->fArchive->fSize;
+    self->fMtime = self->fArchive->fMtime;
+    return SSE_E_OK;
+  }
+
+  self->fFd = open(in_path, O_RDONLY);
+  if (self->fFd < 0 || fstat(self->fFd, &st) != 0) {
+    LOG_ERROR("open(%s) has been failed with [%s].", in_path, strerror(errno));
+    err = (errno == ENOENT) ? SSE_E_NOENT : (errno == EACCES) ? SSE_E_ACCES : SSE_E_GENERIC;
+    TFILESource_Close(self);
+    return err;
+  }
+  self->fSize = st.st_size;
+  self->fMtime = st.st_mtime;
+  return SSE_E_OK;
+}
+
+void
+TFILESource_Close(TFILESource *self)
+{
+  ASSERT(self);
+  if (self->fFd >= 0) {
+    close(self->fFd);
+    self->fFd = -1;
+  }
+  if (self->fPid > 0) {
+    FILESource_Terminate(self->fPid);
+    self->fPid = 0;
+  }
+  if (self->fArchive) {
+    TFILETarArchive_Delete(self->fArchive);
+    self->fArchive = NULL;
+  }
+  if (self->fSparse) {
+    TFILESparseImage_Delete(self->fSparse);
+    self->fSparse = NULL;
+  }
+}
+
+sse_int
+TFILESource_SetSparse(TFILESource *self)
+{
+  sse_int err;
+
+  ASSERT(self);
+  ASSERT(self->fSparse == NULL);
+  if (self->fArchive || self->fStreamed) {
+    LOG_WARN("The source is not a regular file, read it as is.");
+    return SSE_E_OK;
+  }
+  err = FILESparseImage_New(self->fFd, self->fSize, &self->fSparse);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  self->fSize = self->fSparse->fSize;
+  return SSE_E_OK;
+}
+
+void
+TFILESource_SetRange(TFILESource *self,
+                     sse_uint64 in_start,
+                     sse_uint64 in_length)
+{
+  ASSERT(self);
+  if (in_start > self->fSize) {
+    in_start = self->fSize;
+  }
+  if (in_length > self->fSize - in_start) {
+    in_length = self->fSize - in_start;
+  }
+  self->fStart += in_start;
+  self->fSize = in_length;
+}
+
+void
+TFILESource_SetFadvise(TFILESource *self)
+{
+  ASSERT(self);
+  if (self->fFd < 0 || self->fStreamed || self->fSparse) {
+    return;
+  }
+  posix_fadvise(self->fFd, self->fStart, self->fSize, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(self->fFd, self->fStart, FILE_SOURCE_READAHEAD_SIZE, POSIX_FADV_WILLNEED);
+  self->fFadvise = sse_true;
+}
+
+void
+FILESource_DropCache(const sse_char *in_path,
+                     sse_bool in_write_back)
+{
+  int fd;
+
+  ASSERT(in_path);
+  fd = open(in_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  /* Dirty pages are not dropped. */
+  if (in_write_back) {
+    fdatasync(fd);
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+static sse_int
+TFILESource_ReadCommand(TFILESource *self,
+                        sse_byte *out_buf,
+                        sse_size in_len,
+                        sse_uint64 in_offset,
+                        sse_size *out_len)
+{
+  ssize_t n;
+  sse_int err;
+
+  *out_len = 0;
+  if (in_offset != self->fPosition) {
+    LOG_ERROR("The output of the command cannot be read at %llu, %llu bytes have been read.",
+              (unsigned long long)in_offset, (unsigned long long)self->fPosition);
+    return SSE_E_INVAL;
+  }
+  if (!self->fEnded) {
+    do {
+      n = read(self->fFd, out_buf, in_len);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return SSE_E_AGAIN;
+    }
+    if (n < 0) {
+      LOG_ERROR("read() has been failed with [%s].", strerror(errno));
+      return SSE_E_GENERIC;
+    }
+    if (n > 0 || in_len == 0) {
+      self->fPosition += n;
+      *out_len = n;
+      return SSE_E_OK;
+    }
+    self->fEnded = sse_true;
+    LOG_INFO("The command has written %llu bytes.", (unsigned long long)self->fPosition);
+  }
+  /* The end of the output, the size is known once the command has exited. */
+  err = TFILESource_WaitCommand(self);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  self->fSize = self->fPosition;
+  return SSE_E_OK;
+}
+
+sse_int
+TFILESource_Read(TFILESource *self,
+                 sse_byte *out_buf,
+                 sse_size in_len,
+                 sse_uint64 in_offset,
+                 sse_size *out_len)
+{
+  ssize_t n;
+
+  ASSERT(self);
+  ASSERT(out_len);
+  if (in_offset >= self->fSize) {
+    *out_len = 0;
+    return SSE_E_OK;
+  }
+  if (in_len > self->fSize - in_offset) {
+    in_len = self->fSize - in_offset;
+  }
+  if (self->fArchive) {
+    return TFILETarArchive_Read(self->fArchive, out_buf, in_len, self->fStart + in_offset, out_len);
+  }
+  if (self->fSparse) {
+    return TFILESparseImage_Read(self->fSparse, out_buf, in_len, self->fStart + in_offset, out_len);
+  }
+  if (self->fStreamed) {
+    return TFILESource_ReadCommand(self, out_buf, in_len, in_offset, out_len);
+  }
+  n = pread(self->fFd, out_buf, in_len, self->fStart + in_offset);
+  if (n < 0) {
+    LOG_ERROR("pread() has been failed with [%s].", strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  if (self->fFadvise && n > 0) {
+    posix_fadvise(self->fFd, self->fStart + in_offset, n, POSIX_FADV_DONTNEED);
+    posix_fadvise(self->fFd, self->fStart + in_offset + n, FILE_SOURCE_READAHEAD_SIZE, POSIX_FADV_WILLNEED);
+  }
+  *out_len = n;
+  return SSE_E_OK;
+}
+
+sse_int
+TFILESource_GetDescriptor(TFILESource *self)
+{
+  ASSERT(self);
+  return (self->fStreamed && !self->fEnded) ? self->fFd : -1;
+}
+
+sse_int
+TFILESource_Map(TFILESource *self,
+                TFILEMapWindow *io_window,
+                sse_uint64 in_offset,
+                sse_size in_length)
+{
+  ASSERT(self);
+  ASSERT(io_window);
+  if (self->fFd < 0 || self->fArchive || self->fSparse || self->fStreamed || self->fFadvise) {
+    return SSE_E_INVAL;
+  }
+  if (in_offset >= self->fSize) {
+    return SSE_E_INVAL;
+  }
+  if (in_length > self->fSize - in_offset) {
+    in_length = self->fSize - in_offset;
+  }
+  if (in_length == 0) {
+    return SSE_E_INVAL;
+  }
+  return TFILEMapWindow_Map(io_window, self->fFd, self->fStart + in_offset, in_length);
+}
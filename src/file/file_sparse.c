@@ -0,0 +1,434 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+#define FILE_SPARSE_COPY_SIZE (1024 * 1024)
+
+static void
+FILESparse_PutUint64(sse_byte *out_buf,
+                     sse_uint64 in_value)
+{
+  sse_int i;
+
+  for (i = 7; i >= 0; i--) {
+    out_buf[i] = (sse_byte)(in_value & 0xff);
+    in_value >>= 8;
+  }
+}
+
+static sse_uint64
+FILESparse_GetUint64(const sse_byte *in_buf)
+{
+  sse_uint64 value = 0;
+  sse_int i;
+
+  for (i = 0; i < 8; i++) {
+    value = (value << 8) | in_buf[i];
+  }
+  return value;
+}
+
+/*
+ * Image
+ */
+
+static void
+TFILESparseImage_AddExtent(TFILESparseImage *self,
+                           sse_uint64 in_offset,
+                           sse_uint64 in_length,
+                           sse_uint *io_capacity)
+{
+  TFILESparseExtent *extents;
+  TFILESparseExtent *extent;
+
+  if (self->fCount == *io_capacity) {
+    *io_capacity = (*io_capacity == 0) ? 16 : *io_capacity * 2;
+    extents = sse_zeroalloc(sizeof(TFILESparseExtent) * (*io_capacity));
+    ASSERT(extents);
+    if (self->fExtents) {
+      sse_memcpy(extents, self->fExtents, sizeof(TFILESparseExtent) * self->fCount);
+      sse_free(self->fExtents);
+    }
+    self->fExtents = extents;
+  }
+  extent = &self->fExtents[self->fCount++];
+  extent->fOffset = in_offset;
+  extent->fLength = in_length;
+  extent->fPosition = self->fSize;
+  self->fSize += FILE_SPARSE_EXTENT_SIZE + in_length;
+}
+
+/* Find the extents with SEEK_DATA and SEEK_HOLE, the whole file if not supported. */
+static sse_int
+TFILESparseImage_Map(TFILESparseImage *self)
+{
+  sse_uint capacity = 0;
+  off_t data;
+  off_t hole;
+  off_t pos = 0;
+
+  while ((sse_uint64)pos < self->fFileSize) {
+    data = lseek(self->fFd, pos, SEEK_DATA);
+    if (data < 0 && errno == ENXIO) {
+      /* A hole to the end */
+      break;
+    }
+    if (data < 0 && pos == 0 && (errno == EINVAL || errno == EOPNOTSUPP)) {
+      LOG_DEBUG("SEEK_DATA is not supported, the file is not sparse.");
+      TFILESparseImage_AddExtent(self, 0, self->fFileSize, &capacity);
+      break;
+    }
+    if (data < 0 || (hole = lseek(self->fFd, data, SEEK_HOLE)) < 0) {
+      LOG_ERROR("lseek() has been failed with [%s].", strerror(errno));
+      return SSE_E_GENERIC;
+    }
+    if ((sse_uint64)data >= self->fFileSize) {
+      break;
+    }
+    if ((sse_uint64)hole > self->fFileSize) {
+      /* Grown since the size has been taken */
+      hole = self->fFileSize;
+    }
+    TFILESparseImage_AddExtent(self, data, hole - data, &capacity);
+    pos = hole;
+  }
+  return SSE_E_OK;
+}
+
+sse_int
+FILESparseImage_New(int in_fd,
+                    sse_uint64 in_size,
+                    TFILESparseImage **out_image)
+{
+  TFILESparseImage *self;
+  sse_uint64 data = 0;
+  sse_uint i;
+  sse_int err;
+
+  ASSERT(in_fd >= 0);
+  ASSERT(out_image);
+
+  self = sse_zeroalloc(sizeof(TFILESparseImage));
+  ASSERT(self);
+  self->fFd = in_fd;
+  self->fFileSize = in_size;
+  self->fSize = FILE_SPARSE_HEADER_SIZE;
+  err = TFILESparseImage_Map(self);
+  if (err != SSE_E_OK) {
+    TFILESparseImage_Delete(self);
+    return err;
+  }
+  for (i = 0; i < self->fCount; i++) {
+    data += self->fExtents[i].fLength;
+  }
+  LOG_INFO("Sparse image of %llu bytes has %u extents of %llu bytes, %llu bytes.",
+           (unsigned long long)self->fFileSize, self->fCount, (unsigned long long)data, (unsigned long long)self->fSize);
+  *out_image = self;
+  return SSE_E_OK;
+}
+
+void
+TFILESparseImage_Delete(TFILESparseImage *self)
+{
+  ASSERT(self);
+  if (self->fExtents) sse_free(self->fExtents);
+  sse_free(self);
+}
+
+/* Find the extent which includes the offset, fCount if in the header of the image. */
+static sse_uint
+TFILESparseImage_FindExtent(TFILESparseImage *self,
+                            sse_uint64 in_offset)
+{
+  sse_uint low = 0;
+  sse_uint high = self->fCount;
+  sse_uint mid;
+
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (self->fExtents[mid].fPosition <= in_offset) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return (low == 0) ? self->fCount : low - 1;
+}
+
+/* Read the data of the extent, zeros where the file has shrunk. */
+static sse_int
+TFILESparseImage_ReadData(TFILESparseImage *self,
+                          sse_byte *out_buf,
+                          sse_size in_len,
+                          sse_uint64 in_offset)
+{
+  ssize_t n;
+  sse_size done = 0;
+
+  while (done < in_len) {
+    n = pread(self->fFd, out_buf + done, in_len - done, in_offset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      LOG_ERROR("pread() has been failed with [%s].", strerror(errno));
+      return SSE_E_GENERIC;
+    }
+    if (n == 0) {
+      sse_memset(out_buf + done, 0, in_len - done);
+      break;
+    }
+    done += n;
+  }
+  return SSE_E_OK;
+}
+
+sse_int
+TFILESparseImage_Read(TFILESparseImage *self,
+                      sse_byte *out_buf,
+                      sse_size in_len,
+                      sse_uint64 in_offset,
+                      sse_size *out_len)
+{
+  sse_byte header[FILE_SPARSE_HEADER_SIZE];
+  TFILESparseExtent *extent;
+  sse_uint index;
+  sse_uint64 pos;
+  sse_size len;
+  sse_size done = 0;
+
+  ASSERT(self);
+  ASSERT(out_buf);
+  ASSERT(out_len);
+
+  while (done < in_len && in_offset + done < self->fSize) {
+    pos = in_offset + done;
+    len = in_len - done;
+    if (pos + len > self->fSize) {
+      len = self->fSize - pos;
+    }
+    index = TFILESparseImage_FindExtent(self, pos);
+    if (index == self->fCount) {
+      sse_memcpy(header, FILE_SPARSE_MAGIC, 8);
+      FILESparse_PutUint64(header + 8, self->fFileSize);
+      FILESparse_PutUint64(header + 16, self->fCount);
+      if (len > FILE_SPARSE_HEADER_SIZE - pos) len = FILE_SPARSE_HEADER_SIZE - pos;
+      sse_memcpy(out_buf + done, header + pos, len);
+      done += len;
+      continue;
+    }
+    extent = &self->fExtents[index];
+    pos -= extent->fPosition;
+    if (pos < FILE_SPARSE_EXTENT_SIZE) {
+      FILESparse_PutUint64(header, extent->fOffset);
+      FILESparse_PutUint64(header + 8, extent->fLength);
+      if (len > FILE_SPARSE_EXTENT_SIZE - pos) len = FILE_SPARSE_EXTENT_SIZE - pos;
+      sse_memcpy(out_buf + done, header + pos, len);
+    } else {
+      pos -= FILE_SPARSE_EXTENT_SIZE;
+      if (len > extent->fLength - pos) len = extent->fLength - pos;
+      if (TFILESparseImage_ReadData(self, out_buf + done, len, extent->fOffset + pos) != SSE_E_OK) {
+        return SSE_E_GENERIC;
+      }
+    }
+    done += len;
+  }
+  *out_len = done;
+  return SSE_E_OK;
+}
+
+/*
+ * Expand
+ */
+
+/* Read exactly in_len bytes, SSE_E_INVAL if the image ends before. */
+static sse_int
+FILESparse_ReadFully(int in_fd,
+                     sse_byte *out_buf,
+                     sse_size in_len,
+                     sse_uint64 in_offset)
+{
+  ssize_t n;
+  sse_size done = 0;
+
+  while (done < in_len) {
+    n = pread(in_fd, out_buf + done, in_len - done, in_offset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      LOG_ERROR("pread() has been failed with [%s].", strerror(errno));
+      return SSE_E_GENERIC;
+    }
+    if (n == 0) {
+      LOG_ERROR("The sparse image ends at %llu.", (unsigned long long)(in_offset + done));
+      return SSE_E_INVAL;
+    }
+    done += n;
+  }
+  return SSE_E_OK;
+}
+
+/* Write the extents of the image to the new file, only the data is written. */
+static sse_int
+FILESparse_WriteExtents(int in_src_fd,
+                        sse_uint64 in_src_size,
+                        int in_dst_fd)
+{
+  sse_byte header[FILE_SPARSE_HEADER_SIZE];
+  sse_byte *buf = NULL;
+  sse_uint64 file_size;
+  sse_uint64 count;
+  sse_uint64 offset;
+  sse_uint64 length;
+  sse_uint64 end = 0;
+  sse_uint64 pos;
+  sse_uint64 i;
+  sse_size len;
+  sse_int err;
+
+  err = FILESparse_ReadFully(in_src_fd, header, FILE_SPARSE_HEADER_SIZE, 0);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  if (sse_memcmp(header, FILE_SPARSE_MAGIC, 8) != 0) {
+    LOG_ERROR("The file is not a sparse image.");
+    return SSE_E_INVAL;
+  }
+  file_size = FILESparse_GetUint64(header + 8);
+  count = FILESparse_GetUint64(header + 16);
+  pos = FILE_SPARSE_HEADER_SIZE;
+  for (i = 0; i < count; i++) {
+    err = FILESparse_ReadFully(in_src_fd, header, FILE_SPARSE_EXTENT_SIZE, pos);
+    if (err != SSE_E_OK) {
+      break;
+    }
+    pos += FILE_SPARSE_EXTENT_SIZE;
+    offset = FILESparse_GetUint64(header);
+    length = FILESparse_GetUint64(header + 8);
+    /* The extents must be in order, within the file and the image. */
+    if (offset < end || offset > file_size || length > file_size - offset || length > in_src_size - pos) {
+      LOG_ERROR("Extent #%llu of the sparse image is broken.", (unsigned long long)i);
+      err = SSE_E_INVAL;
+      break;
+    }
+    if (buf == NULL) {
+      buf = sse_malloc(FILE_SPARSE_COPY_SIZE);
+      ASSERT(buf);
+    }
+    end = offset + length;
+    while (offset < end) {
+      len = (end - offset > FILE_SPARSE_COPY_SIZE) ? FILE_SPARSE_COPY_SIZE : (sse_size)(end - offset);
+      err = FILESparse_ReadFully(in_src_fd, buf, len, pos);
+      if (err != SSE_E_OK) {
+        break;
+      }
+      if (pwrite(in_dst_fd, buf, len, offset) != (ssize_t)len) {
+        LOG_ERROR("pwrite() has been failed with [%s].", strerror(errno));
+        err = SSE_E_GENERIC;
+        break;
+      }
+      pos += len;
+      offset += len;
+    }
+    if (err != SSE_E_OK) {
+      break;
+    }
+  }
+  if (buf) sse_free(buf);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  if (pos != in_src_size) {
+    LOG_ERROR("The sparse image has %llu bytes after the extents.", (unsigned long long)(in_src_size - pos));
+    return SSE_E_INVAL;
+  }
+  /* The holes, including the one to the end, are never written. */
+  if (ftruncate(in_dst_fd, file_size) != 0) {
+    LOG_ERROR("ftruncate() has been failed with [%s].", strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  LOG_INFO("Sparse image has been expanded to %llu bytes with %llu extents.", (unsigned long long)file_size, (unsigned long long)count);
+  return SSE_E_OK;
+}
+
+sse_int
+FILESparse_Expand(const sse_char *in_path)
+{
+  struct stat st;
+  sse_char *tmp_path;
+  sse_size len;
+  int src_fd;
+  int dst_fd;
+  sse_int err;
+
+  ASSERT(in_path);
+
+  src_fd = open(in_path, O_RDONLY);
+  if (src_fd < 0 || fstat(src_fd, &st) != 0) {
+    LOG_ERROR("open(%s) has been failed with [%s].", in_path, strerror(errno));
+    if (src_fd >= 0) close(src_fd);
+    return SSE_E_NOENT;
+  }
+  len = sse_strlen(in_path) + sizeof(".sparse");
+  tmp_path = sse_malloc(len);
+  ASSERT(tmp_path);
+  snprintf(tmp_path, len, "%s.sparse", in_path);
+  dst_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+  if (dst_fd < 0) {
+    LOG_ERROR("open(%s) has been failed with [%s].", tmp_path, strerror(errno));
+    close(src_fd);
+    sse_free(tmp_path);
+    return SSE_E_GENERIC;
+  }
+  err = FILESparse_WriteExtents(src_fd, st.st_size, dst_fd);
+  close(src_fd);
+  if (close(dst_fd) != 0 && err == SSE_E_OK) {
+    LOG_ERROR("close(%s) has been failed with [%s].", tmp_path, strerror(errno));
+    err = SSE_E_GENERIC;
+  }
+  if (err == SSE_E_OK && rename(tmp_path, in_path) != 0) {
+    LOG_ERROR("rename(%s) has been failed with [%s].", tmp_path, strerror(errno));
+    err = SSE_E_GENERIC;
+  }
+  if (err != SSE_E_OK) {
+    unlink(tmp_path);
+  }
+  sse_free(tmp_path);
+  return err;
+}
@@ -0,0 +1,259 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+#define FILE_TAIL_STATE_MAGIC "tail-state 1"
+#define FILE_TAIL_LINE_SIZE   (4096 + 16)
+
+/* Hash of the block before the offset. */
+static sse_int
+FILETail_HashBlock(int in_fd,
+                   sse_uint64 in_offset,
+                   sse_char *out_hex)
+{
+  TFILEHash hash;
+  sse_byte buf[FILE_TAIL_BLOCK_SIZE];
+  sse_uint64 start;
+  ssize_t n;
+  sse_size done = 0;
+  sse_int err;
+
+  start = (in_offset > sizeof(buf)) ? in_offset - sizeof(buf) : 0;
+  while (start + done < in_offset) {
+    n = pread(in_fd, buf + done, in_offset - start - done, start + done);
+    if (n <= 0) {
+      LOG_ERROR("pread() has been failed with [%s].", (n < 0) ? strerror(errno) : "EOF");
+      return SSE_E_GENERIC;
+    }
+    done += n;
+  }
+  err = TFILEHash_Initialize(&hash, FILE_HASH_ALGORITHM_SHA256);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  TFILEHash_Update(&hash, buf, done);
+  TFILEHash_Finalize(&hash, out_hex);
+  return SSE_E_OK;
+}
+
+static void
+TFILETailState_Load(TFILETailState *self)
+{
+  FILE *fp;
+  sse_char line[FILE_TAIL_LINE_SIZE];
+  unsigned long long dev;
+  unsigned long long ino;
+  unsigned long long offset;
+  sse_char hash[FILE_HASH_HEX_MAX + 1];
+  sse_size len = sse_strlen(self->fFilePath);
+
+  fp = fopen(self->fStatePath, "r");
+  if (fp == NULL) {
+    LOG_DEBUG("No tail state of [%s].", self->fFilePath);
+    return;
+  }
+  /* Header, the source file path, then the inode, offset and hash. */
+  if (!fgets(line, sizeof(line), fp) || sse_strncmp(line, FILE_TAIL_STATE_MAGIC "\n", sizeof(FILE_TAIL_STATE_MAGIC)) != 0) {
+    LOG_WARN("The tail state [%s] is broken, ignore it.", self->fStatePath);
+  } else if (!fgets(line, sizeof(line), fp) || sse_strncmp(line, "path ", 5) != 0 ||
+             sse_strncmp(line + 5, self->fFilePath, len) != 0 || line[5 + len] != '\n') {
+    LOG_WARN("The tail state [%s] is not of [%s], ignore it.", self->fStatePath, self->fFilePath);
+  } else if (!fgets(line, sizeof(line), fp) ||
+             sscanf(line, "inode %llu %llu offset %llu sha256 %64s", &dev, &ino, &offset, hash) != 4) {
+    LOG_WARN("The tail state [%s] is broken, ignore it.", self->fStatePath);
+  } else {
+    self->fDev = dev;
+    self->fIno = ino;
+    self->fOffset = offset;
+    sse_strcpy(self->fHash, hash);
+  }
+  fclose(fp);
+}
+
+/*
+ * Constructor / Destructor
+ */
+
+TFILETailState*
+FILETailState_New(const sse_char *in_file_path,
+                  const sse_char *in_state_dir)
+{
+  TFILETailState *self;
+  const sse_char *name;
+  sse_size len;
+
+  ASSERT(in_file_path);
+  ASSERT(in_state_dir);
+
+  self = sse_zeroalloc(sizeof(TFILETailState));
+  ASSERT(self);
+  self->fFilePath = sse_strdup(in_file_path);
+  ASSERT(self->fFilePath);
+  name = sse_strrchr(in_file_path, '/');
+  name = (name) ? name + 1 : in_file_path;
+  len = sse_strlen(in_state_dir) + 1 + sse_strlen(name) + 1 + 8 + sizeof(".tail");
+  self->fStatePath = sse_malloc(len);
+  ASSERT(self->fStatePath);
+  /* The hash tells the files of the same name in different directories. */
+  snprintf(self->fStatePath, len, "%s/%s-%08x.tail", in_state_dir, name, FILEHash_Fnv1a(in_file_path));
+  self->fOffset = 0;
+  self->fHash[0] = '\0';
+  TFILETailState_Load(self);
+  return self;
+}
+
+void
+TFILETailState_Delete(TFILETailState *self)
+{
+  ASSERT(self);
+  if (self->fFilePath)  sse_free(self->fFilePath);
+  if (self->fStatePath) sse_free(self->fStatePath);
+  sse_free(self);
+}
+
+sse_int
+TFILETailState_GetRange(TFILETailState *self,
+                        sse_uint64 *out_start,
+                        sse_uint64 *out_end)
+{
+  struct stat st;
+  sse_char hash[FILE_HASH_HEX_MAX + 1];
+  int fd;
+  sse_int err;
+
+  ASSERT(self);
+  ASSERT(out_start);
+  ASSERT(out_end);
+
+  *out_start = 0;
+  fd = open(self->fFilePath, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    LOG_ERROR("open(%s) has been failed with [%s].", self->fFilePath, strerror(errno));
+    if (fd >= 0) close(fd);
+    return SSE_E_NOENT;
+  }
+  if (self->fOffset == 0) {
+    LOG_INFO("[%s] has never been uploaded, upload the whole file.", self->fFilePath);
+  } else if ((sse_uint64)st.st_dev != self->fDev || (sse_uint64)st.st_ino != self->fIno) {
+    LOG_INFO("[%s] has been rotated, upload the whole file.", self->fFilePath);
+  } else if ((sse_uint64)st.st_size < self->fOffset) {
+    LOG_INFO("[%s] has been truncated, upload the whole file.", self->fFilePath);
+  } else {
+    err = FILETail_HashBlock(fd, self->fOffset, hash);
+    if (err != SSE_E_OK) {
+      close(fd);
+      return err;
+    }
+    if (sse_strcmp(hash, self->fHash) != 0) {
+      LOG_INFO("[%s] has been rewritten, upload the whole file.", self->fFilePath);
+    } else {
+      LOG_INFO("Upload [%s] from offset %llu.", self->fFilePath, (unsigned long long)self->fOffset);
+      *out_start = self->fOffset;
+    }
+  }
+  close(fd);
+  /* The file to be committed */
+  self->fDev = st.st_dev;
+  self->fIno = st.st_ino;
+  *out_end = st.st_size;
+  return SSE_E_OK;
+}
+
+sse_int
+TFILETailState_Commit(TFILETailState *self,
+                      sse_uint64 in_end)
+{
+  struct stat st;
+  sse_char *tmp_path;
+  sse_size len;
+  FILE *fp;
+  int fd;
+  int ret;
+  sse_int err;
+
+  ASSERT(self);
+
+  fd = open(self->fFilePath, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    LOG_ERROR("open(%s) has been failed with [%s].", self->fFilePath, strerror(errno));
+    if (fd >= 0) close(fd);
+    return SSE_E_NOENT;
+  }
+  if ((sse_uint64)st.st_dev != self->fDev || (sse_uint64)st.st_ino != self->fIno || (sse_uint64)st.st_size < in_end) {
+    LOG_WARN("[%s] has been rotated while uploading, upload the whole file next time.", self->fFilePath);
+    close(fd);
+    return SSE_E_OK;
+  }
+  err = FILETail_HashBlock(fd, in_end, self->fHash);
+  close(fd);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  self->fOffset = in_end;
+
+  /* Replace the state atomically. */
+  len = sse_strlen(self->fStatePath) + sizeof(".new");
+  tmp_path = sse_malloc(len);
+  ASSERT(tmp_path);
+  snprintf(tmp_path, len, "%s.new", self->fStatePath);
+  fp = fopen(tmp_path, "w");
+  if (fp == NULL) {
+    LOG_ERROR("fopen(%s) has been failed with [%s].", tmp_path, strerror(errno));
+    sse_free(tmp_path);
+    return SSE_E_GENERIC;
+  }
+  ret = fprintf(fp, FILE_TAIL_STATE_MAGIC "\npath %s\ninode %llu %llu offset %llu sha256 %s\n",
+                self->fFilePath, (unsigned long long)self->fDev, (unsigned long long)self->fIno,
+                (unsigned long long)self->fOffset, self->fHash);
+  if (ret < 0 || fflush(fp) != 0 || fdatasync(fileno(fp)) != 0) {
+    LOG_ERROR("Writing [%s] has been failed with [%s].", tmp_path, strerror(errno));
+    fclose(fp);
+    unlink(tmp_path);
+    sse_free(tmp_path);
+    return SSE_E_GENERIC;
+  }
+  fclose(fp);
+  if (rename(tmp_path, self->fStatePath) != 0) {
+    LOG_ERROR("rename(%s) has been failed with [%s].", tmp_path, strerror(errno));
+    unlink(tmp_path);
+    sse_free(tmp_path);
+    return SSE_E_GENERIC;
+  }
+  sse_free(tmp_path);
+  LOG_DEBUG("[%s] has been uploaded up to %llu.", self->fFilePath, (unsigned long long)in_end);
+  return SSE_E_OK;
+}
@@ -0,0 +1,480 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+#define FILE_TAR_GLOB_CHARS    "*?["
+#define FILE_TAR_NAME_SIZE     (100)
+#define FILE_TAR_PREFIX_SIZE   (155)
+#define FILE_TAR_LONGLINK      "././@LongLink"
+#define FILE_TAR_HEADER_MAX    (FILE_TAR_BLOCK_SIZE * (2 + (PATH_MAX + FILE_TAR_BLOCK_SIZE) / FILE_TAR_BLOCK_SIZE))
+#define FILE_TAR_ROUND_UP(n)   (((n) + FILE_TAR_BLOCK_SIZE - 1) / FILE_TAR_BLOCK_SIZE * FILE_TAR_BLOCK_SIZE)
+
+/* ustar header */
+struct FILETarHeader_ {
+  sse_char fName[100];
+  sse_char fMode[8];
+  sse_char fUid[8];
+  sse_char fGid[8];
+  sse_char fSize[12];
+  sse_char fMtime[12];
+  sse_char fChksum[8];
+  sse_char fTypeflag;
+  sse_char fLinkname[100];
+  sse_char fMagic[6];
+  sse_char fVersion[2];
+  sse_char fUname[32];
+  sse_char fGname[32];
+  sse_char fDevmajor[8];
+  sse_char fDevminor[8];
+  sse_char fPrefix[155];
+  sse_char fPad[12];
+};
+
+/*
+ * Header
+ */
+
+/* Octal number, or base-256 if it does not fit like GNU tar. */
+static void
+FILETar_SetNumber(sse_char *out_field,
+                  sse_size in_size,
+                  sse_uint64 in_value)
+{
+  sse_size i;
+
+  if (in_size < 12 || in_value < (1ULL << ((in_size - 1) * 3))) {
+    snprintf(out_field, in_size, "%0*llo", (int)in_size - 1, (unsigned long long)in_value);
+    return;
+  }
+  sse_memset(out_field, 0, in_size);
+  for (i = in_size - 1; i > 0 && in_value > 0; i--) {
+    out_field[i] = (sse_char)(in_value & 0xff);
+    in_value >>= 8;
+  }
+  out_field[0] = (sse_char)0x80;
+}
+
+static void
+FILETar_SetHeader(struct FILETarHeader_ *out_header,
+                  const sse_char *in_name,
+                  sse_size in_name_len,
+                  sse_char in_type,
+                  sse_uint in_mode,
+                  sse_int64 in_mtime,
+                  sse_uint64 in_size)
+{
+  sse_size split;
+  sse_uint sum = 0;
+  sse_size i;
+
+  sse_memset(out_header, 0, sizeof(*out_header));
+  if (in_name_len <= FILE_TAR_NAME_SIZE) {
+    sse_memcpy(out_header->fName, in_name, in_name_len);
+  } else {
+    /* Split into the prefix and the name at a '/'. */
+    for (split = in_name_len - FILE_TAR_NAME_SIZE - 1; split < in_name_len && in_name[split] != '/'; split++)
+      ;
+    if (split < in_name_len && split <= FILE_TAR_PREFIX_SIZE) {
+      sse_memcpy(out_header->fPrefix, in_name, split);
+      sse_memcpy(out_header->fName, in_name + split + 1, in_name_len - split - 1);
+    } else {
+      /* Preceded by the long name entry. */
+      sse_memcpy(out_header->fName, in_name, FILE_TAR_NAME_SIZE);
+    }
+  }
+  FILETar_SetNumber(out_header->fMode, sizeof(out_header->fMode), in_mode & 07777);
+  FILETar_SetNumber(out_header->fUid, sizeof(out_header->fUid), 0);
+  FILETar_SetNumber(out_header->fGid, sizeof(out_header->fGid), 0);
+  FILETar_SetNumber(out_header->fSize, sizeof(out_header->fSize), in_size);
+  FILETar_SetNumber(out_header->fMtime, sizeof(out_header->fMtime), (in_mtime > 0) ? in_mtime : 0);
+  out_header->fTypeflag = in_type;
+  sse_memcpy(out_header->fMagic, "ustar", 6);
+  sse_memcpy(out_header->fVersion, "00", 2);
+
+  sse_memset(out_header->fChksum, ' ', sizeof(out_header->fChksum));
+  for (i = 0; i < sizeof(*out_header); i++) {
+    sum += ((sse_byte *)out_header)[i];
+  }
+  snprintf(out_header->fChksum, sizeof(out_header->fChksum), "%06o", sum);
+}
+
+/* Whether the name needs the long name entry. */
+static sse_bool
+FILETar_NeedsLongName(const sse_char *in_name,
+                      sse_size in_len)
+{
+  sse_size split;
+
+  if (in_len <= FILE_TAR_NAME_SIZE) {
+    return sse_false;
+  }
+  for (split = in_len - FILE_TAR_NAME_SIZE - 1; split < in_len && in_name[split] != '/'; split++)
+    ;
+  return !(split < in_len && split <= FILE_TAR_PREFIX_SIZE);
+}
+
+/* Build the headers of the entry into out_buf of FILE_TAR_HEADER_MAX bytes. */
+static void
+TFILETarEntry_BuildHeader(TFILETarEntry *self,
+                          sse_byte *out_buf)
+{
+  sse_size len = sse_strlen(self->fName);
+
+  sse_memset(out_buf, 0, self->fHeaderSize);
+  if (FILETar_NeedsLongName(self->fName, len)) {
+    FILETar_SetHeader((struct FILETarHeader_ *)out_buf, FILE_TAR_LONGLINK, sse_strlen(FILE_TAR_LONGLINK), 'L', 0644, 0, len + 1);
+    sse_memcpy(out_buf + FILE_TAR_BLOCK_SIZE, self->fName, len);
+    out_buf += FILE_TAR_BLOCK_SIZE + FILE_TAR_ROUND_UP(len + 1);
+  }
+  FILETar_SetHeader((struct FILETarHeader_ *)out_buf, self->fName, len, self->fType, self->fMode, self->fMtime, self->fSize);
+}
+
+/*
+ * Members
+ */
+
+static void
+TFILETarArchive_AddEntry(TFILETarArchive *self,
+                         const sse_char *in_path,
+                         const sse_char *in_name,
+                         struct stat *in_st)
+{
+  TFILETarEntry *entries;
+  TFILETarEntry *entry;
+  sse_size len;
+
+  if (self->fCount == self->fCapacity) {
+    self->fCapacity = (self->fCapacity == 0) ? 16 : self->fCapacity * 2;
+    entries = sse_zeroalloc(sizeof(TFILETarEntry) * self->fCapacity);
+    ASSERT(entries);
+    if (self->fEntries) {
+      sse_memcpy(entries, self->fEntries, sizeof(TFILETarEntry) * self->fCount);
+      sse_free(self->fEntries);
+    }
+    self->fEntries = entries;
+  }
+  entry = &self->fEntries[self->fCount++];
+  entry->fPath = sse_strdup(in_path);
+  ASSERT(entry->fPath);
+  len = sse_strlen(in_name);
+  entry->fName = sse_malloc(len + 2);
+  ASSERT(entry->fName);
+  sse_memcpy(entry->fName, in_name, len + 1);
+  if (S_ISDIR(in_st->st_mode)) {
+    /* Directory names end with '/'. */
+    entry->fName[len++] = '/';
+    entry->fName[len] = '\0';
+    entry->fType = '5';
+    entry->fSize = 0;
+  } else {
+    entry->fType = '0';
+    entry->fSize = in_st->st_size;
+  }
+  entry->fMode = in_st->st_mode;
+  entry->fMtime = in_st->st_mtime;
+  entry->fOffset = self->fSize;
+  entry->fHeaderSize = FILE_TAR_BLOCK_SIZE;
+  if (FILETar_NeedsLongName(entry->fName, len)) {
+    entry->fHeaderSize += FILE_TAR_BLOCK_SIZE + FILE_TAR_ROUND_UP(len + 1);
+  }
+  self->fSize += entry->fHeaderSize + FILE_TAR_ROUND_UP(entry->fSize);
+  if (entry->fMtime > self->fMtime) {
+    self->fMtime = entry->fMtime;
+  }
+}
+
+/* Add the file, or the directory and the files under it in the name order. */
+static void
+TFILETarArchive_AddPath(TFILETarArchive *self,
+                        const sse_char *in_path,
+                        const sse_char *in_name)
+{
+  struct stat st;
+  struct dirent **list;
+  sse_char *path;
+  sse_char *name;
+  sse_size len;
+  int n;
+  int i;
+
+  if (lstat(in_path, &st) != 0) {
+    LOG_WARN("lstat(%s) has been failed with [%s].", in_path, strerror(errno));
+    return;
+  }
+  if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+    LOG_DEBUG("[%s] is not a regular file nor a directory, skip it.", in_path);
+    return;
+  }
+  if (sse_strlen(in_name) >= PATH_MAX) {
+    LOG_WARN("The name of [%s] is too long, skip it.", in_path);
+    return;
+  }
+  TFILETarArchive_AddEntry(self, in_path, in_name, &st);
+  if (!S_ISDIR(st.st_mode)) {
+    return;
+  }
+  n = scandir(in_path, &list, NULL, alphasort);
+  if (n < 0) {
+    LOG_WARN("scandir(%s) has been failed with [%s].", in_path, strerror(errno));
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    if (sse_strcmp(list[i]->d_name, ".") != 0 && sse_strcmp(list[i]->d_name, "..") != 0) {
+      len = sse_strlen(in_path) + sse_strlen(list[i]->d_name) + 2;
+      path = sse_malloc(len);
+      ASSERT(path);
+      snprintf(path, len, "%s/%s", in_path, list[i]->d_name);
+      len = sse_strlen(in_name) + sse_strlen(list[i]->d_name) + 2;
+      name = sse_malloc(len);
+      ASSERT(name);
+      snprintf(name, len, "%s/%s", in_name, list[i]->d_name);
+      TFILETarArchive_AddPath(self, path, name);
+      sse_free(path);
+      sse_free(name);
+    }
+    free(list[i]);
+  }
+  free(list);
+}
+
+/* Length of the directory part which the names in the archive are relative to. */
+static sse_size
+FILETar_GetBaseLength(const sse_char *in_path)
+{
+  sse_size len;
+
+  /* The directory before the first component with a glob character. */
+  len = strcspn(in_path, FILE_TAR_GLOB_CHARS);
+  if (in_path[len] == '\0') {
+    /* A directory is archived with its name. */
+    while (len > 1 && in_path[len - 1] == '/') len--;
+  }
+  while (len > 0 && in_path[len - 1] != '/') len--;
+  return len;
+}
+
+/*
+ * Constructor / Destructor
+ */
+
+sse_bool
+FILETarArchive_IsArchivePath(const sse_char *in_path)
+{
+  struct stat st;
+
+  ASSERT(in_path);
+  if (in_path[strcspn(in_path, FILE_TAR_GLOB_CHARS)] != '\0') {
+    return sse_true;
+  }
+  return (stat(in_path, &st) == 0 && S_ISDIR(st.st_mode));
+}
+
+sse_int
+FILETarArchive_New(const sse_char *in_path,
+                   TFILETarArchive **out_archive)
+{
+  TFILETarArchive *self;
+  glob_t matches;
+  sse_size base;
+  sse_size i;
+  int ret;
+
+  ASSERT(in_path);
+  ASSERT(out_archive);
+
+  self = sse_zeroalloc(sizeof(TFILETarArchive));
+  ASSERT(self);
+  self->fFd = -1;
+  base = FILETar_GetBaseLength(in_path);
+
+  if (in_path[strcspn(in_path, FILE_TAR_GLOB_CHARS)] != '\0') {
+    ret = glob(in_path, 0, NULL, &matches);
+    if (ret == 0) {
+      for (i = 0; i < matches.gl_pathc; i++) {
+        TFILETarArchive_AddPath(self, matches.gl_pathv[i], matches.gl_pathv[i] + base);
+      }
+      globfree(&matches);
+    } else if (ret != GLOB_NOMATCH) {
+      LOG_ERROR("glob(%s) has been failed with [%d].", in_path, ret);
+    }
+  } else {
+    TFILETarArchive_AddPath(self, in_path, in_path + base);
+  }
+  if (self->fCount == 0) {
+    LOG_ERROR("No file matches [%s].", in_path);
+    TFILETarArchive_Delete(self);
+    return SSE_E_NOENT;
+  }
+  /* End of archive */
+  self->fSize += FILE_TAR_BLOCK_SIZE * 2;
+  LOG_INFO("[%s] is archived with %u entries, %llu bytes.", in_path, self->fCount, (unsigned long long)self->fSize);
+  *out_archive = self;
+  return SSE_E_OK;
+}
+
+void
+TFILETarArchive_Delete(TFILETarArchive *self)
+{
+  sse_uint i;
+
+  ASSERT(self);
+  for (i = 0; i < self->fCount; i++) {
+    sse_free(self->fEntries[i].fPath);
+    sse_free(self->fEntries[i].fName);
+  }
+  if (self->fEntries) sse_free(self->fEntries);
+  if (self->fFd >= 0)  close(self->fFd);
+  sse_free(self);
+}
+
+/*
+ * Read
+ */
+
+/* Find the entry which includes the offset, fCount if at the end of archive. */
+static sse_uint
+TFILETarArchive_FindEntry(TFILETarArchive *self,
+                          sse_uint64 in_offset)
+{
+  sse_uint low = 0;
+  sse_uint high = self->fCount;
+  sse_uint mid;
+
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (self->fEntries[mid].fOffset <= in_offset) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if (low == self->fCount) {
+    TFILETarEntry *last = &self->fEntries[self->fCount - 1];
+    if (in_offset >= last->fOffset + last->fHeaderSize + FILE_TAR_ROUND_UP(last->fSize)) {
+      return self->fCount;
+    }
+  }
+  return low - 1;
+}
+
+/* Read the content of the member, zeros where the member has shrunk. */
+static sse_size
+TFILETarArchive_ReadMember(TFILETarArchive *self,
+                           sse_uint in_index,
+                           sse_byte *out_buf,
+                           sse_size in_len,
+                           sse_uint64 in_offset)
+{
+  TFILETarEntry *entry = &self->fEntries[in_index];
+  ssize_t n = 0;
+
+  if (self->fFd < 0 || self->fFdIndex != in_index) {
+    if (self->fFd >= 0) close(self->fFd);
+    self->fFd = open(entry->fPath, O_RDONLY);
+    self->fFdIndex = in_index;
+    if (self->fFd < 0) {
+      LOG_WARN("open(%s) has been failed with [%s].", entry->fPath, strerror(errno));
+    }
+  }
+  if (self->fFd >= 0) {
+    n = pread(self->fFd, out_buf, in_len, in_offset);
+    if (n < 0) {
+      LOG_WARN("pread(%s) has been failed with [%s].", entry->fPath, strerror(errno));
+      n = 0;
+    }
+  }
+  if ((sse_size)n < in_len) {
+    sse_memset(out_buf + n, 0, in_len - n);
+  }
+  return in_len;
+}
+
+sse_int
+TFILETarArchive_Read(TFILETarArchive *self,
+                     sse_byte *out_buf,
+                     sse_size in_len,
+                     sse_uint64 in_offset,
+                     sse_size *out_len)
+{
+  sse_byte header[FILE_TAR_HEADER_MAX];
+  TFILETarEntry *entry;
+  sse_uint index;
+  sse_uint64 pos;
+  sse_size len;
+  sse_size done = 0;
+
+  ASSERT(self);
+  ASSERT(out_buf);
+  ASSERT(out_len);
+
+  while (done < in_len && in_offset + done < self->fSize) {
+    pos = in_offset + done;
+    len = in_len - done;
+    if (pos + len > self->fSize) {
+      len = self->fSize - pos;
+    }
+    index = TFILETarArchive_FindEntry(self, pos);
+    if (index == self->fCount) {
+      /* End of archive */
+      sse_memset(out_buf + done, 0, len);
+      done += len;
+      continue;
+    }
+    entry = &self->fEntries[index];
+    pos -= entry->fOffset;
+    if (pos < entry->fHeaderSize) {
+      if (len > entry->fHeaderSize - pos) len = entry->fHeaderSize - pos;
+      TFILETarEntry_BuildHeader(entry, header);
+      sse_memcpy(out_buf + done, header + pos, len);
+    } else if (pos - entry->fHeaderSize < entry->fSize) {
+      pos -= entry->fHeaderSize;
+      if (len > entry->fSize - pos) len = entry->fSize - pos;
+      len = TFILETarArchive_ReadMember(self, index, out_buf + done, len, pos);
+    } else {
+      /* Padding to the block */
+      pos -= entry->fHeaderSize;
+      if (len > FILE_TAR_ROUND_UP(entry->fSize) - pos) len = FILE_TAR_ROUND_UP(entry->fSize) - pos;
+      sse_memset(out_buf + done, 0, len);
+    }
+    done += len;
+  }
+  *out_len = done;
+  return SSE_E_OK;
+}
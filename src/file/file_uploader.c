@@ -16,6 +16,8 @@
  * http://www.yourinventit.com/
  */
 
+#include <stdio.h>
+#include <sys/stat.h>
 #include <servicesync/moat.h>
 #include <sseutils.h>
 #include <file/file.h>
@@ -32,7 +34,10 @@
 static void FILEUploader_OnUploadCompletionCallback(MoatUploader *in_dl, sse_bool in_canceled, sse_pointer in_user_data);
 static void FILEUplaoder_OnUploadErrorCallback(MoatUploader *in_dl, sse_int in_err_code, sse_pointer in_user_data);
 static void TFILEUploader_CallOnCompleteCallback(TFILEUploader *self);
+static void TFILEUploader_NotifyResult(TFILEUploader *self);
 static sse_int TFILEUploader_StoreResultCode(TFILEUploader *self, const sse_char *in_err_code, const sse_char *in_err_msg, sse_bool in_overwrite);
+static void FILEUploader_OnMultipartCompleteCallback(TFILEMultipartUpload *in_multipart, const sse_char *in_err_code, const sse_char *in_err_msg, sse_pointer in_user_data);
+static void FILEUploader_OnSendfileCompleteCallback(TFILESendfileUpload *in_sendfile, const sse_char *in_err_code, const sse_char *in_err_msg, sse_pointer in_user_data);
 
 
 static void
@@ -73,6 +78,245 @@ FILEUplaoder_OnUploadErrorCallback(MoatUploader *in_dl,
   return;
 }
 
+static void
+FILEUploader_OnMultipartCompleteCallback(TFILEMultipartUpload *in_multipart,
+                                         const sse_char *in_err_code,
+                                         const sse_char *in_err_msg,
+                                         sse_pointer in_user_data)
+{
+  TFILEUploader *uploader;
+
+  uploader = (TFILEUploader *)in_user_data;
+  ASSERT(uploader);
+
+  if (sse_strcmp(in_err_code, FILE_ERROR_OK) != 0) {
+    MOAT_VALUE_DUMP_ERROR(TAG, uploader->fUrl);
+    MOAT_VALUE_DUMP_ERROR(TAG, uploader->fFilePath);
+    TFILEUploader_StoreResultCode(uploader, in_err_code, in_err_msg, sse_false);
+  } else if (uploader->fRanged) {
+    /* The end may be short of the snapshot if the file has been truncated while uploading. */
+    TFILEMultipartUpload_GetRange(in_multipart, &uploader->fRangeStart, &uploader->fRangeEnd);
+    if (uploader->fTail && TFILETailState_Commit(uploader->fTail, uploader->fRangeEnd) != SSE_E_OK) {
+      LOG_WARN("The uploaded offset has not been saved, the bytes will be uploaded again next time.");
+    }
+  }
+  TFILEUploader_CallOnCompleteCallback(uploader);
+  return;
+}
+
+static void
+FILEUploader_OnSendfileCompleteCallback(TFILESendfileUpload *in_sendfile,
+                                        const sse_char *in_err_code,
+                                        const sse_char *in_err_msg,
+                                        sse_pointer in_user_data)
+{
+  TFILEUploader *uploader;
+
+  uploader = (TFILEUploader *)in_user_data;
+  ASSERT(uploader);
+
+  if (sse_strcmp(in_err_code, FILE_ERROR_OK) != 0) {
+    MOAT_VALUE_DUMP_ERROR(TAG, uploader->fUrl);
+    MOAT_VALUE_DUMP_ERROR(TAG, uploader->fFilePath);
+    TFILEUploader_StoreResultCode(uploader, in_err_code, in_err_msg, sse_false);
+  }
+  TFILEUploader_CallOnCompleteCallback(uploader);
+  return;
+}
+
+/* "tmpdir" of the filesystem info if configured, otherwise /tmp */
+static void
+TFILEUploader_GetTmpDir(TFILEUploader *self,
+                        sse_char **out_dir,
+                        sse_uint *out_len)
+{
+  MoatValue *tmp_dir;
+
+  *out_dir = "/tmp";
+  *out_len = 4;
+  tmp_dir = (self->fFilesysInfo) ? TFILEFilesysInfo_GetTmpDir(self->fFilesysInfo) : NULL;
+  if (tmp_dir && SseUtilFile_IsDirectory(tmp_dir)) {
+    moat_value_get_string(tmp_dir, out_dir, out_len);
+  }
+}
+
+/* Checkpoint of the multipart upload, ${TMP_DIR}/${ORIGIN_FILENAME}.upload */
+static sse_char*
+TFILEUploader_GetCheckpointPath(TFILEUploader *self,
+                                const sse_char *in_src_file_path)
+{
+  sse_char *dir;
+  sse_uint dir_len;
+  sse_char *basename;
+  sse_char *path;
+  sse_char *p;
+  sse_size len;
+
+  TFILEUploader_GetTmpDir(self, &dir, &dir_len);
+  basename = TFILEArena_StrDup(&self->fArena, in_src_file_path);
+  for (len = sse_strlen(basename); len > 1 && basename[len - 1] == '/'; len--) {
+    basename[len - 1] = '\0';
+  }
+  p = sse_strrchr(basename, '/');
+  p = (p) ? p + 1 : basename;
+  path = TFILEArena_Printf(&self->fArena, NULL, "%.*s/%s.upload", (int)dir_len, dir, p);
+  /* A glob pattern, e.g. "*.log" */
+  for (p = path + dir_len + 1; *p; p++) {
+    if (*p == '*' || *p == '?' || *p == '[' || *p == ']') {
+      *p = '_';
+    }
+  }
+  return path;
+}
+
+/* gzip level requested with the command or configured for the filesystem, FILE_COMPRESS_NONE if not compressed. */
+static sse_int
+TFILEUploader_GetCompressLevel(TFILEUploader *self)
+{
+  MoatValue *spec = self->fCompression;
+  sse_char *str;
+  sse_uint len;
+  sse_int level;
+
+  if (spec == NULL && self->fFilesysInfo) {
+    spec = TFILEFilesysInfo_GetUploadCompression(self->fFilesysInfo);
+  }
+  if (spec == NULL || moat_value_get_string(spec, &str, &len) != SSE_E_OK) {
+    return FILE_COMPRESS_NONE;
+  }
+  if (FILECompress_ParseSpec(str, len, &level) != SSE_E_OK) {
+    LOG_WARN("Upload without compression.");
+    return FILE_COMPRESS_NONE;
+  }
+  return level;
+}
+
+/* Upload to the URLs following the first one as well. */
+static void
+TFILEUploader_AddUrls(TFILEUploader *self)
+{
+  SSESList *list;
+  SSESList *it;
+  sse_char *url;
+  sse_uint len;
+  sse_char *str;
+  sse_int err;
+
+  err = moat_value_get_list(self->fUrls, &list);
+  ASSERT(err == SSE_E_OK);
+  for (it = sse_slist_next(list); it != NULL; it = sse_slist_next(it)) {
+    err = moat_value_get_string((MoatValue *)sse_slist_data(it), &str, &len);
+    ASSERT(err == SSE_E_OK);
+    url = sse_strndup(str, len);
+    ASSERT(url);
+    TFILEMultipartUpload_AddUrl(self->fMultipart, url);
+    sse_free(url);
+  }
+}
+
+/*
+ * Upload the file in parts if the part size is configured and the file is larger than a part,
+ * or compress it while uploading if requested, or upload a range of it if incremental,
+ * or upload it to several URLs, or as a sparse image.
+ */
+static sse_bool
+TFILEUploader_StartMultipart(TFILEUploader *self,
+                             const sse_char *in_src_file_path,
+                             const sse_char *in_dst_url)
+{
+  struct stat st;
+  sse_uint64 size;
+  sse_size part_size = 0;
+  sse_uint concurrency = FILE_UPLOAD_CONCURRENCY_DEFAULT;
+  sse_bool streamed;
+  sse_int level;
+  sse_char *checkpoint;
+  sse_int err;
+
+  /* A directory or a glob pattern is always streamed as a tar archive, and a command as its output. */
+  streamed = FILETarArchive_IsArchivePath(in_src_file_path) || FILESource_IsCommandPath(in_src_file_path);
+  if (!streamed && stat(in_src_file_path, &st) != 0) {
+    return sse_false;
+  }
+  if (self->fFilesysInfo) {
+    part_size = TFILEFilesysInfo_GetUploadPartSize(self->fFilesysInfo);
+    concurrency = TFILEFilesysInfo_GetUploadConcurrency(self->fFilesysInfo);
+  }
+  level = TFILEUploader_GetCompressLevel(self);
+  if (!streamed) {
+    size = (self->fRanged) ? self->fRangeEnd - self->fRangeStart : (sse_uint64)st.st_size;
+    if (size <= part_size) {
+      part_size = 0;
+    }
+    if (self->fRanged || self->fUrls || self->fSparse) {
+      if (part_size == 0 && size > FILE_UPLOAD_IN_MEMORY_MAX) {
+        LOG_ERROR("[%s] is too large to upload in memory, configure \"uploadpartsize\".", in_src_file_path);
+        TFILEUploader_StoreResultCode(self, FILE_ERROR_CONF, "File is too large to upload without \"uploadpartsize\".", sse_false);
+        TFILEUploader_CallOnCompleteCallback(self);
+        return sse_true;
+      }
+    } else if (level == FILE_COMPRESS_NONE && part_size == 0) {
+      return sse_false;
+    } else if (level != FILE_COMPRESS_NONE && part_size == 0 && size > FILE_UPLOAD_IN_MEMORY_MAX) {
+      LOG_WARN("[%s] is too large to compress in memory, configure \"uploadpartsize\" to compress it.", in_src_file_path);
+      return sse_false;
+    }
+  }
+  /* The output of a command may differ every time, it is not resumed, nor an upload to several URLs. */
+  checkpoint = (FILESource_IsCommandPath(in_src_file_path) || self->fUrls) ? NULL : TFILEUploader_GetCheckpointPath(self, in_src_file_path);
+  self->fMultipart = FILEMultipartUpload_New((self->fSnapshotPath) ? self->fSnapshotPath : in_src_file_path,
+                                             in_dst_url, part_size, concurrency, checkpoint);
+  ASSERT(self->fMultipart);
+  if (self->fUrls) {
+    TFILEUploader_AddUrls(self);
+  }
+  TFILEMultipartUpload_SetCompression(self->fMultipart, level);
+  TFILEMultipartUpload_SetWorkerPool(self->fMultipart, self->fWorkers);
+  TFILEMultipartUpload_SetSparse(self->fMultipart, self->fSparse);
+  if (self->fFilesysInfo) {
+    TFILEMultipartUpload_SetFadvise(self->fMultipart, TFILEFilesysInfo_IsFadviseEnabled(self->fFilesysInfo));
+  }
+  if (self->fRanged) {
+    TFILEMultipartUpload_SetRange(self->fMultipart, self->fRangeStart, self->fRangeEnd - self->fRangeStart);
+  }
+  TFILEMultipartUpload_SetOnCompleteCallback(self->fMultipart, FILEUploader_OnMultipartCompleteCallback, self);
+  err = TFILEMultipartUpload_Start(self->fMultipart);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("TFILEMultipartUpload_Start() has been failed with [%s].", sse_get_error_string(err));
+    TFILEUploader_StoreResultCode(self, FILE_ERROR_UPLOAD, "File upload failure.", sse_false);
+    TFILEUploader_CallOnCompleteCallback(self);
+  }
+  return sse_true;
+}
+
+/*
+ * Send the whole file to a plain "http://" URL with sendfile(2) instead of MoatUploader, which
+ * copies it through userspace. sse_false to upload it with MoatUploader.
+ */
+static sse_bool
+TFILEUploader_StartSendfile(TFILEUploader *self,
+                            const sse_char *in_src_file_path,
+                            const sse_char *in_dst_url)
+{
+  sse_int err;
+
+  if (!FILESendfileUpload_IsSupportedUrl(in_dst_url) ||
+      self->fFilesysInfo == NULL || !TFILEFilesysInfo_IsZeroCopyEnabled(self->fFilesysInfo)) {
+    return sse_false;
+  }
+  self->fSendfile = FILESendfileUpload_New((self->fSnapshotPath) ? self->fSnapshotPath : in_src_file_path, in_dst_url);
+  ASSERT(self->fSendfile);
+  TFILESendfileUpload_SetOnCompleteCallback(self->fSendfile, FILEUploader_OnSendfileCompleteCallback, self);
+  TFILESendfileUpload_SetWorkerPool(self->fSendfile, self->fWorkers);
+  err = TFILESendfileUpload_Start(self->fSendfile);
+  if (err != SSE_E_OK) {
+    LOG_WARN("TFILESendfileUpload_Start() has been failed with [%s], upload with MoatUploader.", sse_get_error_string(err));
+    TFILESendfileUpload_Delete(self->fSendfile);
+    self->fSendfile = NULL;
+    return sse_false;
+  }
+  return sse_true;
+}
 
 /*
  * Constructor / Destructor
@@ -89,8 +333,9 @@ FILEUploader_New(const sse_char *in_uid,
   self = sse_zeroalloc(sizeof(TFILEUploader));
   ASSERT(self);
 
+  TFILEArena_Initialize(&self->fArena, 0);
   if (in_uid) {
-    self->fUid = sse_strdup(in_uid);
+    self->fUid = TFILEArena_StrDup(&self->fArena, in_uid);
     LOG_DEBUG("uid=[%s]", in_uid);
   } else {
     self->fUid = NULL;
@@ -98,7 +343,7 @@ FILEUploader_New(const sse_char *in_uid,
   }
 
   if (in_key) {
-    self->fKey = sse_strdup(in_key);
+    self->fKey = TFILEArena_StrDup(&self->fArena, in_key);
     LOG_DEBUG("key=[%s]", in_key);
   } else {
     self->fKey = NULL;
@@ -112,10 +357,34 @@ FILEUploader_New(const sse_char *in_uid,
                               FILEUplaoder_OnUploadErrorCallback,
                               self);
   self->fUrl = NULL;
+  self->fUrls = NULL;
   self->fFilePath = NULL;
+  self->fFilesysInfo = NULL;
+  self->fMultipart = NULL;
+  self->fSendfile = NULL;
+  self->fCompression = NULL;
+  self->fIncremental = sse_false;
+  self->fTail = NULL;
+  self->fSliceOffset = 0;
+  self->fSliceLength = FILE_SOURCE_TO_END;
+  self->fSince = FILE_SLICE_TIME_NONE;
+  self->fUntil = FILE_SLICE_TIME_NONE;
+  self->fForce = sse_false;
+  self->fSparse = sse_false;
+  self->fFingerprint = NULL;
+  self->fNotModified = sse_false;
+  self->fSnapshotPath = NULL;
+  self->fRanged = sse_false;
+  self->fRangeStart = 0;
+  self->fRangeEnd = 0;
   self->fOnCompleteCallback = NULL;
   self->fOnCompleteCallbackUserData = NULL;
   self->fResultCode = NULL;
+  self->fPriority = NULL;
+  self->fPriorityEntered = sse_false;
+  self->fWorkers = NULL;
+  self->fPrepareJob = NULL;
+  self->fCommitJob = NULL;
 
   LOG_DEBUG("Leave: self=[%p]", self);
   return self;
@@ -127,12 +396,24 @@ TFILEUploader_Delete(TFILEUploader *self)
   LOG_DEBUG("Enter: self=[%p]", self);
   ASSERT(self);
 
-  if (self->fUid)         sse_free(self->fUid);
-  if (self->fKey)         sse_free(self->fKey);
+  if (self->fPrepareJob)  TFILEWorkerPool_Cancel(self->fWorkers, self->fPrepareJob);
+  if (self->fCommitJob)   TFILEWorkerPool_Cancel(self->fWorkers, self->fCommitJob);
   if (self->fUploader)    moat_uploader_free(self->fUploader);
+  if (self->fMultipart)   TFILEMultipartUpload_Delete(self->fMultipart);
+  if (self->fSendfile)    TFILESendfileUpload_Delete(self->fSendfile);
+  if (self->fCompression) moat_value_free(self->fCompression);
+  if (self->fTail)        TFILETailState_Delete(self->fTail);
+  if (self->fFingerprint) TFILEFingerprint_Delete(self->fFingerprint);
+  if (self->fSnapshotPath) FILESnapshot_Remove(self->fSnapshotPath);
   if (self->fUrl)         moat_value_free(self->fUrl);
+  if (self->fUrls)        moat_value_free(self->fUrls);
   if (self->fFilePath)    moat_value_free(self->fFilePath);
   if (self->fResultCode)  moat_object_free(self->fResultCode);
+  if (self->fPriorityEntered) TFILEPriority_Leave(self->fPriority);
+  LOG_DEBUG("%u allocations (%zu bytes) have been made from %u chunks for the job.",
+            self->fArena.fAllocCount, self->fArena.fAllocBytes, self->fArena.fChunkCount);
+  TFILEArena_Finalize(&self->fArena);
+  LOG_DEBUG("%u arena chunks are left in the process.", FILEArena_GetLiveChunks());
   sse_free(self);
 }
 
@@ -154,22 +435,416 @@ TFILEUploader_RemoveOnCompleteCallback(TFILEUploader *self)
   self->fOnCompleteCallbackUserData = NULL;
 }
 
+/* The first URL is fUrl, the others are added to the multipart upload. */
+static sse_int
+TFILEUploader_SetUrls(TFILEUploader *self,
+                      MoatValue *in_urls)
+{
+  SSESList *list;
+  SSESList *it;
+  MoatValue *url;
+  sse_char *str;
+  sse_uint len;
+  sse_int err;
+
+  err = moat_value_get_list(in_urls, &list);
+  ASSERT(err == SSE_E_OK);
+  if (list == NULL) {
+    LOG_ERROR("The list of upload URLs is empty.");
+    return SSE_E_INVAL;
+  }
+  for (it = list; it != NULL; it = sse_slist_next(it)) {
+    url = (MoatValue *)sse_slist_data(it);
+    if (moat_value_get_string(url, &str, &len) != SSE_E_OK || len == 0) {
+      LOG_ERROR("The list of upload URLs must consist of strings.");
+      return SSE_E_INVAL;
+    }
+  }
+  self->fUrl = moat_value_clone((MoatValue *)sse_slist_data(list));
+  ASSERT(self->fUrl);
+  if (sse_slist_next(list) != NULL) {
+    self->fUrls = moat_value_clone(in_urls);
+    ASSERT(self->fUrls);
+  }
+  return SSE_E_OK;
+}
+
 sse_int
 TFILEUploader_SetResourcePath(TFILEUploader *self,
                               MoatValue *in_src_filepath,
-                              MoatValue *in_dst_url)
+                              MoatValue *in_dst_url,
+                              TFILEFilesysInfoTbl *in_filesys_info_tbl)
 {
+  MoatValue *scheme;
+  sse_char *str;
+  sse_uint len;
+  sse_int err;
+
   ASSERT(in_src_filepath);
   ASSERT(in_dst_url);
+  ASSERT(in_filesys_info_tbl);
 
+  if (moat_value_get_string(in_src_filepath, &str, &len) == SSE_E_OK &&
+      len >= sizeof(FILE_SOURCE_COMMAND_SCHEME) - 1 &&
+      sse_strncmp(str, FILE_SOURCE_COMMAND_SCHEME, sizeof(FILE_SOURCE_COMMAND_SCHEME) - 1) == 0) {
+    /* Commands are configured with the "cmd:" entry. */
+    scheme = moat_value_new_string(FILE_SOURCE_COMMAND_SCHEME, 0, sse_true);
+    ASSERT(scheme);
+    self->fFilesysInfo = (TFILEFilesysInfo *)TFILEFilesysInfoTbl_FindFilesysInfo(in_filesys_info_tbl, scheme);
+    moat_value_free(scheme);
+  } else {
+    self->fFilesysInfo = (TFILEFilesysInfo *)TFILEFilesysInfoTbl_FindFilesysInfo(in_filesys_info_tbl, in_src_filepath);
+  }
+
+  if (moat_value_get_type(in_dst_url) == MOAT_VALUE_TYPE_LIST) {
+    err = TFILEUploader_SetUrls(self, in_dst_url);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+  } else {
+    self->fUrl = moat_value_clone(in_dst_url);
+    ASSERT(self->fUrl);
+  }
   self->fFilePath = moat_value_clone(in_src_filepath);
   ASSERT(self->fFilePath);
-  self->fUrl = moat_value_clone(in_dst_url);
-  ASSERT(self->fUrl);
 
   return SSE_E_OK;
 }
 
+void
+TFILEUploader_SetCompression(TFILEUploader *self,
+                             MoatValue *in_compression)
+{
+  ASSERT(self);
+  if (self->fCompression) {
+    moat_value_free(self->fCompression);
+    self->fCompression = NULL;
+  }
+  if (in_compression) {
+    self->fCompression = moat_value_clone(in_compression);
+    ASSERT(self->fCompression);
+  }
+}
+
+sse_char*
+TFILEUploader_GetCompressionReport(TFILEUploader *self)
+{
+  ASSERT(self);
+  if (self->fMultipart == NULL) {
+    return NULL;
+  }
+  return TFILEMultipartUpload_GetCompressionReport(self->fMultipart);
+}
+
+void
+TFILEUploader_SetIncremental(TFILEUploader *self,
+                             sse_bool in_incremental)
+{
+  ASSERT(self);
+  self->fIncremental = in_incremental;
+}
+
+void
+TFILEUploader_SetRange(TFILEUploader *self,
+                       sse_uint64 in_offset,
+                       sse_uint64 in_length)
+{
+  ASSERT(self);
+  self->fSliceOffset = in_offset;
+  self->fSliceLength = in_length;
+}
+
+void
+TFILEUploader_SetTimeRange(TFILEUploader *self,
+                           sse_int64 in_since,
+                           sse_int64 in_until)
+{
+  ASSERT(self);
+  self->fSince = in_since;
+  self->fUntil = in_until;
+}
+
+void
+TFILEUploader_SetForce(TFILEUploader *self,
+                       sse_bool in_force)
+{
+  ASSERT(self);
+  self->fForce = in_force;
+}
+
+void
+TFILEUploader_SetSparse(TFILEUploader *self,
+                        sse_bool in_sparse)
+{
+  ASSERT(self);
+  self->fSparse = in_sparse;
+}
+
+void
+TFILEUploader_SetPriority(TFILEUploader *self,
+                          TFILEPriority *in_priority)
+{
+  ASSERT(self);
+  ASSERT(!self->fPriorityEntered);
+  self->fPriority = in_priority;
+}
+
+void
+TFILEUploader_SetWorkerPool(TFILEUploader *self,
+                            TFILEWorkerPool *in_workers)
+{
+  ASSERT(self);
+  self->fWorkers = in_workers;
+}
+
+/* Result of each URL as JSON string, the queries (e.g. signatures) are not reported. */
+static sse_char*
+TFILEUploader_GetDestinationsReport(TFILEUploader *self)
+{
+  SSEString *json;
+  const sse_char *url;
+  const sse_char *code;
+  const sse_char *p;
+  sse_uint count;
+  sse_uint i;
+
+  if (self->fMultipart == NULL || (count = TFILEMultipartUpload_GetUrlCount(self->fMultipart)) < 2) {
+    return NULL;
+  }
+  json = sse_string_new("[");
+  ASSERT(json);
+  for (i = 0; i < count; i++) {
+    code = TFILEMultipartUpload_GetUrlResult(self->fMultipart, i, &url);
+    sse_string_concat_cstr(json, (i == 0) ? "{\"url\":\"" : ",{\"url\":\"");
+    for (p = url; *p && *p != '?' && *p != '#'; p++) {
+      if (*p == '"' || *p == '\\') {
+        sse_string_concat_char(json, '\\');
+      }
+      sse_string_concat_char(json, *p);
+    }
+    if (code && sse_strcmp(code, FILE_ERROR_OK) == 0) {
+      sse_string_concat_cstr(json, "\",\"success\":true}");
+    } else {
+      sse_string_concat_cstr(json, "\",\"success\":false,\"code\":\"");
+      sse_string_concat_cstr(json, (code) ? (sse_char *)code : FILE_ERROR_UPLOAD);
+      sse_string_concat_cstr(json, "\"}");
+    }
+  }
+  sse_string_concat_cstr(json, "]");
+  return sse_string_free(json, sse_false);
+}
+
+MoatObject*
+TFILEUploader_GetResultDetails(TFILEUploader *self)
+{
+  MoatObject *details;
+  sse_char *str;
+  const sse_char *hash;
+  const sse_char *method;
+  sse_int err;
+
+  ASSERT(self);
+  details = moat_object_new();
+  ASSERT(details);
+  str = TFILEUploader_GetCompressionReport(self);
+  if (str) {
+    err = moat_object_add_string_value(details, "compression", str, 0, sse_true, sse_true);
+    ASSERT(err == SSE_E_OK);
+    sse_free(str);
+  }
+  str = TFILEUploader_GetRangeReport(self);
+  if (str) {
+    err = moat_object_add_string_value(details, "range", str, 0, sse_true, sse_true);
+    ASSERT(err == SSE_E_OK);
+    sse_free(str);
+  }
+  hash = (self->fFingerprint) ? TFILEFingerprint_GetHash(self->fFingerprint) : NULL;
+  if (hash) {
+    err = moat_object_add_string_value(details, "hash", (sse_char*)hash, 0, sse_true, sse_true);
+    ASSERT(err == SSE_E_OK);
+  }
+  if (self->fNotModified) {
+    err = moat_object_add_boolean_value(details, "notModified", sse_true, sse_true);
+    ASSERT(err == SSE_E_OK);
+  }
+  str = TFILEUploader_GetDestinationsReport(self);
+  if (str) {
+    err = moat_object_add_string_value(details, "destinations", str, 0, sse_true, sse_true);
+    ASSERT(err == SSE_E_OK);
+    sse_free(str);
+  }
+  if (!self->fNotModified) {
+    method = (self->fSendfile) ? TFILESendfileUpload_GetMethodName(self->fSendfile) : NULL;
+    err = moat_object_add_string_value(details, "transfer", (method) ? (sse_char*)method : "copy", 0, sse_true, sse_true);
+    ASSERT(err == SSE_E_OK);
+  }
+  return details;
+}
+
+sse_char*
+TFILEUploader_GetRangeReport(TFILEUploader *self)
+{
+  sse_char *report;
+  sse_size len = 2 * 20 + 2;
+
+  ASSERT(self);
+  if (!self->fRanged) {
+    return NULL;
+  }
+  report = sse_malloc(len);
+  ASSERT(report);
+  snprintf(report, len, "%llu-%llu", (unsigned long long)self->fRangeStart, (unsigned long long)self->fRangeEnd);
+  return report;
+}
+
+/* Start the incremental upload from the offset uploaded so far. */
+static sse_int
+TFILEUploader_StartTail(TFILEUploader *self,
+                        const sse_char *in_src_file_path)
+{
+  sse_char *dir;
+  sse_uint dir_len;
+  sse_char *state_dir;
+  sse_int err;
+
+  TFILEUploader_GetTmpDir(self, &dir, &dir_len);
+  state_dir = sse_strndup(dir, dir_len);
+  ASSERT(state_dir);
+  self->fTail = FILETailState_New(in_src_file_path, state_dir);
+  sse_free(state_dir);
+  err = TFILETailState_GetRange(self->fTail, &self->fRangeStart, &self->fRangeEnd);
+  if (err != SSE_E_OK) {
+    TFILETailState_Delete(self->fTail);
+    self->fTail = NULL;
+    return err;
+  }
+  self->fRanged = sse_true;
+  LOG_INFO("Upload [%s] in the range %llu-%llu.", in_src_file_path,
+           (unsigned long long)self->fRangeStart, (unsigned long long)self->fRangeEnd);
+  return SSE_E_OK;
+}
+
+/* Resolve the byte range and the time range into the range to upload. */
+static sse_int
+TFILEUploader_StartSlice(TFILEUploader *self,
+                         const sse_char *in_src_file_path)
+{
+  TFILESource source;
+  sse_uint64 start = 0;
+  sse_uint64 end;
+  sse_int err;
+
+  err = TFILESource_Open(&source, in_src_file_path);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  TFILESource_SetRange(&source, self->fSliceOffset, self->fSliceLength);
+  end = source.fSize;
+  if (self->fSince != FILE_SLICE_TIME_NONE) {
+    err = FILESlice_FindTime(&source, self->fSince, &start);
+  }
+  if (err == SSE_E_OK && self->fUntil != FILE_SLICE_TIME_NONE) {
+    err = FILESlice_FindTime(&source, self->fUntil + 1, &end);
+  }
+  if (err == SSE_E_OK) {
+    if (end < start) {
+      end = start;
+    }
+    self->fRangeStart = source.fStart + start;
+    self->fRangeEnd = source.fStart + end;
+    self->fRanged = sse_true;
+    LOG_INFO("Upload [%s] in the range %llu-%llu.", in_src_file_path,
+             (unsigned long long)self->fRangeStart, (unsigned long long)self->fRangeEnd);
+  }
+  TFILESource_Close(&source);
+  return err;
+}
+
+/*
+ * Hashing the file to compare with the fingerprint and copying it into the snapshot may take long,
+ * run them on a worker. The settings are taken out of the uploader on the event loop beforehand,
+ * and the fingerprint and the snapshot are handed over to the uploader when the job is done.
+ */
+struct FILEUploadPrepareJob_ {
+  TFILEUploader *fOwner;                   /** Not touched by the worker */
+  sse_char *fSrcFilePath;
+  sse_char *fDstUrl;
+  sse_char *fTmpDir;                       /** Directory of the fingerprints and the snapshot */
+  sse_int fLevel;                          /** Compression level, see FILECompress_ParseSpec() */
+  sse_bool fSparse;
+  sse_uint64 fRangeStart;                  /** Range of the snapshot */
+  sse_uint64 fRangeEnd;
+  sse_bool fCheck;                         /** Compare with the fingerprint of the last upload */
+  sse_bool fSnapshot;                      /** Take a snapshot to upload */
+  sse_bool fUnchanged;                     /** Result of the comparison */
+  TFILEFingerprint *fFingerprint;          /** Results handed over to the uploader */
+  sse_char *fSnapshotPath;
+};
+typedef struct FILEUploadPrepareJob_ FILEUploadPrepareJob;
+
+static void
+FILEUploader_PrepareWork(sse_pointer in_user_data)
+{
+  FILEUploadPrepareJob *job = (FILEUploadPrepareJob *)in_user_data;
+
+  /* Compare with the fingerprint of the last upload to the destination. */
+  if (job->fCheck) {
+    job->fFingerprint = FILEFingerprint_New(job->fSrcFilePath, job->fDstUrl, job->fLevel, job->fSparse, job->fTmpDir);
+    job->fUnchanged = TFILEFingerprint_IsUnchanged(job->fFingerprint);
+  }
+  /* Upload from a snapshot not to upload a torn copy of the file being written. */
+  if (!job->fUnchanged && job->fSnapshot) {
+    if (FILESnapshot_Take(job->fSrcFilePath, job->fTmpDir, job->fRangeStart, job->fRangeEnd, &job->fSnapshotPath) != SSE_E_OK) {
+      LOG_WARN("Upload [%s] without a snapshot.", job->fSrcFilePath);
+      job->fSnapshotPath = NULL;
+    }
+  }
+}
+
+static void
+FILEUploader_OnPrepareDone(sse_pointer in_user_data,
+                           sse_bool in_canceled)
+{
+  FILEUploadPrepareJob *job = (FILEUploadPrepareJob *)in_user_data;
+  TFILEUploader *self = job->fOwner;
+  sse_int err;
+  sse_char *dst_url;
+  sse_uint dst_url_len;
+
+  if (in_canceled) {
+    LOG_WARN("The upload has been canceled.");
+    if (job->fFingerprint) TFILEFingerprint_Delete(job->fFingerprint);
+    if (job->fSnapshotPath) FILESnapshot_Remove(job->fSnapshotPath);
+    sse_free(job->fSrcFilePath);
+    sse_free(job->fDstUrl);
+    sse_free(job->fTmpDir);
+    sse_free(job);
+    return;
+  }
+  self->fPrepareJob = NULL;
+  self->fFingerprint = job->fFingerprint;
+  self->fSnapshotPath = job->fSnapshotPath;
+  if (job->fUnchanged) {
+    self->fNotModified = sse_true;
+    TFILEUploader_CallOnCompleteCallback(self);
+  } else if (!TFILEUploader_StartMultipart(self, job->fSrcFilePath, job->fDstUrl) &&
+             !TFILEUploader_StartSendfile(self, job->fSrcFilePath, job->fDstUrl)) {
+    err = moat_value_get_string(self->fUrl, &dst_url, &dst_url_len);
+    ASSERT(err == SSE_E_OK);
+    err = moat_uploader_upload(self->fUploader, sse_false, /* Use PUT */
+                               dst_url, dst_url_len, (self->fSnapshotPath) ? self->fSnapshotPath : job->fSrcFilePath);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("moat_uploader_upload() has been failed with [%s].", sse_get_error_string(err));
+      TFILEUploader_StoreResultCode(self, FILE_ERROR_UPLOAD, "File upload failure.", sse_false);
+      TFILEUploader_CallOnCompleteCallback(self);
+    }
+  }
+  sse_free(job->fSrcFilePath);
+  sse_free(job->fDstUrl);
+  sse_free(job->fTmpDir);
+  sse_free(job);
+}
+
 void
 TFILEUploader_UploadFile(TFILEUploader *self)
 {
@@ -179,8 +854,17 @@ TFILEUploader_UploadFile(TFILEUploader *self)
   sse_char *src_file;
   sse_uint src_file_len;
   sse_char *src_file_path;
+  sse_bool sliced;
+  sse_bool whole;
+  FILEUploadPrepareJob *job;
+  sse_char *tmp_dir;
+  sse_uint tmp_dir_len;
 
   ASSERT(self);
+  if (self->fPriority && !self->fPriorityEntered) {
+    TFILEPriority_Enter(self->fPriority, &self->fFilesysInfo, 1);
+    self->fPriorityEntered = sse_true;
+  }
 
   LOG_INFO("Upload the file.");
   MOAT_VALUE_DUMP_INFO(TAG, self->fFilePath);
@@ -193,37 +877,180 @@ TFILEUploader_UploadFile(TFILEUploader *self)
   src_file_path = sse_strndup(src_file, src_file_len);
   ASSERT(src_file_path);
 
-  err = moat_uploader_upload(self->fUploader, sse_false, /* Use PUT */
-                             dst_url, dst_url_len, src_file_path);
-  if (err != SSE_E_OK) {
-    LOG_ERROR("moat_uploader_upload() has been failed with [%s].", sse_get_error_string(err));
-    TFILEUploader_StoreResultCode(self, FILE_ERROR_UPLOAD, "File upload failure.", sse_false);
-    TFILEUploader_CallOnCompleteCallback(self);
+  sliced = (self->fSliceOffset != 0 || self->fSliceLength != FILE_SOURCE_TO_END ||
+            self->fSince != FILE_SLICE_TIME_NONE || self->fUntil != FILE_SLICE_TIME_NONE);
+  whole = FILETarArchive_IsArchivePath(src_file_path) || FILESource_IsCommandPath(src_file_path);
+  if ((sliced || self->fIncremental) && whole) {
+    LOG_WARN("A range cannot be selected from [%s], upload the whole.", src_file_path);
+  } else if (sliced) {
+    if (self->fIncremental) {
+      LOG_WARN("The byte or time range is selected, upload it instead of the appended bytes.");
+    }
+    err = TFILEUploader_StartSlice(self, src_file_path);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("TFILEUploader_StartSlice() has been failed with [%s].", sse_get_error_string(err));
+      TFILEUploader_StoreResultCode(self, FILE_ERROR_NOENT, "No such file to upload.", sse_false);
+      TFILEUploader_CallOnCompleteCallback(self);
+      sse_free(src_file_path);
+      return;
+    }
+  } else if (self->fIncremental) {
+    err = TFILEUploader_StartTail(self, src_file_path);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("TFILEUploader_StartTail() has been failed with [%s].", sse_get_error_string(err));
+      TFILEUploader_StoreResultCode(self, FILE_ERROR_NOENT, "No such file to upload.", sse_false);
+      TFILEUploader_CallOnCompleteCallback(self);
+      sse_free(src_file_path);
+      return;
+    }
   }
-  sse_free(src_file_path);
-
+  if (self->fSparse && (whole || self->fRanged)) {
+    LOG_WARN("A sparse image cannot be made of [%s] or its range, upload it as is.", src_file_path);
+    self->fSparse = sse_false;
+  }
+  job = sse_zeroalloc(sizeof(FILEUploadPrepareJob));
+  ASSERT(job);
+  job->fOwner = self;
+  job->fSrcFilePath = src_file_path;
+  job->fDstUrl = sse_strndup(dst_url, dst_url_len);
+  ASSERT(job->fDstUrl);
+  TFILEUploader_GetTmpDir(self, &tmp_dir, &tmp_dir_len);
+  job->fTmpDir = sse_strndup(tmp_dir, tmp_dir_len);
+  ASSERT(job->fTmpDir);
+  job->fLevel = TFILEUploader_GetCompressLevel(self);
+  job->fSparse = self->fSparse;
+  job->fRangeStart = (self->fRanged) ? self->fRangeStart : 0;
+  job->fRangeEnd = (self->fRanged) ? self->fRangeEnd : FILE_SOURCE_TO_END;
+  job->fCheck = (!self->fRanged && !self->fForce && !whole && self->fUrls == NULL);
+  job->fSnapshot = (!whole && self->fFilesysInfo && TFILEFilesysInfo_IsUploadSnapshotEnabled(self->fFilesysInfo));
+  self->fPrepareJob = TFILEWorkerPool_Submit(self->fWorkers, FILEUploader_PrepareWork, FILEUploader_OnPrepareDone, job);
   return;
 }
 
+/*
+ * The source has been read to be hashed, copied and uploaded, drop it not to leave it in the page
+ * cache. Only read, it is not written back, which could block the event loop.
+ */
 static void
-TFILEUploader_CallOnCompleteCallback(TFILEUploader *self)
+TFILEUploader_DropCache(TFILEUploader *self)
+{
+  sse_char *str;
+  sse_uint len;
+  sse_char *path;
+
+  if (self->fFilesysInfo == NULL || !TFILEFilesysInfo_IsFadviseEnabled(self->fFilesysInfo)) {
+    return;
+  }
+  if (moat_value_get_string(self->fFilePath, &str, &len) != SSE_E_OK) {
+    return;
+  }
+  path = sse_strndup(str, len);
+  ASSERT(path);
+  if (!FILETarArchive_IsArchivePath(path) && !FILESource_IsCommandPath(path)) {
+    FILESource_DropCache(path, sse_false);
+  }
+  sse_free(path);
+}
+
+/*
+ * Hashing the whole file uploaded and writing it back takes long as well, save the fingerprint on a
+ * worker. The job owns the fingerprint until it is done, then hands it back to the uploader.
+ */
+struct FILEUploadCommitJob_ {
+  TFILEUploader *fOwner;                   /** Not touched by the worker */
+  TFILEFingerprint *fFingerprint;
+  sse_char *fETag;                         /** ETag reported by the server, NULL if not reported */
+};
+typedef struct FILEUploadCommitJob_ FILEUploadCommitJob;
+
+static void
+FILEUploader_CommitWork(sse_pointer in_user_data)
+{
+  FILEUploadCommitJob *job = (FILEUploadCommitJob *)in_user_data;
+
+  if (TFILEFingerprint_Commit(job->fFingerprint, job->fETag) != SSE_E_OK) {
+    LOG_WARN("The fingerprint has not been saved, the file will be uploaded again next time.");
+  }
+}
+
+static void
+FILEUploader_OnCommitDone(sse_pointer in_user_data,
+                          sse_bool in_canceled)
+{
+  FILEUploadCommitJob *job = (FILEUploadCommitJob *)in_user_data;
+  TFILEUploader *self = job->fOwner;
+
+  if (in_canceled) {
+    TFILEFingerprint_Delete(job->fFingerprint);
+  } else {
+    self->fCommitJob = NULL;
+    self->fFingerprint = job->fFingerprint;
+  }
+  if (job->fETag) sse_free(job->fETag);
+  sse_free(job);
+  if (!in_canceled) {
+    TFILEUploader_NotifyResult(self);
+  }
+}
+
+/* Save the fingerprint of the file uploaded, then notify the result. */
+static void
+TFILEUploader_CommitFingerprint(TFILEUploader *self)
+{
+  FILEUploadCommitJob *job;
+  const sse_char *etag;
+
+  job = sse_zeroalloc(sizeof(FILEUploadCommitJob));
+  ASSERT(job);
+  job->fOwner = self;
+  job->fFingerprint = self->fFingerprint;
+  self->fFingerprint = NULL;
+  etag = (self->fMultipart) ? TFILEMultipartUpload_GetETag(self->fMultipart) :
+         (self->fSendfile) ? TFILESendfileUpload_GetETag(self->fSendfile) : NULL;
+  if (etag) {
+    job->fETag = sse_strdup(etag);
+    ASSERT(job->fETag);
+  }
+  self->fCommitJob = TFILEWorkerPool_Submit(self->fWorkers, FILEUploader_CommitWork, FILEUploader_OnCommitDone, job);
+}
+
+static void
+TFILEUploader_NotifyResult(TFILEUploader *self)
 {
   MoatValue *err_code;
   MoatValue *err_msg;
 
-  ASSERT(self);
-  if (self->fOnCompleteCallback) {
-    if (self->fResultCode == NULL) {
+  /* After the fingerprint, which reads the file again. */
+  TFILEUploader_DropCache(self);
+  if (self->fOnCompleteCallback == NULL) {
+    return;
+  }
+  if (self->fResultCode == NULL) {
+    if (self->fNotModified) {
+      LOG_INFO("Uploading file has been skipped as not modified.");
+      TFILEUploader_StoreResultCode(self, FILE_ERROR_OK, "File has not been modified since the last upload.", sse_true);
+    } else {
       LOG_INFO("Uploading file has been completed successfuly.");
       TFILEUploader_StoreResultCode(self, FILE_ERROR_OK, "Uploading file has been complated successfuly.", sse_true);
-    } else {
-      LOG_ERROR("Uploading file has been failed.");
-      MOAT_OBJECT_DUMP_ERROR(TAG, self->fResultCode);
     }
-    err_code = moat_object_get_value(self->fResultCode, "err_code");
-    err_msg  = moat_object_get_value(self->fResultCode, "err_msg");
-    self->fOnCompleteCallback(self, err_code, err_msg, self->fUid, self->fKey, self->fOnCompleteCallbackUserData);
+  } else {
+    LOG_ERROR("Uploading file has been failed.");
+    MOAT_OBJECT_DUMP_ERROR(TAG, self->fResultCode);
   }
+  err_code = moat_object_get_value(self->fResultCode, "err_code");
+  err_msg  = moat_object_get_value(self->fResultCode, "err_msg");
+  self->fOnCompleteCallback(self, err_code, err_msg, self->fUid, self->fKey, self->fOnCompleteCallbackUserData);
+}
+
+static void
+TFILEUploader_CallOnCompleteCallback(TFILEUploader *self)
+{
+  ASSERT(self);
+  if (self->fOnCompleteCallback && self->fResultCode == NULL && !self->fNotModified && self->fFingerprint) {
+    TFILEUploader_CommitFingerprint(self);
+    return;
+  }
+  TFILEUploader_NotifyResult(self);
 }
 
 static sse_int
@@ -236,21 +1063,21 @@ TFILEUploader_StoreResultCode(TFILEUploader *self,
 
   ASSERT(self);
   if (self->fResultCode) {
-    if (in_overwrite) {
-      moat_object_free(self->fResultCode);
-    } else {
+    if (!in_overwrite) {
       return SSE_E_OK;
     }
+  } else {
+    self->fResultCode = moat_object_new();
+    ASSERT(self->fResultCode);
   }
-  self->fResultCode = moat_object_new();
-  ASSERT(self->fResultCode);
-  err = moat_object_add_string_value(self->fResultCode, "err_code", (sse_char*)in_err_code, 0, sse_true, sse_false);
+  /* The values are replaced in the object, which is kept until the uploader is deleted. */
+  err = moat_object_add_string_value(self->fResultCode, "err_code", (sse_char*)in_err_code, 0, sse_true, sse_true);
   if (err != SSE_E_OK) {
     moat_object_free(self->fResultCode);
     self->fResultCode = NULL;
     return err;
   }
-  err = moat_object_add_string_value(self->fResultCode, "err_msg", (sse_char*)in_err_msg, 0, sse_true, sse_false);
+  err = moat_object_add_string_value(self->fResultCode, "err_msg", (sse_char*)in_err_msg, 0, sse_true, sse_true);
   if (err != SSE_E_OK) {
     moat_object_free(self->fResultCode);
     self->fResultCode = NULL;
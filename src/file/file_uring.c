@@ -0,0 +1,312 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup    425
+#define __NR_io_uring_enter    426
+#define __NR_io_uring_register 427
+#endif
+
+struct TFILEUring_ {
+  int fRingFd;
+  int fEventFd;
+  MoatIOWatcher *fWatcher;
+  sse_byte *fSqRing;
+  sse_size fSqRingSize;
+  sse_byte *fCqRing;                       /** Same as fSqRing with IORING_FEAT_SINGLE_MMAP */
+  sse_size fCqRingSize;
+  struct io_uring_sqe *fSqes;
+  sse_size fSqesSize;
+  unsigned *fSqHead;
+  unsigned *fSqTail;
+  unsigned *fSqMask;
+  unsigned *fSqArray;
+  unsigned *fCqHead;
+  unsigned *fCqTail;
+  unsigned *fCqMask;
+  struct io_uring_cqe *fCqes;
+  sse_uint fEntries;
+  sse_uint fInFlight;                      /** Writes submitted and not completed */
+  sse_bool fDispatching;                   /** In the callback */
+  sse_bool fDeleted;                       /** Deleted in the callback, freed when it returns */
+  TFILEUring_OnCompleteCallback fOnCompleteCallback;
+  sse_pointer fOnCompleteCallbackUserData;
+};
+
+/* Wait for the writes in flight and discard their completions, the buffers may be freed after this. */
+static void
+TFILEUring_Drain(TFILEUring *self)
+{
+  unsigned head;
+
+  if (self->fRingFd < 0 || self->fInFlight == 0) {
+    return;
+  }
+  while (syscall(__NR_io_uring_enter, self->fRingFd, 0, self->fInFlight, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+         errno == EINTR) {
+    ;
+  }
+  head = __atomic_load_n(self->fCqTail, __ATOMIC_ACQUIRE);
+  __atomic_store_n(self->fCqHead, head, __ATOMIC_RELEASE);
+  self->fInFlight = 0;
+}
+
+static void
+TFILEUring_Free(TFILEUring *self)
+{
+  if (self->fWatcher) {
+    moat_io_watcher_stop(self->fWatcher);
+    moat_io_watcher_free(self->fWatcher);
+  }
+  TFILEUring_Drain(self);
+  if (self->fSqes)                                     munmap(self->fSqes, self->fSqesSize);
+  if (self->fCqRing && self->fCqRing != self->fSqRing) munmap(self->fCqRing, self->fCqRingSize);
+  if (self->fSqRing)                                   munmap(self->fSqRing, self->fSqRingSize);
+  if (self->fRingFd >= 0)                              close(self->fRingFd);
+  if (self->fEventFd >= 0)                             close(self->fEventFd);
+  sse_free(self);
+}
+
+static void
+FILEUring_OnEvent(MoatIOWatcher *in_watcher,
+                  sse_pointer in_user_data,
+                  sse_int in_desc,
+                  sse_int in_event_flags)
+{
+  TFILEUring *self = (TFILEUring *)in_user_data;
+  struct io_uring_cqe cqe;
+  sse_uint64 count;
+  unsigned head;
+
+  ASSERT(self);
+  if (read(self->fEventFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    LOG_ERROR("read(eventfd) has been failed with [%s].", strerror(errno));
+  }
+  self->fDispatching = sse_true;
+  head = *self->fCqHead;
+  while (!self->fDeleted && head != __atomic_load_n(self->fCqTail, __ATOMIC_ACQUIRE)) {
+    cqe = self->fCqes[head & *self->fCqMask];
+    head++;
+    __atomic_store_n(self->fCqHead, head, __ATOMIC_RELEASE);
+    self->fInFlight--;
+    if (self->fOnCompleteCallback) {
+      self->fOnCompleteCallback(self, cqe.user_data, cqe.res, self->fOnCompleteCallbackUserData);
+    }
+  }
+  self->fDispatching = sse_false;
+  if (self->fDeleted) {
+    TFILEUring_Free(self);
+  }
+}
+
+/*
+ * Constructor / Destructor
+ */
+
+TFILEUring*
+FILEUring_New(sse_uint in_entries)
+{
+  TFILEUring *self;
+  struct io_uring_params params;
+
+  self = sse_zeroalloc(sizeof(TFILEUring));
+  ASSERT(self);
+  self->fEventFd = -1;
+  sse_memset(&params, 0, sizeof(params));
+  self->fRingFd = syscall(__NR_io_uring_setup, in_entries, &params);
+  if (self->fRingFd < 0) {
+    LOG_INFO("io_uring is not available, [%s].", strerror(errno));
+    TFILEUring_Free(self);
+    return NULL;
+  }
+  self->fEntries = params.sq_entries;
+
+  self->fSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  self->fCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (self->fCqRingSize > self->fSqRingSize) {
+      self->fSqRingSize = self->fCqRingSize;
+    }
+    self->fCqRingSize = self->fSqRingSize;
+  }
+  self->fSqRing = mmap(NULL, self->fSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       self->fRingFd, IORING_OFF_SQ_RING);
+  if (self->fSqRing == MAP_FAILED) {
+    self->fSqRing = NULL;
+    goto error;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    self->fCqRing = self->fSqRing;
+  } else {
+    self->fCqRing = mmap(NULL, self->fCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         self->fRingFd, IORING_OFF_CQ_RING);
+    if (self->fCqRing == MAP_FAILED) {
+      self->fCqRing = NULL;
+      goto error;
+    }
+  }
+  self->fSqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  self->fSqes = mmap(NULL, self->fSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     self->fRingFd, IORING_OFF_SQES);
+  if (self->fSqes == MAP_FAILED) {
+    self->fSqes = NULL;
+    goto error;
+  }
+  self->fSqHead  = (unsigned *)(self->fSqRing + params.sq_off.head);
+  self->fSqTail  = (unsigned *)(self->fSqRing + params.sq_off.tail);
+  self->fSqMask  = (unsigned *)(self->fSqRing + params.sq_off.ring_mask);
+  self->fSqArray = (unsigned *)(self->fSqRing + params.sq_off.array);
+  self->fCqHead  = (unsigned *)(self->fCqRing + params.cq_off.head);
+  self->fCqTail  = (unsigned *)(self->fCqRing + params.cq_off.tail);
+  self->fCqMask  = (unsigned *)(self->fCqRing + params.cq_off.ring_mask);
+  self->fCqes    = (struct io_uring_cqe *)(self->fCqRing + params.cq_off.cqes);
+
+  self->fEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (self->fEventFd < 0 ||
+      syscall(__NR_io_uring_register, self->fRingFd, IORING_REGISTER_EVENTFD, &self->fEventFd, 1) != 0) {
+    goto error;
+  }
+  self->fWatcher = moat_io_watcher_new(self->fEventFd, FILEUring_OnEvent, self, MOAT_IO_FLAG_READ);
+  if (self->fWatcher == NULL || moat_io_watcher_start(self->fWatcher) != SSE_E_OK) {
+    goto error;
+  }
+  LOG_DEBUG("io_uring of %u entries has been set up.", self->fEntries);
+  return self;
+
+error:
+  LOG_WARN("Setting up io_uring has been failed with [%s].", strerror(errno));
+  TFILEUring_Free(self);
+  return NULL;
+}
+
+void
+TFILEUring_Delete(TFILEUring *self)
+{
+  ASSERT(self);
+  if (self->fDispatching) {
+    /* The owner frees the registered buffers as soon as this returns, the ring is freed later. */
+    TFILEUring_Drain(self);
+    self->fDeleted = sse_true;
+    return;
+  }
+  TFILEUring_Free(self);
+}
+
+sse_int
+TFILEUring_RegisterBuffers(TFILEUring *self,
+                           sse_byte **in_buffers,
+                           sse_size in_size,
+                           sse_uint in_count)
+{
+  struct iovec *iov;
+  sse_uint i;
+  long rc;
+
+  ASSERT(self);
+  iov = sse_malloc(sizeof(struct iovec) * in_count);
+  ASSERT(iov);
+  for (i = 0; i < in_count; i++) {
+    iov[i].iov_base = in_buffers[i];
+    iov[i].iov_len = in_size;
+  }
+  rc = syscall(__NR_io_uring_register, self->fRingFd, IORING_REGISTER_BUFFERS, iov, in_count);
+  sse_free(iov);
+  if (rc != 0) {
+    LOG_WARN("Registering the buffers to io_uring has been failed with [%s].", strerror(errno));
+    return (errno == ENOMEM) ? SSE_E_NOMEM : SSE_E_GENERIC;
+  }
+  return SSE_E_OK;
+}
+
+void
+TFILEUring_SetOnCompleteCallback(TFILEUring *self,
+                                 TFILEUring_OnCompleteCallback in_callback,
+                                 sse_pointer in_user_data)
+{
+  ASSERT(self);
+  self->fOnCompleteCallback = in_callback;
+  self->fOnCompleteCallbackUserData = in_user_data;
+}
+
+sse_int
+TFILEUring_WriteFixed(TFILEUring *self,
+                      sse_int in_fd,
+                      sse_uint in_index,
+                      const sse_byte *in_data,
+                      sse_size in_length,
+                      sse_uint64 in_offset,
+                      sse_uint64 in_tag)
+{
+  struct io_uring_sqe *sqe;
+  unsigned tail;
+  unsigned index;
+  long rc;
+
+  ASSERT(self);
+  if (self->fInFlight >= self->fEntries) {
+    return SSE_E_AGAIN;
+  }
+  tail = *self->fSqTail;
+  index = tail & *self->fSqMask;
+  sqe = &self->fSqes[index];
+  sse_memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->fd = in_fd;
+  sqe->addr = (unsigned long)in_data;
+  sqe->len = in_length;
+  sqe->off = in_offset;
+  sqe->buf_index = in_index;
+  sqe->user_data = in_tag;
+  self->fSqArray[index] = index;
+  __atomic_store_n(self->fSqTail, tail + 1, __ATOMIC_RELEASE);
+
+  do {
+    rc = syscall(__NR_io_uring_enter, self->fRingFd, 1, 0, 0, NULL, 0);
+  } while (rc < 0 && errno == EINTR);
+  if (rc != 1) {
+    LOG_ERROR("io_uring_enter() has been failed with [%s].", (rc < 0) ? strerror(errno) : "not submitted");
+    /* Not consumed by the kernel on any failure, take it back not to submit it with the next one. */
+    __atomic_store_n(self->fSqTail, tail, __ATOMIC_RELEASE);
+    return SSE_E_GENERIC;
+  }
+  self->fInFlight++;
+  return SSE_E_OK;
+}
@@ -0,0 +1,912 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+#define FILE_VERSION_STORE_DIR_MODE (0755)
+#define FILE_VERSION_STORE_READ_SIZE (8192)
+#define FILE_VERSION_STORE_ROLLED_BACK ".rolledback"
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+static sse_char*
+FILEVersionStore_JoinPath(const sse_char *in_dir,
+                          const sse_char *in_name)
+{
+  sse_char *path;
+  sse_size len;
+
+  len = sse_strlen(in_dir) + 1 + sse_strlen(in_name) + 1;
+  path = sse_malloc(len);
+  ASSERT(path);
+  snprintf(path, len, "%s/%s", in_dir, in_name);
+  return path;
+}
+
+static sse_char*
+FILEVersionStore_StrDupValue(MoatValue *in_value)
+{
+  sse_char *str;
+  sse_uint len;
+
+  if (in_value == NULL) {
+    return NULL;
+  }
+  if (moat_value_get_string(in_value, &str, &len) != SSE_E_OK || len == 0) {
+    return NULL;
+  }
+  /* Strip trailing '/' */
+  while (len > 1 && str[len - 1] == '/') {
+    len--;
+  }
+  return sse_strndup(str, len);
+}
+
+/* Create the parent directories of the path. */
+static sse_int
+FILEVersionStore_MakeParents(const sse_char *in_path)
+{
+  sse_char *path;
+  sse_char *p;
+
+  path = sse_strdup(in_path);
+  ASSERT(path);
+  for (p = sse_strchr(path + 1, '/'); p != NULL; p = sse_strchr(p + 1, '/')) {
+    *p = '\0';
+    if (mkdir(path, FILE_VERSION_STORE_DIR_MODE) != 0 && errno != EEXIST) {
+      LOG_ERROR("mkdir(%s) has been failed with [%s].", path, strerror(errno));
+      sse_free(path);
+      return SSE_E_GENERIC;
+    }
+    *p = '/';
+  }
+  sse_free(path);
+  return SSE_E_OK;
+}
+
+/*
+ * Share the file with the other version. A reflink (FICLONE) gives an independent inode sharing
+ * the same data blocks, a hard link is used where the filesystem does not support it.
+ */
+static sse_int
+TFILEVersionStore_ShareFile(TFILEVersionStore *self,
+                            const sse_char *in_src,
+                            const sse_char *in_dst,
+                            mode_t in_mode)
+{
+  int src_fd;
+  int dst_fd;
+
+  if (!self->fNoClone) {
+    src_fd = open(in_src, O_RDONLY);
+    if (src_fd >= 0) {
+      dst_fd = open(in_dst, O_WRONLY | O_CREAT | O_EXCL, in_mode & 07777);
+      if (dst_fd >= 0) {
+        if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+          close(dst_fd);
+          close(src_fd);
+          return SSE_E_OK;
+        }
+        LOG_DEBUG("ioctl(FICLONE) has been failed with [%s], use hard links.", strerror(errno));
+        close(dst_fd);
+        unlink(in_dst);
+        self->fNoClone = sse_true;
+      }
+      close(src_fd);
+    }
+  }
+  if (link(in_src, in_dst) != 0) {
+    LOG_ERROR("link(%s, %s) has been failed with [%s].", in_src, in_dst, strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  return SSE_E_OK;
+}
+
+/* Whether the files have the same contents. */
+static sse_bool
+FILEVersionStore_IsSameFile(const sse_char *in_path1,
+                            const sse_char *in_path2)
+{
+  int fd1;
+  int fd2;
+  struct stat st1;
+  struct stat st2;
+  sse_byte buf1[FILE_VERSION_STORE_READ_SIZE];
+  sse_byte buf2[FILE_VERSION_STORE_READ_SIZE];
+  ssize_t len1;
+  ssize_t len2;
+  sse_bool same = sse_false;
+
+  if (stat(in_path1, &st1) != 0 || stat(in_path2, &st2) != 0) {
+    return sse_false;
+  }
+  if (!S_ISREG(st1.st_mode) || !S_ISREG(st2.st_mode) || st1.st_size != st2.st_size) {
+    return sse_false;
+  }
+  fd1 = open(in_path1, O_RDONLY);
+  if (fd1 < 0) {
+    return sse_false;
+  }
+  fd2 = open(in_path2, O_RDONLY);
+  if (fd2 < 0) {
+    close(fd1);
+    return sse_false;
+  }
+  for (;;) {
+    len1 = read(fd1, buf1, sizeof(buf1));
+    len2 = read(fd2, buf2, sizeof(buf2));
+    if (len1 < 0 || len1 != len2 || sse_memcmp(buf1, buf2, len1) != 0) {
+      break;
+    }
+    if (len1 == 0) {
+      same = sse_true;
+      break;
+    }
+  }
+  close(fd1);
+  close(fd2);
+  return same;
+}
+
+/* Populate in_dst with the files in in_src. */
+static sse_int
+TFILEVersionStore_LinkTree(TFILEVersionStore *self,
+                           const sse_char *in_src,
+                           const sse_char *in_dst)
+{
+  DIR *dir;
+  struct dirent *ent;
+  struct stat st;
+  sse_char *src;
+  sse_char *dst;
+  sse_char target[PATH_MAX];
+  ssize_t len;
+  sse_int err = SSE_E_OK;
+
+  dir = opendir(in_src);
+  if (dir == NULL) {
+    LOG_ERROR("opendir(%s) has been failed with [%s].", in_src, strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  while (err == SSE_E_OK && (ent = readdir(dir)) != NULL) {
+    if (sse_strcmp(ent->d_name, ".") == 0 || sse_strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+    src = FILEVersionStore_JoinPath(in_src, ent->d_name);
+    dst = FILEVersionStore_JoinPath(in_dst, ent->d_name);
+    if (lstat(src, &st) != 0) {
+      LOG_ERROR("lstat(%s) has been failed with [%s].", src, strerror(errno));
+      err = SSE_E_GENERIC;
+    } else if (S_ISDIR(st.st_mode)) {
+      if (mkdir(dst, st.st_mode & 07777) != 0) {
+        LOG_ERROR("mkdir(%s) has been failed with [%s].", dst, strerror(errno));
+        err = SSE_E_GENERIC;
+      } else {
+        err = TFILEVersionStore_LinkTree(self, src, dst);
+      }
+    } else if (S_ISLNK(st.st_mode)) {
+      len = readlink(src, target, sizeof(target) - 1);
+      if (len < 0) {
+        LOG_ERROR("readlink(%s) has been failed with [%s].", src, strerror(errno));
+        err = SSE_E_GENERIC;
+      } else {
+        target[len] = '\0';
+        if (symlink(target, dst) != 0) {
+          LOG_ERROR("symlink(%s) has been failed with [%s].", dst, strerror(errno));
+          err = SSE_E_GENERIC;
+        }
+      }
+    } else {
+      err = TFILEVersionStore_ShareFile(self, src, dst, st.st_mode);
+    }
+    sse_free(src);
+    sse_free(dst);
+  }
+  closedir(dir);
+  return err;
+}
+
+static int
+FILEVersionStore_RemoveEntry(const char *in_path,
+                             const struct stat *in_stat,
+                             int in_flag,
+                             struct FTW *in_ftw)
+{
+  if (remove(in_path) != 0) {
+    LOG_WARN("remove(%s) has been failed with [%s].", in_path, strerror(errno));
+  }
+  return 0;
+}
+
+/* Parse the name of the version directory, which is a sequence number. */
+static sse_bool
+FILEVersionStore_ParseVersion(const sse_char *in_name,
+                              sse_uint64 *out_version)
+{
+  const sse_char *p;
+  sse_uint64 version = 0;
+
+  if (in_name[0] == '\0') {
+    return sse_false;
+  }
+  for (p = in_name; *p != '\0'; p++) {
+    if (*p < '0' || *p > '9') {
+      return sse_false;
+    }
+    version = version * 10 + (*p - '0');
+  }
+  *out_version = version;
+  return sse_true;
+}
+
+static int
+FILEVersionStore_CompareVersion(const void *in_v1,
+                                const void *in_v2)
+{
+  sse_uint64 v1 = *(const sse_uint64 *)in_v1;
+  sse_uint64 v2 = *(const sse_uint64 *)in_v2;
+
+  return (v1 < v2) ? -1 : (v1 > v2) ? 1 : 0;
+}
+
+/* Get the versions in the versions directory in ascending order. */
+static sse_int
+TFILEVersionStore_ListVersions(TFILEVersionStore *self,
+                               sse_uint64 **out_versions,
+                               sse_uint *out_count)
+{
+  DIR *dir;
+  struct dirent *ent;
+  struct stat st;
+  sse_uint64 version;
+  sse_uint64 *versions = NULL;
+  sse_uint count = 0;
+  sse_uint capacity = 0;
+  sse_uint64 *p;
+
+  *out_versions = NULL;
+  *out_count = 0;
+  dir = opendir(self->fVersionsDir);
+  if (dir == NULL) {
+    if (errno == ENOENT) {
+      return SSE_E_OK;
+    }
+    LOG_ERROR("opendir(%s) has been failed with [%s].", self->fVersionsDir, strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  while ((ent = readdir(dir)) != NULL) {
+    if (!FILEVersionStore_ParseVersion(ent->d_name, &version)) {
+      continue;
+    }
+    if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(st.st_mode)) {
+      continue;
+    }
+    if (count == capacity) {
+      capacity = (capacity == 0) ? 8 : capacity * 2;
+      p = sse_zeroalloc(sizeof(sse_uint64) * capacity);
+      ASSERT(p);
+      if (versions) {
+        sse_memcpy(p, versions, sizeof(sse_uint64) * count);
+        sse_free(versions);
+      }
+      versions = p;
+    }
+    versions[count++] = version;
+  }
+  closedir(dir);
+  if (count > 0) {
+    qsort(versions, count, sizeof(sse_uint64), FILEVersionStore_CompareVersion);
+  }
+  *out_versions = versions;
+  *out_count = count;
+  return SSE_E_OK;
+}
+
+static sse_char*
+TFILEVersionStore_GetVersionPath(TFILEVersionStore *self,
+                                 sse_uint64 in_version)
+{
+  sse_char name[32];
+
+  snprintf(name, sizeof(name), "%010llu", (unsigned long long)in_version);
+  return FILEVersionStore_JoinPath(self->fVersionsDir, name);
+}
+
+/* ${VERSIONS_DIR}/${VERSION}.rolledback, which is not listed as a version. */
+static sse_char*
+TFILEVersionStore_GetMarkerPath(TFILEVersionStore *self,
+                                sse_uint64 in_version)
+{
+  sse_char name[48];
+
+  snprintf(name, sizeof(name), "%010llu" FILE_VERSION_STORE_ROLLED_BACK, (unsigned long long)in_version);
+  return FILEVersionStore_JoinPath(self->fVersionsDir, name);
+}
+
+static sse_bool
+TFILEVersionStore_IsRolledBack(TFILEVersionStore *self,
+                               sse_uint64 in_version)
+{
+  sse_char *path;
+  sse_bool rolled_back;
+
+  path = TFILEVersionStore_GetMarkerPath(self, in_version);
+  rolled_back = (access(path, F_OK) == 0);
+  sse_free(path);
+  return rolled_back;
+}
+
+/* Mark the version as rolled back from, or clear the mark. */
+static void
+TFILEVersionStore_SetRolledBack(TFILEVersionStore *self,
+                                sse_uint64 in_version,
+                                sse_bool in_rolled_back)
+{
+  sse_char *path;
+  int fd;
+
+  path = TFILEVersionStore_GetMarkerPath(self, in_version);
+  if (in_rolled_back) {
+    fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+      LOG_WARN("open(%s) has been failed with [%s].", path, strerror(errno));
+    } else {
+      close(fd);
+    }
+  } else if (unlink(path) != 0 && errno != ENOENT) {
+    LOG_WARN("unlink(%s) has been failed with [%s].", path, strerror(errno));
+  }
+  sse_free(path);
+}
+
+/* Index of the newest version older than in_active which has not been rolled back from, -1 if none. */
+static sse_int
+TFILEVersionStore_FindPrevious(TFILEVersionStore *self,
+                               const sse_uint64 *in_versions,
+                               sse_uint in_count,
+                               sse_uint64 in_active)
+{
+  sse_int i;
+
+  for (i = (sse_int)in_count - 1; i >= 0; i--) {
+    if (in_versions[i] < in_active && !TFILEVersionStore_IsRolledBack(self, in_versions[i])) {
+      break;
+    }
+  }
+  return i;
+}
+
+/* Get the version of the directory if it has been created by the store. */
+static sse_bool
+TFILEVersionStore_GetVersion(TFILEVersionStore *self,
+                             const sse_char *in_path,
+                             sse_uint64 *out_version)
+{
+  sse_size len = sse_strlen(self->fVersionsDir);
+
+  if ((sse_strncmp(in_path, self->fVersionsDir, len) != 0) || (in_path[len] != '/')) {
+    return sse_false;
+  }
+  return FILEVersionStore_ParseVersion(in_path + len + 1, out_version);
+}
+
+/* Write back the file or the directory, and its metadata. */
+static sse_int
+FILEVersionStore_SyncPath(const sse_char *in_path,
+                          sse_bool in_dir)
+{
+  int fd;
+
+  fd = open(in_path, O_RDONLY | O_CLOEXEC | ((in_dir) ? O_DIRECTORY : 0));
+  if (fd < 0) {
+    LOG_ERROR("open(%s) has been failed with [%s].", in_path, strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  if (fsync(fd) != 0) {
+    LOG_ERROR("fsync(%s) has been failed with [%s].", in_path, strerror(errno));
+    close(fd);
+    return SSE_E_GENERIC;
+  }
+  close(fd);
+  return SSE_E_OK;
+}
+
+static int
+FILEVersionStore_SyncEntry(const char *in_path,
+                           const struct stat *in_stat,
+                           int in_flag,
+                           struct FTW *in_ftw)
+{
+  if (in_flag != FTW_F && in_flag != FTW_DP) {
+    /* Symbolic links are written back with their directories. */
+    return 0;
+  }
+  return (FILEVersionStore_SyncPath(in_path, in_flag == FTW_DP) == SSE_E_OK) ? 0 : 1;
+}
+
+/* Directory of the path, to be freed with sse_free(). */
+static sse_char*
+FILEVersionStore_GetDirName(const sse_char *in_path)
+{
+  const sse_char *p;
+
+  p = sse_strrchr(in_path, '/');
+  if (p == in_path) {
+    return sse_strdup("/");
+  }
+  return sse_strndup(in_path, p - in_path);
+}
+
+static void
+FILEVersionStore_RemoveTree(const sse_char *in_path)
+{
+  LOG_INFO("Remove the version directory=[%s].", in_path);
+  nftw(in_path, FILEVersionStore_RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/* Replace the link with a new one atomically. */
+static sse_int
+TFILEVersionStore_SwapLink(TFILEVersionStore *self,
+                           const sse_char *in_target)
+{
+  sse_char *tmp_link;
+  sse_size len;
+
+  len = sse_strlen(self->fLinkPath) + sizeof(".new");
+  tmp_link = sse_malloc(len);
+  ASSERT(tmp_link);
+  snprintf(tmp_link, len, "%s.new", self->fLinkPath);
+
+  unlink(tmp_link);
+  if (symlink(in_target, tmp_link) != 0) {
+    LOG_ERROR("symlink(%s, %s) has been failed with [%s].", in_target, tmp_link, strerror(errno));
+    sse_free(tmp_link);
+    return SSE_E_GENERIC;
+  }
+  if (rename(tmp_link, self->fLinkPath) != 0) {
+    LOG_ERROR("rename(%s, %s) has been failed with [%s].", tmp_link, self->fLinkPath, strerror(errno));
+    unlink(tmp_link);
+    sse_free(tmp_link);
+    return SSE_E_GENERIC;
+  }
+  sse_free(tmp_link);
+  return SSE_E_OK;
+}
+
+/* Set fCurrent to the directory which the link points, NULL if the link does not exist. */
+static sse_int
+TFILEVersionStore_ResolveCurrent(TFILEVersionStore *self)
+{
+  struct stat st;
+  sse_char target[PATH_MAX];
+  ssize_t len;
+  sse_char *p;
+
+  if (self->fCurrent) {
+    sse_free(self->fCurrent);
+    self->fCurrent = NULL;
+  }
+  if (lstat(self->fLinkPath, &st) != 0) {
+    if (errno == ENOENT) {
+      return SSE_E_OK;
+    }
+    LOG_ERROR("lstat(%s) has been failed with [%s].", self->fLinkPath, strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  if (!S_ISLNK(st.st_mode)) {
+    LOG_ERROR("[%s] exists, but it is not a symbolic link.", self->fLinkPath);
+    return SSE_E_INVAL;
+  }
+  len = readlink(self->fLinkPath, target, sizeof(target) - 1);
+  if (len < 0) {
+    LOG_ERROR("readlink(%s) has been failed with [%s].", self->fLinkPath, strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  target[len] = '\0';
+  while (len > 1 && target[len - 1] == '/') {
+    target[--len] = '\0';
+  }
+  if (target[0] == '/') {
+    self->fCurrent = sse_strdup(target);
+    ASSERT(self->fCurrent);
+  } else {
+    /* Relative to the directory of the link */
+    p = sse_strrchr(self->fLinkPath, '/');
+    *p = '\0';
+    self->fCurrent = FILEVersionStore_JoinPath(self->fLinkPath, target);
+    *p = '/';
+  }
+  return SSE_E_OK;
+}
+
+TFILEVersionStore*
+FILEVersionStore_New(MoatValue *in_link_path,
+                     MoatValue *in_versions_dir,
+                     sse_uint in_keep_versions)
+{
+  TFILEVersionStore *self;
+  sse_char *link_path;
+  sse_char *p;
+
+  link_path = FILEVersionStore_StrDupValue(in_link_path);
+  if (link_path == NULL || link_path[0] != '/') {
+    LOG_ERROR("The link path must be an absolute path.");
+    MOAT_VALUE_DUMP_ERROR(TAG, in_link_path);
+    if (link_path) sse_free(link_path);
+    return NULL;
+  }
+
+  self = sse_zeroalloc(sizeof(TFILEVersionStore));
+  ASSERT(self);
+  self->fLinkPath = link_path;
+  self->fVersionsDir = FILEVersionStore_StrDupValue(in_versions_dir);
+  if (self->fVersionsDir == NULL) {
+    /* ${DIRNAME_OF_LINK}/versions */
+    p = sse_strrchr(link_path, '/');
+    *p = '\0';
+    self->fVersionsDir = FILEVersionStore_JoinPath(link_path, "versions");
+    *p = '/';
+  }
+  self->fKeepVersions = (in_keep_versions > 0) ? in_keep_versions : 1;
+  self->fCurrent = NULL;
+  self->fStaged = NULL;
+  self->fActivated = sse_false;
+  self->fNoClone = sse_false;
+  LOG_DEBUG("link=[%s], versions=[%s], keep=[%u]", self->fLinkPath, self->fVersionsDir, self->fKeepVersions);
+  return self;
+}
+
+void
+TFILEVersionStore_Delete(TFILEVersionStore *self)
+{
+  ASSERT(self);
+  if (self->fLinkPath)    sse_free(self->fLinkPath);
+  if (self->fVersionsDir) sse_free(self->fVersionsDir);
+  if (self->fCurrent)     sse_free(self->fCurrent);
+  if (self->fStaged)      sse_free(self->fStaged);
+  sse_free(self);
+}
+
+sse_bool
+TFILEVersionStore_GetRelativePath(TFILEVersionStore *self,
+                                  const sse_char *in_path,
+                                  const sse_char **out_rel_path)
+{
+  sse_size len;
+
+  ASSERT(self);
+  ASSERT(in_path);
+  ASSERT(out_rel_path);
+
+  len = sse_strlen(self->fLinkPath);
+  if (sse_strncmp(in_path, self->fLinkPath, len) != 0 || in_path[len] != '/' || in_path[len + 1] == '\0') {
+    return sse_false;
+  }
+  *out_rel_path = in_path + len + 1;
+  return sse_true;
+}
+
+sse_int
+TFILEVersionStore_Stage(TFILEVersionStore *self)
+{
+  sse_uint64 *versions;
+  sse_uint count;
+  sse_uint64 next;
+  sse_int err;
+
+  ASSERT(self);
+  if (self->fStaged) {
+    return SSE_E_OK;
+  }
+
+  err = TFILEVersionStore_ResolveCurrent(self);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+
+  /* Create ${VERSIONS_DIR}/${SEQUENCE_NUMBER}, which does not depend on the clock. */
+  err = FILEVersionStore_MakeParents(self->fVersionsDir);
+  if (err == SSE_E_OK && mkdir(self->fVersionsDir, FILE_VERSION_STORE_DIR_MODE) != 0 && errno != EEXIST) {
+    LOG_ERROR("mkdir(%s) has been failed with [%s].", self->fVersionsDir, strerror(errno));
+    err = SSE_E_GENERIC;
+  }
+  if (err == SSE_E_OK) {
+    err = TFILEVersionStore_ListVersions(self, &versions, &count);
+  }
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  next = (count > 0) ? versions[count - 1] + 1 : 1;
+  if (versions) sse_free(versions);
+
+  /* The number may have been used by a version rolled back from and removed. */
+  TFILEVersionStore_SetRolledBack(self, next, sse_false);
+  self->fStaged = TFILEVersionStore_GetVersionPath(self, next);
+  if (mkdir(self->fStaged, FILE_VERSION_STORE_DIR_MODE) != 0) {
+    LOG_ERROR("mkdir(%s) has been failed with [%s].", self->fStaged, strerror(errno));
+    sse_free(self->fStaged);
+    self->fStaged = NULL;
+    return SSE_E_GENERIC;
+  }
+  LOG_INFO("Stage the new version=[%s].", self->fStaged);
+
+  if (self->fCurrent) {
+    err = TFILEVersionStore_LinkTree(self, self->fCurrent, self->fStaged);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("Copying the current version=[%s] has been failed.", self->fCurrent);
+      TFILEVersionStore_Revert(self);
+      return err;
+    }
+  }
+  return SSE_E_OK;
+}
+
+sse_int
+TFILEVersionStore_Put(TFILEVersionStore *self,
+                      const sse_char *in_rel_path,
+                      const sse_char *in_src_path)
+{
+  sse_char *path;
+  sse_int err;
+
+  ASSERT(self);
+  ASSERT(self->fStaged);
+
+  path = FILEVersionStore_JoinPath(self->fStaged, in_rel_path);
+  err = FILEVersionStore_MakeParents(path);
+  if (err != SSE_E_OK) {
+    sse_free(path);
+    return err;
+  }
+
+  /* Keep sharing the file with the current version if it has not been changed. */
+  if (FILEVersionStore_IsSameFile(in_src_path, path)) {
+    LOG_INFO("[%s] has not been changed.", in_rel_path);
+    unlink(in_src_path);
+    sse_free(path);
+    return SSE_E_OK;
+  }
+
+  /* Never overwrite the file shared with the other versions. */
+  if (unlink(path) != 0 && errno != ENOENT) {
+    LOG_ERROR("unlink(%s) has been failed with [%s].", path, strerror(errno));
+    sse_free(path);
+    return SSE_E_GENERIC;
+  }
+  err = FILECopy_MoveFile(in_src_path, path);
+  sse_free(path);
+  return err;
+}
+
+sse_int
+TFILEVersionStore_Flush(TFILEVersionStore *self)
+{
+  ASSERT(self);
+  ASSERT(self->fStaged);
+
+  /* The files and the directories of the version, depth first, then the entry of the version. */
+  if (nftw(self->fStaged, FILEVersionStore_SyncEntry, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+    LOG_ERROR("Writing back [%s] has been failed.", self->fStaged);
+    return SSE_E_GENERIC;
+  }
+  return FILEVersionStore_SyncPath(self->fVersionsDir, sse_true);
+}
+
+sse_int
+TFILEVersionStore_FlushLink(TFILEVersionStore *self)
+{
+  sse_char *dir;
+  sse_int err;
+
+  ASSERT(self);
+  dir = FILEVersionStore_GetDirName(self->fLinkPath);
+  ASSERT(dir);
+  err = FILEVersionStore_SyncPath(dir, sse_true);
+  sse_free(dir);
+  return err;
+}
+
+sse_int
+TFILEVersionStore_Activate(TFILEVersionStore *self)
+{
+  sse_int err;
+
+  ASSERT(self);
+  ASSERT(self->fStaged);
+
+  err = FILEVersionStore_MakeParents(self->fLinkPath);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  err = TFILEVersionStore_SwapLink(self, self->fStaged);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  self->fActivated = sse_true;
+  LOG_INFO("[%s] has been switched to [%s].", self->fLinkPath, self->fStaged);
+  return SSE_E_OK;
+}
+
+void
+TFILEVersionStore_Revert(TFILEVersionStore *self)
+{
+  ASSERT(self);
+
+  if (self->fActivated) {
+    if (self->fCurrent) {
+      if (TFILEVersionStore_SwapLink(self, self->fCurrent) != SSE_E_OK) {
+        LOG_ERROR("Restoring [%s] to [%s] has been failed.", self->fLinkPath, self->fCurrent);
+        return;
+      }
+    } else {
+      unlink(self->fLinkPath);
+    }
+    self->fActivated = sse_false;
+  }
+  if (self->fStaged) {
+    FILEVersionStore_RemoveTree(self->fStaged);
+    sse_free(self->fStaged);
+    self->fStaged = NULL;
+  }
+  if (self->fCurrent) {
+    sse_free(self->fCurrent);
+    self->fCurrent = NULL;
+  }
+}
+
+/*
+ * Remove the old versions so that fKeepVersions versions are left besides the active one. The
+ * active one and the one to roll back to are never removed, the versions rolled back from are
+ * removed first.
+ */
+static void
+TFILEVersionStore_Prune(TFILEVersionStore *self,
+                        const sse_char *in_active)
+{
+  sse_uint64 *versions;
+  sse_uint64 active;
+  sse_uint count;
+  sse_uint others;
+  sse_uint excess;
+  sse_int previous;
+  sse_int pass;
+  sse_uint i;
+  sse_char *path;
+
+  if (!TFILEVersionStore_GetVersion(self, in_active, &active)) {
+    active = 0;
+  }
+  if (TFILEVersionStore_ListVersions(self, &versions, &count) != SSE_E_OK) {
+    return;
+  }
+  others = count;
+  for (i = 0; i < count; i++) {
+    if (versions[i] == active) {
+      others--;
+      break;
+    }
+  }
+  excess = (others > self->fKeepVersions) ? others - self->fKeepVersions : 0;
+  previous = TFILEVersionStore_FindPrevious(self, versions, count, active);
+
+  /* The versions rolled back from at first, then the oldest ones */
+  for (pass = 0; pass < 2; pass++) {
+    for (i = 0; (i < count) && (excess > 0); i++) {
+      if (versions[i] == active || (sse_int)i == previous) {
+        continue;
+      }
+      if (TFILEVersionStore_IsRolledBack(self, versions[i]) != (pass == 0)) {
+        continue;
+      }
+      path = TFILEVersionStore_GetVersionPath(self, versions[i]);
+      FILEVersionStore_RemoveTree(path);
+      sse_free(path);
+      TFILEVersionStore_SetRolledBack(self, versions[i], sse_false);
+      excess--;
+    }
+  }
+  if (versions) sse_free(versions);
+}
+
+void
+TFILEVersionStore_Commit(TFILEVersionStore *self)
+{
+  ASSERT(self);
+  ASSERT(self->fActivated);
+
+  TFILEVersionStore_Prune(self, self->fStaged);
+  if (self->fCurrent) {
+    sse_free(self->fCurrent);
+    self->fCurrent = NULL;
+  }
+  sse_free(self->fStaged);
+  self->fStaged = NULL;
+  self->fActivated = sse_false;
+}
+
+sse_int
+TFILEVersionStore_Rollback(TFILEVersionStore *self)
+{
+  sse_uint64 *versions;
+  sse_uint64 current;
+  sse_uint count;
+  sse_int i;
+  sse_int err;
+  sse_char *path;
+
+  ASSERT(self);
+  ASSERT(self->fStaged == NULL);
+
+  err = TFILEVersionStore_ResolveCurrent(self);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  if (self->fCurrent == NULL || !TFILEVersionStore_GetVersion(self, self->fCurrent, &current)) {
+    LOG_ERROR("[%s] does not point any version in [%s].", self->fLinkPath, self->fVersionsDir);
+    return SSE_E_NOENT;
+  }
+  err = TFILEVersionStore_ListVersions(self, &versions, &count);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  i = TFILEVersionStore_FindPrevious(self, versions, count, current);
+  if (i < 0) {
+    LOG_ERROR("No version older than [%s].", self->fCurrent);
+    if (versions) sse_free(versions);
+    return SSE_E_NOENT;
+  }
+  path = TFILEVersionStore_GetVersionPath(self, versions[i]);
+  sse_free(versions);
+
+  /* The newer versions are kept until they are pruned by the next commit. */
+  err = TFILEVersionStore_SwapLink(self, path);
+  if (err == SSE_E_OK) {
+    TFILEVersionStore_SetRolledBack(self, current, sse_true);
+    LOG_INFO("[%s] has been rolled back from [%s] to [%s].", self->fLinkPath, self->fCurrent, path);
+  }
+  sse_free(path);
+  sse_free(self->fCurrent);
+  self->fCurrent = NULL;
+  return err;
+}
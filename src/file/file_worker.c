@@ -0,0 +1,419 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2012-2015 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F KOJIMACHI CP BUILDING
+ * 4-4-7 Kojimachi, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <servicesync/moat.h>
+#include <sseutils.h>
+#include <file/file.h>
+
+#define TAG "File"
+#define LOG_ERROR(format, ...) MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)  MOAT_LOG_WARN(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)  MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+#define LOG_TRACE(format, ...) MOAT_LOG_TRACE(TAG, format, ##__VA_ARGS__)
+#include <stdlib.h>
+#define ASSERT(cond) if(!(cond)) { LOG_ERROR("ASSERTION FAILED:" #cond); abort(); }
+
+struct TFILEWorkerLog_ {
+  struct TFILEWorkerLog_ *fNext;
+  sse_int fLevel;
+  sse_char fMessage[];
+};
+typedef struct TFILEWorkerLog_ TFILEWorkerLog;
+
+struct TFILEWorkerJob_ {
+  struct TFILEWorkerJob_ *fNext;
+  TFILEWorkerPool_WorkProc fWork;
+  TFILEWorkerPool_DoneProc fDone;
+  sse_pointer fUserData;
+  sse_int fCanceled;                       /** Set on the event loop, read by the workers */
+  TFILEWorkerLog *fLogs;                   /** Messages logged by the work procedure, oldest first */
+  TFILEWorkerLog **fLogTail;
+};
+
+struct TFILEWorkerPool_ {
+  pthread_t *fThreads;
+  sse_uint fThreadCount;
+  pthread_mutex_t fLock;                   /** Guards fHead, fTail and fStopping */
+  pthread_cond_t fCond;
+  TFILEWorkerJob *fHead;                   /** Jobs waiting for a worker */
+  TFILEWorkerJob *fTail;
+  sse_bool fStopping;
+  sse_int fNice;                           /** Nice level of the workers, guarded by fLock */
+  sse_int fIoPriority;                     /** I/O priority of the workers, guarded by fLock */
+  TFILEWorkerJob *fFinished;               /** Finished jobs, pushed by the workers and taken by the event loop, newest first */
+  int fEventFd;
+  MoatIOWatcher *fWatcher;
+};
+
+/* Job run by the calling worker thread, NULL on the event loop */
+static __thread TFILEWorkerJob *gFILEWorkerCurrentJob = NULL;
+
+static void
+FILEWorker_Print(sse_int in_level,
+                 const sse_char *in_message);
+
+static sse_uint
+FILEWorkerPool_GetDefaultThreadCount(void)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (cpus <= 1) {
+    return 0;
+  }
+  return (cpus - 1 < FILE_WORKER_THREADS_MAX) ? (sse_uint)(cpus - 1) : FILE_WORKER_THREADS_MAX;
+}
+
+/*
+ * Finished jobs, multiple producers (the workers) and a single consumer (the event loop)
+ */
+
+static void
+TFILEWorkerPool_PushFinished(TFILEWorkerPool *self,
+                             TFILEWorkerJob *in_job)
+{
+  TFILEWorkerJob *head;
+  sse_uint64 one = 1;
+
+  head = __atomic_load_n(&self->fFinished, __ATOMIC_RELAXED);
+  do {
+    in_job->fNext = head;
+  } while (!__atomic_compare_exchange_n(&self->fFinished, &head, in_job, sse_true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  if (write(self->fEventFd, &one, sizeof(one)) < 0) {
+    /* Only fails with EAGAIN once the counter is saturated, the loop is going to be woken anyway. */
+  }
+}
+
+/* Take all the finished jobs at once, the oldest first. */
+static TFILEWorkerJob*
+TFILEWorkerPool_TakeFinished(TFILEWorkerPool *self)
+{
+  TFILEWorkerJob *job;
+  TFILEWorkerJob *next;
+  TFILEWorkerJob *jobs = NULL;
+
+  job = __atomic_exchange_n(&self->fFinished, NULL, __ATOMIC_ACQUIRE);
+  while (job) {
+    next = job->fNext;
+    job->fNext = jobs;
+    jobs = job;
+    job = next;
+  }
+  return jobs;
+}
+
+static void
+FILEWorkerPool_CallDone(TFILEWorkerJob *in_jobs,
+                        sse_bool in_canceled)
+{
+  TFILEWorkerJob *next;
+  TFILEWorkerLog *log;
+
+  while (in_jobs) {
+    next = in_jobs->fNext;
+    while (in_jobs->fLogs) {
+      log = in_jobs->fLogs;
+      in_jobs->fLogs = log->fNext;
+      FILEWorker_Print(log->fLevel, log->fMessage);
+      sse_free(log);
+    }
+    in_jobs->fDone(in_jobs->fUserData, in_canceled || in_jobs->fCanceled);
+    sse_free(in_jobs);
+    in_jobs = next;
+  }
+}
+
+static void
+FILEWorkerPool_OnEvent(MoatIOWatcher *in_watcher,
+                       sse_pointer in_user_data,
+                       sse_int in_desc,
+                       sse_int in_event_flags)
+{
+  TFILEWorkerPool *self = (TFILEWorkerPool *)in_user_data;
+  sse_uint64 count;
+
+  ASSERT(self);
+  if (read(self->fEventFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    LOG_ERROR("read(eventfd) has been failed with [%s].", strerror(errno));
+  }
+  FILEWorkerPool_CallDone(TFILEWorkerPool_TakeFinished(self), sse_false);
+}
+
+/*
+ * Workers
+ */
+
+static void*
+FILEWorkerPool_Main(void *in_arg)
+{
+  TFILEWorkerPool *self = (TFILEWorkerPool *)in_arg;
+  TFILEWorkerJob *job;
+  sse_int nice = FILE_PRIORITY_NONE;
+  sse_int io_priority = FILE_PRIORITY_NONE;
+  sse_int wanted_nice;
+  sse_int wanted_io_priority;
+
+  for (;;) {
+    pthread_mutex_lock(&self->fLock);
+    while (self->fHead == NULL && !self->fStopping) {
+      pthread_cond_wait(&self->fCond, &self->fLock);
+    }
+    if (self->fStopping) {
+      pthread_mutex_unlock(&self->fLock);
+      break;
+    }
+    job = self->fHead;
+    self->fHead = job->fNext;
+    if (self->fHead == NULL) {
+      self->fTail = NULL;
+    }
+    wanted_nice = self->fNice;
+    wanted_io_priority = self->fIoPriority;
+    pthread_mutex_unlock(&self->fLock);
+
+    gFILEWorkerCurrentJob = job;
+    /* Tried once per change, an unprivileged thread cannot raise the nice level again. */
+    if (wanted_nice != nice || wanted_io_priority != io_priority) {
+      FILEPriority_SetThread((wanted_nice != nice) ? wanted_nice : FILE_PRIORITY_NONE,
+                             (wanted_io_priority != io_priority) ? wanted_io_priority : FILE_PRIORITY_NONE);
+      nice = wanted_nice;
+      io_priority = wanted_io_priority;
+    }
+    if (!__atomic_load_n(&job->fCanceled, __ATOMIC_RELAXED)) {
+      job->fWork(job->fUserData);
+    }
+    gFILEWorkerCurrentJob = NULL;
+    TFILEWorkerPool_PushFinished(self, job);
+  }
+  return NULL;
+}
+
+/*
+ * Constructor / Destructor
+ */
+
+TFILEWorkerPool*
+FILEWorkerPool_New(sse_int in_threads)
+{
+  TFILEWorkerPool *self;
+  sigset_t all;
+  sigset_t saved;
+  sse_uint count;
+  sse_uint i;
+  int err;
+
+  self = sse_zeroalloc(sizeof(TFILEWorkerPool));
+  ASSERT(self);
+  self->fEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (self->fEventFd < 0) {
+    LOG_ERROR("eventfd() has been failed with [%s].", strerror(errno));
+    sse_free(self);
+    return NULL;
+  }
+  self->fWatcher = moat_io_watcher_new(self->fEventFd, FILEWorkerPool_OnEvent, self, MOAT_IO_FLAG_READ);
+  if (self->fWatcher == NULL || moat_io_watcher_start(self->fWatcher) != SSE_E_OK) {
+    LOG_ERROR("The eventfd could not be watched.");
+    if (self->fWatcher) moat_io_watcher_free(self->fWatcher);
+    close(self->fEventFd);
+    sse_free(self);
+    return NULL;
+  }
+  pthread_mutex_init(&self->fLock, NULL);
+  pthread_cond_init(&self->fCond, NULL);
+  self->fNice = FILE_PRIORITY_NONE;
+  self->fIoPriority = FILE_PRIORITY_NONE;
+
+  count = (in_threads < 0) ? FILEWorkerPool_GetDefaultThreadCount() : (sse_uint)in_threads;
+  if (count > 0) {
+    self->fThreads = sse_malloc(sizeof(pthread_t) * count);
+    ASSERT(self->fThreads);
+  }
+  /* Signals are handled by the event loop, not by the workers. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+  for (i = 0; i < count; i++) {
+    err = pthread_create(&self->fThreads[self->fThreadCount], NULL, FILEWorkerPool_Main, self);
+    if (err != 0) {
+      LOG_WARN("pthread_create() has been failed with [%s].", strerror(err));
+      break;
+    }
+    self->fThreadCount++;
+  }
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  LOG_INFO("%u worker threads have been started.", self->fThreadCount);
+  return self;
+}
+
+void
+TFILEWorkerPool_Delete(TFILEWorkerPool *self)
+{
+  TFILEWorkerJob *jobs;
+  sse_uint i;
+
+  ASSERT(self);
+  pthread_mutex_lock(&self->fLock);
+  self->fStopping = sse_true;
+  pthread_cond_broadcast(&self->fCond);
+  pthread_mutex_unlock(&self->fLock);
+  for (i = 0; i < self->fThreadCount; i++) {
+    pthread_join(self->fThreads[i], NULL);
+  }
+  jobs = self->fHead;
+  self->fHead = NULL;
+  self->fTail = NULL;
+  FILEWorkerPool_CallDone(TFILEWorkerPool_TakeFinished(self), sse_true);
+  FILEWorkerPool_CallDone(jobs, sse_true);
+
+  moat_io_watcher_stop(self->fWatcher);
+  moat_io_watcher_free(self->fWatcher);
+  close(self->fEventFd);
+  pthread_cond_destroy(&self->fCond);
+  pthread_mutex_destroy(&self->fLock);
+  if (self->fThreads) sse_free(self->fThreads);
+  sse_free(self);
+}
+
+sse_uint
+TFILEWorkerPool_GetThreadCount(TFILEWorkerPool *self)
+{
+  ASSERT(self);
+  return self->fThreadCount;
+}
+
+void
+TFILEWorkerPool_SetPriority(TFILEWorkerPool *self,
+                            sse_int in_nice,
+                            sse_int in_io_priority)
+{
+  ASSERT(self);
+  pthread_mutex_lock(&self->fLock);
+  self->fNice = in_nice;
+  self->fIoPriority = in_io_priority;
+  pthread_mutex_unlock(&self->fLock);
+}
+
+TFILEWorkerJob*
+TFILEWorkerPool_Submit(TFILEWorkerPool *self,
+                       TFILEWorkerPool_WorkProc in_work,
+                       TFILEWorkerPool_DoneProc in_done,
+                       sse_pointer in_user_data)
+{
+  TFILEWorkerJob *job;
+
+  ASSERT(self);
+  ASSERT(in_work);
+  ASSERT(in_done);
+  job = sse_zeroalloc(sizeof(TFILEWorkerJob));
+  ASSERT(job);
+  job->fWork = in_work;
+  job->fDone = in_done;
+  job->fUserData = in_user_data;
+  job->fLogTail = &job->fLogs;
+
+  if (self->fThreadCount == 0) {
+    job->fWork(job->fUserData);
+    TFILEWorkerPool_PushFinished(self, job);
+    return job;
+  }
+  pthread_mutex_lock(&self->fLock);
+  if (self->fTail) {
+    self->fTail->fNext = job;
+  } else {
+    self->fHead = job;
+  }
+  self->fTail = job;
+  pthread_cond_signal(&self->fCond);
+  pthread_mutex_unlock(&self->fLock);
+  return job;
+}
+
+void
+TFILEWorkerPool_Cancel(TFILEWorkerPool *self,
+                       TFILEWorkerJob *in_job)
+{
+  ASSERT(self);
+  ASSERT(in_job);
+  __atomic_store_n(&in_job->fCanceled, sse_true, __ATOMIC_RELAXED);
+}
+
+/*
+ * Logging
+ */
+
+void
+FILEWorker_LogPrint(sse_int in_level,
+                    const sse_char *in_format,
+                    ...)
+{
+  TFILEWorkerJob *job = gFILEWorkerCurrentJob;
+  TFILEWorkerLog *log;
+  sse_char buf[FILE_WORKER_LOG_SIZE];
+  va_list args;
+  int len;
+
+  va_start(args, in_format);
+  len = vsnprintf(buf, sizeof(buf), in_format, args);
+  va_end(args);
+  if (len < 0) {
+    return;
+  }
+  if (job == NULL && len < (int)sizeof(buf)) {
+    FILEWorker_Print(in_level, buf);
+    return;
+  }
+  log = sse_malloc(sizeof(TFILEWorkerLog) + len + 1);
+  if (log == NULL) {
+    return;
+  }
+  if (len < (int)sizeof(buf)) {
+    memcpy(log->fMessage, buf, len + 1);
+  } else {
+    va_start(args, in_format);
+    vsnprintf(log->fMessage, len + 1, in_format, args);
+    va_end(args);
+  }
+  if (job == NULL) {
+    FILEWorker_Print(in_level, log->fMessage);
+    sse_free(log);
+    return;
+  }
+  log->fNext = NULL;
+  log->fLevel = in_level;
+  *job->fLogTail = log;
+  job->fLogTail = &log->fNext;
+}
+
+/* The printer of MOAT SDK, below the redirection of file_worker.h */
+#undef ssep_app_log_print
+
+static void
+FILEWorker_Print(sse_int in_level,
+                 const sse_char *in_message)
+{
+  ssep_app_log_print(in_level, "%s", in_message);
+}
@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# Sample the memory of the agent and the page cache used by a file while it is transferred.
+#
+#   ./fadvise_bench.sh <pid of the agent> <file transferred> [seconds between samples]
+#
+# Start it, then send ContentInfo_upload.json (or _download.json) for the file, once with
+# "fadvise": true in filesystem.conf and once with false, and compare the "file" and "cached"
+# columns. Stop it with Ctrl-C, the peak values are printed at the end.
+# Run as root to start from a cold page cache ("echo 1 > /proc/sys/vm/drop_caches").
+#
+# rss    VmRSS of the agent (kB)
+# file   pages of the file resident in the page cache (kB), fincore(1) of util-linux
+# cached Cached of /proc/meminfo relative to the start (kB)
+
+if [ $# -lt 2 ]; then
+  echo "Usage: $0 <pid> <file> [interval]" >&2
+  exit 1
+fi
+PID=$1
+FILE=$2
+INTERVAL=${3:-1}
+
+meminfo() {
+  awk -v key="$1:" '$1 == key { print $2 }' /proc/meminfo
+}
+
+resident() {
+  if [ -e "$FILE" ] && command -v fincore > /dev/null; then
+    fincore --bytes --noheadings --output RES "$FILE" 2> /dev/null | awk '{ print int($1 / 1024) }'
+  else
+    echo 0
+  fi
+}
+
+if [ "$(id -u)" = "0" ]; then
+  sync
+  echo 1 > /proc/sys/vm/drop_caches
+fi
+CACHED0=$(meminfo Cached)
+PEAK_RSS=0
+PEAK_FILE=0
+PEAK_CACHED=0
+
+report() {
+  echo "peak: rss=${PEAK_RSS}kB file=${PEAK_FILE}kB cached=${PEAK_CACHED}kB"
+  exit 0
+}
+trap report INT TERM
+
+printf "%-10s %10s %10s %10s\n" time rss file cached
+while kill -0 "$PID" 2> /dev/null; do
+  RSS=$(awk '$1 == "VmRSS:" { print $2 }' /proc/"$PID"/status 2> /dev/null)
+  RSS=${RSS:-0}
+  RES=$(resident)
+  CACHED=$(( $(meminfo Cached) - CACHED0 ))
+  [ "$RSS" -gt "$PEAK_RSS" ] && PEAK_RSS=$RSS
+  [ "$RES" -gt "$PEAK_FILE" ] && PEAK_FILE=$RES
+  [ "$CACHED" -gt "$PEAK_CACHED" ] && PEAK_CACHED=$CACHED
+  printf "%-10s %10s %10s %10s\n" "$(date +%T)" "$RSS" "$RES" "$CACHED"
+  sleep "$INTERVAL"
+done
+report